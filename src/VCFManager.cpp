@@ -9,6 +9,11 @@
 
 #include "VCFManager.h"
 
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define GT_PLANES_SSSE3
+#endif
+
 bool VCFManager::OpenInVCF()
 {
     if(in_open)
@@ -117,12 +122,26 @@ void VCFManager::setBitVector()
     vec_len =  (no_samples *  ploidy) / 8 + (((no_samples * ploidy) % 8)?1:0) ;
     
     block_max_size = vec_len * no_vec_in_block + 1;
-    bv.Create(block_max_size);
+    createBlockBuffer();
     block_id = 0;
     vec_read_in_block = 0;
 }
 
+void VCFManager::createBlockBuffer()
+{
+    if(block_pool)
+    {
+        size_t capacity;
+        uchar * ptr = block_pool->Get(block_max_size, capacity);
+        bv.Create(ptr, capacity);
+    }
+    else
+        bv.Create(block_max_size);
+}
+
 // Splits multiple alleles sites, reads genotypes, creates blocks of bytes to process, fills out [archive_name].bcf file
+// Records are read by a reader thread, parsed (unpacked, split, converted to bit vectors) by no_parse_threads threads
+// and consumed in the original order by the calling thread
 bool VCFManager::ProcessInVCF()
 {
     if(!in_open)
@@ -152,171 +171,97 @@ bool VCFManager::ProcessInVCF()
     // Write header to file
     bcf_hdr_write(out_vcf, out_hdr);
     
-    int32_t tmpi = 0;
-    char * alt_desc = new char[256];
-    bcf1_t *rec    = bcf_init1();
-    bcf1_t *new_rec = bcf_init1();
+    // Decompression of BGZF blocks of input in htslib threads
+    hts_set_threads(in_vcf, no_parse_threads);
     
-    while ( bcf_read1(in_vcf, in_hdr, rec)>=0 )
-    {
-        if(rec->errcode)
-        {
-            std::cout << "Repair VCF file\n";
-            exit(9);
-        }
-        bcf_unpack(rec, BCF_UN_ALL);  // Unpack all in record
-        if(rec->d.fmt->n !=  (int) ploidy)
-        {
-            std::cout << "Wrong ploidy (not equal to " << ploidy << ") for record at position " << rec->pos+1 <<".\n";
-            std::cout << "Repair VCF file OR set correct ploidy using -p option\n";
-            exit(9);
-        }
-        
-        // Set CHROM field
-        new_rec->rid = rec->rid;
-        // Set POS field
-        new_rec->pos = rec->pos;
-        // Set QUAL field
-        new_rec->qual = 0;
+    CRecordBlockQueue inQueue(no_parse_threads * 2);
+    CParsedBatchQueue parsedQueue(no_parse_threads * 4);
+    atomic<uint32_t> no_running_parsers(no_parse_threads);
+    
+    // Read input records
+    thread reader([&]{
+        vector<bcf1_t *> records;
+        int batch_id = 0;
+        bcf1_t * rec = bcf_init1();
         
-        if( tmpi%100000 == 0)
-            std::cout << tmpi << " variants preprocessed\n";
-
-        if(rec->n_allele > 2)
+        while ( bcf_read1(in_vcf, in_hdr, rec)>=0 )
         {
-            //if "ALT,<M>", do not change line(as VCF was already altered)
-            if(rec->n_allele==3 && strcmp(rec->d.allele[2], "<M>") == 0)
+            records.push_back(rec);
+            rec = bcf_init1();
+            if(records.size() == VCF_BATCH_SIZE)
             {
-                // Check if alt_desc size is enough for alleles
-                uint64_t allele_size = strlen(rec->d.allele[0])+strlen(rec->d.allele[1])+6;
-                if(allele_size > 256)
-                {
-                    delete [] alt_desc;
-                    alt_desc = new char[allele_size];
-                }
-                
-                strcpy(alt_desc, rec->d.allele[0]);
-                strcat(alt_desc, ",");
-                strcat(alt_desc, rec->d.allele[1]);
-                strcat(alt_desc, ",");
-                strcat(alt_desc, rec->d.allele[2]);
-                
-                bcf_update_alleles_str(out_hdr, new_rec, alt_desc);
-                
-                addGTtoBitVector(in_hdr, rec);
-                
-                bcf_update_info_int32(out_hdr, new_rec, "_row", &tmpi, 1);
-                tmpi++;
-                
-                bcf_write1(out_vcf, out_hdr, new_rec);
-                bcf_clear(new_rec);
-                bcf_clear(rec);
+                inQueue.Push(batch_id++, 0, records);
+                records.clear();
             }
-            else  // Break multi alleles into several lines/sites
+        }
+        if(!records.empty())
+            inQueue.Push(batch_id++, 0, records);
+        
+        bcf_destroy1(rec);
+        inQueue.Complete();
+    });
+    
+    // Parse records: split multiple alleles sites and convert genotypes to bit vectors
+    vector<thread *> parsers(no_parse_threads, nullptr);
+    for(uint32_t i = 0; i < no_parse_threads; ++i)
+        parsers[i] = new thread([&]{
+            vector<bcf1_t *> records, sites;
+            vector<uchar_t> gt_planes;
+            int batch_id;
+            uint64_t tmp;
+            parse_buffers_t buf;
+            
+            while(inQueue.Pop(batch_id, tmp, records))
             {
+                gt_planes.reserve(records.size() * 2 * vec_len);
                 
-                for(int a=1; a < rec->n_allele; a++)  //create one line for each single allele
+                for(auto rec : records)
                 {
-                                      
-                    // Check if alt_desc size is enough for alleles
-                    uint64_t allele_size = strlen(rec->d.allele[0])+strlen(rec->d.allele[a])+6;
-                    if(allele_size > 256)
-                    {
-                        delete [] alt_desc;
-                        alt_desc = new char[allele_size];
-                    }
-                    
-                    // Cut unnecessary letters at the end
-                    size_t len_ref = strlen(rec->d.allele[0]), len_alt = strlen(rec->d.allele[a]);
-                    if(len_ref > 1  && len_alt > 1)
-                    {
-                        while((rec->d.allele[0][len_ref-1] == rec->d.allele[a][len_alt-1] ) && len_ref > 1 && len_alt > 1)
-                        {len_ref--; len_alt--;}
-                    }
-                    
-                    strcpy(alt_desc, "\0");
-                    strncat(alt_desc, rec->d.allele[0], len_ref);
-                    strcat(alt_desc, ",");
-                    strncat(alt_desc, rec->d.allele[a], len_alt);
-                    strcat(alt_desc, ",<M>");
-                    
-                    // New record
-                    bcf_update_alleles_str(out_hdr, new_rec, alt_desc);
-                    
-                    int *gt_arr = NULL, ngt_arr = 0;
-                    bcf_get_genotypes(in_hdr, rec, &gt_arr, &ngt_arr);
-                    for(int i = 0; i < ngt_arr; i++)
-                    {   // gt_arr needed to create bit vectors
-                        if(bcf_gt_allele(gt_arr[i]) != 0)
-                        {
-                            if(bcf_gt_allele(gt_arr[i]) == a)
-                                gt_arr[i] = bcf_gt_phased(1);
-                            else if(bcf_gt_is_missing(gt_arr[i]))
-                                ;
-                            else
-                                gt_arr[i] = bcf_gt_phased(2);
-                        }
-                    }
-                    
-                    // New record
-                    bcf_update_genotypes(in_hdr, new_rec, gt_arr, bcf_hdr_nsamples(in_hdr)*ploidy);
-                    
-                    
-                    // Add genotypes from site annotation to two vectors in bit memory vec
-                    addGTtoBitVector(in_hdr, new_rec);
-                    
-                    bcf_update_info_int32(out_hdr, new_rec, "_row", &tmpi, 1) ;
-                    
-                    // New record
-                    bcf_subset(out_hdr, new_rec, 0, 0); // Do not write genotypes
-                    
-                    tmpi++;
-                    
-                    // New record
-                    bcf_write1(out_vcf, out_hdr, new_rec);
-                    
-                    free(gt_arr);
-                    bcf_clear(new_rec);
-                    
-                    // Set CHROM field
-                    new_rec->rid = rec->rid;
-                    // Set POS field
-                    new_rec->pos = rec->pos;
-                    // Set QUAL field
-                    new_rec->qual = 0;
-                    
+                    parseRecord(rec, sites, gt_planes, buf);
+                    bcf_destroy1(rec);
                 }
-                bcf_clear(rec);
-            }
-        }
-        else // Do not change line (single allele)
-        {
-            // Check if alt_desc size is enough for alleles
-            uint64_t allele_size = strlen(rec->d.allele[0])+strlen(rec->d.allele[1])+5;
-            if(allele_size > 256)
-            {
-                delete [] alt_desc;
-                alt_desc = new char[allele_size];
+                
+                parsedQueue.Push(batch_id, sites, gt_planes);
+                
+                sites.clear();
+                gt_planes.clear();
+                records.clear();
             }
             
-            strcpy(alt_desc, rec->d.allele[0]);
-            strcat(alt_desc, ",");
-            strcat(alt_desc, rec->d.allele[1]);
-            
-            bcf_update_alleles_str(out_hdr, new_rec, alt_desc);
+            if(--no_running_parsers == 0)
+                parsedQueue.Complete();
+        });
+    
+    // Write sites and collect bit vectors into blocks
+    int32_t tmpi = 0;
+    vector<bcf1_t *> sites;
+    vector<uchar_t> gt_data;
+    
+    while(parsedQueue.Pop(sites, gt_data))
+    {
+        for(size_t j = 0; j < sites.size(); ++j)
+        {
+            if( tmpi%100000 == 0)
+                std::cout << tmpi << " variants preprocessed\n";
             
-            addGTtoBitVector(in_hdr, rec);
+            addVectorsToBlock(gt_data.data() + j * 2 * vec_len);
             
-            bcf_update_info_int32(out_hdr, new_rec, "_row", &tmpi, 1);
+            bcf_update_info_int32(out_hdr, sites[j], "_row", &tmpi, 1);
             tmpi++;
             
-            bcf_write1(out_vcf, out_hdr, new_rec);
-            bcf_clear(new_rec);
-            bcf_clear(rec);
+            bcf_write1(out_vcf, out_hdr, sites[j]);
+            bcf_destroy1(sites[j]);
         }
-        
     }
     
+    reader.join();
+    for(auto p : parsers)
+    {
+        p->join();
+        delete p;
+    }
+    parsers.clear();
+    
     std::cout << "All variants preprocessed\n";
 
     // Last pack (may be smaller than block size
@@ -347,51 +292,236 @@ bool VCFManager::ProcessInVCF()
      
     std::cout << "Index for BCF file with list of variant sites (" << arch_name + ".bcf.csi" << ") created." << std::endl;
 
-    bcf_destroy1(rec);
-    bcf_destroy1(new_rec);
-    delete [] alt_desc;
-
     return true;
 }
 
-
-void VCFManager::addGTtoBitVector(bcf_hdr_t * hdr, bcf1_t * recc)
+// Splits record into sites (sites only records appended to sites), genotypes of each site are added as two vectors to _bv
+void VCFManager::parseRecord(bcf1_t * rec, vector<bcf1_t *> & sites, vector<uchar_t> & gt_planes, parse_buffers_t & buf)
 {
-    int *gt_arr = NULL, ngt_arr = 0;
-    int allele;
-    bcf_get_genotypes(hdr, recc, &gt_arr, &ngt_arr);
+    if(rec->errcode)
+    {
+        std::cout << "Repair VCF file\n";
+        exit(9);
+    }
+    bcf_unpack(rec, BCF_UN_ALL);  // Unpack all in record
+    if(rec->d.fmt->n !=  (int) ploidy)
+    {
+        std::cout << "Wrong ploidy (not equal to " << ploidy << ") for record at position " << rec->pos+1 <<".\n";
+        std::cout << "Repair VCF file OR set correct ploidy using -p option\n";
+        exit(9);
+    }
+    
+    bcf1_t *new_rec = bcf_init1();
+    
+    // Set CHROM field
+    new_rec->rid = rec->rid;
+    // Set POS field
+    new_rec->pos = rec->pos;
+    // Set QUAL field
+    new_rec->qual = 0;
     
-    // Set vector with more significant bits of dibits
-    for(int i = 0; i < ngt_arr; i++)
+    if(rec->n_allele > 2)
     {
-        allele = bcf_gt_allele(gt_arr[i]);
-        if(allele == 0 || allele == 1)
+        //if "ALT,<M>", do not change line(as VCF was already altered)
+        if(rec->n_allele==3 && strcmp(rec->d.allele[2], "<M>") == 0)
         {
-            bv.PutBit(0);
+            // Check if buf.alt_desc size is enough for alleles
+            uint64_t allele_size = strlen(rec->d.allele[0])+strlen(rec->d.allele[1])+6;
+            if(allele_size > buf.alt_desc_size)
+            {
+                delete [] buf.alt_desc;
+                buf.alt_desc_size = allele_size;
+                buf.alt_desc = new char[buf.alt_desc_size];
+            }
+            
+            strcpy(buf.alt_desc, rec->d.allele[0]);
+            strcat(buf.alt_desc, ",");
+            strcat(buf.alt_desc, rec->d.allele[1]);
+            strcat(buf.alt_desc, ",");
+            strcat(buf.alt_desc, rec->d.allele[2]);
+            
+            bcf_update_alleles_str(out_hdr, new_rec, buf.alt_desc);
+            
+            int ngt_arr = bcf_get_genotypes(in_hdr, rec, &buf.gt_arr, &buf.m_gt_arr);
+            addGTtoBitVector(buf.gt_arr, ngt_arr, gt_planes);
+            
+            sites.push_back(new_rec);
         }
-        else //if(bcf_gt_is_missing(gt_arr[i]) || bcf_gt_allele(gt_arr[i]) == 2)
+        else  // Break multi alleles into several lines/sites
         {
-            bv.PutBit(1);
+            int ngt_arr = bcf_get_genotypes(in_hdr, rec, &buf.gt_arr, &buf.m_gt_arr);
+            buf.gt_split.resize(ngt_arr > 0 ? ngt_arr : 0);
+            int * gt_arr = buf.gt_split.data();
+            
+            for(int a=1; a < rec->n_allele; a++)  //create one line for each single allele
+            {
+                                  
+                // Check if buf.alt_desc size is enough for alleles
+                uint64_t allele_size = strlen(rec->d.allele[0])+strlen(rec->d.allele[a])+6;
+                if(allele_size > buf.alt_desc_size)
+                {
+                    delete [] buf.alt_desc;
+                    buf.alt_desc_size = allele_size;
+                    buf.alt_desc = new char[buf.alt_desc_size];
+                }
+                
+                // Cut unnecessary letters at the end
+                size_t len_ref = strlen(rec->d.allele[0]), len_alt = strlen(rec->d.allele[a]);
+                if(len_ref > 1  && len_alt > 1)
+                {
+                    while((rec->d.allele[0][len_ref-1] == rec->d.allele[a][len_alt-1] ) && len_ref > 1 && len_alt > 1)
+                    {len_ref--; len_alt--;}
+                }
+                
+                strcpy(buf.alt_desc, "\0");
+                strncat(buf.alt_desc, rec->d.allele[0], len_ref);
+                strcat(buf.alt_desc, ",");
+                strncat(buf.alt_desc, rec->d.allele[a], len_alt);
+                strcat(buf.alt_desc, ",<M>");
+                
+                // New record
+                bcf_update_alleles_str(out_hdr, new_rec, buf.alt_desc);
+                
+                for(int i = 0; i < ngt_arr; i++)
+                {   // gt_arr needed to create bit vectors
+                    gt_arr[i] = buf.gt_arr[i];
+                    if(bcf_gt_allele(gt_arr[i]) != 0)
+                    {
+                        if(bcf_gt_allele(gt_arr[i]) == a)
+                            gt_arr[i] = bcf_gt_phased(1);
+                        else if(bcf_gt_is_missing(gt_arr[i]))
+                            ;
+                        else
+                            gt_arr[i] = bcf_gt_phased(2);
+                    }
+                }
+                
+                // Add genotypes of the new site as two vectors (genotypes are not written to the sites file)
+                addGTtoBitVector(gt_arr, ngt_arr, gt_planes);
+                
+                sites.push_back(new_rec);
+                
+                if(a + 1 < rec->n_allele)
+                {
+                    new_rec = bcf_init1();
+                    
+                    // Set CHROM field
+                    new_rec->rid = rec->rid;
+                    // Set POS field
+                    new_rec->pos = rec->pos;
+                    // Set QUAL field
+                    new_rec->qual = 0;
+                }
+            }
         }
     }
-    bv.FlushPartialWordBuffer();
-    
-    // Set vector with less significant bits of dibits
-    for(int i = 0; i < ngt_arr; i++)
+    else // Do not change line (single allele)
     {
-        allele = bcf_gt_allele(gt_arr[i]);
-        if(allele == 1 || allele == 2)
+        // Check if buf.alt_desc size is enough for alleles
+        uint64_t allele_size = strlen(rec->d.allele[0])+strlen(rec->d.allele[1])+5;
+        if(allele_size > buf.alt_desc_size)
         {
-            bv.PutBit(1);
+            delete [] buf.alt_desc;
+            buf.alt_desc_size = allele_size;
+            buf.alt_desc = new char[buf.alt_desc_size];
         }
-        else //0
+        
+        strcpy(buf.alt_desc, rec->d.allele[0]);
+        strcat(buf.alt_desc, ",");
+        strcat(buf.alt_desc, rec->d.allele[1]);
+        
+        bcf_update_alleles_str(out_hdr, new_rec, buf.alt_desc);
+        
+        int ngt_arr = bcf_get_genotypes(in_hdr, rec, &buf.gt_arr, &buf.m_gt_arr);
+        addGTtoBitVector(buf.gt_arr, ngt_arr, gt_planes);
+        
+        sites.push_back(new_rec);
+    }
+}
+
+#ifdef GT_PLANES_SSSE3
+static bool select_gt_planes_ssse3()
+{
+    __builtin_cpu_init();
+    
+    return __builtin_cpu_supports("ssse3");
+}
+
+static const bool gt_planes_ssse3 = select_gt_planes_ssse3();
+
+// Bits of groups of 16 haplotypes of both vectors; returns the number of processed haplotypes
+__attribute__((target("ssse3")))
+static uint32_t addGTtoPlanesSSSE3(const int * gt_arr, uint32_t no_haplotypes, uchar_t * plane1, uchar_t * plane2)
+{
+    uint32_t i = 0;
+    
+    // For gt = bcf_gt_phased/unphased(allele), gt >> 1 is allele + 1 (0 for missing value)
+    const __m128i v_one = _mm_set1_epi32(1);
+    const __m128i v_two = _mm_set1_epi32(2);
+    const __m128i v_three = _mm_set1_epi32(3);
+    // Reverse bytes within each 8-byte half, so the first haplotype gets the most significant bit
+    const __m128i v_rev = _mm_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+    
+    for(; i + 16 <= no_haplotypes; i += 16)
+    {
+        __m128i p1[4], p2[4];
+        for(int k = 0; k < 4; ++k)
         {
-            bv.PutBit(0);
+            __m128i a = _mm_srai_epi32(_mm_loadu_si128((const __m128i *) (gt_arr + i + 4 * k)), 1);
+            __m128i is_0 = _mm_cmpeq_epi32(a, v_one);
+            __m128i is_1 = _mm_cmpeq_epi32(a, v_two);
+            __m128i is_2 = _mm_cmpeq_epi32(a, v_three);
+            p1[k] = _mm_or_si128(is_0, is_1);     // negated later
+            p2[k] = _mm_or_si128(is_1, is_2);
         }
         
+        __m128i b1 = _mm_packs_epi16(_mm_packs_epi32(p1[0], p1[1]), _mm_packs_epi32(p1[2], p1[3]));
+        __m128i b2 = _mm_packs_epi16(_mm_packs_epi32(p2[0], p2[1]), _mm_packs_epi32(p2[2], p2[3]));
+        uint32_t m1 = ~_mm_movemask_epi8(_mm_shuffle_epi8(b1, v_rev));
+        uint32_t m2 = _mm_movemask_epi8(_mm_shuffle_epi8(b2, v_rev));
+        
+        plane1[i >> 3] = (uchar_t) m1;
+        plane1[(i >> 3) + 1] = (uchar_t) (m1 >> 8);
+        plane2[i >> 3] = (uchar_t) m2;
+        plane2[(i >> 3) + 1] = (uchar_t) (m2 >> 8);
+    }
+    
+    return i;
+}
+#endif
+
+// Append genotypes of a site as two vectors (vec_len bytes each) to gt_planes
+// First vector: 1 for missing value or allele >= 2, second vector: 1 for allele 1 or 2 (haplotypes from the most significant bit)
+void VCFManager::addGTtoBitVector(const int * gt_arr, int ngt_arr, vector<uchar_t> & gt_planes)
+{
+    uint32_t no_haplotypes = ngt_arr > 0 ? min((uint32_t) ngt_arr, no_samples * ploidy) : 0;
+    size_t pos = gt_planes.size();
+    gt_planes.resize(pos + 2 * vec_len, 0);
+    uchar_t * plane1 = gt_planes.data() + pos;
+    uchar_t * plane2 = plane1 + vec_len;
+    
+    uint32_t i = 0;
+    
+#ifdef GT_PLANES_SSSE3
+    if(gt_planes_ssse3)
+        i = addGTtoPlanesSSSE3(gt_arr, no_haplotypes, plane1, plane2);
+#endif
+    
+    int allele;
+    for(; i < no_haplotypes; ++i)
+    {
+        allele = bcf_gt_allele(gt_arr[i]);
+        if(allele != 0 && allele != 1)
+            plane1[i >> 3] |= 0x80 >> (i & 7);
+        if(allele == 1 || allele == 2)
+            plane2[i >> 3] |= 0x80 >> (i & 7);
     }
-    bv.FlushPartialWordBuffer();
-    free(gt_arr);
+}
+
+// Add pair of vectors of a single site to the current block
+void VCFManager::addVectorsToBlock(unsigned char * data)
+{
+    bv.PutBytes(data, 2 * vec_len);
     
     vec_read_in_block += 2; // Two vectors added
     if(vec_read_in_block == no_vec_in_block) // Insert complete block into queue of blocks
@@ -403,7 +533,7 @@ void VCFManager::addGTtoBitVector(bcf_hdr_t * hdr, bcf1_t * recc)
         block_id++;
         
         bv.Close();
-        bv.Create(block_max_size);
+        createBlockBuffer();
         vec_read_in_block = 0;
     }
 }
@@ -12,11 +12,35 @@
 
 #include <iostream>
 #include <fstream>
+#include <atomic>
 #include "htslib/vcf.h"
 #include "defs.h"
 #include "params.h"
 #include "bit_memory.h"
 #include "queues.h"
+#include "buffer_pool.h"
+
+// Buffers reused by a parsing thread for consecutive records
+typedef struct parse_buffers_tag
+{
+    char * alt_desc;
+    uint64_t alt_desc_size;
+    int * gt_arr;
+    int m_gt_arr;
+    vector<int> gt_split;
+    
+    parse_buffers_tag() : alt_desc_size(256), gt_arr(nullptr), m_gt_arr(0)
+    {
+        alt_desc = new char[alt_desc_size];
+    }
+    
+    ~parse_buffers_tag()
+    {
+        delete [] alt_desc;
+        if(gt_arr)
+            free(gt_arr);
+    }
+} parse_buffers_t;
 
 class VCFManager {
     
@@ -37,8 +61,10 @@ class VCFManager {
     
     CBitMemory bv;
     int64 block_max_size;
+    uint32_t no_parse_threads;
     uint32_t no_vec_in_block, vec_read_in_block, block_id;
     CBlockQueue * queue = nullptr;
+    CBufferPool<uchar> * block_pool = nullptr;
     
     bool in_hdr_read;
     
@@ -46,7 +72,10 @@ class VCFManager {
     bool OpenInVCF();
     bool OpenOutVCF();
     void setBitVector();
-    void addGTtoBitVector(bcf_hdr_t * hdr, bcf1_t * rec);
+    void createBlockBuffer();
+    void addGTtoBitVector(const int * gt_arr, int ngt_arr, vector<uchar_t> & gt_planes);
+    void parseRecord(bcf1_t * rec, vector<bcf1_t *> & sites, vector<uchar_t> & gt_planes, parse_buffers_t & buf);
+    void addVectorsToBlock(unsigned char * data);
     
 public:
     VCFManager() {
@@ -56,6 +85,7 @@ public:
         no_samples = 0;
         ploidy = 0;
         no_vec = 0;
+        no_parse_threads = 1;
     }
     VCFManager(const Params & params) {
         in_open = false;
@@ -70,6 +100,11 @@ public:
         arch_name = params.arch_name;
         no_vec = 0;
         
+        // Parsing threads work alongside the compressing threads
+        no_parse_threads = params.n_threads / 2;
+        if(!no_parse_threads)
+            no_parse_threads = 1;
+        
         if(params.task == tcompress || params.task == tcompress_dev_pre)
         {
             out_vcf_name = arch_name;
@@ -116,9 +151,11 @@ public:
         CloseFiles();
     }
   
-    void setQueue(CBlockQueue * _queue)
+    // Buffers of blocks are taken from _block_pool (if given); consumers of the queue should return them to the pool
+    void setQueue(CBlockQueue * _queue, CBufferPool<uchar> * _block_pool = nullptr)
     {
         queue = _queue;
+        block_pool = _block_pool;
     };
     
     uint64_t getNoVec()
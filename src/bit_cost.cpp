@@ -0,0 +1,179 @@
+/*
+ This file is a part of GTC software distributed under GNU GPL 3 licence.
+ 
+ Authors: Agnieszka Danek and Sebastian Deorowicz
+ 
+ Version: 1
+ Date   : 2017-April
+ */
+#include "bit_cost.h"
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define BIT_COST_DISPATCH
+#endif
+
+// ************************************************************************************
+// Scalar version; the same code is compiled with the POPCNT instruction and with the portable popcount
+template<bool bounded>
+__attribute__((always_inline))
+static inline uint64_t bit_cost_words(const uint64_t *x, const uint64_t *y, size_t n, uint64_t best_cost)
+{
+    uint64_t r = 0;
+    size_t i = 0;
+
+    for(; i + 4 <= n; i += 4)
+    {
+        if(bounded && r >= best_cost)
+            return r;
+        r += __builtin_popcountll(x[i] ^ y[i]);
+        r += __builtin_popcountll(x[i + 1] ^ y[i + 1]);
+        r += __builtin_popcountll(x[i + 2] ^ y[i + 2]);
+        r += __builtin_popcountll(x[i + 3] ^ y[i + 3]);
+    }
+    for(; i < n; ++i)
+        r += __builtin_popcountll(x[i] ^ y[i]);
+
+    return r;
+}
+
+template<bool bounded>
+static uint64_t bit_cost_generic(const uint64_t *x, const uint64_t *y, size_t n, uint64_t best_cost)
+{
+    return bit_cost_words<bounded>(x, y, n, best_cost);
+}
+
+#ifdef BIT_COST_DISPATCH
+template<bool bounded>
+__attribute__((target("popcnt")))
+static uint64_t bit_cost_popcnt(const uint64_t *x, const uint64_t *y, size_t n, uint64_t best_cost)
+{
+    return bit_cost_words<bounded>(x, y, n, best_cost);
+}
+
+// ************************************************************************************
+// AVX2 version: byte counts from a nibble lookup (vpshufb) summed to 64-bit lanes with vpsadbw
+__attribute__((target("avx2")))
+static inline __m256i popcnt_bytes_avx2(__m256i v)
+{
+    const __m256i lut = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                         0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low_mask = _mm256_set1_epi8(0x0f);
+
+    __m256i lo = _mm256_and_si256(v, low_mask);
+    __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), low_mask);
+
+    return _mm256_add_epi8(_mm256_shuffle_epi8(lut, lo), _mm256_shuffle_epi8(lut, hi));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i xor_load_avx2(const uint64_t *x, const uint64_t *y)
+{
+    return _mm256_xor_si256(_mm256_loadu_si256((const __m256i *) x), _mm256_loadu_si256((const __m256i *) y));
+}
+
+__attribute__((target("avx2")))
+static inline uint64_t hsum_avx2(__m256i v)
+{
+    __m128i s = _mm_add_epi64(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+
+    return (uint64_t) _mm_cvtsi128_si64(s) + (uint64_t) _mm_extract_epi64(s, 1);
+}
+
+template<bool bounded>
+__attribute__((target("avx2,popcnt")))
+static uint64_t bit_cost_avx2(const uint64_t *x, const uint64_t *y, size_t n, uint64_t best_cost)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i acc = zero;
+    size_t i = 0;
+
+    // Byte counts of 4 vectors (at most 32 per byte) are reduced by a single vpsadbw
+    for(; i + 16 <= n; i += 16)
+    {
+        __m256i c = _mm256_add_epi8(
+            _mm256_add_epi8(popcnt_bytes_avx2(xor_load_avx2(x + i, y + i)), popcnt_bytes_avx2(xor_load_avx2(x + i + 4, y + i + 4))),
+            _mm256_add_epi8(popcnt_bytes_avx2(xor_load_avx2(x + i + 8, y + i + 8)), popcnt_bytes_avx2(xor_load_avx2(x + i + 12, y + i + 12))));
+        acc = _mm256_add_epi64(acc, _mm256_sad_epu8(c, zero));
+
+        if(bounded)
+        {
+            uint64_t r = hsum_avx2(acc);
+            if(r >= best_cost)
+                return r;
+        }
+    }
+    for(; i + 4 <= n; i += 4)
+        acc = _mm256_add_epi64(acc, _mm256_sad_epu8(popcnt_bytes_avx2(xor_load_avx2(x + i, y + i)), zero));
+
+    uint64_t r = hsum_avx2(acc);
+    for(; i < n; ++i)
+        r += __builtin_popcountll(x[i] ^ y[i]);
+
+    return r;
+}
+
+// ************************************************************************************
+// AVX-512 version, VPOPCNTQ on 8 words at once; the tail is read with a masked load
+__attribute__((target("avx512f,avx512vpopcntdq")))
+static inline __m512i popcnt_xor_avx512(const uint64_t *x, const uint64_t *y, __mmask8 mask)
+{
+    return _mm512_popcnt_epi64(_mm512_xor_si512(_mm512_maskz_loadu_epi64(mask, x), _mm512_maskz_loadu_epi64(mask, y)));
+}
+
+// Sum of 64-bit lanes, reduced through 256-bit and 128-bit halves
+// (zero-masked extracts, as the unmasked ones and _mm512_reduce_add_epi64 trigger -Wuninitialized in GCC 12 headers)
+__attribute__((target("avx512f,avx2")))
+static inline uint64_t hsum_avx512(__m512i v)
+{
+    return hsum_avx2(_mm256_add_epi64(_mm512_maskz_extracti64x4_epi64(0xff, v, 0), _mm512_maskz_extracti64x4_epi64(0xff, v, 1)));
+}
+
+template<bool bounded>
+__attribute__((target("avx512f,avx512vpopcntdq,avx2")))
+static uint64_t bit_cost_avx512(const uint64_t *x, const uint64_t *y, size_t n, uint64_t best_cost)
+{
+    __m512i acc = _mm512_setzero_si512();
+    size_t i = 0;
+
+    for(; i + 16 <= n; i += 16)
+    {
+        acc = _mm512_add_epi64(acc, _mm512_add_epi64(popcnt_xor_avx512(x + i, y + i, 0xff), popcnt_xor_avx512(x + i + 8, y + i + 8, 0xff)));
+
+        if(bounded)
+        {
+            uint64_t r = hsum_avx512(acc);
+            if(r >= best_cost)
+                return r;
+        }
+    }
+    for(; i < n; i += 8)
+    {
+        __mmask8 mask = n - i >= 8 ? 0xff : (__mmask8) ((1u << (n - i)) - 1);
+        acc = _mm512_add_epi64(acc, popcnt_xor_avx512(x + i, y + i, mask));
+    }
+
+    return hsum_avx512(acc);
+}
+#endif
+
+// ************************************************************************************
+static bit_cost_fun_t select_kernel(bool bounded)
+{
+#ifdef BIT_COST_DISPATCH
+    __builtin_cpu_init();
+
+    if(__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vpopcntdq"))
+        return bounded ? bit_cost_avx512<true> : bit_cost_avx512<false>;
+    if(__builtin_cpu_supports("avx2"))
+        return bounded ? bit_cost_avx2<true> : bit_cost_avx2<false>;
+    if(__builtin_cpu_supports("popcnt"))
+        return bounded ? bit_cost_popcnt<true> : bit_cost_popcnt<false>;
+#endif
+
+    return bounded ? bit_cost_generic<true> : bit_cost_generic<false>;
+}
+
+bit_cost_fun_t bit_cost_full_kernel = select_kernel(false);
+bit_cost_fun_t bit_cost_bounded_kernel = select_kernel(true);
+
@@ -0,0 +1,23 @@
+/*
+ This file is a part of GTC software distributed under GNU GPL 3 licence.
+ 
+ Authors: Agnieszka Danek and Sebastian Deorowicz
+ 
+ Version: 1
+ Date   : 2017-April
+ */
+#ifndef bit_cost_h
+#define bit_cost_h
+
+#include <cstdint>
+#include <cstddef>
+
+// Number of different bits of two arrays of n 64-bit words
+// The bounded variant may stop as soon as the count reaches best_cost (the result is then >= best_cost, but not exact)
+typedef uint64_t (*bit_cost_fun_t)(const uint64_t *x, const uint64_t *y, size_t n, uint64_t best_cost);
+
+// Kernels chosen at start-up according to the CPU (AVX-512 VPOPCNTDQ, AVX2, POPCNT or portable popcount)
+extern bit_cost_fun_t bit_cost_full_kernel;
+extern bit_cost_fun_t bit_cost_bounded_kernel;
+
+#endif /* bit_cost_h */
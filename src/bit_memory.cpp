@@ -154,6 +154,28 @@ bool CBitMemory::Create(int64 size)
     return mode == mode_mem_write;
 }
 
+// ********************************************************************************************
+// Write to the given buffer; the buffer is owned by the object (so it is reallocated if too small)
+bool CBitMemory::Create(uchar *p, int64 size)
+{
+    if(mode != mode_none)
+        return false;
+    
+    if(mem_buffer && mem_buffer_ownership)
+        delete[] mem_buffer;
+    
+    mem_buffer_size = size;
+    mem_buffer = p;
+    mem_buffer_ownership = true;
+    
+    mode = mode_mem_write;
+    mem_buffer_pos = 0;
+    
+    word_buffer_size = 32;
+    
+    return mode == mode_mem_write;
+}
+
 // ********************************************************************************************
 bool CBitMemory::Close()
 {
@@ -43,6 +43,7 @@ public:
     
     bool Open(uchar *p, int64 size, bool force_open = false);
     bool Create(int64 size = 1);
+    bool Create(uchar *p, int64 size);
     bool Complete();
     bool Close();
     bool Restart();
@@ -53,6 +54,7 @@ public:
     bool SetPos(int64 pos);
     
     inline int32 GetWordPos(void);
+    inline int64 GetSize(void);
     
     inline bool PutBit(const uint32 word);
     inline bool Put2Bits(const uint32 word);
@@ -176,6 +178,12 @@ int32 CBitMemory::GetWordPos(void)
     return word_buffer_pos;
 }
 
+// ********************************************************************************************
+int64 CBitMemory::GetSize(void)
+{
+    return mem_buffer_size;
+}
+
 
 // ********************************************************************************************
 bool CBitMemory::PutBit(const uint32 word)
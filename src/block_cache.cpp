@@ -0,0 +1,165 @@
+/*
+ This file is a part of GTC software distributed under GNU GPL 3 licence.
+ 
+ Authors: Agnieszka Danek and Sebastian Deorowicz
+ 
+ Version: 1
+ Date   : 2017-April
+ */
+
+#include "block_cache.h"
+
+#include <iostream>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+
+using namespace std;
+
+const uint64_t BLOCK_CACHE_MAGIC = 0x0142435447ull;  // "GTCB", version 1
+
+bool CBlockCache::Open(const string & _cache_dir, uint64_t checksum, uint64_t _vec_len, uint64_t _max_size)
+{
+    struct stat st;
+    
+    if(stat(_cache_dir.c_str(), &st) != 0)
+        mkdir(_cache_dir.c_str(), 0755);
+    if(stat(_cache_dir.c_str(), &st) != 0 || !S_ISDIR(st.st_mode))
+    {
+        cerr << "Cannot use cache directory: " << _cache_dir << endl;
+        return false;
+    }
+    
+    char tmp[17];
+    snprintf(tmp, sizeof(tmp), "%016llx", (unsigned long long) checksum);
+    
+    cache_dir = _cache_dir;
+    key = tmp;
+    vec_len = _vec_len;
+    max_size = _max_size;
+    
+    return true;
+}
+
+string CBlockCache::blockFileName(uint32_t block_id)
+{
+    return cache_dir + "/" + key + "." + to_string(block_id) + ".gtcb";
+}
+
+const uchar * CBlockCache::Load(uint32_t block_id, uint64_t & no_variants)
+{
+    if(fm)
+    {
+        delete fm;
+        fm = nullptr;
+    }
+    
+    string fname = blockFileName(block_id);
+    struct stat st;
+    if(stat(fname.c_str(), &st) != 0)
+        return nullptr;
+    
+    fm = new memory_mapped_file::read_only_mmf(fname.c_str());
+    if(!fm->is_open() || fm->file_size() < 3 * sizeof(uint64_t))
+        return nullptr;
+    
+    // Header: magic, vec_len, number of variants
+    uint64_t header[3];
+    memcpy(header, fm->data(), sizeof(header));
+    
+    if(header[0] != BLOCK_CACHE_MAGIC || header[1] != vec_len || fm->file_size() != sizeof(header) + header[2] * 2 * vec_len)
+        return nullptr;
+    
+    no_variants = header[2];
+    
+    // Mark the block as recently used
+    utimensat(AT_FDCWD, fname.c_str(), nullptr, 0);
+    
+    return (const uchar *) fm->data() + sizeof(header);
+}
+
+// The block is written to a temporary file and renamed, so concurrent readers never see a partial block
+bool CBlockCache::Store(uint32_t block_id, uint64_t no_variants, const uchar * data)
+{
+    string fname = blockFileName(block_id);
+    string tmp_name = fname + "." + to_string(getpid()) + ".tmp";
+    
+    FILE * f = fopen(tmp_name.c_str(), "wb");
+    if(!f)
+        return false;
+    
+    uint64_t header[3] = {BLOCK_CACHE_MAGIC, vec_len, no_variants};
+    bool ok = fwrite(header, sizeof(header), 1, f) == 1;
+    if(no_variants)
+        ok = ok && fwrite(data, 2 * vec_len, no_variants, f) == no_variants;
+    ok = (fclose(f) == 0) && ok;
+    
+    if(!ok || rename(tmp_name.c_str(), fname.c_str()) != 0)
+    {
+        remove(tmp_name.c_str());
+        return false;
+    }
+    
+    evict(fname);
+    
+    return true;
+}
+
+// Remove least recently used block files (of all archives in the directory) until they fit in max_size bytes
+// Files removed while mapped by other queries stay readable for them
+void CBlockCache::evict(const string & keep_name)
+{
+    struct block_file_t {
+        struct timespec mtime;
+        uint64_t size;
+        string name;
+    };
+    
+    if(!max_size)
+        return;
+    
+    DIR * dir = opendir(cache_dir.c_str());
+    if(!dir)
+        return;
+    
+    vector<block_file_t> files;
+    uint64_t total_size = 0;
+    struct dirent * de;
+    struct stat st;
+    
+    while((de = readdir(dir)) != nullptr)
+    {
+        size_t len = strlen(de->d_name);
+        if(len < 5 || strcmp(de->d_name + len - 5, ".gtcb") != 0)
+            continue;
+        
+        string name = cache_dir + "/" + de->d_name;
+        if(stat(name.c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+            continue;
+        
+        files.push_back({st.st_mtim, (uint64_t) st.st_size, name});
+        total_size += st.st_size;
+    }
+    closedir(dir);
+    
+    if(total_size <= max_size)
+        return;
+    
+    sort(files.begin(), files.end(), [](const block_file_t & x, const block_file_t & y) {
+        return x.mtime.tv_sec < y.mtime.tv_sec || (x.mtime.tv_sec == y.mtime.tv_sec && x.mtime.tv_nsec < y.mtime.tv_nsec);
+    });
+    
+    for(auto & f : files)
+    {
+        if(total_size <= max_size)
+            break;
+        if(f.name == keep_name)
+            continue;
+        if(remove(f.name.c_str()) == 0)
+            total_size -= f.size;
+    }
+}
@@ -0,0 +1,60 @@
+/*
+ This file is a part of GTC software distributed under GNU GPL 3 licence.
+ 
+ Authors: Agnieszka Danek and Sebastian Deorowicz
+ 
+ Version: 1
+ Date   : 2017-April
+ */
+
+#ifndef block_cache_h
+#define block_cache_h
+
+#include <stdio.h>
+#include <string>
+#include <cpp-mmf/memory_mapped_file.hpp>
+
+#include "defs.h"
+
+// On-disk cache of decoded blocks of an archive (for repeated range queries)
+// Each block is kept in a separate file <cache_dir>/<archive checksum>.<block_id>.gtcb holding
+// decoded (not permuted) pairs of vectors of all variants of the block
+// The size of all block files in the directory is limited; least recently used files (by mtime) are removed first
+class CBlockCache
+{
+    std::string cache_dir;
+    std::string key;
+    uint64_t vec_len;
+    uint64_t max_size;
+    
+    memory_mapped_file::read_only_mmf *fm;
+    
+    std::string blockFileName(uint32_t block_id);
+    void evict(const std::string & keep_name);
+    
+public:
+    CBlockCache() : vec_len(0), max_size(0), fm(nullptr)
+    {}
+    
+    ~CBlockCache()
+    {
+        if(fm)
+            delete fm;
+    }
+    
+    // checksum - checksum of the whole archive (stored in the archive by the compressor)
+    // _max_size - limit of the size of all block files in the directory in bytes (0 - no limit)
+    bool Open(const std::string & _cache_dir, uint64_t checksum, uint64_t _vec_len, uint64_t _max_size);
+    bool IsOpen()
+    {
+        return !key.empty();
+    }
+    
+    // Returns decoded vectors of the block (2 * vec_len bytes per variant) or nullptr if the block is not cached
+    // The data are valid until the next call of Load
+    const uchar * Load(uint32_t block_id, uint64_t & no_variants);
+    
+    bool Store(uint32_t block_id, uint64_t no_variants, const uchar * data);
+};
+
+#endif /* block_cache_h */
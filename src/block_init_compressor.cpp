@@ -8,7 +8,8 @@
  */
 
 #include "block_init_compressor.h"
-#include <list>
+#include "queues.h"
+#include "gt_expand.h"
 #include <utility>
 
 void BlockInitCompressor::SetBlock(uint64_t _cur_no_vec, uchar_t * _data)
@@ -17,11 +18,29 @@ void BlockInitCompressor::SetBlock(uint64_t _cur_no_vec, uchar_t * _data)
     cur_no_vec = _cur_no_vec;
 }
 
-void BlockInitCompressor::PermuteBlock(vector<int> & perm, bool permute)
+// AC (count of allele 1) and AN (count of not missing values) for each variant of the block, as pairs
+void BlockInitCompressor::CountAlleles(vector<uint32_t> & ac_an)
+{
+    uint32_t no_haplotypes = s->n_samples * s->ploidy;
+    uint32_t n_allele_1, n_missing;
+    
+    ac_an.resize(cur_no_vec);
+    
+    // Unused bits of the last byte are zeros in both vectors, so they are not counted
+    for(uint64_t i = 0; i < cur_no_vec / 2; ++i)
+    {
+        const uchar_t * v1 = data + 2 * i * s->vec_len;
+        gt_count(v1, v1 + s->vec_len, nullptr, s->vec_len, n_allele_1, n_missing);
+        ac_an[2 * i] = n_allele_1;
+        ac_an[2 * i + 1] = no_haplotypes - n_missing;
+    }
+}
+
+void BlockInitCompressor::PermuteBlock(vector<int> & perm, bool permute, int block_id)
 {
     if(permute)
     {
-        permute_range_vec(0, cur_no_vec, perm);
+        permute_range_vec(0, cur_no_vec, perm, block_id);
     }
     else
     {
@@ -45,7 +64,15 @@ bool BlockInitCompressor::Compress(vector<bool> &zeros, vector<bool> &copies,  u
     
     uint64_t i;
     
-    bm.Create(s->vec_len*s->max_no_vec_in_block/10);
+    uchar * pool_buffer = nullptr;
+    if(comp_pool)
+    {
+        size_t capacity;
+        pool_buffer = comp_pool->Get(s->vec_len*s->max_no_vec_in_block/10, capacity);
+        bm.Create(pool_buffer, capacity);
+    }
+    else
+        bm.Create(s->vec_len*s->max_no_vec_in_block/10);
     comp_no_matches = 0;
     comp_no_literals = 0;
     comp_zero_run = 0;
@@ -67,7 +94,9 @@ bool BlockInitCompressor::Compress(vector<bool> &zeros, vector<bool> &copies,  u
     bm.TakeOwnership();
     compressedBlock = bm.mem_buffer;
     compressed_size = bm.mem_buffer_pos;
-    origin_of_copy = new uint32_t[no_copy];
+    if(comp_pool && compressedBlock != pool_buffer)     // Buffer was reallocated as it was too small
+        comp_pool->Replace(pool_buffer, compressedBlock, bm.GetSize());
+    origin_of_copy = copy_pool ? copy_pool->Get(no_copy) : new uint32_t[no_copy];
     
     memcpy(origin_of_copy, comp_pos_copy, no_copy*sizeof(uint32_t));
     
@@ -112,6 +141,8 @@ void BlockInitCompressor::Allocate()
     allocated = true;
 }
 
+// Called for every block, so matches and copies never refer to vectors of other blocks (and match chains are limited by max_depth);
+// a variant is decoded from vectors of its own block only
 void BlockInitCompressor::Clear()
 {
     uint64_t i;
@@ -648,12 +679,12 @@ void BlockInitCompressor::restruct(uint64_t in_vec_pos)
             ht_insert(i, in_vec_pos);
 }
 
-void BlockInitCompressor::permute_range_vec(uint64_t id_start, uint64_t id_stop, vector<int> &v_perm)
+void BlockInitCompressor::permute_range_vec(uint64_t id_start, uint64_t id_stop, vector<int> &v_perm, int block_id)
 {
     int n_h_samples = v_perm.size();
     uint64_t part_vec = id_stop - id_start;
     vector<mc_vec_t> mc_vectors;
-    mt19937 mt;
+    mt19937 mt((uint32_t) block_id);    // sample of variants depends only on the block (not on the order of threads)
     
     // Calculate bit vectors with bits from the randomly chosen variants
     mc_vec_t empty_vec;
@@ -681,7 +712,7 @@ void BlockInitCompressor::permute_range_vec(uint64_t id_start, uint64_t id_stop,
             mc_ids.push_back(i);		
     }
 	
-    random_shuffle(mc_ids.begin(), mc_ids.end());
+    shuffle(mc_ids.begin(), mc_ids.end(), mt);
     uint32_t mc_sort_size = mc_ids.size() > PART_TRIALS ? PART_TRIALS : mc_ids.size();
     sort(mc_ids.begin(), mc_ids.begin() + mc_sort_size);
 	
@@ -710,89 +741,18 @@ void BlockInitCompressor::permute_range_vec(uint64_t id_start, uint64_t id_stop,
     
     // Determine the best permutation
     vector<int> perm;
-    uint64_t cost_perm = 0;
-    
-    perm.push_back(0);
-	
-    list<pair<int, int>> density_list;
-
-    density_list.push_back(make_pair(0, n_ones[0]));
-    auto p = density_list.begin();
-    for (int i = 1; i < (int) n_ones.size(); ++i)
-        density_list.push_back(make_pair(i, n_ones[i]));
-
-    // Insert two guards into list
-    int huge_val = 1 << 28;
-    density_list.push_back(make_pair(-1, -2*huge_val));
-    density_list.push_back(make_pair(-1, 2*huge_val));
-
-    density_list.sort([](pair<int, int> &x, pair<int, int> &y) {return x.second < y.second; });
-
-    int n_cur_samples = n_h_samples;
-
-    while (n_cur_samples)
+    if(perm_chain && block_id >= 0)
     {
-        uint64_t best_cost = huge_val;
-        auto best_p = p;
-
-        // Look for the most similar vector to *p
-        // Starts from p and moves up and down on the list ordered according to the number of ones
-        // This limits the number of vector pairs that must be evaluated
-        auto p_down = p;
-        auto p_up = p;
-        --p_down;
-        ++p_up;
-
-        uint64_t dif_up = abs(p->second - p_up->second);
-        uint64_t dif_down = abs(p->second - p_down->second);
-
-        while (true)
-        {
-            uint64_t min_dif = min(dif_up, dif_down);
-
-            if (min_dif >= best_cost)
-                break;
-
-            if (dif_up < dif_down)
-            {
-                uint64_t cost = bit_cost(mc_vectors[p->first], mc_vectors[p_up->first], best_cost);
-                if (cost < best_cost)
-                {
-                    best_cost = cost;
-                    best_p = p_up;
-
-                    if (best_cost == 0)
-			break;
-                }
-
-                ++p_up;
-                dif_up = abs(p->second - p_up->second);
-            }
-            else
-            {
-                uint64_t cost = bit_cost(mc_vectors[p->first], mc_vectors[p_down->first], best_cost);
-                if (cost < best_cost)
-                {
-                    best_cost = cost;
-                    best_p = p_down;
-
-                    if (best_cost == 0)
-                        break;
-                }
-
-                --p_down;
-                dif_down = abs(p->second - p_down->second);
-            }
-        }
-
-        perm.push_back(best_p->first);
-        density_list.erase(p);
-        p = best_p;
-
-        cost_perm += best_cost;
-        --n_cur_samples;
-    }	
-	
+        // Only the greedy tour waits for the previous block; it is handed to the next block before the refinement
+        vector<int> prev_perm;
+        perm_chain->Get(block_id, prev_perm);
+        perm_engine.BuildTour(mc_vectors, n_ones, perm, &prev_perm);
+        perm_chain->Put(block_id, perm);
+        perm_engine.RefineTour(mc_vectors, n_ones, perm);
+    }
+    else
+        perm_engine.Run(mc_vectors, n_ones, perm);
+    
     uint64_t cost_tsp2 = 0;
     for (int i = 1; i < n_h_samples; ++i)
         cost_tsp2 += bit_cost(mc_vectors[perm[i - 1]], mc_vectors[perm[i]]);
@@ -14,83 +14,13 @@
 #include "defs.h"
 #include "bit_memory.h"
 #include "compression_settings.h"
+#include "buffer_pool.h"
+#include "permutation_engine.h"
 #include <array>
-#include "nmmintrin.h"
 #include <random>
 #include <cstring>
 
-typedef array<uint64_t, MC_ARRAY_SIZE> mc_vec_t;
-
-// Count number of bits between two arrays that are different (same positions)
-// Operation POPCNT is used (available for modern CPUs)
-template <typename T>
-inline uint64_t bit_cost(const T &x, const T&y)
-{
-    uint64_t r = 0;
-
-    int max_i = x.size();
-
-    switch (max_i % 4)
-    {
-    case 3:
-        --max_i;
-        r += _mm_popcnt_u64(x[max_i] ^ y[max_i]);
-    case 2:
-        --max_i;
-        r += _mm_popcnt_u64(x[max_i] ^ y[max_i]);
-    case 1:
-        --max_i;
-        r += _mm_popcnt_u64(x[max_i] ^ y[max_i]);
-    }
-
-    for (int i = max_i - 1; i >= 0;)
-    {
-        r += _mm_popcnt_u64(x[i] ^ y[i]);
-        --i;
-        r += _mm_popcnt_u64(x[i] ^ y[i]);
-        --i;
-        r += _mm_popcnt_u64(x[i] ^ y[i]);
-        --i;
-        r += _mm_popcnt_u64(x[i] ^ y[i]);
-        --i;
-    }
-
-    return r;
-}
-
-template <typename T>
-inline uint64_t bit_cost(const T &x, const T&y, uint64_t best_cost)
-{
-    uint64_t r = 0;
-    int max_i = x.size();
-
-    switch (max_i % 4)
-    {
-    case 3:
-        --max_i;
-        r += _mm_popcnt_u64(x[max_i] ^ y[max_i]);
-    case 2:
-        --max_i;
-        r += _mm_popcnt_u64(x[max_i] ^ y[max_i]);
-    case 1:
-        --max_i;
-        r += _mm_popcnt_u64(x[max_i] ^ y[max_i]);
-    }
-
-    for (int i = max_i - 1; i >= 0 && r < best_cost;)
-    {
-        r += _mm_popcnt_u64(x[i] ^ y[i]);
-        --i;
-        r += _mm_popcnt_u64(x[i] ^ y[i]);
-        --i;
-        r += _mm_popcnt_u64(x[i] ^ y[i]);
-        --i;
-        r += _mm_popcnt_u64(x[i] ^ y[i]);
-        --i;
-    }
-
-    return r;
-}
+class CPermutationChain;
 
 class BlockInitCompressor{
 
@@ -159,18 +89,29 @@ class BlockInitCompressor{
     void encode_literal_run(int32_t len, const uchar * lit_run);
     char bits_used(unsigned int n);
     uchar_t get_ones_group(uint64_t vec_id);
-    void permute_range_vec(uint64_t id_start, uint64_t id_stop, vector<int> &v_perm);
+    void permute_range_vec(uint64_t id_start, uint64_t id_stop, vector<int> &v_perm, int block_id);
     
     double aux_dividor; //help for get_ones_group 
     
+    // Output buffers are taken from pools (if given); the consumer should return them to the pools
+    CBufferPool<uchar> * comp_pool = nullptr;
+    CBufferPool<uint32_t> * copy_pool = nullptr;
+    
+    CPermutationEngine perm_engine;
+    CPermutationChain * perm_chain = nullptr;     // set if tours follow the tour of the previous block
+    
     uint32_t n_vec_in_ht_parts;
     uint32_t n_vec_in_ht_vecs;
     
 public:
     
-    BlockInitCompressor(CompSettings * _settings)
+    BlockInitCompressor(CompSettings * _settings, CBufferPool<uchar> * _comp_pool = nullptr, CBufferPool<uint32_t> * _copy_pool = nullptr, CPermutationChain * _perm_chain = nullptr)
     {
         s = _settings;
+        comp_pool = _comp_pool;
+        copy_pool = _copy_pool;
+        perm_chain = _perm_chain;
+        perm_engine = CPermutationEngine(s->perm_quality, s->perm_threads);
         allocated = false;
         aux_dividor = (double)s->vec_len*BITS_IN_BYTE/s->ones_ranges;
 
@@ -194,8 +135,10 @@ public:
     }
     
     void SetBlock(uint64_t _cur_no_vec, uchar_t * _data);
-    void PermuteBlock(vector<int> & perm, bool permute = true);
+    // block_id is required with the permutation chain (all blocks must be permuted in this case)
+    void PermuteBlock(vector<int> & perm, bool permute = true, int block_id = -1);
     bool Compress(vector<bool> &zeros, vector<bool> &copies, uchar * &compressedBlock, size_t & compressed_size, uint32_t *& origin_of_copy);
+    void CountAlleles(vector<uint32_t> & ac_an);
 };
 
 #endif /* block_init_compressor_h */
@@ -0,0 +1,96 @@
+/*
+ This file is a part of GTC software distributed under GNU GPL 3 licence.
+ 
+ Authors: Agnieszka Danek and Sebastian Deorowicz
+ 
+ Version: 1
+ Date   : 2017-April
+ */
+
+#ifndef buffer_pool_h
+#define buffer_pool_h
+
+#include <mutex>
+#include <vector>
+#include <unordered_map>
+
+using namespace std;
+
+// Pool of memory buffers; buffers are returned to the pool (instead of being freed) and reused for the next blocks
+template<typename T> class CBufferPool
+{
+    vector<pair<T *, size_t>> free_buffers;
+    unordered_map<T *, size_t> used_buffers;    // Sizes of buffers taken from the pool
+    size_t max_free;
+    
+    mutex mtx;
+    
+public:
+    CBufferPool(size_t _max_free) : max_free(_max_free)
+    {}
+    
+    ~CBufferPool()
+    {
+        for(auto &x : free_buffers)
+            delete [] x.first;
+    }
+    
+    // Returns a buffer of at least size elements; its real size is stored in capacity
+    T * Get(size_t size, size_t &capacity)
+    {
+        lock_guard<std::mutex> lck(mtx);
+        
+        T * ptr = nullptr;
+        for(size_t i = free_buffers.size(); i > 0; --i)
+            if(free_buffers[i-1].second >= size)
+            {
+                ptr = free_buffers[i-1].first;
+                capacity = free_buffers[i-1].second;
+                free_buffers.erase(free_buffers.begin() + (i-1));
+                break;
+            }
+        
+        if(!ptr)
+        {
+            capacity = size ? size : 1;
+            ptr = new T[capacity];
+        }
+        used_buffers[ptr] = capacity;
+        
+        return ptr;
+    }
+    
+    T * Get(size_t size)
+    {
+        size_t capacity;
+        return Get(size, capacity);
+    }
+    
+    // The buffer taken from the pool was reallocated (and the old one freed) by its user
+    void Replace(T * old_ptr, T * new_ptr, size_t new_capacity)
+    {
+        lock_guard<std::mutex> lck(mtx);
+        
+        used_buffers.erase(old_ptr);
+        used_buffers[new_ptr] = new_capacity;
+    }
+    
+    // Buffers not taken from the pool are just freed
+    void Release(T * ptr)
+    {
+        if(!ptr)
+            return;
+        
+        lock_guard<std::mutex> lck(mtx);
+        
+        auto p = used_buffers.find(ptr);
+        if(p != used_buffers.end() && free_buffers.size() < max_free)
+            free_buffers.push_back(make_pair(ptr, p->second));
+        else
+            delete [] ptr;
+        if(p != used_buffers.end())
+            used_buffers.erase(p);
+    }
+};
+
+#endif /* buffer_pool_h */
@@ -11,352 +11,116 @@
 
 CBufferedBitMemory::CBufferedBitMemory()
 {
-    bm = NULL;
-    left = 0;
+    data = NULL;
+    size = 0;
+    byte_pos = 0;
     buffer = 0;
+    no_bits = 0;
 };
 
 void CBufferedBitMemory::setBitMemory(CBitMemory * _bm)
 {
-    bm = _bm;
+    data = _bm->mem_buffer;
+    size = _bm->GetSize();
 }
 
 bool CBufferedBitMemory::SetPos(int64 pos)
 {
-    left = 0;
     buffer = 0;
-    return bm->SetPos(pos);
+    no_bits = 0;
+    if((uint64_t) pos > size)
+        return false;
+    byte_pos = pos;
+    return true;
 }
 
-int32_t CBufferedBitMemory::decodeFastLut(CHuffman * huff)
+// Byte by byte refill close to the end of the stream (zeros are read past the end)
+void CBufferedBitMemory::refillTail()
 {
-    int32_t result;
-    uint32_t toGet;
-    uint32_t max_lut_len = huff->max_lut_len;
-    
-    if(left)
+    while(no_bits < 56)
     {
-        if(left < max_lut_len)
-        {
-            buffer = buffer & bm->n_bit_mask[left];
-            toGet = max_lut_len - left;
-            temp = buffer << toGet;
-            bm->GetBits(buffer, toGet);
-            buffer |= temp;
-            
-            result = huff->DecodeFastLut(buffer, no_bits);
-            while (result < 0)
-            {
-                bm->GetBit(buffer);
-                result = huff->Decode(buffer);
-            }
-            left = max_lut_len - no_bits;
-
-            return result;
-        }
-        else
-        {
-            buffer = buffer & bm->n_bit_mask[left];
-            left -= max_lut_len;
-            temp = buffer >> left;
-            
-            result = huff->DecodeFastLut(temp, no_bits);
-            
-            while (result < 0)
-            {
-                if(left)
-                {
-                    temp = (buffer >> (left--  - 1) ) & 1;
-                    result = huff->Decode(temp);
-                }
-                else
-                {
-                    bm->GetBit(buffer);
-                    result = huff->Decode(buffer);
-                }
-            }
-            left = max_lut_len - no_bits + left;
-            return result;
-            
-        }
-    }
-    else
-    {
-        bm->GetBits(buffer, max_lut_len);
-        result = huff->DecodeFastLut(buffer, no_bits);
-        while (result < 0)
-        {
-            bm->GetBit(buffer);
-            result = huff->Decode(buffer);
-        }
-        left = max_lut_len - no_bits;
-        return result;
+        if(byte_pos < size)
+            buffer |= (uint64_t) data[byte_pos++] << (56 - no_bits);
+        no_bits += 8;
     }
 }
 
-int32_t CBufferedBitMemory::decodeFastLutStat(CHuffman * huff, uint32_t & no_read_bits)
+// Codes longer than the index of the main table: canonical codes are found with limits of codes of each length,
+// other codes continue in subtables
+int32_t CBufferedBitMemory::decodeLong(const CHuffman * huff, const CHuffman::t_lut_entry * e)
 {
-    no_read_bits = 0;
-    int32_t result;
-    uint32_t toGet;
-    uint32_t max_lut_len = huff->max_lut_len;
-    
-    if(left)
+    if(e->pair_len == HUF_LUT_LONG)
     {
-        if(left < max_lut_len)
-        {
-            buffer = buffer & bm->n_bit_mask[left];
-            toGet = max_lut_len - left;
-            temp = buffer << toGet;
-            bm->GetBits(buffer, toGet);
-            buffer |= temp;
-            
-            result = huff->DecodeFastLut(buffer, no_bits);
-            no_read_bits += no_bits;
-            while (result < 0)
-            {
-                bm->GetBit(buffer);
-                result = huff->Decode(buffer);
-                no_read_bits++;
-            }
-            left = max_lut_len - no_bits;
-            
-            return result;
-        }
-        else
+        for(uint32_t len = huff->lut_bits + 1; len <= huff->max_len; ++len)
         {
-            buffer = buffer & bm->n_bit_mask[left];
-            left -= max_lut_len;
-            temp = buffer >> left;
-            
-            result = huff->DecodeFastLut(temp, no_bits);
-            no_read_bits += no_bits;
-            
-            while (result < 0)
+            uint32_t code = peek(len);
+            if(code < huff->canon_limit[len])
             {
-                if(left)
-                {
-                    temp = (buffer >> (left--  - 1) ) & 1;
-                    result = huff->Decode(temp);
-                    no_read_bits++;
-                }
-                else
-                {
-                    bm->GetBit(buffer);
-                    result = huff->Decode(buffer);
-                    no_read_bits++;
-                }
+                consume(len);
+                return (int32_t) huff->canon_symbols[huff->canon_offset[len] + code - huff->canon_first[len]];
             }
-            left = max_lut_len - no_bits + left;
-            return result;
         }
+        return 0; // not a code of the tree
     }
-    else
-    {
-        bm->GetBits(buffer, max_lut_len);
-        result = huff->DecodeFastLut(buffer, no_bits);
-        no_read_bits += no_bits;
-        while (result < 0)
-        {
-            bm->GetBit(buffer);
-            result = huff->Decode(buffer);
-        }
-        left = max_lut_len - no_bits;
-        return result;
-    }
-}
-
-int32_t CBufferedBitMemory::decodeFast(CHuffman * huff)
-{
-    uint32_t min_len = huff->min_len;
-    
-    if(!huff->max_len)
-        return 0;
-    int32_t result;
     
-    if(left)
-    {
-        if(left > min_len)
-        {
-            buffer = buffer & bm->n_bit_mask[left];
-            left = left - min_len;
-            temp = buffer >> (left);
-                
-            result = huff->DecodeFast(temp);
-            while (result < 0)
-            {
-                if(left)
-                {
-                    temp = (buffer >> (left--  - 1) ) & 1;
-                    result = huff->Decode(temp);
-                }
-                else
-                {
-                    bm->GetBit(buffer);
-                    result = huff->Decode(buffer);
-                }
-            }
-                
-            return result;
-        }
-        else
-        {
-            buffer = buffer & bm->n_bit_mask[left];
-            temp = buffer << (min_len - left);
-            bm->GetBits(buffer, min_len - left);
-            left = 0;
-            buffer = buffer | temp;
-
-            result = huff->DecodeFast(buffer);
-            while (result < 0)
-            {
-                bm->GetBit(buffer);
-                result = huff->Decode(buffer);
-            }
-                
-            return result;
-        }
-    }
-    else
+    uint32_t lut_bits = huff->lut_bits;
+    while(e->pair_len == HUF_LUT_SUBTABLE)
     {
-        bm->GetBits(buffer, min_len);
-        result = huff->DecodeFast(buffer);
-        while (result < 0)
-        {
-            bm->GetBit(buffer);
-            result = huff->Decode(buffer);
-        }
-
-        return result;
+        consume(lut_bits);
+        refill();
+        lut_bits = e->len;
+        e = huff->decode_lut.data() + e->symbol + peek(lut_bits);
     }
+    consume(e->len);
+    
+    return (int32_t) e->symbol;
 }
 
-int32_t CBufferedBitMemory::decodeFastStat(CHuffman * huff, uint32_t &no_read_bits)
+uint32_t CBufferedBitMemory::getBits(uint32_t n_bits)
 {
-    no_read_bits = 0;
-    uint32_t min_len = huff->min_len;
-    
-    if(!huff->max_len)
+    if(!n_bits)
         return 0;
-    int32_t result;
     
-    no_read_bits = min_len;
+    refill();
+    uint32_t result = peek(n_bits);
+    consume(n_bits);
     
-    if(left)
-    {
-        if(left > min_len)
-        {
-            buffer = buffer & bm->n_bit_mask[left];
-            left = left - min_len;
-            temp = buffer >> (left);
-            
-            result = huff->DecodeFast(temp);
-            while (result < 0)
-            {
-                if(left)
-                {
-                    temp = (buffer >> (left--  - 1) ) & 1;
-                    result = huff->Decode(temp);
-                    no_read_bits++;
-                }
-                else
-                {
-                    bm->GetBit(buffer);
-                    result = huff->Decode(buffer);
-                    no_read_bits++;
-                }
-            }
-            
-            return result;
-        }
-        else
-        {
-            buffer = buffer & bm->n_bit_mask[left];
-            temp = buffer << (min_len - left);
-            bm->GetBits(buffer, min_len - left);
-            left = 0;
-            buffer = buffer | temp;
-            
-            result = huff->DecodeFast(buffer);
-            while (result < 0)
-            {
-                bm->GetBit(buffer);
-                result = huff->Decode(buffer);
-                no_read_bits++;
-            }
-            
-            return result;
-            
-        }
-    }
-    else
-    {
-        bm->GetBits(buffer, min_len);
-        result = huff->DecodeFast(buffer);
-        while (result < 0)
-        {
-            bm->GetBit(buffer);
-            result = huff->Decode(buffer);
-            no_read_bits++;
-        }
-
-        return result;
-    }
+    return result;
 }
 
-uint32_t CBufferedBitMemory::getBits(uint32_t no_bits)
+// Unpack n values of n_bits bits (n_bits <= 32); several values are taken from the buffer after each refill
+void CBufferedBitMemory::getBitsArray(uint32_t * out, uint64_t n, uint32_t n_bits)
 {
-    uint32_t result = 0, toGet;
-    
-    if( left > no_bits)
+    if(!n_bits)
     {
-        buffer = buffer & bm->n_bit_mask[left];
-        result = buffer >> (left - no_bits);
-        left = left - no_bits;
-
-        return result;
+        std::fill_n(out, n, 0);
+        return;
     }
-    else
+    
+    for(uint64_t i = 0; i < n; )
     {
-        if(left)
-        {
-            buffer = buffer & bm->n_bit_mask[left];
-            toGet = no_bits - left;
-            result = buffer << toGet;
-            bm->GetBits(temp, toGet);
-            result = result | temp;
-            left = 0;
-
-            return result;
-        }
-        else
+        refill();
+        for(; i < n && no_bits >= n_bits; ++i)
         {
-            bm->GetBits(result, no_bits);
-
-            return result;
+            out[i] = peek(n_bits);
+            consume(n_bits);
         }
     }
 }
 
-void CBufferedBitMemory::getBitsAndDiscard(uint32_t no_bits)
+void CBufferedBitMemory::getBitsAndDiscard(uint32_t n_bits)
 {
-    if(no_bits > left)
+    if(n_bits <= no_bits)
     {
-        bm->GetBitsAndDiscard(no_bits - left);
-        left = 0;
+        consume(n_bits);
+        return;
     }
-    else
-        left -= no_bits;
-}
-
-void CBufferedBitMemory::getBuffer(uint32_t & _buffer, uint16_t & _left)
-{
-    _buffer = buffer;
-    _left = left;
-}
-
-void CBufferedBitMemory::setBuffer(uint32_t _buffer, uint16_t _left)
-{
-    buffer = _buffer;
-    left = _left;
+    
+    // Skip whole bytes and start with an empty buffer
+    n_bits -= no_bits;
+    byte_pos += n_bits >> 3;
+    buffer = 0;
+    no_bits = 0;
+    refill();
+    consume(n_bits & 7);
 }
@@ -11,33 +11,115 @@
 
 #include "defs.h"
 #include <iostream>
+#include <string.h>
 #include "bit_memory.h"
 #include "huffman.h"
 
+// Bit reader working directly on the memory of CBitMemory; bits are kept in a 64-bit buffer aligned to the MSB
+// and refilled with 8-byte (unaligned) loads
 class CBufferedBitMemory
 {
-    CBitMemory * bm = NULL;
-    uint32_t buffer = 0;
-    
-    uint8_t no_bits;
-    uint32_t temp;
-    
+    const uchar * data = NULL;
+    uint64_t size = 0;
+    uint64_t byte_pos = 0;      // next byte to load to the buffer
+    uint64_t buffer = 0;
+    uint32_t no_bits = 0;       // number of valid bits in the buffer
+
+    inline void refill();
+    void refillTail();
+    inline uint32_t peek(uint32_t n_bits) const;
+    inline void consume(uint32_t n_bits);
+    int32_t decodeLong(const CHuffman * huff, const CHuffman::t_lut_entry * e);
+
 public:
-    uint16_t left = 0;
     CBufferedBitMemory();
     void setBitMemory(CBitMemory * _bm);
-    uint32_t getBits(uint32_t no_bits);
-    void getBitsAndDiscard(uint32_t no_bits);
-    
+    uint32_t getBits(uint32_t n_bits);
+    void getBitsArray(uint32_t * out, uint64_t n, uint32_t n_bits);
+    void getBitsAndDiscard(uint32_t n_bits);
+
     bool SetPos(int64 pos);
+
+    inline int32_t decodeFastLut(const CHuffman * huff);
+    inline int32_t decodeFast(const CHuffman * huff);
+    inline void decodeRun(const CHuffman * huff, uchar_t * out, uint32_t n_symbols);
+};
+
+// ********************************************************************************************
+// After the refill there are at least 56 valid bits in the buffer
+// Bits below the valid ones are the next bits of the stream (or zeros), so OR-ing them again is harmless
+void CBufferedBitMemory::refill()
+{
+    if(byte_pos + 8 <= size)
+    {
+        uint64_t word;
+        memcpy(&word, data + byte_pos, 8);
+        buffer |= __builtin_bswap64(word) >> no_bits;
+        byte_pos += (63 - no_bits) >> 3;
+        no_bits |= 56;
+    }
+    else
+        refillTail();
+}
+
+// ********************************************************************************************
+uint32_t CBufferedBitMemory::peek(uint32_t n_bits) const
+{
+    return (uint32_t) (buffer >> (64 - n_bits));
+}
+
+// ********************************************************************************************
+void CBufferedBitMemory::consume(uint32_t n_bits)
+{
+    buffer <<= n_bits;
+    no_bits -= n_bits;
+}
+
+// ********************************************************************************************
+int32_t CBufferedBitMemory::decodeFastLut(const CHuffman * huff)
+{
+    refill();
     
-    int32_t decodeFastLut(CHuffman * huff); //first get max len
-    int32_t decodeFastLutStat(CHuffman * huff, uint32_t & no_read_bits);
-    int32_t decodeFast(CHuffman * huff); //first get min len
-    int32_t decodeFastStat(CHuffman * huff, uint32_t &no_read_bits);
+    const CHuffman::t_lut_entry * e = huff->decode_lut.data() + peek(huff->lut_bits);
+    if(e->pair_len >= HUF_LUT_LONG)
+        return decodeLong(huff, e);
+    consume(e->len);
     
-    void setBuffer(uint32_t _buffer, uint16_t _left);
-    void getBuffer(uint32_t & _buffer, uint16_t & _left);
-};
+    return (int32_t) e->symbol;
+}
+
+// ********************************************************************************************
+// All trees are decoded with the table, so there is no difference between codes read from the shortest or the longest length
+int32_t CBufferedBitMemory::decodeFast(const CHuffman * huff)
+{
+    return decodeFastLut(huff);
+}
+
+// ********************************************************************************************
+// Decode n_symbols consecutive symbols (< 256) of a single tree; pairs of short codes are decoded with a single lookup
+void CBufferedBitMemory::decodeRun(const CHuffman * huff, uchar_t * out, uint32_t n_symbols)
+{
+    while(n_symbols > 1)
+    {
+        refill();
+        const CHuffman::t_lut_entry * e = huff->decode_lut.data() + peek(huff->lut_bits);
+
+        if(e->pair_len && e->pair_len < HUF_LUT_LONG)
+        {
+            out[0] = (uchar_t) e->symbol;
+            out[1] = (uchar_t) e->symbol2;
+            consume(e->pair_len);
+            out += 2;
+            n_symbols -= 2;
+        }
+        else
+        {
+            *out++ = (uchar_t) decodeFastLut(huff);
+            n_symbols--;
+        }
+    }
+    if(n_symbols)
+        *out = (uchar_t) decodeFastLut(huff);
+}
 
 #endif /* buffered_bm_h */
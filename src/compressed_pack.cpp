@@ -11,42 +11,18 @@
 
 using namespace std;
 
-bool CompressedPack::loadPack(const std::string & arch_name)
+// Report a Huffman tree that cannot be read
+static bool corruptedTree(const string & fname)
+{
+    cerr << "Corrupted archive (Huffman tree): " << fname << endl;
+    return false;
+}
+
+bool CompressedPack::loadPack(const std::string & arch_name, bool genotypes)
 {
     string fname = arch_name + ".gtc";
-    
-    //sdsl vectors
-    sdsl::isfstream in(fname, std::ios::binary | std::ios::in);
-    if (!in) 
-    {
-       // if (sdsl::util::verbose)
-        {
-            std::cerr << "Could not load file `" << fname << "`" << std::endl;
-        }
-        exit(1);
-    }
-    
-    rrr_zeros_only_bit_vector[0].load(in);
-    rrr_zeros_only_bit_vector[1].load(in);
-    rrr_copy_bit_vector[0].load(in);
-    rrr_copy_bit_vector[1].load(in);
-  
-    uint64_t parametersFileStartPosition = in.tellg();
-    
-    in.close();
-    
-    if (sdsl::util::verbose) {
-        std::cerr << "Load file `" << fname << "`" << std::endl;
-    }
-    
-    rrr_rank_zeros_only_bit_vector_0 = sdsl::rrr_vector<>::rank_0_type(&rrr_zeros_only_bit_vector[0]);
-    rrr_rank_zeros_only_bit_vector_1 = sdsl::rrr_vector<>::rank_1_type(&rrr_zeros_only_bit_vector[1]);
-    rrr_rank_copy_bit_vector[0] = sdsl::rrr_vector<>::rank_1_type(&rrr_copy_bit_vector[0]);
-    rrr_rank_copy_bit_vector[1] = sdsl::rrr_vector<>::rank_1_type(&rrr_copy_bit_vector[1]);
-    
-//rest of archive
-    uint64_t buf_pos = 0;
-    uint64_t arch_size = 0;
+    const uchar * file_data = nullptr;
+    uint64_t file_size = 0;
     
 #ifndef MMAP
     {
@@ -59,16 +35,14 @@ bool CompressedPack::loadPack(const std::string & arch_name)
         }        
         
         fseek(comp, 0, SEEK_END);
-        arch_size = ftell(comp) - parametersFileStartPosition;
-        fseek(comp, parametersFileStartPosition, SEEK_SET);
+        file_size = ftell(comp);
+        fseek(comp, 0, SEEK_SET);
         
-        buf = new uchar[arch_size];
-        fread(buf, sizeof(uchar)*arch_size, 1, comp);
+        uchar * data = new uchar[file_size];
+        fread(data, sizeof(uchar)*file_size, 1, comp);
+        file_data = data;
         
         fclose(comp);
-        
-        cout << parametersFileStartPosition << endl;
-        cout << arch_size << endl;
     }
 #else //if BOOST
 /*    const boost::interprocess::mode_t mode = boost::interprocess::read_only;
@@ -85,10 +59,80 @@ bool CompressedPack::loadPack(const std::string & arch_name)
         exit(1);
     }
 
-    buf = (uchar *) fm->data() + parametersFileStartPosition;
-    arch_size = fm->file_size() - parametersFileStartPosition;
+    file_data = (const uchar *) fm->data();
+    file_size = fm->file_size();
 #endif
     
+    // Bit vectors of zeros-only and copied vectors: used in place (no copies, no building of rank structures),
+    // older archives store sdsl rrr vectors, which are converted
+    uint64_t magic = 0;
+    uint64_t parametersFileStartPosition = 0;
+    bool corrupted = false;
+    if(file_size >= sizeof(uint64_t))
+        memcpy(&magic, file_data, sizeof(uint64_t));
+    
+    if(magic == ARCH_MAGIC_RANK_BV)
+    {
+        CRankBitVector * bvs[4] = {&zeros_only_bv[0], &zeros_only_bv[1], &copy_bv[0], &copy_bv[1]};
+        
+        parametersFileStartPosition = sizeof(uint64_t);
+        for(auto bv : bvs)
+        {
+            corrupted = parametersFileStartPosition + sizeof(uint64_t) > file_size;
+            if(corrupted)
+                break;
+            parametersFileStartPosition += bv->Map(file_data + parametersFileStartPosition);
+        }
+    }
+    else
+    {
+        sdsl::isfstream in(fname, std::ios::binary | std::ios::in);
+        if (!in) 
+        {
+            std::cerr << "Could not load file `" << fname << "`" << std::endl;
+            exit(1);
+        }
+        
+        sdsl::rrr_vector<> rrr_bit_vector;
+        for(int v = 0; v < 2; v++)
+        {
+            rrr_bit_vector.load(in);
+            zeros_only_bv[v].Build(rrr_bit_vector);
+        }
+        for(int v = 0; v < 2; v++)
+        {
+            rrr_bit_vector.load(in);
+            copy_bv[v].Build(rrr_bit_vector);
+        }
+        
+        parametersFileStartPosition = in.tellg();
+        in.close();
+    }
+    
+    if(corrupted || parametersFileStartPosition > file_size)
+    {
+        cout << "Corrupted archive: " << fname << endl;
+        exit(1);
+    }
+    
+//rest of archive
+    uint64_t buf_pos = 0;
+    uint64_t arch_size = file_size - parametersFileStartPosition;
+    buf = (uchar *) file_data + parametersFileStartPosition;
+    
+    // Checksum of the whole archive, stored at its end (not stored by older versions)
+    checksum = 0;
+    if(arch_size >= 2 * sizeof(uint64_t))
+    {
+        memcpy(&magic, buf + arch_size - sizeof(uint64_t), sizeof(uint64_t));
+        if(magic == ARCH_MAGIC_CHECKSUM)
+        {
+            memcpy(&checksum, buf + arch_size - 2 * sizeof(uint64_t), sizeof(uint64_t));
+            arch_size -= 2 * sizeof(uint64_t);
+        }
+    }
+    buf_size = arch_size;
+    
     memcpy(&s.ones_ranges, buf + buf_pos, sizeof(uchar));
     buf_pos = buf_pos + sizeof(uchar);
 
@@ -97,6 +141,12 @@ bool CompressedPack::loadPack(const std::string & arch_name)
     
     memcpy(&s.vec_len, buf + buf_pos, sizeof(uint64_t));
     buf_pos = buf_pos + sizeof(uint64_t);
+    
+    perm_diff = (s.ones_ranges & ARCH_FLAG_PERM_DIFF) != 0;
+    s.ones_ranges &= ~ARCH_FLAG_PERM_DIFF;
+    
+    ac_index = (s.ones_ranges & ARCH_FLAG_AC_INDEX) != 0;
+    s.ones_ranges &= ~ARCH_FLAG_AC_INDEX;
 
     s.bit_size_literal = 8;
     
@@ -104,7 +154,8 @@ bool CompressedPack::loadPack(const std::string & arch_name)
     memcpy(&len_huf, buf + buf_pos, sizeof(uint32_t));
     buf_pos = buf_pos + sizeof(uint32_t);
     
-    huf_match_diff_MSB.LoadTree(buf + buf_pos, len_huf);
+    if(!huf_match_diff_MSB.LoadTree(buf + buf_pos, len_huf))
+        return corruptedTree(fname);
     buf_pos = buf_pos + sizeof(uchar)*len_huf;
     
     if(huf_match_diff_MSB.max_len > 31)
@@ -113,7 +164,8 @@ bool CompressedPack::loadPack(const std::string & arch_name)
     memcpy(&len_huf, buf + buf_pos, sizeof(uint32_t));
     buf_pos = buf_pos + sizeof(uint32_t);
     
-    huf_group_type.LoadTree(buf + buf_pos, len_huf);
+    if(!huf_group_type.LoadTree(buf + buf_pos, len_huf))
+        return corruptedTree(fname);
     buf_pos = buf_pos + sizeof(uchar)*len_huf;
     
     if(huf_group_type.max_len > 31)
@@ -127,22 +179,26 @@ bool CompressedPack::loadPack(const std::string & arch_name)
     {
         memcpy(&len_huf, buf + buf_pos, sizeof(uint32_t));
         buf_pos = buf_pos + sizeof(uint32_t);
-        huf_literals[o_g].LoadTree(buf + buf_pos, len_huf);
+        if(!huf_literals[o_g].LoadTree(buf + buf_pos, len_huf))
+            return corruptedTree(fname);
         buf_pos = buf_pos + sizeof(uchar)*len_huf;
         
         memcpy(&len_huf, buf + buf_pos, sizeof(uint32_t));
         buf_pos = buf_pos + sizeof(uint32_t);
-        huf_zeros_runs[o_g].LoadTree(buf + buf_pos, len_huf);
+        if(!huf_zeros_runs[o_g].LoadTree(buf + buf_pos, len_huf))
+            return corruptedTree(fname);
         buf_pos = buf_pos + sizeof(uchar)*len_huf;
         
         memcpy(&len_huf, buf + buf_pos, sizeof(uint32_t));
         buf_pos = buf_pos + sizeof(uint32_t);
-        huf_ones_runs[o_g].LoadTree(buf + buf_pos, len_huf);
+        if(!huf_ones_runs[o_g].LoadTree(buf + buf_pos, len_huf))
+            return corruptedTree(fname);
         buf_pos = buf_pos + sizeof(uchar)*len_huf;
         
         memcpy(&len_huf, buf + buf_pos, sizeof(uint32_t));
         buf_pos = buf_pos + sizeof(uint32_t);
-        huf_match_lens[o_g].LoadTree(buf + buf_pos, len_huf);
+        if(!huf_match_lens[o_g].LoadTree(buf + buf_pos, len_huf))
+            return corruptedTree(fname);
         buf_pos = buf_pos + sizeof(uchar)*len_huf;
     }
     
@@ -150,7 +206,8 @@ bool CompressedPack::loadPack(const std::string & arch_name)
     memcpy(&len_huf, buf + buf_pos, sizeof(uint32_t));
     buf_pos = buf_pos + sizeof(uint32_t);
     
-    huf_flags.LoadTree(buf + buf_pos, len_huf);
+    if(!huf_flags.LoadTree(buf + buf_pos, len_huf))
+        return corruptedTree(fname);
     buf_pos = buf_pos + sizeof(uchar)*len_huf;
     
     memcpy(&no_vec, buf + buf_pos, sizeof(uint64_t));
@@ -163,6 +220,7 @@ bool CompressedPack::loadPack(const std::string & arch_name)
     memcpy(&no_copy, buf + buf_pos, sizeof(uint64_t));
     buf_pos = buf_pos + sizeof(uint64_t);
     
+    used_bits_cp = 0;
     memcpy(&used_bits_cp, buf + buf_pos, sizeof(char));
     buf_pos = buf_pos + sizeof(char);
     
@@ -175,6 +233,8 @@ bool CompressedPack::loadPack(const std::string & arch_name)
     memcpy(&no_non_copy, buf + buf_pos, sizeof(uint64_t));
     buf_pos = buf_pos + sizeof(uint64_t);
     
+    fill_n(max_used_bits_litRunSize, MAX_NUMBER_OF_GROUP, 0);
+    fill_n(used_bits_litRunSize, MAX_NUMBER_OF_GROUP, 0);
     for(int o = 0; o < (int) s.ones_ranges; o++)
     {
         memcpy(&max_used_bits_litRunSize[o], buf + buf_pos, sizeof(uchar_t));
@@ -187,9 +247,11 @@ bool CompressedPack::loadPack(const std::string & arch_name)
         buf_pos = buf_pos + sizeof(uint32_t) * (MAX_LITERAL_RUN + 4);
     }
     
+    used_bits_noncp = 0;
     memcpy(&used_bits_noncp, buf + buf_pos, sizeof(char));
     buf_pos = buf_pos + sizeof(char);
     
+    s.bit_size_id_match_pos_diff = 0;
     memcpy(&s.bit_size_id_match_pos_diff, buf + buf_pos, sizeof(char));
     buf_pos = buf_pos + sizeof(char);
     
@@ -208,32 +270,188 @@ bool CompressedPack::loadPack(const std::string & arch_name)
     memcpy(&s.n_samples, buf + buf_pos, sizeof(uint32_t));
     buf_pos = buf_pos + sizeof(uint32_t);
 
+    if(perm_diff)
+    {
+        block_perm_pos.resize(no_blocks);
+        memcpy(block_perm_pos.data(), buf + buf_pos, sizeof(uint64_t) * no_blocks);
+        buf_pos = buf_pos + sizeof(uint64_t) * no_blocks;
+    }
+    
     uint64_t bv_perm_size;
     memcpy(&bv_perm_size, buf + buf_pos, sizeof(bv_perm.mem_buffer_pos));
     buf_pos = buf_pos + sizeof(bv_perm.mem_buffer_pos);
     bv_perm.Open(buf + buf_pos, bv_perm_size);
     buf_pos += bv_perm_size;
     
-    uint64_t core_size = arch_size - buf_pos;
-    bm.Open(buf + buf_pos, core_size);
+    // AC/AN of variants with the range of AC in blocks
+    if(ac_index)
+    {
+        block_ac_min.resize(no_blocks);
+        block_ac_max.resize(no_blocks);
+        memcpy(block_ac_min.data(), buf + buf_pos, sizeof(uint32_t) * no_blocks);
+        buf_pos = buf_pos + sizeof(uint32_t) * no_blocks;
+        memcpy(block_ac_max.data(), buf + buf_pos, sizeof(uint32_t) * no_blocks);
+        buf_pos = buf_pos + sizeof(uint32_t) * no_blocks;
+        
+        ac_bytes = s.ac_bytes();
+        variant_ac = buf + buf_pos;
+        buf_pos = buf_pos + no_vec * ac_bytes;
+    }
+    
+    core_pos = buf_pos;
+    if(genotypes)
+        openGenotypes();
 
     return true;
 }
 
+// Permutations and the core (vectors with genotypes) are prepared only if genotypes are decoded
+void CompressedPack::openGenotypes()
+{
+    // Decoding of a permutation starts from the last block with full permutation
+    if(perm_diff)
+    {
+        block_perm_full.resize(no_blocks);
+        for(uint32_t i = 0; i < no_blocks; ++i)
+        {
+            uint32_t full = 0;
+            bv_perm.SetPos(block_perm_pos[i]);
+            bv_perm.GetBit(full);
+            block_perm_full[i] = (full || i == 0) ? i : block_perm_full[i - 1];
+        }
+    }
+    initPermStore();
+    
+    bm.Open(buf + core_pos, buf_size - core_pos);
+}
+
+void CompressedPack::initPermStore()
+{
+    uint64_t perm_mem = 2 * sizeof(uint32_t) * (uint64_t) s.n_samples * s.ploidy;
+    
+    perm_store.assign(no_blocks, nullptr);
+    perm_store_use.assign(no_blocks, 0);
+    perm_store_time = 0;
+    perm_store_size = 0;
+    perm_store_capacity = (uint32_t) min<uint64_t>(no_blocks, max<uint64_t>(PERM_STORE_MIN_BLOCKS, PERM_STORE_MAX_MEM / max<uint64_t>(perm_mem, 1)));
+    
+    perm_reader.bv.setBitMemory(&bv_perm);
+    perm_reader.block_id = -1;
+    if(perm_diff)
+    {
+        perm_reader.perm.resize(s.n_samples * s.ploidy);
+        perm_reader.rev_perm.resize(s.n_samples * s.ploidy);
+        perm_reader.next_rev_perm.resize(s.n_samples * s.ploidy);
+    }
+}
+
+// Permutation of the block (forward and reverse) taken from the store or, if not stored, decoded and stored
+perm_block_ptr_t CompressedPack::getPerm(uint32_t block_id)
+{
+    lock_guard<mutex> lck(perm_mtx);
+    
+    perm_store_use[block_id] = ++perm_store_time;
+    if(perm_store[block_id])
+        return perm_store[block_id];
+    
+    if(perm_store_size == perm_store_capacity)
+    {
+        uint32_t lru_id = block_id;
+        for(uint32_t i = 0; i < no_blocks; ++i)
+            if(perm_store[i] && (lru_id == block_id || perm_store_use[i] < perm_store_use[lru_id]))
+                lru_id = i;
+        perm_store[lru_id] = nullptr;
+        perm_store_size--;
+    }
+    
+    shared_ptr<perm_block_t> pb = make_shared<perm_block_t>();
+    readPerm(block_id, *pb);
+    perm_store[block_id] = pb;
+    perm_store_size++;
+    
+    return perm_store[block_id];
+}
+
 void CompressedPack::getPermArray(int block_id, uint32_t * perm)
+{
+    perm_block_ptr_t pb = getPerm((uint32_t) block_id);
+    memcpy(perm, pb->perm.data(), sizeof(uint32_t) * pb->perm.size());
+}
+
+void CompressedPack::readPerm(uint32_t block_id, perm_block_t & pb)
 {
     uint32_t no_haplotypes = s.n_samples * s.ploidy;
+    
+    if(perm_diff)
+    {
+        // Continue from the last decoded block or from the closest stored block if no full permutation is stored between it and the block
+        if(perm_reader.block_id < (int64_t) block_perm_full[block_id] || perm_reader.block_id > block_id)
+            perm_reader.block_id = (int64_t) block_perm_full[block_id] - 1;
+        for(int64_t i = (int64_t) block_id - 1; i > perm_reader.block_id; --i)
+            if(perm_store[i])
+            {
+                perm_reader.perm = perm_store[i]->perm;
+                perm_reader.rev_perm = perm_store[i]->rev_perm;
+                perm_reader.block_id = i;
+                break;
+            }
+        while(perm_reader.block_id < block_id)
+            decodePermBlock((uint32_t) ++perm_reader.block_id, perm_reader);
+        
+        pb.perm = perm_reader.perm;
+        pb.rev_perm = perm_reader.rev_perm;
+        return;
+    }
+    
     uint32_t bits_used_single = s.bits_used(no_haplotypes);
     uint32_t single_perm_bv_size = bits_used_single * no_haplotypes; //in bits
     single_perm_bv_size = single_perm_bv_size/8 + (single_perm_bv_size%8?1:0); //in bytes
-    bv_perm.SetPos(block_id * single_perm_bv_size);
+    if((uint64_t) (block_id + 1) * single_perm_bv_size > (uint64_t) bv_perm.GetSize())
+    {
+        cout << "error in getPermArray" << endl;
+        exit(1);
+    }
     
+    pb.perm.resize(no_haplotypes);
+    pb.rev_perm.resize(no_haplotypes);
+    perm_reader.bv.SetPos((uint64_t) block_id * single_perm_bv_size);
+    perm_reader.bv.getBitsArray(pb.perm.data(), no_haplotypes, bits_used_single);
     for(uint32_t i = 0; i < no_haplotypes; ++i)
+        pb.rev_perm[pb.perm[i]] = i;
+}
+
+// Full permutation of the block or its difference from the permutation of the previous block
+void CompressedPack::decodePermBlock(uint32_t block_id, perm_reader_t & reader)
+{
+    uint32_t no_haplotypes = s.n_samples * s.ploidy;
+    uint32_t bits_used_single = s.bits_used(no_haplotypes);
+    
+    if(!reader.bv.SetPos(block_perm_pos[block_id]))
     {
-        if(!bv_perm.GetBits(perm[i], bits_used_single))
-        {
-            cout << "error in getPermArray" << endl;
-            exit(1);
-        }
-    }    
+        cout << "error in getPermArray" << endl;
+        exit(1);
+    }
+    
+    if(reader.bv.getBits(1))
+    {
+        reader.bv.getBitsArray(reader.perm.data(), no_haplotypes, bits_used_single);
+        for(uint32_t i = 0; i < no_haplotypes; ++i)
+            reader.rev_perm[reader.perm[i]] = i;
+        return;
+    }
+    
+    // Successor of a haplotype in the previous tour is the haplotype at the next position
+    uint32_t * tour = reader.next_rev_perm.data();
+    tour[0] = reader.bv.getBits(bits_used_single);
+    for(uint32_t i = 1; i < no_haplotypes; ++i)
+    {
+        if(reader.bv.getBits(1))
+            tour[i] = reader.rev_perm[reader.perm[tour[i - 1]] + 1];
+        else
+            tour[i] = reader.bv.getBits(bits_used_single);
+    }
+    
+    reader.rev_perm.swap(reader.next_rev_perm);
+    for(uint32_t i = 0; i < no_haplotypes; ++i)
+        reader.perm[reader.rev_perm[i]] = i;
 }
@@ -18,6 +18,11 @@
 #include "defs.h"
 #include "compression_settings.h"
 #include "huffman.h"
+#include "buffered_bm.h"
+#include "rank_bit_vector.h"
+#include <vector>
+#include <memory>
+#include <mutex>
 
 #define MMAP
 
@@ -27,18 +32,40 @@
 #include <cpp-mmf/memory_mapped_file.hpp>
 #endif
 
+// Maximal memory of the store of decoded permutations
+const uint64_t PERM_STORE_MAX_MEM = 1ull << 27;
+const uint32_t PERM_STORE_MIN_BLOCKS = 4;
+
+// Decoded permutation of a block
+typedef struct perm_block_tag {
+    std::vector<uint32_t> perm;         // position of haplotype
+    std::vector<uint32_t> rev_perm;     // haplotype at position
+} perm_block_t;
+
+// Stored permutations are never modified, so they can be used by many threads; the pointer keeps
+// the permutation alive when it is removed from the store
+typedef std::shared_ptr<const perm_block_t> perm_block_ptr_t;
+
+// Reader of permutations of blocks; the last decoded permutation is kept, so the next block is decoded
+// from its difference (archives with permutations stored as differences from the previous block)
+typedef struct perm_reader_tag {
+    CBufferedBitMemory bv;
+    int64_t block_id = -1;
+    std::vector<uint32_t> perm;         // position of haplotype
+    std::vector<uint32_t> rev_perm;     // haplotype at position
+    std::vector<uint32_t> next_rev_perm;
+} perm_reader_t;
+
 class CompressedPack {
     friend class Decompressor;
     CompSettings s;
     uchar * buf = nullptr;
+    uint64_t buf_size = 0;
+    uint64_t checksum = 0;  // checksum of the whole archive (0 if not stored)
     
-    // sdsl vectors and ranks
-    sdsl::rrr_vector<> rrr_copy_bit_vector[2];  //for copy vectors (even and odd)
-    sdsl::rrr_vector<> rrr_zeros_only_bit_vector[2];  //for zeros vectors (even and odd)
-
-    sdsl::rrr_vector<>::rank_0_type rrr_rank_zeros_only_bit_vector_0;
-    sdsl::rrr_vector<>::rank_1_type rrr_rank_zeros_only_bit_vector_1;
-    sdsl::rrr_vector<>::rank_1_type rrr_rank_copy_bit_vector[2];
+    // bit vectors with ranks (in the mapped archive)
+    CRankBitVector copy_bv[2];  //for copy vectors (even and odd)
+    CRankBitVector zeros_only_bv[2];  //for zeros vectors (even and odd)
     
 #ifdef MMAP
 //    boost::interprocess::file_mapping *fm;
@@ -67,7 +94,7 @@ class CompressedPack {
     uint32_t  max_used_bits_litRunSize[MAX_NUMBER_OF_GROUP], used_bits_litRunSize[MAX_NUMBER_OF_GROUP] ;
     uint32_t minLitRunSize[MAX_NUMBER_OF_GROUP][MAX_LITERAL_RUN + 4]; //shift by 3, to be able to differentiate between 2, 3 and 4 flags nad literal run of 2, 3 or 4; 1 for sentinel
     
-    uint32_t bm_comp_pos_size;
+    uint64_t bm_comp_pos_size;
     uint32_t bm_comp_cp_size;
     uint32_t bitsize_perm;
     
@@ -77,6 +104,32 @@ class CompressedPack {
    
     CBitMemory bm;
     CBitMemory bv_perm;
+    uint64_t core_pos = 0;  // position of the core in buf
+    
+    // Permutations stored as differences from the permutation of the previous block
+    bool perm_diff = false;
+    std::vector<uint64_t> block_perm_pos;       // byte position of the permutation of the block
+    std::vector<uint32_t> block_perm_full;      // last block (<= block) with full permutation
+    
+    // Store of recently used permutations (LRU)
+    std::mutex perm_mtx;
+    std::vector<perm_block_ptr_t> perm_store;   // empty for blocks not in the store
+    std::vector<uint64_t> perm_store_use;       // time of the last use
+    uint64_t perm_store_time = 0;
+    uint32_t perm_store_size = 0;
+    uint32_t perm_store_capacity = 0;
+    perm_reader_t perm_reader;
+    
+    // AC and AN of variants (ac_bytes bytes each, in the mapped archive) and the range of AC in blocks
+    bool ac_index = false;
+    uint32_t ac_bytes = 0;
+    const uchar * variant_ac = nullptr;
+    std::vector<uint32_t> block_ac_min;
+    std::vector<uint32_t> block_ac_max;
+    
+    void initPermStore();
+    void decodePermBlock(uint32_t block_id, perm_reader_t & reader);
+    void readPerm(uint32_t block_id, perm_block_t & pb);
 
 public:
     CompressedPack()
@@ -105,8 +158,28 @@ public:
             delete [] huf_match_lens;
     }
     
-    bool loadPack(const std::string & arch_name);
+    bool loadPack(const std::string & arch_name, bool genotypes = true);
+    void openGenotypes();
+    perm_block_ptr_t getPerm(uint32_t block_id);
     void getPermArray(int block_id, uint32_t * perm);
+    
+    bool hasACIndex() const
+    {
+        return ac_index;
+    }
+    
+    void getACAN(uint64_t variant_id, uint32_t & ac, uint32_t & an) const
+    {
+        ac = an = 0;
+        memcpy(&ac, variant_ac + 2 * variant_id * ac_bytes, ac_bytes);
+        memcpy(&an, variant_ac + (2 * variant_id + 1) * ac_bytes, ac_bytes);
+    }
+    
+    // False if no variant of the block has allele count in [min_ac; max_ac]
+    bool blockACInRange(uint32_t block_id, uint32_t min_ac, uint32_t max_ac) const
+    {
+        return block_ac_max[block_id] >= min_ac && block_ac_min[block_id] <= max_ac;
+    }
 };
 
 #endif /* compressed_pack_h */
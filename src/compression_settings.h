@@ -13,6 +13,8 @@
 #include <iostream>
 #include "params.h"
 #include "defs.h"
+#include <thread>
+#include <algorithm>
 
 class CompSettings 
 {
@@ -34,9 +36,21 @@ public:
     uint32_t bit_size_run_len = 0;
     uint32_t bit_size_literal;
     uint32_t bit_size_ones_goup;
+    
+    uint32_t perm_quality;
+    uint32_t perm_threads;      // threads available to the permutation of a single block
+    bool perm_warm_start;       // permutations start from the previous block and are stored as moves
+    bool ac_index;              // allele counts of variants are stored (for filtering without decoding)
 
     char bits_used(unsigned int n);
     
+    // Bytes of a single allele count in the archive (a count is not greater than the number of haplotypes)
+    uint32_t ac_bytes() const
+    {
+        uint64_t no_haplotypes = (uint64_t) n_samples * ploidy;
+        return no_haplotypes < 0x100 ? 1 : (no_haplotypes < 0x10000 ? 2 : 4);
+    }
+    
     CompSettings()
     {
         n_samples = 0;
@@ -57,6 +71,11 @@ public:
         bit_size_run_len = 0;
         bit_size_literal = 8;
         bit_size_ones_goup = 0;
+        
+        perm_quality = 1;
+        perm_threads = 1;
+        perm_warm_start = false;
+        ac_index = false;
     }
     
     CompSettings(Params params, uint32_t _n_samples)
@@ -79,6 +98,11 @@ public:
         bit_size_run_len = (uint32_t)log2(vec_len) + 1;
         bit_size_literal = 8;
         bit_size_ones_goup = bits_used(ones_ranges - 1);
+        
+        perm_quality = params.perm_quality;
+        perm_threads = std::max(1u, std::thread::hardware_concurrency() / std::max(1u, params.n_threads));
+        perm_warm_start = params.perm_warm_start;
+        ac_index = params.ac_index;
     }
 };
 
@@ -11,45 +11,98 @@
 
 void Decompressor::decompress()
 {
-    if(samples_to_decompress == "")
-        decompressRange(range);
+    if(sites_only)
+        decompressSites(range);
+    else if(samples_to_decompress == "")
+    {
+        if(n_threads > 1 && !(block_cache.IsOpen() && range != ""))
+            decompressRangeParallel(range);
+        else
+            decompressRange(range);
+    }
     else
         decompressSampleSmart(range);
 }
 
+// Records of sites only: read from the BCF file of the archive, AC/AN (if needed) taken from the archive
+int Decompressor::decompressSites(const string & range)
+{
+    bcf1_t * record = bcf_init();
+    hts_itr_t * itr = nullptr;
+    kstring_t str = {0,0,0};
+    uint64_t vec_id = 0;
+    bool first_record = true;
+    uint32_t written_records = 0;
+    
+    if(range != "")
+        itr = bcf_itr_querys(bcf_idx, hdr, range.c_str());
+    
+    while(written_records < records_to_process)
+    {
+        if(range != "")
+        {
+            if(!itr || bcf_itr_next(bcf, itr, record) == -1)
+                break;
+            if(first_record && out_AC_AN)
+            {
+                bcf_info_t * a = bcf_get_info(hdr, record, "_row");
+                vec_id = a->v1.i*2;
+            }
+            first_record = false;
+        }
+        else if(bcf_read1(bcf, hdr, record) < 0)
+            break;
+        
+        if(out_AC_AN && !setACANIndexed(hdr, record, vec_id))
+        {
+            vec_id += 2;
+            continue;
+        }
+        vec_id += 2;
+        
+        bcf_unpack(record, BCF_UN_ALL);
+        record->n_sample = bcf_hdr_nsamples(hdr);
+        bcf_update_info_int32(hdr, record, "_row", NULL, 0);
+        
+        writeRecord(record, str);
+        written_records++;
+    }
+    if(itr)
+        bcf_itr_destroy(itr);
+    
+    closeOut();
+    bcf_destroy(record);
+    
+    return 0;
+}
+
 int Decompressor::decompressRange(const string & range)
 {
     initialLut();
     
     uchar_t * decomp_data = nullptr;
     uchar_t * decomp_data_perm = nullptr;
-    uint32_t * perm = nullptr;
-    uint32_t * rev_perm = nullptr;
+    perm_block_ptr_t perm_block;
+    const uint32_t * rev_perm = nullptr;
     uint32_t pos;
     
     uint32_t no_haplotypes = smpl.no_samples * pack.s.ploidy;
-    perm = new uint32_t[no_haplotypes];
-    rev_perm = new uint32_t[no_haplotypes];
 	
     bcf1_t * record = bcf_init();
-    uint32_t g, vec1_start, vec2_start;
+    uint32_t g, vec2_start;
     
     uint32_t  end;
     uint32_t i = 0;
     
-    buff_bm.setBitMemory(&pack.bm);
-    
     const char *key = "GT";
     khint_t k;
     vdict_t *d;
     int fmt_id;
     uint32_t block_id, prev_block_id = 0xFFFF;
-    done_unique.clear();
+    main_ctx.clear();
     kstring_t str = {0,0,0};
     uint32_t written_records = 0;    
    
-    long long * tmp_vec_ll = nullptr;
-    long long * lut_ll = nullptr;
     if(range == "")
     {
         // VCF/BCF processing
@@ -59,10 +112,6 @@ int Decompressor::decompressRange(const string & range)
         
         if ( !bcf_hdr_idinfo_exists(hdr,BCF_HL_FMT,fmt_id) )
         {
-            if(perm)
-                delete [] perm;
-            if(rev_perm)
-                delete [] rev_perm;
             bcf_destroy(record);
             
             if ( !no_haplotypes )
@@ -95,12 +144,18 @@ int Decompressor::decompressRange(const string & range)
             g = 0;
         }
         
-        tmp_vec_ll = new long long[end];
         decomp_data = new uchar_t[pack.s.vec_len*2];
         decomp_data_perm = new uchar_t[pack.s.vec_len*2];
         
         while (bcf_read1(bcf, hdr, record)>= 0 && written_records < records_to_process)
         {
+            // Variants filtered out by allele counts stored in the archive are not decoded
+            if(use_ac_index && !setACANIndexed(hdr, record, i))
+            {
+                i += 2;
+                continue;
+            }
+            
             pos = 0;
             str.l = 3;
             
@@ -112,36 +167,25 @@ int Decompressor::decompressRange(const string & range)
             if(block_id != prev_block_id)
             {
                 // Get approproate permutations
-                pack.getPermArray(block_id, perm);
-                reverse_perm(perm, rev_perm, no_haplotypes);
+                perm_block = pack.getPerm(block_id);
+                rev_perm = perm_block->rev_perm.data();
             }
             
             fill_n(decomp_data, pack.s.vec_len*2, 0);
             
-            vec1_start = 0;
             vec2_start = (uint32_t)pack.s.vec_len;
-            decomp_vec_rrr_range(i++, 0, pack.s.vec_len, pos, decomp_data_perm, 0, false);
-            decomp_vec_rrr_range(i++, 0, pack.s.vec_len, pos, decomp_data_perm, 0, false);
+            decomp_vec_rrr(main_ctx, i++, pos, decomp_data_perm);
+            decomp_vec_rrr(main_ctx, i++, pos, decomp_data_perm);
             
             decode_perm_rev(no_haplotypes, vec2_start, rev_perm, decomp_data_perm, decomp_data);
         
             prev_block_id = block_id;
            
-            char *pt = str.s + str.l;
-            //tmp_vec_ll = (long long *)pt;
-            for (vec1_start = 0; vec1_start < end; ++vec1_start)
-            {
-                //memcpy(pt + (vec1_start << 3), lut[decomp_data[vec1_start]][decomp_data[vec2_start++]], 8);
-                lut_ll = (long long *)(lut[decomp_data[vec1_start]][decomp_data[vec2_start++]]);
-               //*(tmp_vec_ll+ vec1_start) = *lut_ll;
-                tmp_vec_ll[vec1_start] = *lut_ll;
-            }
-            memcpy(pt, tmp_vec_ll, end << 3);
-            
+            gt_expand_kernel(decomp_data, decomp_data + vec2_start, end, str.s + str.l);
             str.l = str.l + (end << 3);
             if(g)
             {
-                memcpy(str.s + str.l, lut[decomp_data[vec1_start]][decomp_data[vec2_start]], g);
+                gt_expand_bits(decomp_data[end], decomp_data[vec2_start + end], g, str.s + str.l);
                 str.l = str.l + g;
             }
             
@@ -150,34 +194,22 @@ int Decompressor::decompressRange(const string & range)
             bcf_update_info_int32(hdr, record, "_row", NULL, 0);
             
             // AC/AN count
-            if(out_AC_AN)
+            if(out_AC_AN && !use_ac_index)
             {
-                if(setACAN(hdr, record, str))
+                if(setACANPlanes(hdr, record, decomp_data, decomp_data + vec2_start, nullptr, pack.s.vec_len))
                 {
-                    if(out_genotypes)
-                        bcf_update_genotypes_fast(str, record);
-                    
-                    bcf_write1(out, hdr, record);
+                    writeRecord(record, str);
                     written_records++;
                 }
             }
             else
             {
-                if(out_genotypes)
-                    bcf_update_genotypes_fast(str, record);
-            
-                bcf_write1(out, hdr, record);
+                writeRecord(record, str);
                 written_records++;
             }            
         }        
         
-        delete [] tmp_vec_ll;
-        for (auto & it:done_unique)
-        {
-            delete [] it.second;
-        }
-
-        done_unique.clear();
+        main_ctx.clear();
     }
     else
     {
@@ -188,10 +220,6 @@ int Decompressor::decompressRange(const string & range)
         
         if (!bcf_hdr_idinfo_exists(hdr,BCF_HL_FMT,fmt_id))
         {
-            if(perm)
-                delete [] perm;
-            if(rev_perm)
-                delete [] rev_perm;
             bcf_destroy(record);
             
             if ( !no_haplotypes ) return 0;
@@ -223,7 +251,6 @@ int Decompressor::decompressRange(const string & range)
             g = 0;
         }
         
-        tmp_vec_ll = new long long[end];
         decomp_data = new uchar_t[pack.s.vec_len*2];
         decomp_data_perm = new uchar_t[pack.s.vec_len*2];
        
@@ -238,6 +265,13 @@ int Decompressor::decompressRange(const string & range)
                 i = (a->v1.i*2);
             }
             
+            // Variants filtered out by allele counts stored in the archive are not decoded
+            if(use_ac_index && !setACANIndexed(hdr, record, i))
+            {
+                i += 2;
+                continue;
+            }
+            
             pos = 0;
             str.l = 3;
             
@@ -249,35 +283,31 @@ int Decompressor::decompressRange(const string & range)
             if(block_id != prev_block_id)
             {
                 // Get approproate permutations
-                pack.getPermArray(block_id, perm);
-                reverse_perm(perm, rev_perm, no_haplotypes);
+                perm_block = pack.getPerm(block_id);
+                rev_perm = perm_block->rev_perm.data();
             }
-            fill_n(decomp_data, pack.s.vec_len*2, 0);
-
-            vec1_start = 0;
             vec2_start = pack.s.vec_len;
-            decomp_vec_rrr_range(i++, 0, pack.s.vec_len, pos, decomp_data_perm, 0, false);
-            decomp_vec_rrr_range(i++, 0, pack.s.vec_len, pos, decomp_data_perm, 0, false);
-            
-            // Permutations
-            decode_perm_rev(no_haplotypes, vec2_start, rev_perm, decomp_data_perm, decomp_data);
-            
-            prev_block_id = block_id;
-            char *pt = str.s + str.l;
-            //tmp_vec_ll = (long long *)pt;
-            for (vec1_start = 0; vec1_start < end; ++vec1_start)
+            if(block_cache.IsOpen())
+            {
+                memcpy(decomp_data, getCachedVariant(i, rev_perm, decomp_data_perm), pack.s.vec_len*2);
+                i += 2;
+            }
+            else
             {
-                //memcpy(pt + (vec1_start << 3), lut[decomp_data[vec1_start]][decomp_data[vec2_start++]], 8);
-                lut_ll = (long long *)(lut[decomp_data[vec1_start]][decomp_data[vec2_start++]]);
-                //*(tmp_vec_ll+ vec1_start) = *lut_ll;
-                tmp_vec_ll[vec1_start] = *lut_ll;
+                fill_n(decomp_data, pack.s.vec_len*2, 0);
+                decomp_vec_rrr(main_ctx, i++, pos, decomp_data_perm);
+                decomp_vec_rrr(main_ctx, i++, pos, decomp_data_perm);
+                
+                // Permutations
+                decode_perm_rev(no_haplotypes, vec2_start, rev_perm, decomp_data_perm, decomp_data);
             }
-            memcpy(pt, tmp_vec_ll, end << 3);
             
+            prev_block_id = block_id;
+            gt_expand_kernel(decomp_data, decomp_data + vec2_start, end, str.s + str.l);
             str.l = str.l + (end << 3);
             if(g)
             {
-                memcpy(str.s + str.l, lut[decomp_data[vec1_start]][decomp_data[vec2_start]], g);
+                gt_expand_bits(decomp_data[end], decomp_data[vec2_start + end], g, str.s + str.l);
                 str.l = str.l + g;
             }
             
@@ -286,45 +316,32 @@ int Decompressor::decompressRange(const string & range)
             bcf_update_info_int32(hdr, record, "_row", NULL, 0);
        
             // AC/AN count
-            if(out_AC_AN)
+            if(out_AC_AN && !use_ac_index)
             {
-                if(setACAN(hdr, record, str))
+                if(setACANPlanes(hdr, record, decomp_data, decomp_data + vec2_start, nullptr, pack.s.vec_len))
                 {
-                    if(out_genotypes)
-                        bcf_update_genotypes_fast(str, record);
-                    bcf_write1(out, hdr, record);
+                    writeRecord(record, str);
                     written_records++;
                 }
             }
             else
             {
-                if(out_genotypes)
-                    bcf_update_genotypes_fast(str, record);
-                bcf_write1(out, hdr, record);
+                writeRecord(record, str);
                 written_records++;
             }
             
         }
         bcf_itr_destroy(itr);
         
-        delete [] tmp_vec_ll;
-        for (auto & it:done_unique)
-        {
-            delete [] it.second;
-        }
-        done_unique.clear();
+        main_ctx.clear();
     }
     
-    hts_close(out);
+    closeOut();
     
     if(decomp_data)
         delete [] decomp_data;
     if(decomp_data_perm)
         delete [] decomp_data_perm;
-    if(perm)
-        delete [] perm;
-    if(rev_perm)
-        delete [] rev_perm;
     if(str.s)
     {
         free(str.s);
@@ -335,460 +352,795 @@ int Decompressor::decompressRange(const string & range)
     return 0;
 }
 
-int Decompressor::decompressSampleSmart(const string & range)
+// Get decoded (not permuted) pair of vectors of the variant starting at vec_id
+// The whole block is taken from the cache of decoded blocks or, if not cached yet, decoded and stored in the cache
+// rev_perm must hold the permutation of the block of vec_id
+const uchar_t * Decompressor::getCachedVariant(uint64_t vec_id, const uint32_t * rev_perm, uchar_t * decomp_data_perm)
 {
-  
-    if(smpl.no_samples > NO_SAMPLE_THRESHOLD)// || range != "")
-    {
-        return decompressRangeSample(range);
-    }
-    else if (range != "")
+    uint32_t block_id = (uint32_t) (vec_id / pack.s.max_no_vec_in_block);
+    uint64_t first_vec_in_block = (uint64_t) block_id * pack.s.max_no_vec_in_block;
+    
+    if(block_id != cached_block_id)
     {
+        uint64_t last_vec_in_block = min(first_vec_in_block + pack.s.max_no_vec_in_block, pack.no_vec);
+        uint64_t no_variants = (last_vec_in_block - first_vec_in_block) / 2;
+        uint64_t no_cached_variants = 0;
         
-        bcf1_t * record = bcf_init();
-        bcf_info_t * a = nullptr;
-        hts_itr_t * itr = bcf_itr_querys(bcf_idx, hdr, range.c_str());
-        uint32_t block_id, written_records = 0;
-        
-        if(bcf_itr_next(bcf, itr, record) != -1 && written_records < records_to_process)
+        cached_data = block_cache.Load(block_id, no_cached_variants);
+        if(!cached_data || no_cached_variants != no_variants)
         {
-            a = bcf_get_info(hdr, record, "_row"); //bcf_get_info_id
-            block_id = (a->v1.i)*2/pack.s.max_no_vec_in_block;
-            written_records++;
-        
-            while(bcf_itr_next(bcf, itr, record) != -1 && written_records < records_to_process)
-            {
-                written_records++;
-            }
-            a = bcf_get_info(hdr, record, "_row"); //bcf_get_info_id
-            if( block_id == (a->v1.i)*2/pack.s.max_no_vec_in_block) //all records within the same block
+            uint32_t pos;
+            
+            cached_block.assign(no_variants * 2 * pack.s.vec_len, 0);
+            
+            for(uint64_t j = 0; j < no_variants; ++j)
             {
-                bcf_destroy(record);
-                bcf_itr_destroy(itr);
-                return decompressRangeSample(range);
+                pos = 0;
+                decomp_vec_rrr(main_ctx, first_vec_in_block + 2*j, pos, decomp_data_perm);
+                decomp_vec_rrr(main_ctx, first_vec_in_block + 2*j + 1, pos, decomp_data_perm);
+                decode_perm_rev(pack.s.n_samples*pack.s.ploidy, (int) pack.s.vec_len, rev_perm, decomp_data_perm, cached_block.data() + j * 2 * pack.s.vec_len);
             }
-        
+            
+            block_cache.Store(block_id, no_variants, cached_block.data());
+            cached_data = cached_block.data();
         }
-        bcf_destroy(record);
-        bcf_itr_destroy(itr);
-
+        cached_block_id = block_id;
     }
-    initialLut();
     
-    std::vector<std::pair<uint32_t,uint32_t>> whichByte_whereInRes(smpl.no_samples*pack.s.ploidy + 1); // +1 for guard
-    //std::vector<std::pair<uint32_t,uchar_t>> whichByte_whereInRes(smpl.no_samples*pack.s.ploidy);
+    return cached_data + (vec_id - first_vec_in_block) * pack.s.vec_len;
+}
+
+// Set up decoding state with own readers of the archive streams (archive data is shared, read positions are not)
+void Decompressor::initDecodeContext(DecodeContext & ctx)
+{
+    ctx.bm.Open(pack.bm.mem_buffer, pack.bm.GetSize());
+    ctx.bm_comp_pos.Open(pack.bm_comp_pos.mem_buffer, pack.bm_comp_pos.GetSize());
+    ctx.bm_comp_copy_orgl_id.Open(pack.bm_comp_copy_orgl_id.mem_buffer, pack.bm_comp_copy_orgl_id.GetSize());
+    ctx.buff_bm.setBitMemory(&ctx.bm);
+}
+
+// Decode genotypes of a single variant (pair of vectors starting at vec_id) and append them to str (BCF encoded GT)
+void Decompressor::decodeRecordGT(DecodeContext & ctx, uint64_t vec_id, const uint32_t * rev_perm, uchar_t * decomp_data_perm, uchar_t * decomp_data, kstring_t & str)
+{
+    uint32_t pos = 0;
+    uint32_t no_haplotypes = smpl.no_samples * pack.s.ploidy;
+    uint32_t vec2_start = (uint32_t)pack.s.vec_len;
+    uint32_t end = (no_haplotypes & 7) ? pack.s.vec_len - 1 : pack.s.vec_len;
+    uint32_t g = no_haplotypes & 7;
     
-    buff_bm.setBitMemory(&pack.bm);
-    bool is_unique = false;
-    uint32_t unique_pos = 0, unique_pos_first_in_block = 0;
-    uint64_t  curr_zeros = 0, curr_copy = 0;
+    fill_n(decomp_data, pack.s.vec_len*2, 0);
     
-    uint64_t bv_size = pack.rrr_zeros_only_bit_vector[0].size();
+    decomp_vec_rrr(ctx, vec_id, pos, decomp_data_perm);
+    decomp_vec_rrr(ctx, vec_id + 1, pos, decomp_data_perm);
     
-    zeros_only_bit_vector[0] = sdsl::bit_vector(bv_size);
-    zeros_only_bit_vector[1] = sdsl::bit_vector(bv_size);
-    copy_bit_vector[0] = sdsl::bit_vector(bv_size);
-    copy_bit_vector[1] = sdsl::bit_vector(bv_size);
+    decode_perm_rev(no_haplotypes, vec2_start, rev_perm, decomp_data_perm, decomp_data);
     
-    uint64_t v_pos;
-    for(v_pos = 0; v_pos + 64 < bv_size; v_pos += 64)
+    gt_expand_kernel(decomp_data, decomp_data + vec2_start, end, str.s + str.l);
+    str.l = str.l + (end << 3);
+    if(g)
     {
-        zeros_only_bit_vector[0].set_int(v_pos, pack.rrr_zeros_only_bit_vector[0].get_int(v_pos, 64), 64);
-        zeros_only_bit_vector[1].set_int(v_pos, pack.rrr_zeros_only_bit_vector[1].get_int(v_pos, 64), 64);
-        copy_bit_vector[0].set_int(v_pos, pack.rrr_copy_bit_vector[0].get_int(v_pos, 64), 64);
-        copy_bit_vector[1].set_int(v_pos, pack.rrr_copy_bit_vector[1].get_int(v_pos, 64), 64);
+        gt_expand_bits(decomp_data[end], decomp_data[vec2_start + end], g, str.s + str.l);
+        str.l = str.l + g;
     }
     
-    uint64_t tail_len = bv_size - v_pos;
-    zeros_only_bit_vector[0].set_int(v_pos, pack.rrr_zeros_only_bit_vector[0].get_int(v_pos, tail_len), tail_len);
-    zeros_only_bit_vector[1].set_int(v_pos, pack.rrr_zeros_only_bit_vector[1].get_int(v_pos, tail_len), tail_len);
-    copy_bit_vector[0].set_int(v_pos, pack.rrr_copy_bit_vector[0].get_int(v_pos, tail_len), tail_len);
-    copy_bit_vector[1].set_int(v_pos, pack.rrr_copy_bit_vector[1].get_int(v_pos, tail_len), tail_len);
-    
-    uint32_t * perm = nullptr;
-    
-    perm = new uint32_t[pack.s.n_samples * pack.s.ploidy]; //pack.s.n_samples * pack.s.ploidy
-    
-    uint32_t block_id, prev_block_id = 0xFFFF;
+    str.s[str.l] = 0;
+}
 
-    uint32_t where; //uchar where;
-    uint32_t ind_id_orig;
+// Multi-threaded version of decompressRange
+// Reader thread groups records by blocks of the archive, workers decompress whole blocks (each with own decoding state and permutations),
+// the calling thread writes decompressed records in the original order
+int Decompressor::decompressRangeParallel(const string & range)
+{
+    initialLut();
     
-    unique_pos = 0;
-    curr_zeros = 0, curr_copy = 0;
-  
-    int32_t *tmpia = (int*)malloc(smpl.no_samples * pack.s.ploidy*sizeof(int));
-    bcf1_t * record = bcf_init();
-    uint64_t var_idx = 0, start;
-    uint32_t written_records = 0;
+    uint32_t no_haplotypes = smpl.no_samples * pack.s.ploidy;
     
-    // Set out BCF
     const char *key = "GT";
     khint_t k;
     vdict_t *d;
     int fmt_id;
-  
+    kstring_t str_hdr = {0,0,0};
+    
     d = (vdict_t*)hdr->dict[BCF_DT_ID];
     k = kh_get(vdict, d, key);
     fmt_id = (k == kh_end(d)? -1 : kh_val(d, k).id);
     
-    uint32_t no_haplotypes = smpl.no_samples* pack.s.ploidy;
-    if ( !bcf_hdr_idinfo_exists(hdr,BCF_HL_FMT,fmt_id) )
+    if (!bcf_hdr_idinfo_exists(hdr,BCF_HL_FMT,fmt_id))
     {
-        hts_close(out);
-        free(tmpia);
-        if ( !no_haplotypes ) return 0;
+        if ( !no_haplotypes )
+            return 0;
         return -1;  // the key not present in the header
     }
     
-    kstring_t str = {0,0,0};
-    bcf_enc_int1(&str, fmt_id);
-    
-    bcf_enc_size(&str, pack.s.ploidy, BCF_BT_INT8);
-    
-    char *tmp;
-    str.m = str.l + no_haplotypes + 1;
-    kroundup32(str.m);
-    if ((tmp = (char*)realloc(str.s, str.m)))
-        str.s = tmp;
-    else
-        exit(8);
-
-    str.l = 3;
-//    uint32_t pos;
-    if (no_haplotypes == 0) bcf_enc_size(&str, 0, BCF_BT_NULL);
+    // Header of the GT field, common for all records
+    bcf_enc_int1(&str_hdr, fmt_id);
+    bcf_enc_size(&str_hdr, pack.s.ploidy, BCF_BT_INT8);
+    str_hdr.l = 3;
     
-    uchar_t *resUnique = nullptr;
-   // resUnique = new uchar_t[pack.no_non_copy*smpl.no_samples*pack.s.ploidy];
-    resUnique = new uchar_t[pack.s.max_no_vec_in_block*smpl.no_samples*pack.s.ploidy];
-    uchar_t * resAll = nullptr;
-    // resAll = new uchar_t[pack.no_vec*smpl.no_samples*pack.s.ploidy];
-  //  resAll = new uchar_t[pack.s.max_no_vec_in_block*smpl.no_samples*pack.s.ploidy];
-    resAll = new uchar_t[2*smpl.no_samples*pack.s.ploidy];
-
+    size_t str_size = str_hdr.l + no_haplotypes + 1;
+    kroundup32(str_size);
     
-    uint32_t first_vec_in_block = 0;
+    CRecordBlockQueue inQueue(max((int) n_threads * 2, 4));
+    CDecompressedPartQueue outQueue(n_threads * 4 * (pack.s.max_no_vec_in_block / 2 / DECOMP_CHUNK_SIZE + 1));
+    atomic<bool> stop(false);
+    atomic<uint32_t> no_running_workers(n_threads);
     
-    if(range != "")
-    {
-        bcf_info_t * a = nullptr;
-        hts_itr_t * itr = bcf_itr_querys(bcf_idx, hdr, range.c_str());
+    // Read records (sites only) and group them by blocks
+    thread reader([&]{
+        vector<bcf1_t *> records;
+        bcf1_t * record = bcf_init();
+        hts_itr_t * itr = nullptr;
+        bcf_info_t * a;
+        int part_id = 0;
+        bool first_record = true;
+        uint64_t vec_id = 0, first_vec_id = 0;
+        uint32_t block_id, curr_block_id = 0;
         
-        while(bcf_itr_next(bcf, itr, record) != -1 && written_records < records_to_process)
+        if(range != "")
         {
-            if(!var_idx)
+            itr = bcf_itr_querys(bcf_idx, hdr, range.c_str());
+            if(!itr)
             {
-                a = bcf_get_info(hdr, record, "_row"); //bcf_get_info_id
-                var_idx = a->v1.i;
+                bcf_destroy(record);
+                inQueue.Complete();
+                return;
+            }
+        }
+        
+        while(!stop)
+        {
+            if(itr)
+            {
+                if(bcf_itr_next(bcf, itr, record) == -1)
+                    break;
+                if(first_record)
+                {
+                    a = bcf_get_info(hdr, record, "_row");
+                    vec_id = a->v1.i*2;
+                    first_record = false;
+                }
             }
+            else if(bcf_read1(bcf, hdr, record) < 0)
+                break;
             
-            // Permutations
-            block_id = (var_idx*2)/pack.s.max_no_vec_in_block;
+            block_id = vec_id/pack.s.max_no_vec_in_block; // Pair of vectors always in the same block
             
-            if(block_id != prev_block_id) // Get perm and find out which bytes need decoding
+            // Blocks without variants in the range of allele counts are not passed to workers
+            if(use_ac_index && !pack.blockACInRange(block_id, minAC, maxAC_all))
             {
-                first_vec_in_block = block_id*pack.s.max_no_vec_in_block;
-                
-                unique_pos = 0;
-                if(prev_block_id == 0xFFFF) //to set curr_zeros, curr_copy (first processed block)
+                vec_id += 2;
+                continue;
+            }
+            
+            if(!records.empty() && block_id != curr_block_id)
+            {
+                inQueue.Push(part_id++, first_vec_id, records);
+                records.clear();
+            }
+            if(records.empty())
+            {
+                first_vec_id = vec_id;
+                curr_block_id = block_id;
+            }
+            
+            records.push_back(record);
+            record = bcf_init();
+            vec_id += 2;
+        }
+        if(!records.empty())
+            inQueue.Push(part_id++, first_vec_id, records);
+        
+        bcf_destroy(record);
+        if(itr)
+            bcf_itr_destroy(itr);
+        inQueue.Complete();
+    });
+    
+    // Decompress blocks
+    vector<thread *> workers(n_threads, nullptr);
+    for(uint32_t t = 0; t < n_threads; ++t)
+        workers[t] = new thread([&]{
+            DecodeContext ctx;
+            initDecodeContext(ctx);
+            
+            perm_block_ptr_t perm_block;
+            uchar_t * decomp_data = new uchar_t[pack.s.vec_len*2];
+            uchar_t * decomp_data_perm = new uchar_t[pack.s.vec_len*2];
+            
+            vector<bcf1_t *> records, out_records;
+            vector<kstring_t> out_gt;
+            int part_id, chunk_id;
+            uint64_t vec_id;
+            
+            while(inQueue.Pop(part_id, vec_id, records))
+            {
+                if(stop)
                 {
-                    uint8_t parity = first_vec_in_block&1;
-                    uint32_t id = first_vec_in_block>>1;
-                    curr_zeros = pack.rrr_rank_zeros_only_bit_vector_0(id+((parity))) + pack.rrr_rank_zeros_only_bit_vector_1(id);
-                    curr_copy = pack.rrr_rank_copy_bit_vector[0](id+((parity))) + pack.rrr_rank_copy_bit_vector[1](id);
-                    //unique_pos_first_in_block = first_vec_in_block - curr_zeros - curr_copy;
-                    
-                   // first_vec_in_block = 0;
+                    for(auto record : records)
+                        bcf_destroy(record);
+                    continue;
                 }
-                unique_pos_first_in_block = first_vec_in_block - curr_zeros - curr_copy;
                 
-                // Get approproate permutations
-                pack.getPermArray(block_id, perm);
+                // Matches never cross block boundaries, so the cache is useless for the next block
+                ctx.clear();
+                perm_block = pack.getPerm((uint32_t) (vec_id/pack.s.max_no_vec_in_block));
                 
-                for(uint32_t s = 0; s < smpl.no_samples; s++)
+                chunk_id = 0;
+                size_t r;
+                for(r = 0; r < records.size(); ++r, vec_id += 2)
                 {
-                    for (uint32_t p = 0; p < pack.s.ploidy; p++ )
+                    bcf1_t * record = records[r];
+                    
+                    if(use_ac_index && !setACANIndexed(hdr, record, vec_id))
                     {
-                        ind_id_orig = sampleIDs[s]*pack.s.ploidy+p;
-                        
-                        where = s*pack.s.ploidy  + p;
-                        whichByte_whereInRes[where] =  std::make_pair(perm[ind_id_orig]>>3, where); //now original_id_only
+                        bcf_destroy(record);
+                        continue;
                     }
-                }
-                whichByte_whereInRes[smpl.no_samples*pack.s.ploidy] =  std::make_pair(0xFFFFFFFF, smpl.no_samples*pack.s.ploidy); //guard
-                
-                // Sort by byte_no
-                std::sort(whichByte_whereInRes.begin(), whichByte_whereInRes.end());
-                
-            /*    //count bytes to decode
-                uint32_t bytesToDecode = 0;
-                if(no_haplotypes > 0)
-                    bytesToDecode = 1;
-                for(int b = 1; b < no_haplotypes; b++)
-                    if(whichByte_whereInRes[b].first != whichByte_whereInRes[b-1].first)
-                        bytesToDecode++;
-                
-              */
-                prev_block_id = block_id;
-                
-                // Get vectors from all block
-                //copies only within the same block, so only part of resUnique (within the same block and using the same perm) will be used - no need to fix previous unique bytes (these are in different blocks, with diff perm)
-                uint64_t last_vec_in_block = (block_id+1)* pack.s.max_no_vec_in_block ;
-                last_vec_in_block = last_vec_in_block < pack.no_vec ? last_vec_in_block : pack.no_vec;
-                
-                for (uint64_t i = first_vec_in_block; i < var_idx*2; i++ )
-                {
-                    get_vec_bytes(i, whichByte_whereInRes, resUnique, is_unique, curr_zeros, curr_copy, resAll, unique_pos_first_in_block, first_vec_in_block, false);
-                
-                    if(is_unique)
+                    
+                    bcf_unpack(record, BCF_UN_ALL);
+                    record->n_sample = bcf_hdr_nsamples(hdr);
+                    
+                    kstring_t str;
+                    str.m = str_size;
+                    str.s = (char*) malloc(str.m);
+                    if(!str.s)
+                        exit(8);
+                    memcpy(str.s, str_hdr.s, str_hdr.l);
+                    str.l = str_hdr.l;
+                    
+                    decodeRecordGT(ctx, vec_id, perm_block->rev_perm.data(), decomp_data_perm, decomp_data, str);
+                    
+                    bcf_update_info_int32(hdr, record, "_row", NULL, 0);
+                    
+                    // AC/AN count
+                    if(!out_AC_AN || use_ac_index || setACANPlanes(hdr, record, decomp_data, decomp_data + pack.s.vec_len, nullptr, pack.s.vec_len))
                     {
-                      //  for(uint32_t idx = 0; idx < no_haplotypes; idx++)
+                        if(vcf_writer.IsOpen())
                         {
-                           // resUnique[pack.no_non_copy*whichByte_whereInRes[idx].second  + unique_pos] = resAll[whichByte_whereInRes[idx].second * pack.no_vec + i];
-                            
-                       //     resUnique[unique_pos*pack.s.vec_len + whichByte_whereInRes[idx].second] = resAll[i * pack.s.vec_len + whichByte_whereInRes[idx].second];
-                       //      memcpy(resUnique + unique_pos*no_haplotypes, resAll + (i-first_vec_in_block) * no_haplotypes, no_haplotypes);
-                                  memcpy(resUnique + unique_pos*no_haplotypes, resAll + (i&1) * no_haplotypes, no_haplotypes);
-                            
+                            // Text line is formatted here, the main thread only writes it
+                            kstring_t line = {0, 0, 0};
+                            vcf_writer.FormatRecord(hdr, record, out_genotypes ? &str : nullptr, line);
+                            free(str.s);
+                            str = line;
                         }
-                        unique_pos++;
+                        else if(out_genotypes)
+                            bcf_update_genotypes_fast(str, record);
+                        out_records.push_back(record);
+                        out_gt.push_back(str);
+                    }
+                    else
+                    {
+                        bcf_destroy(record);
+                        free(str.s);
                     }
-                }
-            }
-         //   else
-            {
-                
-                //previous vectors in block are decompressed already
-                for (uint64_t i = var_idx*2; i <= var_idx*2+1; i++ )
                     
-                {    get_vec_bytes(i, whichByte_whereInRes, resUnique, is_unique, curr_zeros, curr_copy, resAll, unique_pos_first_in_block, first_vec_in_block);
-                
-                    if(is_unique)
+                    if(out_records.size() == DECOMP_CHUNK_SIZE && r + 1 < records.size())
                     {
-                        //  for(uint32_t idx = 0; idx < no_haplotypes; idx++)
+                        if(!outQueue.Push(part_id, chunk_id++, false, out_records, out_gt))
                         {
-                            // resUnique[pack.no_non_copy*whichByte_whereInRes[idx].second  + unique_pos] = resAll[whichByte_whereInRes[idx].second * pack.no_vec + i];
-                            
-                            //     resUnique[unique_pos*pack.s.vec_len + whichByte_whereInRes[idx].second] = resAll[i * pack.s.vec_len + whichByte_whereInRes[idx].second];
-                           // memcpy(resUnique + unique_pos*no_haplotypes, resAll + (i-first_vec_in_block) * no_haplotypes, no_haplotypes);
-                             memcpy(resUnique + unique_pos*no_haplotypes, resAll + (i&1) * no_haplotypes, no_haplotypes);
+                            ++r;
+                            break;
                         }
-                        unique_pos++;
+                        out_records.clear();
+                        out_gt.clear();
                     }
                 }
                 
-            }
-            
-//            pos = 0;
-            str.l = 3;
-            bcf_unpack(record, BCF_UN_ALL);
-            record->n_sample = bcf_hdr_nsamples(hdr);
-            char *pt = str.s + str.l;
-    
-            for (int g = 0; g < (int) smpl.no_samples; g++)
-            {
-                for (uint32_t p = 0; p < pack.s.ploidy; p++ )
-                {
-                    start =  (g*pack.s.ploidy+p);
-                    pt[start] = lut[resAll[start]][resAll[start+no_haplotypes]][(perm[sampleIDs[g]*pack.s.ploidy + p])%8];
-                    //memcpy(pt + (g*pack.s.ploidy+p), lut[resAll[start]][resAll[start+no_haplotypes]] +(perm[sampleIDs[g]*pack.s.ploidy + p])%8, 1);
-                }
-            }
-          
-            str.l = str.l + (smpl.no_samples*pack.s.ploidy);
-            str.s[str.l] = 0;
-            
-            bcf_update_info_int32(hdr, record, "_row", NULL, 0);
-            
-            // AC/AN count
-            if(out_AC_AN)
-            {
-                if(setACAN(hdr, record, str))
-                {
-                    if(out_genotypes)
-                        bcf_update_genotypes_fast(str, record);
-                    
-                    bcf_write1(out, hdr, record);
-                    written_records++;
-                    
-                }
-            }
-            else
-            {
-                if(out_genotypes)
-                    bcf_update_genotypes_fast(str, record);
+                if(r == records.size())
+                    outQueue.Push(part_id, chunk_id, true, out_records, out_gt);
                 
-                bcf_write1(out, hdr, record);
-                written_records++;
+                // Data not passed to the writer (it finished earlier)
+                for(; r < records.size(); ++r)
+                    bcf_destroy(records[r]);
+                for(auto record : out_records)
+                    bcf_destroy(record);
+                for(auto & s : out_gt)
+                    free(s.s);
+                out_records.clear();
+                out_gt.clear();
+                records.clear();
             }
             
-            var_idx++;
+            delete [] decomp_data;
+            delete [] decomp_data_perm;
             
-            prev_block_id = block_id;
-        }
-        bcf_itr_destroy(itr);
-    }
-    else
+            if(--no_running_workers == 0)
+                outQueue.Complete();
+        });
+    
+    // Write records in the original order
+    vector<bcf1_t *> records;
+    vector<kstring_t> gt_data;
+    uint32_t written_records = 0;
+    
+    while(outQueue.Pop(records, gt_data))
     {
-        
-        while (bcf_read1(bcf, hdr, record) >= 0 &&  written_records < records_to_process)
+        size_t r;
+        for(r = 0; r < records.size() && written_records < records_to_process; ++r)
         {
-            // Permutations
-            block_id = (var_idx*2) / pack.s.max_no_vec_in_block;
-            if(block_id != prev_block_id) //get perm and find out which bytes need decoding
-            {
-                first_vec_in_block = block_id*pack.s.max_no_vec_in_block;
-                unique_pos = 0;
-                if(prev_block_id == 0xFFFF) //to set curr_zeros, curr_copy (first processed block)
-                {
-                    uint8_t parity = first_vec_in_block&1;
-                    uint32_t id = first_vec_in_block>>1;
-                    curr_zeros = pack.rrr_rank_zeros_only_bit_vector_0(id+((parity))) + pack.rrr_rank_zeros_only_bit_vector_1(id);
-                    curr_copy = pack.rrr_rank_copy_bit_vector[0](id+((parity))) + pack.rrr_rank_copy_bit_vector[1](id);
-                    //unique_pos_first_in_block = first_vec_in_block - curr_zeros - curr_copy;
-                    
-                    // first_vec_in_block = 0;
-                }
-                unique_pos_first_in_block = first_vec_in_block - curr_zeros - curr_copy;
-                
-                
-                
-                //get approproate permutations
-                pack.getPermArray(block_id, perm);
+            if(vcf_writer.IsOpen())
+                vcf_writer.Write(gt_data[r].s, gt_data[r].l);
+            else
+                bcf_write1(out, hdr, records[r]);
+            written_records++;
+            bcf_destroy(records[r]);
+            free(gt_data[r].s);
+        }
+        for(; r < records.size(); ++r)
+        {
+            bcf_destroy(records[r]);
+            free(gt_data[r].s);
+        }
+        
+        if(written_records >= records_to_process)
+        {
+            stop = true;
+            outQueue.Abort();
+            break;
+        }
+    }
+    
+    reader.join();
+    for(auto p : workers)
+    {
+        p->join();
+        delete p;
+    }
+    workers.clear();
+    
+    closeOut();
+    
+    free(str_hdr.s);
+    
+    return 0;
+}
+
+// Statistics of the whole archive; threads take whole blocks (each with own decoding state and counters),
+// vectors are not un-permuted
+int Decompressor::computeStats()
+{
+    Samples names;
+    if(names.loadSamples(arch_name + ".ind"))
+    {
+        cout << "Error while reading the file with names of samples: " << arch_name << ".ind" << endl;
+        exit(1);
+    }
+    
+    FILE * f = stdout;
+    if(out_name != "")
+    {
+        f = fopen(out_name.c_str(), "w");
+        if(!f)
+        {
+            cout << "Could not open " << out_name << endl;
+            exit(1);
+        }
+    }
+    
+    vector<CArchiveStats> part_stats(n_threads, CArchiveStats(pack.s.n_samples, pack.s.ploidy));
+    atomic<uint32_t> next_block(0);
+    
+    vector<thread *> workers(n_threads, nullptr);
+    for(uint32_t t = 0; t < n_threads; ++t)
+        workers[t] = new thread([&, t]{
+            DecodeContext ctx;
+            initDecodeContext(ctx);
+            
+            CArchiveStats & st = part_stats[t];
+            uchar_t * decomp_data_perm = new uchar_t[pack.s.vec_len*2];
+            uint32_t block_id;
+            
+            while((block_id = next_block++) < pack.no_blocks)
+            {
+                ctx.clear();
+                perm_block_ptr_t perm_block = pack.getPerm(block_id);
                 
-                for(uint32_t s = 0; s < smpl.no_samples; s++)
+                uint64_t first_vec = (uint64_t) block_id * pack.s.max_no_vec_in_block;
+                uint64_t last_vec = min(first_vec + pack.s.max_no_vec_in_block, pack.no_vec);
+                for(uint64_t vec_id = first_vec; vec_id < last_vec; vec_id += 2)
                 {
-                    for (uint32_t p = 0; p < pack.s.ploidy; p++ )
-                    {
-                        ind_id_orig = sampleIDs[s]*pack.s.ploidy+p;
-                        where = s*pack.s.ploidy  + p;
-                        whichByte_whereInRes[where] =  std::make_pair(perm[ind_id_orig]>>3, where); // now original_id_only
-                    }
-                }
-                 whichByte_whereInRes[smpl.no_samples*pack.s.ploidy] =  std::make_pair(0xFFFFFFFF, smpl.no_samples*pack.s.ploidy); //guard
-                
-                
-                // Sort by byte_id (.first)
-                std::sort(whichByte_whereInRes.begin(), whichByte_whereInRes.end());
-                
-            /*    //count bytes to decode
-                uint32_t bytesToDecode = 0;
-                if(no_haplotypes > 0)
-                    bytesToDecode = 1;
-                for(int b = 1; b < no_haplotypes; b++)
-                    if(whichByte_whereInRes[b].first != whichByte_whereInRes[b-1].first)
-                        bytesToDecode++;
-              */
-                prev_block_id = block_id;
-                
-                // Get vectors from all block
-                uint64_t last_vec_in_block = var_idx*2 + pack.s.max_no_vec_in_block;
-                last_vec_in_block = last_vec_in_block < pack.no_vec ? last_vec_in_block : pack.no_vec;
-                
-                for (uint64_t i = var_idx*2; i <= var_idx*2+1; i++ ){
-                    get_vec_bytes(i, whichByte_whereInRes, resUnique, is_unique, curr_zeros, curr_copy, resAll, unique_pos_first_in_block, first_vec_in_block);
-                    
+                    uint32_t pos = 0;
+                    decomp_vec_rrr(ctx, vec_id, pos, decomp_data_perm);
+                    decomp_vec_rrr(ctx, vec_id + 1, pos, decomp_data_perm);
                     
-                    if(is_unique)
-                    {
-                      //  for(uint32_t idx = 0; idx < no_haplotypes; idx++)
-                        {
-                        //    resUnique[pack.no_non_copy*whichByte_whereInRes[idx].second  + unique_pos] = resAll[whichByte_whereInRes[idx].second * pack.no_vec + i];
-                       //    memcpy(resUnique + unique_pos*no_haplotypes, resAll + (i-first_vec_in_block) * no_haplotypes, no_haplotypes);
-                            memcpy(resUnique + unique_pos*no_haplotypes, resAll + (i&1) * no_haplotypes, no_haplotypes);
-
-                            
-                        }
-                        unique_pos++;
-                    }
+                    st.AddVariant(decomp_data_perm, decomp_data_perm + pack.s.vec_len, pack.s.vec_len,
+                        perm_block->perm.data(), perm_block->rev_perm.data());
                 }
             }
-            else
+            
+            delete [] decomp_data_perm;
+        });
+    
+    for(auto p : workers)
+    {
+        p->join();
+        delete p;
+    }
+    workers.clear();
+    
+    for(uint32_t t = 1; t < n_threads; ++t)
+        part_stats[0].Merge(part_stats[t]);
+    part_stats[0].Write(f, names.getNames());
+    
+    if(f != stdout)
+        fclose(f);
+    
+    return 0;
+}
+
+int Decompressor::decompressSampleSmart(const string & range)
+{
+  
+    if(smpl.no_samples > NO_SAMPLE_THRESHOLD || (block_cache.IsOpen() && range != ""))
+    {
+        return decompressRangeSample(range);
+    }
+    else if (range != "")
+    {
+        
+        bcf1_t * record = bcf_init();
+        bcf_info_t * a = nullptr;
+        hts_itr_t * itr = bcf_itr_querys(bcf_idx, hdr, range.c_str());
+        uint32_t block_id, written_records = 0;
+        
+        if(bcf_itr_next(bcf, itr, record) != -1 && written_records < records_to_process)
+        {
+            a = bcf_get_info(hdr, record, "_row"); //bcf_get_info_id
+            block_id = (a->v1.i)*2/pack.s.max_no_vec_in_block;
+            written_records++;
+        
+            while(bcf_itr_next(bcf, itr, record) != -1 && written_records < records_to_process)
             {
-                for (uint64_t i = var_idx*2; i <= var_idx*2+1; i++ ){
-                    get_vec_bytes(i, whichByte_whereInRes, resUnique, is_unique, curr_zeros, curr_copy, resAll, unique_pos_first_in_block, first_vec_in_block);
-                    
-                    
-                    if(is_unique)
-                    {
-                        //  for(uint32_t idx = 0; idx < no_haplotypes; idx++)
-                        {
-                            //    resUnique[pack.no_non_copy*whichByte_whereInRes[idx].second  + unique_pos] = resAll[whichByte_whereInRes[idx].second * pack.no_vec + i];
-                            //    memcpy(resUnique + unique_pos*no_haplotypes, resAll + (i-first_vec_in_block) * no_haplotypes, no_haplotypes);
-                            memcpy(resUnique + unique_pos*no_haplotypes, resAll + (i&1) * no_haplotypes, no_haplotypes);
-                            
-                            
-                        }
-                        unique_pos++;
-                    }
-                }
+                written_records++;
             }
+            a = bcf_get_info(hdr, record, "_row"); //bcf_get_info_id
+            if( block_id == (a->v1.i)*2/pack.s.max_no_vec_in_block) //all records within the same block
+            {
+                bcf_destroy(record);
+                bcf_itr_destroy(itr);
+                return decompressRangeSample(range);
+            }
+        
+        }
+        bcf_destroy(record);
+        bcf_itr_destroy(itr);
+
+    }
+    initialLut();
+    
+    buff_bm.setBitMemory(&pack.bm);
+    
+    perm_block_ptr_t perm_block;
+    
+    uint32_t block_id, prev_block_id = 0xFFFFFFFF;
+    
+    bcf1_t * record = bcf_init();
+    uint64_t var_idx = 0;
+    uint32_t written_records = 0;
+    
+    // Set out BCF
+    const char *key = "GT";
+    khint_t k;
+    vdict_t *d;
+    int fmt_id;
+    
+    d = (vdict_t*)hdr->dict[BCF_DT_ID];
+    k = kh_get(vdict, d, key);
+    fmt_id = (k == kh_end(d)? -1 : kh_val(d, k).id);
+    
+    uint32_t no_haplotypes = smpl.no_samples* pack.s.ploidy;
+    if ( !bcf_hdr_idinfo_exists(hdr,BCF_HL_FMT,fmt_id) )
+    {
+        closeOut();
+        bcf_destroy(record);
+        if ( !no_haplotypes ) return 0;
+        return -1;  // the key not present in the header
+    }
+    
+    kstring_t str = {0,0,0};
+    bcf_enc_int1(&str, fmt_id);
+    
+    bcf_enc_size(&str, pack.s.ploidy, BCF_BT_INT8);
+    
+    char *tmp;
+    str.m = str.l + no_haplotypes + 1;
+    kroundup32(str.m);
+    if ((tmp = (char*)realloc(str.s, str.m)))
+        str.s = tmp;
+    else
+        exit(8);
+    
+    str.l = 3;
+    if (no_haplotypes == 0) bcf_enc_size(&str, 0, BCF_BT_NULL);
+    
+    hts_itr_t * itr = nullptr;
+    if(range != "")
+    {
+        itr = bcf_itr_querys(bcf_idx, hdr, range.c_str());
+        if(bcf_itr_next(bcf, itr, record) != -1)
+        {
+            bcf_info_t * a = bcf_get_info(hdr, record, "_row");
+            var_idx = a->v1.i;
+        }
+        else
+            written_records = records_to_process;
+    }
+    else if(bcf_read1(bcf, hdr, record) < 0)
+        written_records = records_to_process;
+    
+    while(written_records < records_to_process)
+    {
+        block_id = (var_idx*2)/pack.s.max_no_vec_in_block;
+        
+        if(block_id != prev_block_id) // Get perm and find out which bytes of vectors need decoding
+        {
+            perm_block = pack.getPerm(block_id);
+            initBlockColumns(block_id, perm_block->perm.data());
+            prev_block_id = block_id;
+        }
+        
+        // Vectors of the block are decoded once, in order, up to the ones needed by the current variant
+        decodeBlockColumns(var_idx*2+1);
+        
+        str.l = 3;
+        bcf_unpack(record, BCF_UN_ALL);
+        record->n_sample = bcf_hdr_nsamples(hdr);
+        
+        char *pt = str.s + str.l;
+        uint32_t no_cols = (uint32_t) col_bytes.size() - 1;
+        uchar_t * row_0 = block_cols.data() + (var_idx*2 - col_first_vec) * no_cols;
+        uchar_t * row_1 = row_0 + no_cols;
+        
+        for(uint32_t h = 0; h < no_haplotypes; h++)
+            pt[h] = gt_value(row_0[hap_col[h]], row_1[hap_col[h]], hap_shift[h]);
+        
+        str.l = str.l + no_haplotypes;
+        str.s[str.l] = 0;
+        
+        bcf_update_info_int32(hdr, record, "_row", NULL, 0);
+        
+        // AC/AN count
+        if(!out_AC_AN || setACANPlanes(hdr, record, row_0, row_1, col_mask.data(), no_cols))
+        {
+            writeRecord(record, str);
+            written_records++;
+        }
+        
+        var_idx++;
+        
+        if(itr)
+        {
+            if(bcf_itr_next(bcf, itr, record) == -1)
+                break;
+        }
+        else if(bcf_read1(bcf, hdr, record) < 0)
+            break;
+    }
+    if(itr)
+        bcf_itr_destroy(itr);
+    
+    closeOut();
+    if(str.s)
+    {
+        free(str.s);
+        str.s = nullptr;
+    }
+    bcf_destroy(record);
+    
+    return 0;
+}
+
+// Set columns of the block store: distinct bytes of vectors (in permuted order) holding the selected haplotypes
+void Decompressor::initBlockColumns(uint32_t block_id, const uint32_t * perm)
+{
+    uint32_t no_haplotypes = smpl.no_samples * pack.s.ploidy;
+    uint32_t ind_id_orig;
+    
+    col_bytes.clear();
+    hap_col.resize(no_haplotypes);
+    hap_shift.resize(no_haplotypes);
+    
+    for(uint32_t s = 0; s < smpl.no_samples; s++)
+        for (uint32_t p = 0; p < pack.s.ploidy; p++)
+        {
+            ind_id_orig = sampleIDs[s]*pack.s.ploidy + p;
+            col_bytes.push_back(perm[ind_id_orig] >> 3);
+            hap_shift[s*pack.s.ploidy + p] = perm[ind_id_orig] % 8;
+        }
+    
+    sort(col_bytes.begin(), col_bytes.end());
+    col_bytes.erase(unique(col_bytes.begin(), col_bytes.end()), col_bytes.end());
+    
+    for(uint32_t s = 0; s < smpl.no_samples; s++)
+        for (uint32_t p = 0; p < pack.s.ploidy; p++)
+            hap_col[s*pack.s.ploidy + p] = (uint32_t) (lower_bound(col_bytes.begin(), col_bytes.end(), perm[sampleIDs[s]*pack.s.ploidy + p] >> 3) - col_bytes.begin());
+    
+    col_mask.assign(col_bytes.size(), 0);
+    for(uint32_t h = 0; h < no_haplotypes; ++h)
+        col_mask[hap_col[h]] |= 0x80 >> hap_shift[h];
+    
+    col_bytes.push_back(0xFFFFFFFF); // guard
+    
+    col_first_vec = (uint64_t) block_id * pack.s.max_no_vec_in_block;
+    col_next_vec = col_first_vec;
+    
+    // Number of zero-only and copied vectors before the block
+    uint8_t parity = col_first_vec & 1;
+    uint64_t id = col_first_vec >> 1;
+    col_zeros = pack.zeros_only_bv[0].rank0(id + parity) + pack.zeros_only_bv[1].rank1(id);
+    col_copy = pack.copy_bv[0].rank1(id + parity) + pack.copy_bv[1].rank1(id);
+    col_unique_first = col_first_vec - col_zeros - col_copy;
+    
+    block_cols.resize((size_t) pack.s.max_no_vec_in_block * (col_bytes.size() - 1));
+    unique_rows.clear();
+}
+
+// Decode vectors of the current block (only the selected columns) up to last_vec_id (inclusive)
+// Copies and matches refer to unique vectors of the same block, so each of them is decoded exactly once
+void Decompressor::decodeBlockColumns(uint64_t last_vec_id)
+{
+    uint32_t no_cols = (uint32_t) col_bytes.size() - 1;
+    uint32_t tmp;
+    
+    for(; col_next_vec <= last_vec_id; col_next_vec++)
+    {
+        uint64_t vec_id = col_next_vec;
+        uint8_t parity = vec_id & 1;
+        uint64_t vector = vec_id >> 1;
+        uchar_t * row = block_cols.data() + (vec_id - col_first_vec) * no_cols;
+        
+        if((parity && pack.zeros_only_bv[1][vector]) || (!parity && !pack.zeros_only_bv[0][vector]))
+        {
+            col_zeros++;
+            fill_n(row, no_cols, 0);
+        }
+        else if(pack.copy_bv[parity][vector]) // Copy of other vector (certainly placed within the same block)
+        {
+            unsigned long long bit_pos = col_copy*pack.used_bits_cp;
             
-//            pos = 0;
-            str.l = 3;
-            bcf_unpack(record, BCF_UN_ALL);
-            record->n_sample = bcf_hdr_nsamples(hdr);
+            tmp = 0;
+            pack.bm_comp_copy_orgl_id.SetPos(bit_pos >> 3);
+            pack.bm_comp_copy_orgl_id.GetBits(tmp, bit_pos&7); // %8
+            pack.bm_comp_copy_orgl_id.GetBits(tmp, pack.used_bits_cp);
             
-            char *pt = str.s + str.l;
+            uint64_t orgl_unique_id = vec_id - col_zeros - col_copy - tmp - 1;
+            col_copy++;
             
-            for (int g = 0; g < (int) smpl.no_samples; g++)
+            memcpy(row, block_cols.data() + unique_rows[orgl_unique_id - col_unique_first] * no_cols, no_cols);
+        }
+        else
+        {
+            decodeUniqueColumns(vec_id - col_zeros - col_copy, row);
+            unique_rows.push_back((uint32_t) (vec_id - col_first_vec));
+        }
+    }
+}
+
+// Decode the selected columns of a single unique vector into row
+void Decompressor::decodeUniqueColumns(uint64_t curr_non_copy_vec_id, uchar_t * row)
+{
+    uint32_t no_cols = (uint32_t) col_bytes.size() - 1;
+    if(!no_cols)
+        return;
+    
+    uint32_t last_byte = col_bytes[no_cols - 1]; // Last byte to decode
+    uint32_t next_col = 0;
+    uchar_t byte;
+    uint32_t tmp = 0;
+    
+    uint32_t curr_pos;
+    unsigned long long full_pos = curr_non_copy_vec_id/FULL_POS_STEP  * (sizeof(uint32_t) + pack.used_bits_noncp*(FULL_POS_STEP-1)/BITS_IN_BYTE);
+    pack.bm_comp_pos.SetPos(full_pos);
+    pack.bm_comp_pos.GetWord(curr_pos);
+    uint32_t j = ((curr_non_copy_vec_id-1)%FULL_POS_STEP)/(sizeof(uint32_t)*BITS_IN_BYTE), end = curr_non_copy_vec_id%FULL_POS_STEP;
+    if(j)
+    {
+        pack.bm_comp_pos.SetPos(full_pos + sizeof(uint32_t) + j*pack.used_bits_noncp*sizeof(uint32_t));
+        j = j*(sizeof(uint32_t)*BITS_IN_BYTE);
+        
+        if(end > j + 1)
+            pack.bm_comp_pos.GetBitsAndDiscard((int32_t)pack.used_bits_noncp * (end - 1 - j));
+        if(end  > j)
+            pack.bm_comp_pos.GetBits(tmp, (int32_t)pack.used_bits_noncp);
+    }
+    else
+    {
+        if(end > 1)
+            pack.bm_comp_pos.GetBitsAndDiscard((int32_t)pack.used_bits_noncp*(end - 1));
+        if(end)
+            pack.bm_comp_pos.GetBits(tmp, (int32_t)pack.used_bits_noncp);
+    }
+    curr_pos += tmp;
+    
+    uint32_t ones_group;
+    uint32_t decoded_bytes = 0;
+    uint32_t run_len;
+    uint64_t best_pos = 0;
+    uint32_t best_match_len = 0;
+    int32_t  flag;
+    uint32 litRun;
+    uchar_t * match_row = nullptr;
+    
+    buff_bm.SetPos(curr_pos);
+    
+    ones_group = buff_bm.decodeFastLut(&pack.huf_group_type);
+    
+    CHuffman * h_lit = &pack.huf_literals[ones_group];
+    
+    while(decoded_bytes <= last_byte)
+    {
+        flag = buff_bm.decodeFastLut(&pack.huf_flags);
+        
+        switch(flag)
+        {
+            case 0: // literal
+                byte = buff_bm.decodeFastLut(h_lit);
+                if(decoded_bytes == col_bytes[next_col])
+                    row[next_col++] = byte;
+                decoded_bytes++;
+                break;
+            case 1: // match
+                // Difference between current and match is stored
+                tmp = buff_bm.decodeFastLut(&pack.huf_match_diff_MSB);
+                best_pos = tmp << (pack.s.bit_size_id_match_pos_diff - MATCH_BITS_HUF);
+                tmp = buff_bm.getBits(pack.s.bit_size_id_match_pos_diff - MATCH_BITS_HUF);
+                best_pos = best_pos | tmp;
+                best_pos = curr_non_copy_vec_id - best_pos - 1;
+                match_row = block_cols.data() + unique_rows[best_pos - col_unique_first] * no_cols;
+                // fall through
+            case 2: // match same
+                best_match_len = buff_bm.decodeFast(&pack.huf_match_lens[ones_group]);
+                for(; decoded_bytes + best_match_len > col_bytes[next_col]; next_col++)
+                    row[next_col] = match_row[next_col];
+                decoded_bytes += best_match_len;
+                break;
+            case 3: // run of zeros
+                run_len = buff_bm.decodeFast(&(pack.huf_zeros_runs[ones_group]));
+                for(; decoded_bytes + run_len > col_bytes[next_col]; next_col++)
+                    row[next_col] = 0;
+                decoded_bytes += run_len;
+                break;
+            case 4: // run of ones
+                run_len = buff_bm.decodeFast(&(pack.huf_ones_runs[ones_group]));
+                for(; decoded_bytes + run_len > col_bytes[next_col]; next_col++)
+                    row[next_col] = 0xFF;
+                decoded_bytes += run_len;
+                break;
+            default: // run of literals (2 (MIN_LITERAL_RUN) - MAX_LITERAL_RUN)
             {
-                for (uint32_t p = 0; p < pack.s.ploidy; p++)
+                flag = flag - 3; // Shift by 3, to be able to difference between 2,3 and 4 flags nad literal run of 2,3 or 4
+                
+                litRun = buff_bm.getBits(pack.used_bits_litRunSize[ones_group]);
+                if(flag + decoded_bytes <= col_bytes[next_col])
                 {
-                    start =  (g*pack.s.ploidy+p);
-                    pt[start] = lut[resAll[start]][resAll[start+no_haplotypes]][(perm[sampleIDs[g]*pack.s.ploidy + p])%8];
-                    //memcpy(pt + (start), lut[resAll[start]][resAll[start+no_haplotypes]] +(perm[sampleIDs[g]*pack.s.ploidy + p])%8, 1);
+                    if(!litRun) // litRun == 0 means used_bits_litRunSize bits were not enough to store size
+                        litRun = buff_bm.getBits(pack.max_used_bits_litRunSize[ones_group]);
+                    
+                    litRun = litRun + pack.minLitRunSize[ones_group][flag] - 1; // 1 is added to litRun, so it is never == 0
+                    
+                    // Skip run of literals
+                    buff_bm.getBitsAndDiscard(litRun);
+                    decoded_bytes += flag;
                 }
-            }
-            
-            str.l = str.l + (smpl.no_samples*pack.s.ploidy);
-            str.s[str.l] = 0;
-            
-            bcf_update_info_int32(hdr, record, "_row", NULL, 0);
-            // AC/AN count
-            if(out_AC_AN)
-            {
-                if(setACAN(hdr, record, str))
+                else
                 {
-                    if(out_genotypes)
-                        bcf_update_genotypes_fast(str, record);
-                    
-                    bcf_write1(out, hdr, record);
-                    written_records++;
+                    if(!litRun)
+                        buff_bm.getBitsAndDiscard(pack.max_used_bits_litRunSize[ones_group]);
                     
+                    for(int i = 0; i < flag; i++)
+                    {
+                        byte = buff_bm.decodeFastLut(h_lit);
+                        if(decoded_bytes == col_bytes[next_col])
+                            row[next_col++] = byte;
+                        decoded_bytes++;
+                    }
                 }
             }
-            else
-            {
-                if(out_genotypes)
-                    bcf_update_genotypes_fast(str, record);
-                
-                bcf_write1(out, hdr, record);
-                written_records++;
-            }
-            
-            var_idx++;
-            
-            
-            prev_block_id = block_id;
         }
+        
+        if(next_col == no_cols)
+            return; // all columns decoded
     }
-    hts_close(out);
-    free(tmpia);
-    if(str.s)
-    {
-        free(str.s);
-        str.s = nullptr;
-    }
-    bcf_destroy(record);
-
-    if(resUnique)
-        delete [] resUnique;
-    if(resAll)
-        delete [] resAll;
-    if(perm)
-        delete [] perm;
-    return 0;
 }
 
 int Decompressor::decompressRangeSample(const string & range)
@@ -797,26 +1149,22 @@ int Decompressor::decompressRangeSample(const string & range)
     
     uchar_t *decomp_data = nullptr;
     uchar_t * decomp_data_perm = nullptr;
-    uint32_t * perm = nullptr;
-    uint32_t * rev_perm = nullptr;
+    perm_block_ptr_t perm_block;
+    const uint32_t * rev_perm = nullptr;
     uint32_t pos;
     
     uint32_t no_haplotypes = smpl.no_samples*pack.s.ploidy;
-    perm = new uint32_t[pack.s.n_samples * pack.s.ploidy];
-    rev_perm = new uint32_t[pack.s.n_samples * pack.s.ploidy];
     
     bcf1_t * record = bcf_init();
-    uint32_t gg, vec1_start, vec2_start;
+    uint32_t gg, vec2_start;
 //    uint32_t  end;
     uint32_t i = 0;
     
-    buff_bm.setBitMemory(&pack.bm);
-    
     const char *key = "GT";
     khint_t k;
     vdict_t *d;
     int fmt_id;
-    done_unique.clear();
+    main_ctx.clear();
     uint32_t block_id, prev_block_id = 0xFFFF;
     
     uint32_t written_records = 0;
@@ -827,8 +1175,16 @@ int Decompressor::decompressRangeSample(const string & range)
     long long * tmp_vec_ll = new long long[pack.s.vec_len + 1];
     char *tmp_vec = (char*) tmp_vec_ll;
     
+    // Selected haplotypes (for AC/AN)
+    vector<uchar_t> hap_mask(pack.s.vec_len, 0);
+    for(uint32_t g = 0; g < smpl.no_samples; ++g)
+        for(uint32_t p = 0; p < pack.s.ploidy; ++p)
+        {
+            uint32_t h = sampleIDs[g] * pack.s.ploidy + p;
+            hap_mask[h >> 3] |= 0x80 >> (h & 7);
+        }
+    
     
-    long long * lut_ll = nullptr;
     
     
     if(range == "")
@@ -839,10 +1195,6 @@ int Decompressor::decompressRangeSample(const string & range)
         
         if ( !bcf_hdr_idinfo_exists(hdr,BCF_HL_FMT,fmt_id) )
         {
-            if(perm)
-                delete [] perm;
-            if(rev_perm)
-                delete [] rev_perm;
             bcf_destroy(record);
             if ( !no_haplotypes ) return 0;
             return -1;  // the key not present in the header
@@ -894,16 +1246,15 @@ int Decompressor::decompressRangeSample(const string & range)
             if(block_id != prev_block_id)
             {
                 // Get approproate permutations
-                pack.getPermArray(block_id, perm);
-                reverse_perm(perm, rev_perm, pack.s.n_samples*pack.s.ploidy);
+                perm_block = pack.getPerm(block_id);
+                rev_perm = perm_block->rev_perm.data();
             }
             
             fill_n(decomp_data, pack.s.vec_len*2, 0);
             
-            vec1_start = 0;
             vec2_start = pack.s.vec_len;
-            decomp_vec_rrr_range(i++, 0, pack.s.vec_len, pos, decomp_data_perm, 0, false);
-            decomp_vec_rrr_range(i++, 0, pack.s.vec_len, pos, decomp_data_perm, 0, false);
+            decomp_vec_rrr(main_ctx, i++, pos, decomp_data_perm);
+            decomp_vec_rrr(main_ctx, i++, pos, decomp_data_perm);
             
             // Permutations
             decode_perm_rev(pack.s.n_samples*pack.s.ploidy, vec2_start, rev_perm, decomp_data_perm, decomp_data);
@@ -928,19 +1279,9 @@ int Decompressor::decompressRangeSample(const string & range)
 
           //  uint32_t start;
             
-            for (vec1_start = 0; vec1_start < end; ++vec1_start)
-            {
-                //memcpy(tmp_vec + (vec1_start << 3), lut[decomp_data[vec1_start]][decomp_data[vec2_start++]], 8);
-                lut_ll = (long long *)(lut[decomp_data[vec1_start]][decomp_data[vec2_start++]]);
-                *(tmp_vec_ll + vec1_start) = *lut_ll;//*(long long *)lut[decomp_data[vec1_start]][decomp_data[vec2_start++]];
-            }
-            
-            // str.l = str.l + (end << 3);
+            gt_expand_kernel(decomp_data, decomp_data + vec2_start, end, tmp_vec);
             if(gg)
-            {
-                memcpy(tmp_vec + (end << 3), lut[decomp_data[vec1_start]][decomp_data[vec2_start]], gg);
-                //      str.l = str.l + g;
-            }
+                gt_expand_bits(decomp_data[end], decomp_data[vec2_start + end], gg, tmp_vec + (end << 3));
             
             
             uint32_t which;
@@ -960,659 +1301,351 @@ int Decompressor::decompressRangeSample(const string & range)
                     which = sampleIDs[g]*pack.s.ploidy;
                     pt[g * pack.s.ploidy] = tmp_vec[which];
                 }
-             }
-             else
-             {
-                for (uint32_t g = 0; g < smpl.no_samples ; ++g)
-                {
-                    which = sampleIDs[g]*pack.s.ploidy;
-                    for(int p = 0; p < (int) pack.s.ploidy; p++)
-                        pt[g * pack.s.ploidy + p] = tmp_vec[which + p];
-                }
-             }
-            
-            
-            
-             /*
-            for (uint32_t g = 0; g < smpl.no_samples ; ++g)
-            {
-               // for(int p = 0; p < (int) pack.s.ploidy; p++)
-                {
-                    which = sampleIDs[g]*pack.s.ploidy;
-                    memcpy(pt + (g * pack.s.ploidy), tmp_vec + which, pack.s.ploidy);
-                }
-            }*/
-            
-            
-            
-            str.l = str.l + smpl.no_samples*pack.s.ploidy;
-            str.s[str.l] = 0;
-            
-            bcf_update_info_int32(hdr, record, "_row", NULL, 0);
-       
-            // AC/AN count
-            if(out_AC_AN)
-            {
-                if(setACAN(hdr, record, str))
-                {
-                    if(out_genotypes)
-                        bcf_update_genotypes_fast(str, record);
-                    
-                    bcf_write1(out, hdr, record);
-                    written_records++;
-                    
-                }
-            }
-            else
-            {
-                if(out_genotypes)
-                    bcf_update_genotypes_fast(str, record);
-                
-                bcf_write1(out, hdr, record);
-                written_records++;
-            }
-            
-        }
-        
-        for (auto & it:done_unique)
-        {
-            delete [] it.second;
-        }
-        done_unique.clear();
-        
-        //delete [] tmp_vec;
-
-    }
-    else
-    {
-        d = (vdict_t*)hdr->dict[BCF_DT_ID];
-        k = kh_get(vdict, d, key);
-        fmt_id = (k == kh_end(d)? -1 : kh_val(d, k).id);
-        
-        if ( !bcf_hdr_idinfo_exists(hdr,BCF_HL_FMT,fmt_id) )
-        {
-            if(perm)
-                delete [] perm;
-            if(rev_perm)
-                delete [] rev_perm;
-            bcf_destroy(record);
-            
-            if ( !no_haplotypes ) return 0;
-            return -1;  // the key not present in the header
-        }
-        
-        decomp_data = new uchar_t[pack.s.vec_len*2];
-        decomp_data_perm = new uchar_t[pack.s.vec_len*2];
-
-        
-        bcf_enc_int1(&str, fmt_id);
-        bcf_enc_size(&str, pack.s.ploidy, BCF_BT_INT8);
-
-        char *tmp;
-        str.m = str.l + no_haplotypes + 1;
-        kroundup32(str.m);
-        if ((tmp = (char*)realloc(str.s, str.m)))
-            str.s = tmp;
-        else
-            exit(8);
-        str.l = 3;
-        if (no_haplotypes == 0) bcf_enc_size(&str, 0, BCF_BT_NULL);
-        
-        uint32_t  end;
-        if(no_haplotypes & 7)//%8)
-        {
-            end = pack.s.vec_len - 1;
-            gg = no_haplotypes & 7;//%8;
-        }
-        else
-        {
-            end = pack.s.vec_len;
-            gg = 0;
-        }
-
-        
-        
-        
-        bcf_info_t * a;
-        hts_itr_t * itr = bcf_itr_querys(bcf_idx, hdr, range.c_str());
-        
-     //   char * tmp_vec = new char[pack.s.vec_len * 8 + 8];
-        
-    
-        
-        while(bcf_itr_next(bcf, itr, record) != -1 && written_records < records_to_process)
-        {
-            if(!i)
-            {
-                a = bcf_get_info(hdr, record, "_row"); //bcf_get_info_id
-                i = (a->v1.i*2);
-            }
-            
-            pos = 0;
-            str.l = 3;
-            
-            bcf_unpack(record, BCF_UN_ALL);
-            record->n_sample = bcf_hdr_nsamples(hdr);
-            
-            // Permutations
-            block_id = i/pack.s.max_no_vec_in_block; //pair of vectors always in the same block (so it is enough to find first vector block
-            if(block_id != prev_block_id)
-            {
-                // Get approproate permutations
-                pack.getPermArray(block_id, perm);
-                reverse_perm(perm, rev_perm, pack.s.n_samples*pack.s.ploidy);
-            }
-            fill_n(decomp_data, pack.s.vec_len*2, 0);
-            
-            vec1_start = 0;
-            vec2_start = pack.s.vec_len;
-            decomp_vec_rrr_range(i++, 0, pack.s.vec_len, pos, decomp_data_perm, 0, false);
-            decomp_vec_rrr_range(i++, 0, pack.s.vec_len, pos, decomp_data_perm, 0, false);
-            
-            // Permutations
-          //  decode_perm(pack.s.n_samples * pack.s.ploidy, vec2_start, perm, decomp_data_perm, decomp_data);
-           
-            decode_perm_rev(pack.s.n_samples*pack.s.ploidy, vec2_start, rev_perm, decomp_data_perm, decomp_data);
-            prev_block_id = block_id;
-            
-            char *pt = str.s + str.l;
-    /*
-            for (uint32_t g = 0; g < smpl.no_samples ; ++g)
-            {
-                for(int p = 0; p < (int) pack.s.ploidy; p++)
-                {
-                    vec1_start = (sampleIDs[g]*pack.s.ploidy + p)/8; //2 vectors per variant
-                    memcpy(pt + (g * pack.s.ploidy + p), lut[decomp_data[vec1_start]][decomp_data[vec1_start + pack.s.vec_len]]+(sampleIDs[g] * pack.s.ploidy + p)%8, 1);
-                }
-            }
-     
-            str.l = str.l + smpl.no_samples*pack.s.ploidy;
-            str.s[str.l] = 0;
-          */
-          // cout << i << " " << str.l << " " <<  (int) str.s[0] << (int) str.s[1] << (int) str.s[2] << (int) str.s[3] << (int) str.s[4] << (int) str.s[2002] << endl;
-          
-            
-            
-            
-             /////////////////
-
-            for (vec1_start = 0; vec1_start < end; ++vec1_start)
-            {
-               // memcpy(tmp_vec + (vec1_start << 3), lut[decomp_data[vec1_start]][decomp_data[vec2_start++]], 8);
-                lut_ll = (long long *)(lut[decomp_data[vec1_start]][decomp_data[vec2_start++]]);
-                *(tmp_vec_ll + vec1_start) = *lut_ll;//*(long long *)lut[decomp_data[vec1_start]][decomp_data[vec2_start++]];
-
-            }
-         
-           // str.l = str.l + (end << 3);
-            if(gg)
-            {
-                memcpy(tmp_vec + (end << 3), lut[decomp_data[vec1_start]][decomp_data[vec2_start]], gg);
-          //      str.l = str.l + g;
-            }
-  
-            
-            uint32_t which;
-            if(pack.s.ploidy == 2)
-            {
-                for (uint32_t g = 0; g < smpl.no_samples ; ++g)
-                {
-                    which = sampleIDs[g]*pack.s.ploidy;
-                    pt[g * pack.s.ploidy] = tmp_vec[which];
-                    pt[g * pack.s.ploidy + 1] = tmp_vec[which + 1];
-                }
-            }
-            else if (pack.s.ploidy == 1)
-            {
-                for (uint32_t g = 0; g < smpl.no_samples ; ++g)
-                {
-                    which = sampleIDs[g]*pack.s.ploidy;
-                    pt[g * pack.s.ploidy] = tmp_vec[which];
-                }
-            }
-            else
-            {
+             }
+             else
+             {
                 for (uint32_t g = 0; g < smpl.no_samples ; ++g)
                 {
                     which = sampleIDs[g]*pack.s.ploidy;
                     for(int p = 0; p < (int) pack.s.ploidy; p++)
                         pt[g * pack.s.ploidy + p] = tmp_vec[which + p];
                 }
-            }
-
+             }
+            
+            
+            
+             /*
+            for (uint32_t g = 0; g < smpl.no_samples ; ++g)
+            {
+               // for(int p = 0; p < (int) pack.s.ploidy; p++)
+                {
+                    which = sampleIDs[g]*pack.s.ploidy;
+                    memcpy(pt + (g * pack.s.ploidy), tmp_vec + which, pack.s.ploidy);
+                }
+            }*/
+            
             
             
             str.l = str.l + smpl.no_samples*pack.s.ploidy;
             str.s[str.l] = 0;
             
-            
             bcf_update_info_int32(hdr, record, "_row", NULL, 0);
        
             // AC/AN count
             if(out_AC_AN)
             {
-                if(setACAN(hdr, record, str))
+                if(setACANPlanes(hdr, record, decomp_data, decomp_data + vec2_start, hap_mask.data(), pack.s.vec_len))
                 {
-                    if(out_genotypes)
-                        bcf_update_genotypes_fast(str, record);
-                    
-                    bcf_write1(out, hdr, record);
+                    writeRecord(record, str);
                     written_records++;
                     
                 }
             }
             else
             {
-                if(out_genotypes)
-                    bcf_update_genotypes_fast(str, record);
-                
-                bcf_write1(out, hdr, record);
+                writeRecord(record, str);
                 written_records++;
             }
             
         }
         
-        bcf_itr_destroy(itr);
-        
-        for (auto & it:done_unique)
-        {
-            delete [] it.second;
-        }
-        done_unique.clear();
+        main_ctx.clear();
         
-       // delete [] tmp_vec;
-    }
-    
-    hts_close(out);
-    
-    if(tmp_vec_ll)
-        delete [] tmp_vec_ll;
-    if(decomp_data)
-        delete [] decomp_data;
-    if(decomp_data_perm)
-        delete [] decomp_data_perm;
-    if(perm)
-        delete perm;
-    if(rev_perm)
-       delete[] rev_perm;
-    
-    if(str.s)
-    {
-        free(str.s);
-        str.s = nullptr;
-    }
-    bcf_destroy(record);
-    return 0;
-}
-
-
-bool Decompressor::setACAN(bcf_hdr_t * hdr, bcf1_t * record, const kstring_t & str)
-{
-    int32 an = 0, ac = 0;
+        //delete [] tmp_vec;
 
-    for(int32_t l = 3; l < (int) str.l; l++)
-    {
-        an++;
-        if(str.s[l] == 0x05)
-            ac++;
     }
-
-    if(ac >= minAC && ac <= maxAC)
+    else
     {
+        d = (vdict_t*)hdr->dict[BCF_DT_ID];
+        k = kh_get(vdict, d, key);
+        fmt_id = (k == kh_end(d)? -1 : kh_val(d, k).id);
         
-        bcf_update_info_int32(hdr, record, "AN", &an, 1);
-        bcf_update_info_int32(hdr, record, "AC", &ac, 1);
-        return true;
-    }
-
-    return false;
-}
-
-/************************/
-// full_decode: if true, always decode full; otherwise decode only unique vectors
-uchar_t Decompressor::get_vec_bytes(uint64_t vec_id, std::vector< std::pair<uint32_t, uint32_t> > & whichByte_whereInRes, uchar_t * resUnique, bool & is_uniqe_id, uint64_t & curr_zeros, uint64_t & curr_copy, uchar_t * resAll, uint32_t unique_pos_first_in_block, uint32_t first_vec_in_block, bool full_decode) //uchar_t Decompressor::get_vec_bytes(uint64_t vec_id, std::vector< std::pair<uint32_t, uchar_t> > & whichByte_whereInRes, uchar_t * resUnique, bool & is_uniqe_id, uint64_t & curr_zeros, uint64_t & curr_copy, uchar_t * resAll)
-{
-    
-   //if(vec_id == 322560)
-   //     cout << "here" << endl;
-
-    
-    uint32_t next_haplotype = 0; // Next byte to decode
-    
-    uint32_t last_byte = whichByte_whereInRes.back().first; // Last byte to decode
-    
-    uchar_t byte;
-    
-    uint32_t tmp = 0;
-    
-    uint8_t parity = vec_id&1;
-    uint64_t vector = vec_id >> 1, curr_non_copy_vec_id;
-    uint64_t no_haplotypes = whichByte_whereInRes.size() - 1;
-    uint64_t vec_start = parity*no_haplotypes;//(vec_id - first_vec_in_block) * no_haplotypes;
-    
-    if(parity)
-    {
-        if(copy_bit_vector[parity][vector]) // If vector is a copy od other vector (certainly it is placed within the same block)
+        if ( !bcf_hdr_idinfo_exists(hdr,BCF_HL_FMT,fmt_id) )
         {
+            bcf_destroy(record);
             
-            if(!full_decode)
-            {
-                is_uniqe_id = false;
-                curr_copy++;
-                return 0;
-            }
-            
-            unsigned long long bit_pos = (curr_copy)*pack.used_bits_cp;
-            
-            pack.bm_comp_copy_orgl_id.SetPos(bit_pos >> 3);
-            pack.bm_comp_copy_orgl_id.GetBits(tmp, bit_pos&7); // %8
-            pack.bm_comp_copy_orgl_id.GetBits(tmp, pack.used_bits_cp);
-            
-            // Here curr_non_copy_vec_id is a fake curr_non_copy_vec_id (it is ud of the next non_copy_vec_id)
-            curr_non_copy_vec_id = vec_id - curr_zeros - curr_copy;
-            
-            curr_non_copy_vec_id = curr_non_copy_vec_id - tmp - 1;
-            is_uniqe_id = false;
-            curr_copy++;
-            
-            
-           
-          //  for(uint32_t idx = 0; idx < no_haplotypes; idx++)
-            {
-               // resAll[whichByte_whereInRes[idx].second * pack.no_vec + vec_id] = resUnique[pack.no_non_copy*whichByte_whereInRes[idx].second  + curr_non_copy_vec_id];
-             //   resAll[vec_id * pack.s.vec_len + whichByte_whereInRes[idx].second] = resUnique[curr_non_copy_vec_id*pack.s.vec_len + whichByte_whereInRes[idx].second];
-                memcpy(resAll + vec_start, resUnique + (curr_non_copy_vec_id-unique_pos_first_in_block)*no_haplotypes, no_haplotypes) ;
-                
-            }
-            return 0;
+            if ( !no_haplotypes ) return 0;
+            return -1;  // the key not present in the header
         }
-        else if(zeros_only_bit_vector[1][vector])
-        {
-            is_uniqe_id = false;
-            curr_zeros++;
-            
-            if(!full_decode)
-                return 0;
-            
-          //  for(uint32_t idx = 0; idx < no_haplotypes; idx++)
-            {
-//                resAll[idx * pack.no_vec + vec_id] = 0;  //zero everywhere
-            //    resAll[vec_id * pack.s.vec_len + idx] = 0;
-                
-                fill_n(resAll + vec_start, no_haplotypes, 0);
+        
+        decomp_data = new uchar_t[pack.s.vec_len*2];
+        decomp_data_perm = new uchar_t[pack.s.vec_len*2];
 
-                
-            }
-            
-            return 0;
+        
+        bcf_enc_int1(&str, fmt_id);
+        bcf_enc_size(&str, pack.s.ploidy, BCF_BT_INT8);
+
+        char *tmp;
+        str.m = str.l + no_haplotypes + 1;
+        kroundup32(str.m);
+        if ((tmp = (char*)realloc(str.s, str.m)))
+            str.s = tmp;
+        else
+            exit(8);
+        str.l = 3;
+        if (no_haplotypes == 0) bcf_enc_size(&str, 0, BCF_BT_NULL);
+        
+        uint32_t  end;
+        if(no_haplotypes & 7)//%8)
+        {
+            end = pack.s.vec_len - 1;
+            gg = no_haplotypes & 7;//%8;
         }
         else
         {
-            curr_non_copy_vec_id = vec_id - curr_zeros - curr_copy;
-            is_uniqe_id = true;
+            end = pack.s.vec_len;
+            gg = 0;
         }
-    }
-    else if(!zeros_only_bit_vector[0][vector])
-    {
-        is_uniqe_id = false;
-        curr_zeros++;
+
         
-        if(!full_decode)
-            return 0;
         
-      /*  for(uint32_t idx = 0; idx < no_haplotypes; idx++)
-        {
-           // resAll[idx * pack.no_vec + vec_id] = 0;
-            resAll[vec_id * pack.s.vec_len + vec_id] = 0;
-        }*/
-        fill_n(resAll + vec_start, no_haplotypes, 0);
         
-        return 0;
-    }
-    else
-    {
-        if(copy_bit_vector[parity][vector])
+        bcf_info_t * a;
+        hts_itr_t * itr = bcf_itr_querys(bcf_idx, hdr, range.c_str());
+        
+     //   char * tmp_vec = new char[pack.s.vec_len * 8 + 8];
+        
+    
+        
+        while(bcf_itr_next(bcf, itr, record) != -1 && written_records < records_to_process)
         {
-            if(!full_decode)
+            if(!i)
             {
-                is_uniqe_id = false;
-                curr_copy++;
-                return 0;
+                a = bcf_get_info(hdr, record, "_row"); //bcf_get_info_id
+                i = (a->v1.i*2);
             }
             
-            unsigned long long bit_pos = (curr_copy)*pack.used_bits_cp;
-            
-            pack.bm_comp_copy_orgl_id.SetPos(bit_pos >> 3);
-            pack.bm_comp_copy_orgl_id.GetBits(tmp, bit_pos&7); // %8
-            pack.bm_comp_copy_orgl_id.GetBits(tmp, pack.used_bits_cp);
-            
-            // Here curr_non_copy_vec_id is a fake curr_non_copy_vec_id (it is ud of the next non_copy_vec_id)
-            curr_non_copy_vec_id = vec_id - curr_zeros - curr_copy;
-            curr_non_copy_vec_id = curr_non_copy_vec_id - tmp - 1;
-            is_uniqe_id = false;
-            curr_copy++;
+            pos = 0;
+            str.l = 3;
             
+            bcf_unpack(record, BCF_UN_ALL);
+            record->n_sample = bcf_hdr_nsamples(hdr);
             
-            if(!full_decode)
-                return 0;
-        //    for(uint32_t idx = 0; idx < no_haplotypes; idx++)
-            {
-             //   resAll[whichByte_whereInRes[idx].second * pack.no_vec + vec_id] = resUnique[pack.no_non_copy*whichByte_whereInRes[idx].second  + curr_non_copy_vec_id];
-                
-          //      resAll[vec_id * pack.s.vec_len + whichByte_whereInRes[idx].second] = resUnique[curr_non_copy_vec_id*pack.s.vec_len + whichByte_whereInRes[idx].second];
-                
-                memcpy(resAll + vec_start, resUnique + (curr_non_copy_vec_id-unique_pos_first_in_block)*no_haplotypes, no_haplotypes);
-                
-            }
-            return 0;
-        }
-        else
-        {
-            curr_non_copy_vec_id = vec_id - curr_zeros - curr_copy;
-            is_uniqe_id = true;
-        }
-    }
-    
-    uint32_t curr_pos;
-    tmp = 0;
-    unsigned long long full_pos = curr_non_copy_vec_id/FULL_POS_STEP  * (sizeof(uint32_t) + pack.used_bits_noncp*(FULL_POS_STEP-1)/BITS_IN_BYTE);
-    pack.bm_comp_pos.SetPos(full_pos);
-    pack.bm_comp_pos.GetWord(curr_pos);
-    uint32_t j = ((curr_non_copy_vec_id-1)%FULL_POS_STEP)/(sizeof(uint32_t)*BITS_IN_BYTE), end = curr_non_copy_vec_id%FULL_POS_STEP;
-    if(j)
-    {
-        pack.bm_comp_pos.SetPos(full_pos + sizeof(uint32_t) + j*pack.used_bits_noncp*sizeof(uint32_t));
-        j = j*(sizeof(uint32_t)*BITS_IN_BYTE);
-        
-        if(end > j + 1)
-            pack.bm_comp_pos.GetBitsAndDiscard((int32_t)pack.used_bits_noncp * (end - 1 - j));
-        if(end  > j)
-            pack.bm_comp_pos.GetBits(tmp, (int32_t)pack.used_bits_noncp);
-    }
-    else
-    {
-        if(end > 1)
-            pack.bm_comp_pos.GetBitsAndDiscard((int32_t)pack.used_bits_noncp*(end - 1));
-        if(end)
-            pack.bm_comp_pos.GetBits(tmp, (int32_t)pack.used_bits_noncp);
-        
-    }
-    curr_pos += tmp;
-    
-    uint32_t ones_group;
-    
-    uint32_t decoded_bytes = 0;
-    uint32_t zero_run_len,ones_run_len;
-    uint32_t best_pos = 0;
-    uint32_t best_match_len = 0;
-    int32_t  flag;
-    uint32 litRun;
-    
-    buff_bm.SetPos(curr_pos);
-    
-    ones_group = buff_bm.decodeFastLut(&pack.huf_group_type);
-    
-    CHuffman * h_lit = &pack.huf_literals[ones_group];
-    
-    while(decoded_bytes <= last_byte)
-    {
-        flag = buff_bm.decodeFastLut(&pack.huf_flags);
-        
-        switch(flag)
-        {
-            case 0: //literal
+            // Permutations
+            block_id = i/pack.s.max_no_vec_in_block; //pair of vectors always in the same block (so it is enough to find first vector block
+            if(block_id != prev_block_id)
             {
-                byte = buff_bm.decodeFastLut(h_lit);
-                while(decoded_bytes == whichByte_whereInRes[next_haplotype].first) //curr byte == next byte to decode
-                {
-                  //  resAll[whichByte_whereInRes[next_haplotype].second * pack.no_vec + vec_id] = byte;
-                    resAll[vec_start + whichByte_whereInRes[next_haplotype].second] = byte;
-                    next_haplotype++;
-//                    if(next_haplotype == no_haplotypes)
-//                        return 0; //all haplotypes decoded
-                }
-                
-                decoded_bytes++;
-                break;
+                // Get approproate permutations
+                perm_block = pack.getPerm(block_id);
+                rev_perm = perm_block->rev_perm.data();
             }
-            case 1: //match
+            vec2_start = pack.s.vec_len;
+            if(block_cache.IsOpen())
             {
-                // Difference between current and match is stored
-                tmp = buff_bm.decodeFastLut(&pack.huf_match_diff_MSB);
-                best_pos = tmp << (pack.s.bit_size_id_match_pos_diff - MATCH_BITS_HUF);
-                tmp = buff_bm.getBits(pack.s.bit_size_id_match_pos_diff - MATCH_BITS_HUF);
-                best_pos = best_pos | tmp;
-                
-                best_pos += 1;
-                best_pos = curr_non_copy_vec_id - best_pos;
+                memcpy(decomp_data, getCachedVariant(i, rev_perm, decomp_data_perm), pack.s.vec_len*2);
+                i += 2;
+            }
+            else
+            {
+                fill_n(decomp_data, pack.s.vec_len*2, 0);
+                decomp_vec_rrr(main_ctx, i++, pos, decomp_data_perm);
+                decomp_vec_rrr(main_ctx, i++, pos, decomp_data_perm);
                 
-                //  prev_vec_match = best_pos;
-                best_match_len = buff_bm.decodeFast(&pack.huf_match_lens[ones_group]);
+                // Permutations
+              //  decode_perm(pack.s.n_samples * pack.s.ploidy, vec2_start, perm, decomp_data_perm, decomp_data);
                 
-                while(decoded_bytes + best_match_len  >  whichByte_whereInRes[next_haplotype].first)
+                decode_perm_rev(pack.s.n_samples*pack.s.ploidy, vec2_start, rev_perm, decomp_data_perm, decomp_data);
+            }
+            prev_block_id = block_id;
+            
+            char *pt = str.s + str.l;
+    /*
+            for (uint32_t g = 0; g < smpl.no_samples ; ++g)
+            {
+                for(int p = 0; p < (int) pack.s.ploidy; p++)
                 {
-                  //  resAll[whichByte_whereInRes[next_haplotype].second * pack.no_vec + vec_id] = resUnique[pack.no_non_copy*whichByte_whereInRes[next_haplotype].second  + best_pos];
-                    resAll[vec_start + whichByte_whereInRes[next_haplotype].second] = resUnique[(best_pos-unique_pos_first_in_block)*no_haplotypes + whichByte_whereInRes[next_haplotype].second];
-                    
-                    next_haplotype++;
-//                    if(next_haplotype == no_haplotypes)
-//                        return 0; //all haplotypes decoded
+                    vec1_start = (sampleIDs[g]*pack.s.ploidy + p)/8; //2 vectors per variant
+                    memcpy(pt + (g * pack.s.ploidy + p), lut[decomp_data[vec1_start]][decomp_data[vec1_start + pack.s.vec_len]]+(sampleIDs[g] * pack.s.ploidy + p)%8, 1);
                 }
-                decoded_bytes += best_match_len;
-                break;
             }
-            case 2: //match same
+     
+            str.l = str.l + smpl.no_samples*pack.s.ploidy;
+            str.s[str.l] = 0;
+          */
+          // cout << i << " " << str.l << " " <<  (int) str.s[0] << (int) str.s[1] << (int) str.s[2] << (int) str.s[3] << (int) str.s[4] << (int) str.s[2002] << endl;
+          
+            
+            
+            
+             /////////////////
+
+            gt_expand_kernel(decomp_data, decomp_data + vec2_start, end, tmp_vec);
+            if(gg)
+                gt_expand_bits(decomp_data[end], decomp_data[vec2_start + end], gg, tmp_vec + (end << 3));
+  
+            
+            uint32_t which;
+            if(pack.s.ploidy == 2)
             {
-                best_match_len = buff_bm.decodeFast(&pack.huf_match_lens[ones_group]);
-               
-                while(decoded_bytes + best_match_len  >  whichByte_whereInRes[next_haplotype].first)
+                for (uint32_t g = 0; g < smpl.no_samples ; ++g)
                 {
-                  //  resAll[whichByte_whereInRes[next_haplotype].second * pack.no_vec + vec_id] = resUnique[pack.no_non_copy*whichByte_whereInRes[next_haplotype].second  + best_pos];
-                     resAll[vec_start + whichByte_whereInRes[next_haplotype].second] = resUnique[(best_pos-unique_pos_first_in_block)*no_haplotypes + whichByte_whereInRes[next_haplotype].second];
-                    
-                    next_haplotype++;
-//                    if(next_haplotype == no_haplotypes)
-//                        return 0; //all haplotypes decoded
+                    which = sampleIDs[g]*pack.s.ploidy;
+                    pt[g * pack.s.ploidy] = tmp_vec[which];
+                    pt[g * pack.s.ploidy + 1] = tmp_vec[which + 1];
                 }
-                
-                decoded_bytes += best_match_len;
-                break;
             }
-            case 3:
+            else if (pack.s.ploidy == 1)
             {
-                zero_run_len = buff_bm.decodeFast(&(pack.huf_zeros_runs[ones_group]));
-                
-                while(decoded_bytes + zero_run_len  >  whichByte_whereInRes[next_haplotype].first)
+                for (uint32_t g = 0; g < smpl.no_samples ; ++g)
                 {
-                    //resAll[whichByte_whereInRes[next_haplotype].second * pack.no_vec + vec_id] = 0;
-                    
-                    resAll[vec_start + whichByte_whereInRes[next_haplotype].second] = 0;
-                    
-                    next_haplotype++;
-//                    if(next_haplotype == no_haplotypes)
-//                        return 0; //all haplotypes decoded
+                    which = sampleIDs[g]*pack.s.ploidy;
+                    pt[g * pack.s.ploidy] = tmp_vec[which];
                 }
-                
-                decoded_bytes += zero_run_len;
-                break;
             }
-            case 4:
+            else
             {
-                ones_run_len = buff_bm.decodeFast(&(pack.huf_ones_runs[ones_group]));
-                
-                while(decoded_bytes + ones_run_len  >  whichByte_whereInRes[next_haplotype].first)
+                for (uint32_t g = 0; g < smpl.no_samples ; ++g)
                 {
-                   // resAll[whichByte_whereInRes[next_haplotype].second * pack.no_vec + vec_id] = 0xFF;
-                    resAll[vec_start + whichByte_whereInRes[next_haplotype].second] = 0xFF;
-                    
-                    next_haplotype++;
-//                    if(next_haplotype == no_haplotypes)
-//                        return 0; //all haplotypes decoded
+                    which = sampleIDs[g]*pack.s.ploidy;
+                    for(int p = 0; p < (int) pack.s.ploidy; p++)
+                        pt[g * pack.s.ploidy + p] = tmp_vec[which + p];
                 }
-                
-                decoded_bytes += ones_run_len;
-                break;
             }
-            default: //run of literals (2 (MIN_LITERAL_RUN) - MAX_LITERAL_RUN)
+
+            
+            
+            str.l = str.l + smpl.no_samples*pack.s.ploidy;
+            str.s[str.l] = 0;
+            
+            
+            bcf_update_info_int32(hdr, record, "_row", NULL, 0);
+       
+            // AC/AN count
+            if(out_AC_AN)
             {
-                flag = flag - 3; // Shift by 3, to be able to difference between 2,3 and 4 flags nad literal run of 2,3 or 4
-                
-                if(flag + decoded_bytes <= whichByte_whereInRes[next_haplotype].first)
+                if(setACANPlanes(hdr, record, decomp_data, decomp_data + vec2_start, hap_mask.data(), pack.s.vec_len))
                 {
-                    litRun = buff_bm.getBits(pack.used_bits_litRunSize[ones_group]);
-                    if(!litRun) //litRun == 0 means used_bits_litRunSize bits were not enough to store size
-                        litRun = buff_bm.getBits(pack.max_used_bits_litRunSize[ones_group]);
-                    
-                    litRun = litRun + pack.minLitRunSize[ones_group][flag] - 1; //1 is added to litRun, so it is never == 0
+                    writeRecord(record, str);
+                    written_records++;
                     
-                    //skip run of literals
-                    buff_bm.getBitsAndDiscard(litRun);
-                    decoded_bytes += flag;
-                }
-                else
-                {
-                    litRun = buff_bm.getBits(pack.used_bits_litRunSize[ones_group]);
-                    if(!litRun) //litRun == 0 means used_bits_litRunSize bits were not enough to store size
-                        buff_bm.getBitsAndDiscard(pack.max_used_bits_litRunSize[ones_group]);
-
-                    for(int i = 0; i < flag; i++)
-                    {
-                        byte = buff_bm.decodeFastLut(h_lit);
-                        while(decoded_bytes  ==  whichByte_whereInRes[next_haplotype].first)
-                        {
-                            //resAll[whichByte_whereInRes[next_haplotype].second * pack.no_vec + vec_id] = byte;
-                            
-                            resAll[vec_start + whichByte_whereInRes[next_haplotype].second] =  byte;
-                            next_haplotype++;
-//                            if(next_haplotype == no_haplotypes)
-//                                return 0; //all haplotypes decoded
-                        }
-                        
-                        decoded_bytes++;
-                    }
                 }
             }
+            else
+            {
+                writeRecord(record, str);
+                written_records++;
+            }
+            
         }
         
-        if(next_haplotype == no_haplotypes)
-            return 0; //all haplotypes decoded
+        bcf_itr_destroy(itr);
+        
+        main_ctx.clear();
         
+       // delete [] tmp_vec;
+    }
+    
+    closeOut();
+    
+    if(tmp_vec_ll)
+        delete [] tmp_vec_ll;
+    if(decomp_data)
+        delete [] decomp_data;
+    if(decomp_data_perm)
+        delete [] decomp_data_perm;
+    
+    if(str.s)
+    {
+        free(str.s);
+        str.s = nullptr;
     }
+    bcf_destroy(record);
     return 0;
 }
 
+
+// Set AC/AN of the record if AC and AF (AC/AN) are in the ranges
+bool Decompressor::setACAN(bcf_hdr_t * hdr, bcf1_t * record, int32 ac, int32 an)
+{
+    if(ac >= minAC && ac <= maxAC && ac >= minAF * an && ac <= maxAF * an)
+    {
+        bcf_update_info_int32(hdr, record, "AN", &an, 1);
+        bcf_update_info_int32(hdr, record, "AC", &ac, 1);
+        return true;
+    }
+    
+    return false;
+}
+
+// AC/AN counted on bit-planes of the variant (only haplotypes selected by the mask, if given); AN does not include missing values
+bool Decompressor::setACANPlanes(bcf_hdr_t * hdr, bcf1_t * record, const uchar_t * v1, const uchar_t * v2, const uchar_t * mask, size_t n_bytes)
+{
+    uint32_t n_allele_1, n_missing;
+    
+    gt_count(v1, v2, mask, n_bytes, n_allele_1, n_missing);
+    
+    return setACAN(hdr, record, n_allele_1, smpl.no_samples * pack.s.ploidy - n_missing);
+}
+
+// AC/AN of the variant starting at vec_id taken from the archive, so variants out of the range are not decoded at all
+bool Decompressor::setACANIndexed(bcf_hdr_t * hdr, bcf1_t * record, uint64_t vec_id)
+{
+    if(!pack.blockACInRange((uint32_t) (vec_id / pack.s.max_no_vec_in_block), minAC, maxAC_all))
+        return false;
+    
+    uint32_t ac, an;
+    pack.getACAN(vec_id >> 1, ac, an);
+    
+    return setACAN(hdr, record, ac, an);
+}
+
+/************************/
+// full_decode: if true, always decode full; otherwise decode only unique vectors
 bool Decompressor::loadPack()
 {
-    bool b = pack.loadPack(arch_name);
-    if(b)
+    // Sites only: the archive is not needed at all without AC/AN, and its genotypes are not needed if AC/AN are stored
+    // (for all samples)
+    if(!out_genotypes && !out_AC_AN)
+    {
+        sites_only = true;
+        return true;
+    }
+    
+    bool b = pack.loadPack(arch_name, out_genotypes);
+    if(b && !out_genotypes)
+    {
+        sites_only = pack.hasACIndex() && samples_to_decompress == "";
+        if(!sites_only)
+            pack.openGenotypes();
+    }
+    
+    if(b && !sites_only)
     {
         zeros_only_vector = new uchar_t[pack.s.vec_len]();
         ones_only_vector = new uchar_t[pack.s.vec_len];
         fill_n(ones_only_vector, pack.s.vec_len, 0xFF);
+        initDecodeContext(main_ctx);
+        
+        if(cache_dir != "")
+        {
+            if(pack.checksum)
+                block_cache.Open(cache_dir, pack.checksum, pack.s.vec_len, (uint64_t) cache_max_MB << 20);
+            else
+                cerr << "No checksum in the archive (written by an older version of GTC), decoded blocks are not cached" << endl;
+        }
     }
     return b;
 }
 
+// Write the record with genotypes given in str (BCF-encoded GT)
+void Decompressor::writeRecord(bcf1_t * record, kstring_t & str)
+{
+    if(vcf_writer.IsOpen())
+        vcf_writer.WriteRecord(hdr, record, out_genotypes ? &str : nullptr);
+    else
+    {
+        if(out_genotypes)
+            bcf_update_genotypes_fast(str, record);
+        bcf_write1(out, hdr, record);
+    }
+}
+
+void Decompressor::closeOut()
+{
+    vcf_writer.Close();
+    hts_close(out);
+}
+
 int Decompressor::initOut()
 {
     char write_mode[5] = "wb-";
@@ -1621,32 +1654,26 @@ int Decompressor::initOut()
         write_mode[3] = compression_level;
         write_mode[4] = '\0';
     }
+    else if(out_type == VCF_GZ)
+        strcpy(write_mode, "wz");
+    else
+        strcpy(write_mode, "w");
+    
     if(out_name != "")
     {
-        char *gz_fname = (char*) malloc(strlen(out_name.c_str())+5);
+        char *gz_fname = (char*) malloc(strlen(out_name.c_str())+8);
         if(out_type == VCF)
-        {
-            snprintf(gz_fname,strlen(out_name.c_str())+5,"%s.vcf",out_name.c_str());
-            out   = hts_open(gz_fname, "w");
-        }
+            snprintf(gz_fname,strlen(out_name.c_str())+8,"%s.vcf",out_name.c_str());
+        else if(out_type == VCF_GZ)
+            snprintf(gz_fname,strlen(out_name.c_str())+8,"%s.vcf.gz",out_name.c_str());
         else
-        {
-            snprintf(gz_fname,strlen(out_name.c_str())+5,"%s.bcf",out_name.c_str());
-            out   = hts_open(gz_fname, write_mode);
-        }
+            snprintf(gz_fname,strlen(out_name.c_str())+8,"%s.bcf",out_name.c_str());
+        out = hts_open(gz_fname, write_mode);
         free(gz_fname);
     }
     else
-    {
-        if(out_type == VCF)
-        {
-            out = hts_open("-", "w");
-        }
-        else
-        {
-            out = hts_open("-", write_mode);
-	}   
-    }
+        out = hts_open("-", write_mode);
+    
     if(!out)
     {
         std::cout << "could not open " << out << " file" << std::endl;
@@ -1667,19 +1694,27 @@ int Decompressor::initOut()
     bcf_hdr_add_sample(hdr, NULL);
     bcf_hdr_write(out, hdr);
     
+    // BGZF blocks compressed in parallel
+    if(out_type != VCF && n_threads > 1)
+        hts_set_threads(out, n_threads);
+    
+    // VCF text is formatted by own writer (if the ploidy is supported)
+    if(out_type == VCF || out_type == VCF_GZ)
+        vcf_writer.Open(out, pack.s.ploidy);
+    
     if(out_AC_AN)
     {
         bcf_hdr_append(hdr,"##INFO=<ID=AC,Number=A,Type=String,Description=\"Count of alternate alleles\">");
         bcf_hdr_append(hdr,"##INFO=<ID=AN,Number=A,Type=String,Description=\"Count of total alleles\">");
         bcf_hdr_sync(hdr);
         
-        //more strict of minAC/minAF is taken into account
-        if(minAF && minAF > (double)minAC/(smpl.no_samples*pack.s.ploidy))
-            minAC = ceil(minAF * (smpl.no_samples*pack.s.ploidy));
-        //more strict of minAC/minAF is taken into account
+        // AF is checked for each record with its AN (haplotypes without missing values), which is at most the number of
+        // all haplotypes, so only maxAF bounds AC of all variants
+        maxAC_all = maxAC;
         if(maxAF < 1 && maxAF < (double)maxAC/(smpl.no_samples*pack.s.ploidy))
-            maxAC = floor(maxAF * (smpl.no_samples*pack.s.ploidy));
-        //minAC and maxAC are used
+            maxAC_all = floor(maxAF * (smpl.no_samples*pack.s.ploidy));
+        
+        use_ac_index = pack.hasACIndex() && samples_to_decompress == "";
     }
     return 0;
 }
@@ -1700,497 +1735,198 @@ int Decompressor::loadBCF()
     return 0;
 }
 
-void Decompressor::setMemoryUsage()
-{
-    // Set memory usage
-    if(MB_memory)
-    {
-        if(max_MB_memory)
-            max_stored_unique = (max_MB_memory*1000000) / pack.s.vec_len;
-        else
-            max_stored_unique = pack.no_vec;
-        
-        if (PART_SIZE*2 < max_stored_unique)
-            max_stored_unique = PART_SIZE*2;
-    }
-    else
-        max_stored_unique = 0;
-}
-
 void Decompressor::initialLut()
 {
-    uchar mask;
-    
-    for(int c = 0; c < 8; c++)
-    {  mask = 0x80 >> c;
-        for(int i = 0; i < 256; i++)
-        {
-            if(i & mask)
-            {
-                for(int j = 0; j < 256; j++)
-                {
-                    if(j & mask)  //11
-                    {lut[i][j][c] = bcf_gt_phased(2);}
-                    else            //10
-                    {lut[i][j][c] = bcf_gt_missing;}
-                }
-                
-            }
-            else
-            {
-                for(int j = 0; j < 256; j++)
-                {
-                    if(j & mask)    //01
-                    {lut[i][j][c] = bcf_gt_phased(1);}
-                    else                //00
-                    {lut[i][j][c] = bcf_gt_phased(0);}
-                }
-            }
-        }
-    }
-	
 	// Permutation LUT
 	for(int i = 0; i < 8; ++i)
 		perm_lut[i] = 1 << (7 - i);	
 }
 
-void Decompressor::decomp_vec_rrr_range(uint64_t vec_id, uint64_t offset, uint64_t length, uint32_t & pos, uchar_t *decomp_data, uint64_t start_id, bool is_unique_id)
+// Decode a single vector; unique vectors are taken from (or decoded into) the buffer of the current block
+void Decompressor::decomp_vec_rrr(DecodeContext & ctx, uint64_t vec_id, uint32_t & pos, uchar_t *decomp_data)
 {
-    
-    uint64_t id, curr_non_copy_vec_id, toDelete;
-    uint32_t curr_pos, decoded_bytes;
-    uint32_t zero_run_len, ones_run_len, rest=0;
-    uint32_t best_pos = 0;
-    uint32_t best_match_len = 0;
-    uint64_t prev_vec_match = 0;
-    int32_t  flag;
-    uint32_t bit0;
-    int32 bits_read;
-    uint32 tmp = 0;
-    uint16_t left;
-    
-    if(is_unique_id)
-    {
-        curr_non_copy_vec_id = vec_id;
-        
-        got_it = done_unique.find (curr_non_copy_vec_id);
-        
-        if ( got_it != done_unique.end())
-        {
-            memcpy(decomp_data+pos, got_it->second + offset, length);
-            pos += length;
-            return;
-        }
-        
-    }
-    else
-    {
-        id = vec_id >> 1; //vec_id/2
-        uchar parity = vec_id&1;
-        if((parity && pack.rrr_zeros_only_bit_vector[1][id]) || (!(parity) && !pack.rrr_zeros_only_bit_vector[0][id]))
-        {
-            memcpy(decomp_data+pos, zeros_only_vector, pack.s.vec_len);
-            pos += pack.s.vec_len;
-            return;
-        }
-        
-        if(pack.rrr_copy_bit_vector[parity][id])
-        {
-            unsigned long long bit_pos = (pack.rrr_rank_copy_bit_vector[0](id + ((parity))) + pack.rrr_rank_copy_bit_vector[1](id))*pack.used_bits_cp;
-            
-            pack.bm_comp_copy_orgl_id.SetPos(bit_pos >> 3);  // /8
-            pack.bm_comp_copy_orgl_id.GetBits(tmp, bit_pos&7);  // %8
-            pack.bm_comp_copy_orgl_id.GetBits(tmp, pack.used_bits_cp);
-            
-            // Here curr_non_copy_vec_id is a fake curr_non_copy_vec_id (it is ud of the next non_copy_vec_id)
-            curr_non_copy_vec_id = vec_id - pack.rrr_rank_zeros_only_bit_vector_0(id+((parity))) - pack.rrr_rank_zeros_only_bit_vector_1(id) - \
-            pack.rrr_rank_copy_bit_vector[0](id+((parity))) - pack.rrr_rank_copy_bit_vector[1](id);
-            
-            curr_non_copy_vec_id = curr_non_copy_vec_id - tmp - 1;
-            
-            got_it = done_unique.find (curr_non_copy_vec_id);
-            
-            if ( got_it != done_unique.end())
-            {
-                memcpy(decomp_data+pos, got_it->second + offset, length);
-                pos += length;
-                return;
-            }
-        }
-        else //unique and not a copy - no need to check if it was previously decompressed (got_it)
-        {
-            curr_non_copy_vec_id = vec_id - pack.rrr_rank_zeros_only_bit_vector_0(id+((parity))) - pack.rrr_rank_zeros_only_bit_vector_1(id) - \
-            pack.rrr_rank_copy_bit_vector[0](id+((parity))) - pack.rrr_rank_copy_bit_vector[1](id);
-        }
-    }
-
-    tmp = 0;
-    unsigned long long full_pos = curr_non_copy_vec_id/FULL_POS_STEP  * (sizeof(uint32_t) + pack.used_bits_noncp*(FULL_POS_STEP-1)/BITS_IN_BYTE);
-    pack.bm_comp_pos.SetPos(full_pos);
-    pack.bm_comp_pos.GetWord(curr_pos);
-    uint32_t  j = ((curr_non_copy_vec_id-1)%FULL_POS_STEP)/(sizeof(uint32_t)*BITS_IN_BYTE), end = curr_non_copy_vec_id%FULL_POS_STEP;
-    if(j)
+    uint64_t id = vec_id >> 1; //vec_id/2
+    uchar parity = vec_id&1;
+    uint64_t curr_non_copy_vec_id;
+    uint32 tmp = 0;
+    
+    if((parity && pack.zeros_only_bv[1][id]) || (!(parity) && !pack.zeros_only_bv[0][id]))
     {
-        pack.bm_comp_pos.SetPos(full_pos + sizeof(uint32_t) + j*pack.used_bits_noncp*sizeof(uint32_t));
-        j = j*(sizeof(uint32_t)*BITS_IN_BYTE);
+        memcpy(decomp_data+pos, zeros_only_vector, pack.s.vec_len);
+        pos += pack.s.vec_len;
+        return;
+    }
+    
+    curr_non_copy_vec_id = vec_id - pack.zeros_only_bv[0].rank0(id+((parity))) - pack.zeros_only_bv[1].rank1(id) - \
+    pack.copy_bv[0].rank1(id+((parity))) - pack.copy_bv[1].rank1(id);
+    
+    if(pack.copy_bv[parity][id])
+    {
+        unsigned long long bit_pos = (pack.copy_bv[0].rank1(id + ((parity))) + pack.copy_bv[1].rank1(id))*pack.used_bits_cp;
         
-        if(end > j + 1)
-            pack.bm_comp_pos.GetBitsAndDiscard((int32_t)pack.used_bits_noncp * (end - 1 - j));
-        if(end  > j)
-            pack.bm_comp_pos.GetBits(tmp, (int32_t)pack.used_bits_noncp);
+        ctx.bm_comp_copy_orgl_id.SetPos(bit_pos >> 3);  // /8
+        ctx.bm_comp_copy_orgl_id.GetBits(tmp, bit_pos&7);  // %8
+        ctx.bm_comp_copy_orgl_id.GetBits(tmp, pack.used_bits_cp);
+        
+        // Here curr_non_copy_vec_id is the id of the next unique vector, so the id of the origin is counted back from it
+        curr_non_copy_vec_id = curr_non_copy_vec_id - tmp - 1;
     }
-    else
+    
+    // Unique vectors of the block are remembered until the block changes
+    uint64_t block_id = vec_id / pack.s.max_no_vec_in_block;
+    if(block_id != ctx.block_id)
     {
-        if(end > 1)
-            pack.bm_comp_pos.GetBitsAndDiscard((int32_t)pack.used_bits_noncp*(end - 1));
-        if(end)
-            pack.bm_comp_pos.GetBits(tmp, (int32_t)pack.used_bits_noncp);
+        id = block_id * pack.s.max_no_vec_in_block / 2; // Blocks start at even vectors
+        ctx.block_id = block_id;
+        ctx.block_unique_first = id*2 - pack.zeros_only_bv[0].rank0(id) - pack.zeros_only_bv[1].rank1(id) - \
+        pack.copy_bv[0].rank1(id) - pack.copy_bv[1].rank1(id);
+        ctx.block_state.assign(pack.s.max_no_vec_in_block, 0);
     }
-    curr_pos += tmp;
     
-    uint32 litRun;
-    buff_bm.SetPos(curr_pos);
-    uint32_t ones_group;
-    ones_group = buff_bm.decodeFastLut(&pack.huf_group_type);
-    CHuffman * h_lit = &pack.huf_literals[ones_group];
-    decoded_bytes = 0;
-    while(decoded_bytes < offset)
+    if(curr_non_copy_vec_id < ctx.block_unique_first || curr_non_copy_vec_id - ctx.block_unique_first >= ctx.block_state.size())
     {
-        flag = buff_bm.decodeFastLut(&pack.huf_flags);
-        switch(flag)
+        cout << "Corrupted archive: copy of vector " << vec_id << " refers to another block" << endl;
+        exit(1);
+    }
+    
+    uint32_t row = (uint32_t) (curr_non_copy_vec_id - ctx.block_unique_first);
+    if(ctx.block_data.size() < (size_t) (row + 1) * pack.s.vec_len)
+        ctx.block_data.resize((size_t) (row + 1) * pack.s.vec_len);
+    
+    if(ctx.block_state[row] != 2)
+        decodeUniqueVectors(ctx, row);
+    
+    memcpy(decomp_data+pos, ctx.block_data.data() + (size_t) row * pack.s.vec_len, pack.s.vec_len);
+    pos += pack.s.vec_len;
+}
+
+// Decode unique vector (row of the block buffer) with all not yet decoded vectors it refers to.
+// Phase 1 parses the vectors from the last one, writing literals and runs and collecting matches as copies.
+// Phase 2 makes the copies from the first vector, so the source of each copy (always an earlier vector of the block) is already complete.
+void Decompressor::decodeUniqueVectors(DecodeContext & ctx, uint32_t row)
+{
+    uint32_t vec_len = pack.s.vec_len;
+    uchar_t * block_data = ctx.block_data.data();
+    
+    ctx.plan_heap.clear();
+    ctx.plan_copies.clear();
+    ctx.plan_rows.clear();
+    
+    ctx.plan_heap.push_back(row);
+    ctx.block_state[row] = 1;
+    
+    // Phase 1
+    while(!ctx.plan_heap.empty())
+    {
+        pop_heap(ctx.plan_heap.begin(), ctx.plan_heap.end());
+        uint32_t curr_row = ctx.plan_heap.back();
+        ctx.plan_heap.pop_back();
+        ctx.plan_rows.push_back(curr_row);
+        
+        uint64_t curr_non_copy_vec_id = ctx.block_unique_first + curr_row;
+        uchar_t * curr_data = block_data + (size_t) curr_row * vec_len;
+        
+        uint32_t tmp = 0;
+        uint32_t curr_pos;
+        unsigned long long full_pos = curr_non_copy_vec_id/FULL_POS_STEP  * (sizeof(uint32_t) + pack.used_bits_noncp*(FULL_POS_STEP-1)/BITS_IN_BYTE);
+        ctx.bm_comp_pos.SetPos(full_pos);
+        ctx.bm_comp_pos.GetWord(curr_pos);
+        uint32_t  j = ((curr_non_copy_vec_id-1)%FULL_POS_STEP)/(sizeof(uint32_t)*BITS_IN_BYTE), end = curr_non_copy_vec_id%FULL_POS_STEP;
+        if(j)
         {
-            case 0:  //literal
-            {
-                buff_bm.decodeFastLut(h_lit);
-                decoded_bytes++;
-                break;
-            }
-            case 1: //match
-            {
-                // Difference between current and match id
-                tmp = buff_bm.decodeFastLut(&pack.huf_match_diff_MSB);
-                best_pos = tmp << (pack.s.bit_size_id_match_pos_diff - MATCH_BITS_HUF);
-                tmp = buff_bm.getBits(pack.s.bit_size_id_match_pos_diff - MATCH_BITS_HUF);
-                best_pos = best_pos | tmp;
-                best_pos += 1; //shift (to not waste 1 value)
-                
-                best_pos = curr_non_copy_vec_id - best_pos;
-                prev_vec_match = best_pos;
-                
-                best_match_len = buff_bm.decodeFast(&pack.huf_match_lens[ones_group]);
-                if(decoded_bytes + best_match_len  <=  offset)
-                {
-                    decoded_bytes += best_match_len;
-                }
-                else if(decoded_bytes + best_match_len <= offset + length)
-                {
-                    buff_bm.getBuffer(bit0, left);
-                    curr_pos = pack.bm.GetPos() - 1;
-                    bits_read = 8 - pack.bm.GetWordPos();
-                    nesting++;
-                    decomp_vec_rrr_range(best_pos, offset, decoded_bytes + best_match_len - offset, pos, decomp_data, start_id, true);
-                    nesting--;
-                    pack.bm.SetPos(curr_pos);
-                    pack.bm.GetBitsAndDiscard(bits_read);
-                    
-                    buff_bm.setBuffer(bit0, left);
-                    rest = decoded_bytes + best_match_len  - offset;
-                    decoded_bytes = offset;
-                    
-                }
-                else //if(decoded_bytes + best_match_len > offset + length)
-                {
-                    buff_bm.getBuffer(bit0, left);
-                    
-                    curr_pos = pack.bm.GetPos() - 1;
-                    bits_read = 8 - pack.bm.GetWordPos();
-                    nesting++;
-                    decomp_vec_rrr_range(best_pos, offset, length, pos, decomp_data, start_id, true);
-                    nesting--;
-                    pack.bm.SetPos(curr_pos);
-                    pack.bm.GetBitsAndDiscard(bits_read);
-                    buff_bm.setBuffer(bit0, left);
-                    decoded_bytes = offset;
-                    rest = length;
-                }
-                break;
-            }
-            case 2: //match same
-            {
-                best_match_len = buff_bm.decodeFast(&pack.huf_match_lens[ones_group]);
-                
-                if(decoded_bytes + best_match_len  <=  offset)
-                {
-                    decoded_bytes += best_match_len;
-                }
-                else if(decoded_bytes + best_match_len <= offset + length)
-                {
-                    buff_bm.getBuffer(bit0, left);
-                    curr_pos = pack.bm.GetPos() - 1;
-                    bits_read = 8 - pack.bm.GetWordPos();
-                    nesting++;
-                    decomp_vec_rrr_range(prev_vec_match, offset, decoded_bytes + best_match_len - offset, pos, decomp_data, start_id, true);
-                    nesting--;
-                    pack.bm.SetPos(curr_pos);
-                    pack.bm.GetBitsAndDiscard(bits_read);
-                    buff_bm.setBuffer(bit0, left);
-                    
-                    rest = decoded_bytes + best_match_len  - offset;
-                    decoded_bytes = offset;
-                    
-                }
-                else //if(decoded_bytes + best_match_len > offset + length)
-                {
-                    buff_bm.getBuffer(bit0, left);
-                    
-                    curr_pos = pack.bm.GetPos() - 1;
-                    bits_read = 8 - pack.bm.GetWordPos();
-                    nesting++;
-                    decomp_vec_rrr_range(prev_vec_match, offset, length, pos, decomp_data, start_id, true);
-                    nesting--;
-                    pack.bm.SetPos(curr_pos);
-                    pack.bm.GetBitsAndDiscard(bits_read);
-                    buff_bm.setBuffer(bit0, left);
-                    
-                    decoded_bytes = offset;
-                    rest = length;
-                }
-                
-                break;
-            }
-            case 3: //zero run
-            {
-                zero_run_len = buff_bm.decodeFast(&(pack.huf_zeros_runs[ones_group]));
-                if(zero_run_len > offset - decoded_bytes)
-                {
-                    rest = (zero_run_len - (offset - decoded_bytes)) ;
-                    rest = rest < length ? rest : length;
-                    zero_run_len = offset - decoded_bytes;
-                }
-                decoded_bytes += zero_run_len;
-                if(rest)
-                {
-                    memcpy(decomp_data+pos, zeros_only_vector, rest);
-                    pos = pos + rest;
-                }
-                break;
-            }
-            case 4: //ones run
-            {
-                
-                ones_run_len = buff_bm.decodeFast(&(pack.huf_ones_runs[ones_group]));
-                
-                if(ones_run_len > offset - decoded_bytes)
-                {
-                    rest = (ones_run_len - (offset - decoded_bytes)) ;
-                    rest = rest < length ? rest : length;
-                    ones_run_len = offset - decoded_bytes;
-                }
-                
-                decoded_bytes += ones_run_len;
-                
-                if(rest)
-                {
-                    memcpy(decomp_data+pos, ones_only_vector, rest);
-                    pos = pos + rest;
-                }
-                break;
-            }
-            default: // Run of literals (2 (MIN_LITERAL_RUN) - MAX_LITERAL_RUN)
-            {
-                flag = flag - 3; // Shift by 3, to be able to difference between 2 and 3, 4 flags nad literal run of 2 or 3, 4
-                
-                if(flag < (int) (offset - decoded_bytes))
-                {
-                    
-                    litRun = buff_bm.getBits(pack.used_bits_litRunSize[ones_group]);
-                    if(!litRun) //litRun == 0 means used_bits_litRunSize bits were not enough to store size
-                        litRun = buff_bm.getBits(pack.max_used_bits_litRunSize[ones_group]);
-                    
-                    litRun = litRun + pack.minLitRunSize[ones_group][flag] - 1; //1 is added to litRun, so it is never == 0
-                    
-                    // Skip run of literals
-                    buff_bm.getBitsAndDiscard(litRun);
-                    decoded_bytes += flag;
-                }
-                else
-                {
-                    // Discard description of size (bits) of run of literals
-                    
-                    litRun = buff_bm.getBits(pack.used_bits_litRunSize[ones_group]);
-                    if(!litRun) //litRun == 0 means used_bits_litRunSize bits were not enough to store size
-                        buff_bm.getBitsAndDiscard(pack.max_used_bits_litRunSize[ones_group]);
-                    
-                    rest = (flag - (offset - decoded_bytes)) ;
-                    rest = rest < length ? rest : length;
-                    
-                    flag = offset - decoded_bytes;
-                    for(int i = 0; i < flag; i++)
+            ctx.bm_comp_pos.SetPos(full_pos + sizeof(uint32_t) + j*pack.used_bits_noncp*sizeof(uint32_t));
+            j = j*(sizeof(uint32_t)*BITS_IN_BYTE);
+            
+            if(end > j + 1)
+                ctx.bm_comp_pos.GetBitsAndDiscard((int32_t)pack.used_bits_noncp * (end - 1 - j));
+            if(end  > j)
+                ctx.bm_comp_pos.GetBits(tmp, (int32_t)pack.used_bits_noncp);
+        }
+        else
+        {
+            if(end > 1)
+                ctx.bm_comp_pos.GetBitsAndDiscard((int32_t)pack.used_bits_noncp*(end - 1));
+            if(end)
+                ctx.bm_comp_pos.GetBits(tmp, (int32_t)pack.used_bits_noncp);
+        }
+        curr_pos += tmp;
+        
+        uint32_t decoded_bytes = 0;
+        uint32_t run_len;
+        uint32_t match_row = curr_row; // no match yet
+        int32_t  flag;
+        uint32 litRun;
+        
+        ctx.buff_bm.SetPos(curr_pos);
+        uint32_t ones_group = ctx.buff_bm.decodeFastLut(&pack.huf_group_type);
+        CHuffman * h_lit = &pack.huf_literals[ones_group];
+        
+        while(decoded_bytes < vec_len)
+        {
+            flag = ctx.buff_bm.decodeFastLut(&pack.huf_flags);
+            switch(flag)
+            {
+                case 0: //literal
+                    curr_data[decoded_bytes++] = ctx.buff_bm.decodeFastLut(h_lit);
+                    break;
+                case 1: //match
+                    // Difference between current and match id
+                    tmp = ctx.buff_bm.decodeFastLut(&pack.huf_match_diff_MSB);
+                    tmp = (tmp << (pack.s.bit_size_id_match_pos_diff - MATCH_BITS_HUF)) | ctx.buff_bm.getBits(pack.s.bit_size_id_match_pos_diff - MATCH_BITS_HUF);
+                    match_row = curr_row - tmp - 1; // Wraps around if the match is outside the block
+                    // fall through
+                case 2: //same match
+                    if(match_row >= curr_row)
                     {
-                        buff_bm.decodeFastLut(h_lit);
+                        cout << "Corrupted archive: match of vector " << curr_non_copy_vec_id << " outside its block" << endl;
+                        exit(1);
                     }
-                    
-                    for(int i = 0; i < (int) rest; i++)
+                    run_len = ctx.buff_bm.decodeFast(&pack.huf_match_lens[ones_group]);
+                    run_len = (run_len <= vec_len - decoded_bytes) ? run_len : vec_len - decoded_bytes;
+                    ctx.plan_copies.emplace_back(curr_row, match_row, decoded_bytes, run_len);
+                    if(!ctx.block_state[match_row])
                     {
-                        decomp_data[pos++] =  buff_bm.decodeFastLut(h_lit);
+                        ctx.block_state[match_row] = 1;
+                        ctx.plan_heap.push_back(match_row);
+                        push_heap(ctx.plan_heap.begin(), ctx.plan_heap.end());
                     }
-                    decoded_bytes += flag + rest;
-                }
-                break;
-            }
-        }
-        
-    }
-    decoded_bytes = rest;
-    while(decoded_bytes < length)
-    {
-        flag = buff_bm.decodeFastLut(&pack.huf_flags);
-        switch(flag)
-        {
-            case 0: //literal
-            {
-                decomp_data[pos++] =  buff_bm.decodeFastLut(h_lit);
-                decoded_bytes++;
-                break;
-            }
-            case 1: //match
-            {
-                // difference between current and match is stored
-                tmp = buff_bm.decodeFastLut(&pack.huf_match_diff_MSB);
-                best_pos = tmp << (pack.s.bit_size_id_match_pos_diff - MATCH_BITS_HUF);
-                tmp = buff_bm.getBits(pack.s.bit_size_id_match_pos_diff - MATCH_BITS_HUF);
-                best_pos = best_pos | tmp;
-                
-                best_pos += 1;
-                
-                best_pos = curr_non_copy_vec_id - best_pos;
-            
-                prev_vec_match = best_pos;
-                best_match_len = buff_bm.decodeFast(&pack.huf_match_lens[ones_group]);
-    
-                if(best_match_len <= length - decoded_bytes)
-                {
-                    buff_bm.getBuffer(bit0, left);
-                    curr_pos = pack.bm.GetPos() - 1;
-                    bits_read = 8 - pack.bm.GetWordPos();
-                    nesting++;
-                    decomp_vec_rrr_range(best_pos, offset + decoded_bytes, best_match_len, pos, decomp_data, start_id, true);
-                    nesting--;
-                    pack.bm.SetPos(curr_pos);
-                    pack.bm.GetBitsAndDiscard(bits_read);
-                    decoded_bytes += best_match_len;
-                    buff_bm.setBuffer(bit0, left);
-                }
-                else
-                {
-                    buff_bm.getBuffer(bit0, left);
+                    decoded_bytes += run_len;
+                    break;
+                case 3: //zero run
+                    run_len = ctx.buff_bm.decodeFast(&(pack.huf_zeros_runs[ones_group]));
+                    run_len = (run_len <= vec_len - decoded_bytes) ? run_len : vec_len - decoded_bytes;
+                    memcpy(curr_data + decoded_bytes, zeros_only_vector, run_len);
+                    decoded_bytes += run_len;
+                    break;
+                case 4: //one run
+                    run_len = ctx.buff_bm.decodeFast(&(pack.huf_ones_runs[ones_group]));
+                    run_len = (run_len <= vec_len - decoded_bytes) ? run_len : vec_len - decoded_bytes;
+                    memcpy(curr_data + decoded_bytes, ones_only_vector, run_len);
+                    decoded_bytes += run_len;
+                    break;
+                default: // Run of literals (MIN_LITERAL_RUN - MAX_LITERAL_RUN)
+                    flag = flag - 3; // Shift by 3, to be able to difference between 2 and 3, 4 flags nad literal run of 2 or 3, 4
                     
-                    curr_pos = pack.bm.GetPos() - 1;
-                    bits_read = 8 - pack.bm.GetWordPos();
-                    nesting++;
-                    decomp_vec_rrr_range(best_pos, offset + decoded_bytes, length - decoded_bytes, pos, decomp_data, start_id, true);
-                    nesting--;
-                    pack.bm.SetPos(curr_pos);
-                    pack.bm.GetBitsAndDiscard(bits_read);
-                    buff_bm.setBuffer(bit0, left);
-                    decoded_bytes += length - decoded_bytes;
-                }
-                break;
-            }
-            case 2: //same match
-            {
-                best_match_len = buff_bm.decodeFast(&pack.huf_match_lens[ones_group]);
-                
-                if(best_match_len <= length - decoded_bytes)
-                {
-                    buff_bm.getBuffer(bit0, left);
+                    if(flag + decoded_bytes > vec_len)
+                        flag = vec_len - decoded_bytes;
                     
+                    litRun = ctx.buff_bm.getBits(pack.used_bits_litRunSize[ones_group]);
+                    if(!litRun) //litRun == 0 means used_bits_litRunSize bits were not enough to store size
+                        ctx.buff_bm.getBitsAndDiscard(pack.max_used_bits_litRunSize[ones_group]);
                     
-                    curr_pos = pack.bm.GetPos() - 1;
-                    bits_read = 8 - pack.bm.GetWordPos();
-                    nesting++;
-                    decomp_vec_rrr_range(prev_vec_match, offset + decoded_bytes, best_match_len, pos, decomp_data, start_id, true);
-                    nesting--;
-                    pack.bm.SetPos(curr_pos);
-                    pack.bm.GetBitsAndDiscard(bits_read);
-                    buff_bm.setBuffer(bit0, left);
-                    decoded_bytes += best_match_len;
-                }
-                else
-                {
-                    buff_bm.getBuffer(bit0, left);
-                    curr_pos = pack.bm.GetPos() - 1;
-                    bits_read = 8 - pack.bm.GetWordPos();
-                    nesting++;
-                    decomp_vec_rrr_range(prev_vec_match, offset + decoded_bytes, length - decoded_bytes, pos, decomp_data, start_id, true);
-                    nesting--;
-                    pack.bm.SetPos(curr_pos);
-                    pack.bm.GetBitsAndDiscard(bits_read);
-                    buff_bm.setBuffer(bit0, left);
-                    decoded_bytes += length - decoded_bytes;
-                }
-                break;
-            }
-            case 3: //zero run
-            {
-                
-                zero_run_len = buff_bm.decodeFast(&(pack.huf_zeros_runs[ones_group]));
-                zero_run_len = (zero_run_len <= length - decoded_bytes ) ? zero_run_len : length - decoded_bytes;
-                memcpy(decomp_data + pos, zeros_only_vector, zero_run_len);
-                decoded_bytes = decoded_bytes + zero_run_len;
-                pos = pos + zero_run_len;
-                break;
-            }
-            case 4: //one run
-            {
-                ones_run_len = buff_bm.decodeFast(&(pack.huf_ones_runs[ones_group]));
-                ones_run_len = (ones_run_len <= length - decoded_bytes)  ? ones_run_len : length - decoded_bytes;
-                memcpy(decomp_data + pos, ones_only_vector, ones_run_len);
-                decoded_bytes = decoded_bytes + ones_run_len;
-                pos = pos + ones_run_len;
-                break;
-                
-            }
-            default: // Run of literals (2-200)
-            {
-                flag = flag - 3; // Shift by 2, to be able to difference between 2 and 3 flags nad literal run of 2 or 3
-                
-                if(flag + decoded_bytes > length )
-                    flag = length - decoded_bytes;
-                
-                litRun = buff_bm.getBits(pack.used_bits_litRunSize[ones_group]);
-                if(!litRun) //litRun == 0 means used_bits_litRunSize bits were not enough to store size
-                    buff_bm.getBitsAndDiscard(pack.max_used_bits_litRunSize[ones_group]);
-                
-                for(int i = 0; i < flag; i++)
-                {
-                    decomp_data[pos++] =  buff_bm.decodeFastLut(h_lit);
-                }
-                decoded_bytes += flag;
-                break;
+                    ctx.buff_bm.decodeRun(h_lit, curr_data + decoded_bytes, flag);
+                    decoded_bytes += flag;
+                    break;
             }
         }
     }
     
-    if(!is_unique_id && max_stored_unique)
-    {
-        uchar_t * vector;
-        if(done_unique.size() > max_stored_unique)
-        {
-            toDelete = stored_unique.back();
-            stored_unique.pop_back();
-            vector = done_unique[toDelete];
-            done_unique.erase(toDelete);
-        }
-        else
-        {
-            vector = new uchar_t[pack.s.vec_len];
-        }
-        
-        memcpy(vector, decomp_data + (pos - pack.s.vec_len), pack.s.vec_len);
-        done_unique[curr_non_copy_vec_id] = vector;
-        stored_unique.push_front(curr_non_copy_vec_id);
-    }
+    // Phase 2 (copies are grouped by vectors in the order of parsing, i.e., from the last vector)
+    for(auto p = ctx.plan_copies.rbegin(); p != ctx.plan_copies.rend(); ++p)
+        memcpy(block_data + (size_t) p->dst * vec_len + p->offset, block_data + (size_t) p->src * vec_len + p->offset, p->len);
+    
+    for(auto r : ctx.plan_rows)
+        ctx.block_state[r] = 2;
 }
 
 void Decompressor::decode_perm(int no_haplotypes, int vec2_start, uint32_t *perm, uchar_t *decomp_data_perm, uchar_t *decomp_data)
@@ -2210,68 +1946,42 @@ void Decompressor::decode_perm(int no_haplotypes, int vec2_start, uint32_t *perm
     }
 }
 
-void Decompressor::decode_perm_rev(int no_haplotypes, int vec2_start, uint32_t *rev_perm, uchar_t *decomp_data_perm, uchar_t *decomp_data)
+// Word of the vector starting at p (bit of the first haplotype as MSB); bytes past the end of the vector are zeros
+static inline uint64_t load_vec_word(const uchar_t *p, uint32_t n_bytes_left)
 {
-#if 0
-	for (uint32 x = 0; x < no_haplotypes; ++x)
-    {
-		auto j = rev_perm[x];
-		uchar_t x_p = perm_lut[x % 8];
-		uchar_t j_p = perm_lut[j % 8];
-		int x8 = x / 8;
-		int j8 = j / 8;
-		if (decomp_data_perm[x8] & x_p)
-			decomp_data[j8] += j_p;
-		if (decomp_data_perm[vec2_start + x8] & x_p)
-			decomp_data[vec2_start + j8] += j_p;
-	}
-	return;
-#endif
-	
-    uint32 x;
-    for (x = 0; x + 8 < (uint32) no_haplotypes;)
-    {
-        int x8 = x / 8;
-        int d_x8 = decomp_data_perm[x8];
-        int d2_x8 = decomp_data_perm[vec2_start + x8];
+    uint64_t w = 0;
+    memcpy(&w, p, n_bytes_left < 8 ? n_bytes_left : 8);
+    
+    return __builtin_bswap64(w);
+}
 
-        if(!d_x8 && !d2_x8)
-        {
-            x += 8;
-            continue;
-        }
-	
-        int x_p = 1 << 7;
-        for(int i = 0; i < 8; ++i, ++x, x_p >>= 1)
+// Bits of both vectors are moved to the original positions of haplotypes; only the set bits are visited
+// (zero words are skipped), so the cost depends on the number of alternative alleles, not on the number of haplotypes
+void Decompressor::decode_perm_rev(int no_haplotypes, int vec2_start, const uint32_t *rev_perm, uchar_t *decomp_data_perm, uchar_t *decomp_data)
+{
+    uint32_t n_bytes = ((uint32_t) no_haplotypes + 7) / 8;
+    
+    for(int v = 0; v < 2; ++v)
+    {
+        const uchar_t * in = decomp_data_perm + v * vec2_start;
+        uchar_t * out = decomp_data + v * vec2_start;
+        
+        for(uint32_t x0 = 0; x0 < (uint32_t) no_haplotypes; x0 += 64)
         {
-            auto j = rev_perm[x];
-
-            uchar_t j_p = perm_lut[j % 8];
-            int j8 = j / 8;
+            uint64_t w = load_vec_word(in + x0 / 8, n_bytes - x0 / 8);
+            if(!w)
+                continue;
+            if((uint32_t) no_haplotypes - x0 < 64)
+                w &= ~0ull << (64 - ((uint32_t) no_haplotypes - x0));
             
-            if (d_x8 & x_p)
-                decomp_data[j8] += j_p;
-            if (d2_x8 & x_p)
-                decomp_data[vec2_start + j8] += j_p;
+            while(w)
+            {
+                auto j = rev_perm[x0 + 63 - __builtin_ctzll(w)];
+                w &= w - 1;
+                out[j / 8] |= perm_lut[j % 8];
+            }
         }
     }
-	
-    int x8 = x / 8;
-    int d_x8 = decomp_data_perm[x8];
-    int d2_x8 = decomp_data_perm[vec2_start + x8];
-
-    for (; x < (uint32) no_haplotypes; ++x)
-    {
-        auto j = rev_perm[x];
-        uchar_t x_p = perm_lut[x % 8];
-        uchar_t j_p = perm_lut[j % 8];
-
-        int j8 = j / 8;
-        if (d_x8 & x_p)
-            decomp_data[j8] += j_p;
-        if (d2_x8 & x_p)
-            decomp_data[vec2_start + j8] += j_p;
-    }
 }
 
 void inline Decompressor::reverse_perm(uint32_t *perm, uint32_t *rev_perm, int no_haplotypes)
@@ -2333,15 +2043,13 @@ void Decompressor::getBV()
     perm = new uint32_t[no_haplotypes];
     rev_perm = new uint32_t[no_haplotypes];
     
-    done_unique.clear();
+    main_ctx.clear();
     uint32_t g, vec1_start, vec2_start;
     
     uint32_t  end;
     uint32_t i = 0;
     
     uint32_t block_id, prev_block_id = 0xFFFF;
-    buff_bm.setBitMemory(&pack.bm);
-    
     if(no_haplotypes & 7)//%8)
     {
         end = pack.s.vec_len - 1;
@@ -2372,8 +2080,8 @@ void Decompressor::getBV()
         fill_n(decomp_data, pack.s.vec_len*2, 0);
         vec1_start = 0;
         vec2_start = pack.s.vec_len;
-        decomp_vec_rrr_range(i++, 0, pack.s.vec_len, pos, decomp_data_perm, 0, false);
-        decomp_vec_rrr_range(i++, 0, pack.s.vec_len, pos, decomp_data_perm, 0, false);
+        decomp_vec_rrr(main_ctx, i++, pos, decomp_data_perm);
+        decomp_vec_rrr(main_ctx, i++, pos, decomp_data_perm);
         
         decode_perm_rev(no_haplotypes, vec2_start, rev_perm, decomp_data_perm, decomp_data);
         
@@ -2389,11 +2097,7 @@ void Decompressor::getBV()
         prev_block_id = block_id;
     }
     
-    for (auto & it:done_unique)
-    {
-        delete [] it.second;
-    }
-    done_unique.clear();
+    main_ctx.clear();
     
     if(decomp_data)
         delete [] decomp_data;
@@ -2428,14 +2132,12 @@ void Decompressor::getVarBV(uint32_t var_to_dec)
     perm = new uint32_t[no_haplotypes];
     rev_perm = new uint32_t[no_haplotypes];
     
-    done_unique.clear();
+    main_ctx.clear();
     uint32_t g, vec1_start, vec2_start;
     
     uint32_t  end;
     
     uint32_t block_id, prev_block_id = 0xFFFF;
-    buff_bm.setBitMemory(&pack.bm);
-    
     if(no_haplotypes & 7)//%8)
     {
         end = pack.s.vec_len - 1;
@@ -2466,8 +2168,8 @@ void Decompressor::getVarBV(uint32_t var_to_dec)
         
         vec1_start = 0;
         vec2_start = pack.s.vec_len;
-        decomp_vec_rrr_range(i++, 0, pack.s.vec_len, pos, decomp_data_perm, 0, false);
-        decomp_vec_rrr_range(i++, 0, pack.s.vec_len, pos, decomp_data_perm, 0, false);
+        decomp_vec_rrr(main_ctx, i++, pos, decomp_data_perm);
+        decomp_vec_rrr(main_ctx, i++, pos, decomp_data_perm);
         
         decode_perm_rev(no_haplotypes, vec2_start, rev_perm, decomp_data_perm, decomp_data);
         
@@ -2483,11 +2185,7 @@ void Decompressor::getVarBV(uint32_t var_to_dec)
         prev_block_id = block_id;
     }
     
-    for (auto & it:done_unique)
-    {
-        delete [] it.second;
-    }
-    done_unique.clear();
+    main_ctx.clear();
     
     if(decomp_data)
         delete [] decomp_data;
@@ -2524,14 +2222,12 @@ void Decompressor::getVarSampleBV(uint32_t var_to_dec, uint32_t sample_to_dec)
     perm = new uint32_t[no_haplotypes];
     rev_perm = new uint32_t[no_haplotypes];
     
-    done_unique.clear();
+    main_ctx.clear();
     uint32_t g, vec1_start, vec2_start;
     
     uint32_t  end;
     
     uint32_t block_id, prev_block_id = 0xFFFF;
-    buff_bm.setBitMemory(&pack.bm);
-    
     if(no_haplotypes & 7)//%8)
     {
         end = pack.s.vec_len - 1;
@@ -2562,15 +2258,15 @@ void Decompressor::getVarSampleBV(uint32_t var_to_dec, uint32_t sample_to_dec)
    
     vec1_start = 0;
     vec2_start = pack.s.vec_len;
-    decomp_vec_rrr_range(i++, 0, pack.s.vec_len, pos, decomp_data_perm, 0, false);
-    decomp_vec_rrr_range(i++, 0, pack.s.vec_len, pos, decomp_data_perm, 0, false);
+    decomp_vec_rrr(main_ctx, i++, pos, decomp_data_perm);
+    decomp_vec_rrr(main_ctx, i++, pos, decomp_data_perm);
     
     decode_perm_rev(no_haplotypes, vec2_start, rev_perm, decomp_data_perm, decomp_data);
     
     for(int p= 0; p < pack.s.ploidy; p++)
     {
         vec1_start = (sample_to_dec*pack.s.ploidy + p)/8; //2 vectors per variant
-        uchar gt = *(lut[decomp_data[vec1_start]][decomp_data[vec1_start + pack.s.vec_len]] + (sample_to_dec*pack.s.ploidy + p)%8);
+        uchar gt = gt_value(decomp_data[vec1_start], decomp_data[vec1_start + pack.s.vec_len], (sample_to_dec*pack.s.ploidy + p)%8);
         
         if(gt == bcf_gt_missing)
         {
@@ -2595,11 +2291,7 @@ void Decompressor::getVarSampleBV(uint32_t var_to_dec, uint32_t sample_to_dec)
     
     prev_block_id = block_id;
 
-    for (auto & it:done_unique)
-    {
-        delete [] it.second;
-    }
-    done_unique.clear();
+    main_ctx.clear();
     
     if(decomp_data)
         delete [] decomp_data;
@@ -2628,28 +2320,6 @@ void Decompressor::getSampleBV(uint32_t sample_to_dec)
     uint32_t unique_pos = 0;
     uint64_t  curr_zeros = 0, curr_copy = 0;
     
-    uint64_t bv_size = pack.rrr_zeros_only_bit_vector[0].size();
-    
-    zeros_only_bit_vector[0] = sdsl::bit_vector(bv_size);
-    zeros_only_bit_vector[1] = sdsl::bit_vector(bv_size);
-    copy_bit_vector[0] = sdsl::bit_vector(bv_size);
-    copy_bit_vector[1] = sdsl::bit_vector(bv_size);
-    
-    uint64_t v_pos;
-    for(v_pos = 0; v_pos + 64 < bv_size; v_pos += 64)
-    {
-        zeros_only_bit_vector[0].set_int(v_pos, pack.rrr_zeros_only_bit_vector[0].get_int(v_pos, 64), 64);
-        zeros_only_bit_vector[1].set_int(v_pos, pack.rrr_zeros_only_bit_vector[1].get_int(v_pos, 64), 64);
-        copy_bit_vector[0].set_int(v_pos, pack.rrr_copy_bit_vector[0].get_int(v_pos, 64), 64);
-        copy_bit_vector[1].set_int(v_pos, pack.rrr_copy_bit_vector[1].get_int(v_pos, 64), 64);
-    }
-    
-    uint64_t tail_len = bv_size - v_pos;
-    zeros_only_bit_vector[0].set_int(v_pos, pack.rrr_zeros_only_bit_vector[0].get_int(v_pos, tail_len), tail_len);
-    zeros_only_bit_vector[1].set_int(v_pos, pack.rrr_zeros_only_bit_vector[1].get_int(v_pos, tail_len), tail_len);
-    copy_bit_vector[0].set_int(v_pos, pack.rrr_copy_bit_vector[0].get_int(v_pos, tail_len), tail_len);
-    copy_bit_vector[1].set_int(v_pos, pack.rrr_copy_bit_vector[1].get_int(v_pos, tail_len), tail_len);
-    
     uint32_t * perm = nullptr;
     
     perm = new uint32_t[pack.s.n_samples * pack.s.ploidy];
@@ -2731,7 +2401,7 @@ uchar_t Decompressor::get_vec_byte(uint32 vec_id, uint32 byte_no, uchar_t * resU
     
     if(parity)
     {
-        if(copy_bit_vector[parity][vector])
+        if(pack.copy_bv[parity][vector])
         {
             unsigned long long bit_pos = (curr_copy)*pack.used_bits_cp;
             
@@ -2747,7 +2417,7 @@ uchar_t Decompressor::get_vec_byte(uint32 vec_id, uint32 byte_no, uchar_t * resU
             curr_copy++;
             return resUnique[curr_non_copy_vec_id];
         }
-        else if(zeros_only_bit_vector[1][vector])
+        else if(pack.zeros_only_bv[1][vector])
         {
             is_uniqe_id = false;
             curr_zeros++;
@@ -2759,7 +2429,7 @@ uchar_t Decompressor::get_vec_byte(uint32 vec_id, uint32 byte_no, uchar_t * resU
             is_uniqe_id = true;
         }
     }
-    else if(!zeros_only_bit_vector[0][vector])
+    else if(!pack.zeros_only_bv[0][vector])
     {
         is_uniqe_id = false;
         curr_zeros++;
@@ -2767,7 +2437,7 @@ uchar_t Decompressor::get_vec_byte(uint32 vec_id, uint32 byte_no, uchar_t * resU
     }
     else
     {
-        if(copy_bit_vector[parity][vector])
+        if(pack.copy_bv[parity][vector])
         {
             unsigned long long bit_pos = (curr_copy)*pack.used_bits_cp;
             
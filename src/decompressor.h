@@ -17,10 +17,53 @@
 #include "htslib/vcf.h"
 #include "samples.h"
 #include "buffered_bm.h"
+#include "gt_expand.h"
+#include "vcf_writer.h"
 #include "huffman.h"
 #include "my_vcf.h"
-#include <deque>
+#include "queues.h"
+#include "block_cache.h"
+#include "stats.h"
+#include <vector>
+#include <atomic>
 
+// Copy of bytes between rows of the buffer of decoded unique vectors (the same positions in both vectors)
+typedef struct plan_copy_tag {
+    uint32_t dst;
+    uint32_t src;
+    uint32_t offset;
+    uint32_t len;
+    
+    plan_copy_tag(uint32_t _dst, uint32_t _src, uint32_t _offset, uint32_t _len) :
+    dst(_dst), src(_src), offset(_offset), len(_len)
+    {}
+} plan_copy_t;
+
+// Decoding state owned by a single thread: own read positions in the archive streams and own buffer of decoded unique vectors
+class DecodeContext {
+public:
+    CBitMemory bm;
+    CBitMemory bm_comp_pos;
+    CBitMemory bm_comp_copy_orgl_id;
+    CBufferedBitMemory buff_bm;
+    
+    // Unique vectors of the current block (row per vector; at most max_no_vec_in_block rows of vec_len bytes)
+    uint64_t block_id = UINT64_MAX;
+    uint64_t block_unique_first = 0;   // id of the first unique vector of the block
+    std::vector<uchar_t> block_data;
+    std::vector<uchar_t> block_state;  // 0 - not decoded, 1 - in the decode plan, 2 - decoded
+    
+    // Decode plan
+    std::vector<uint32_t> plan_heap;   // rows waiting to be parsed (max-heap)
+    std::vector<uint32_t> plan_rows;   // parsed rows
+    std::vector<plan_copy_t> plan_copies;
+    
+    void clear()
+    {
+        block_id = UINT64_MAX;
+        block_state.clear();
+    }
+};
 
 class Decompressor {
     
@@ -37,16 +80,18 @@ class Decompressor {
     
     // Output and output settings
     htsFile *out;
+    CVCFWriter vcf_writer;
     file_type out_type;
     string out_name;
     char compression_level;
-    bool MB_memory;
     bool out_AC_AN;
     bool out_genotypes;
+    bool sites_only = false;    // genotypes are neither written nor needed for AC/AN (the core of the archive is not used)
     uint32_t records_to_process;
-    uint32_t max_MB_memory;
     double minAF, maxAF;
     int32_t minAC, maxAC;
+    int32_t maxAC_all = INT32_MAX;  // upper bound of AC from maxAC and maxAF with AN of all haplotypes (for skipping blocks)
+    bool use_ac_index = false;  // allele counts are taken from the archive (if stored and all samples are decompressed)
     
     // For BCF output
     htsFile * bcf = nullptr;
@@ -54,44 +99,63 @@ class Decompressor {
     bcf_hdr_t * hdr = nullptr;
     uint32_t * sampleIDs = nullptr;
     
+    uint32_t n_threads;
+    
+    // Cache of decoded blocks
+    string cache_dir;
+    uint32_t cache_max_MB = 0;
+    CBlockCache block_cache;
+    vector<uchar_t> cached_block;      // decoded block (if not loaded from the cache)
+    const uchar_t * cached_data = nullptr;
+    uint32_t cached_block_id = 0xFFFFFFFF;
+    
     CBufferedBitMemory buff_bm;
-    std::unordered_map<uint64_t, uchar_t *> done_unique;
-    std::unordered_map<uint64_t, uchar_t *>::const_iterator got_it;
+    DecodeContext main_ctx; // decoding state of the main thread
     
+    int decompressSites(const string & range);
     int decompressRange(const string & range);
-    void decomp_vec_rrr_range(uint64_t vec_id, uint64_t offset, uint64_t length, uint32_t & pos, uchar_t *decomp_data, uint64_t start_id, bool is_unique_id);
+    int decompressRangeParallel(const string & range);
+    void initDecodeContext(DecodeContext & ctx);
+    void decodeRecordGT(DecodeContext & ctx, uint64_t vec_id, const uint32_t * rev_perm, uchar_t * decomp_data_perm, uchar_t * decomp_data, kstring_t & str);
+    const uchar_t * getCachedVariant(uint64_t vec_id, const uint32_t * rev_perm, uchar_t * decomp_data_perm);
+    void decomp_vec_rrr(DecodeContext & ctx, uint64_t vec_id, uint32_t & pos, uchar_t *decomp_data);
+    void decodeUniqueVectors(DecodeContext & ctx, uint32_t row);
     
     int decompressSampleSmart(const string & range);
     
     uchar_t get_vec_byte(uint32 vec_id, uint32 byte_no, uchar_t * resUnique, bool & is_uniqe_id, uint64_t & curr_zeros, uint64_t & curr_copy);
     
-    uchar_t get_vec_bytes(uint64_t vec_id, std::vector< std::pair<uint32_t, uint32_t> > & whichByte_whereInRes, uchar_t * resUnique, bool & is_uniqe_id, uint64_t & curr_zeros, uint64_t & curr_copy, uchar_t * resAll, uint32_t unique_pos_first_in_block, uint32_t first_vec_in_block, bool full_decode = true); //uchar_t get_vec_bytes(uint64_t vec_id, std::vector< std::pair<uint32_t, uchar_t> > & whichByte_whereInRes, uchar_t * resUnique, bool & is_uniqe_id, uint64_t & curr_zeros, uint64_t & curr_copy, uchar_t * resAll);
+    // Block-columnar store for decompressSampleSmart: only bytes of vectors holding the selected haplotypes
+    vector<uint32_t> col_bytes;     // distinct bytes (in permuted order) needed in the current block, with guard at the end
+    vector<uint32_t> hap_col;       // column of each selected haplotype
+    vector<uchar_t> hap_shift;      // position of each selected haplotype within its byte
+    vector<uchar_t> col_mask;       // bits of selected haplotypes in each column
+    vector<uchar_t> block_cols;     // decoded columns of vectors of the current block (row per vector)
+    vector<uint32_t> unique_rows;   // rows of consecutive unique vectors of the current block
+    uint64_t col_first_vec = 0, col_next_vec = 0, col_unique_first = 0;
+    uint64_t col_zeros = 0, col_copy = 0;
+    
+    void initBlockColumns(uint32_t block_id, const uint32_t * perm);
+    void decodeBlockColumns(uint64_t last_vec_id);
+    void decodeUniqueColumns(uint64_t curr_non_copy_vec_id, uchar_t * row);
     
     int decompressRangeSample(const string & range);
-    bool setACAN(bcf_hdr_t * hdr, bcf1_t * record, const kstring_t & str);
+    bool setACAN(bcf_hdr_t * hdr, bcf1_t * record, int32 ac, int32 an);
+    bool setACANPlanes(bcf_hdr_t * hdr, bcf1_t * record, const uchar_t * v1, const uchar_t * v2, const uchar_t * mask, size_t n_bytes);
+    bool setACANIndexed(bcf_hdr_t * hdr, bcf1_t * record, uint64_t vec_id);
+    void writeRecord(bcf1_t * record, kstring_t & str);
+    void closeOut();
     
 	void inline decode_perm(int no_haplotypes, int vec2_start, uint32_t *perm, uchar_t *decomp_data_perm, uchar_t *decomp_data);
-	void inline decode_perm_rev(int no_haplotypes, int vec2_start, uint32_t *rev_perm, uchar_t *decomp_data_perm, uchar_t *decomp_data);
+	void inline decode_perm_rev(int no_haplotypes, int vec2_start, const uint32_t *rev_perm, uchar_t *decomp_data_perm, uchar_t *decomp_data);
 	void inline reverse_perm(uint32_t *perm, uint32_t *rev_perm, int no_haplotypes);
 	
 	uchar_t perm_lut[8];
-    alignas(8) uchar lut[256][256][8];
     void initialLut();
     
     uchar_t *zeros_only_vector = nullptr;
     uchar_t *ones_only_vector = nullptr;
-    int nesting = 0;
     
-    // Create a deque containing ids of remembered vectors
-    std::deque<uint64_t> stored_unique;
-    uint64_t max_stored_unique = 0;
-    
-    sdsl::bit_vector zeros_only_bit_vector[2];
-    sdsl::rank_support_v5<> rank_zeros_only_vector[2];
-    
-    sdsl::bit_vector copy_bit_vector[2];
-    sdsl::rank_support_v5<> rank_copy_bit_vector[2];
-
     FILE * bv_out = nullptr; //for view_dev only
 public:
     Decompressor()
@@ -100,8 +164,6 @@ public:
         out_type = VCF;
         out_name = "";
         samples_to_decompress = "";
-        max_MB_memory = 0;
-        MB_memory = true;
         range = "";
         records_to_process = UINT32_MAX;
         
@@ -112,6 +174,8 @@ public:
         maxAC = INT32_MAX;
         minAF = 0;
         maxAF = 1;
+        
+        n_threads = 1;
     }
     
     Decompressor(Params & params)
@@ -121,8 +185,6 @@ public:
         out_type = params.out_type;
         out_name = params.out_name;
         samples_to_decompress = params.samples;
-        max_MB_memory = params.max_MB_memory;
-        MB_memory = params.MB_memory;
         range = params.range;
         out_AC_AN = params.out_AC_AN;
         out_genotypes = params.out_genotypes;
@@ -131,6 +193,9 @@ public:
         maxAF = params.maxAF;
         minAC = params.minAC;
         maxAC = params.maxAC;
+        n_threads = params.n_threads;
+        cache_dir = params.cache_dir;
+        cache_max_MB = params.cache_max_MB;
     }
     
     ~Decompressor()
@@ -154,10 +219,10 @@ public:
     }
     
     void decompress();
+    int computeStats();
    
     
     bool loadPack();
-    void setMemoryUsage();
     int initOut();
     int loadBCF();
 
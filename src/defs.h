@@ -18,7 +18,7 @@
 
 #define FORCED_BV_TYPE RRR
 
-enum file_type {VCF, BCF, BV, TXT_BV};
+enum file_type {VCF, BCF, BV, TXT_BV, VCF_GZ};
 enum task_type {tcompress, tquery, tcompress_dev_pre, tcompress_dev, tquery_dev, tstats};
 
 #ifdef WIN32
@@ -60,7 +60,11 @@ typedef unsigned int uint32_t;
 #endif
 
 const uint32 MC_TRIALS = 100000;
-const uint32 MAX_HUF_LUT_LEN = 16;
+const uint32 MAX_HUF_LUT_LEN = 11; // Number of bits indexing the main Huffman decoding table (and each of its subtables)
+const uint32 HUF_LUT_SUBTABLE = 0xFF;
+const uint32 HUF_LUT_LONG = 0xFE; // Canonical code longer than the index of the main table
+const uint32 MAX_HUF_CODE_LEN = 24; // Maximum length of Huffman codes (codes are shortened if needed)
+const uint32 HUF_CANONICAL_MARK = 0xFFFFFFFFu; // Begins Huffman tables stored as lengths of canonical codes
 const uint32 NO_SAMPLE_THRESHOLD = 4000; //variable "where" and "whichByte_whereInRes" changed to uint32_t from uchar
 const uint32 MATCH_BITS_HUF = 8;  //8-10
 
@@ -74,9 +78,15 @@ const uint32_t HASH_KEY_LEN2 = 5;
 const uint32_t MIN_ZERO_RUN_LEN = 2;
 const uint32_t MIN_ONES_RUN_LEN = 2;
 const uint32_t FULL_POS_STEP = 1025; // So there are 1024 * bits_used between full positions
+const uint64_t ARCH_MAGIC_CHECKSUM = 0x00314d5553435447ull;  // "GTCSUM1" at the end of archives, after the checksum of the archive
+const uint32_t ARCH_FLAG_PERM_DIFF = 0x40; // Set in the ones_ranges byte of the archive if permutations may be stored as differences from the previous block
+const uint32_t ARCH_FLAG_AC_INDEX = 0x80;  // Set in the ones_ranges byte of the archive if allele counts of variants are stored
+const uint64_t ARCH_MAGIC_RANK_BV = 0x0031564252435447ull;   // "GTCRBV1" at the start of archives with bit vectors used in place (older archives start with sdsl rrr vectors)
 const uint32_t BITS_IN_BYTE = 8;
 const uint32_t MAX_LITERAL_RUN = 252; // max 252
 const uint32_t MIN_LITERAL_RUN = 20;  // min 2
+const uint32_t VCF_BATCH_SIZE = 64; // Number of input records parsed at once by a single thread
+const uint32_t DECOMP_CHUNK_SIZE = 256; // Number of records passed at once from a decompressing thread to the writer
 const uint32_t PART_SIZE = 3584; // Number of variants processed in block (number of vectors processed in block: 2*PART_SIZE)
 
 const uint32_t PART_TRIALS = 10*PART_SIZE*2 / 20; 
@@ -8,10 +8,25 @@
  */
 
 #include "end_compressor.h"
+#include "permutation_engine.h"
+#include "rank_bit_vector.h"
 #include <iostream>
+#include <fcntl.h>
 
 void EndCompressor::Encode()
 {
+    no_vec = curr_vec_id;
+    for(int v = 0; v < 2; v++)
+    {
+        zeros_only_bit_vector[v].resize(no_vec/2+no_vec%2);
+        copy_bit_vector[v].resize(no_vec/2+no_vec%2);
+    }
+    comp_pos_non_copy.resize(unique_no);
+    
+    n_workers = n_threads < no_blocks ? n_threads : no_blocks;
+    if(!n_workers)
+        n_workers = 1;
+    thread_buffers.resize(n_workers);
     
     rank_copy_bit_vector[0] = sdsl::rank_support_v5<>(&copy_bit_vector[0]);
     rank_copy_bit_vector[1] = sdsl::rank_support_v5<>(&copy_bit_vector[1]);
@@ -126,30 +141,28 @@ void EndCompressor::Encode()
     }
     huf_group_type.Complete();
     
-    bm_huff.Create(bm.mem_buffer_pos);
-    
-    bm.Restart();
-    
-    litRunSize = new uint16_t[literalRunCount];
-    literalRunCount = 0;
-    
     for(int o = 0; o < (int) s->ones_ranges; o++)
         for(int i = 0; i <= (int) MAX_LITERAL_RUN + 3; i++) //shift by 3, to be able to difference between 3 and 4 flags nad literal run of 3 or 4
             
             minLitRunSize[o][i] = INT32_MAX;
     
-    block = 0;
-    uint64_t unique = 0;
-    
     // Check and store literal flag lenghts; calculate minLitRunSize for each group and flag
-    for(uint64_t cur_vec_id = 0; cur_vec_id < unique_no; ++cur_vec_id)
+    vector<model_stats_t> stats(n_workers, model_stats_t(s->ones_ranges, 0, 0));
+    processBlocks([&](uint32_t thread_id, uint32_t block_id) {
+        CBitMemory in;
+        openBlock(in, thread_id, block_id);
+        for(uint64_t vec_id = block_first_unique[block_id]; vec_id < block_first_unique[block_id] + unique_in_block[block_id]; ++vec_id)
+            getLitRunSizes(in, vec_id, block_id, stats[thread_id]);
+    });
+    
+    for(auto &ms : stats)
     {
-        if(cur_vec_id > unique + unique_in_block[block])
-        {
-            unique += unique_in_block[block];
-            block++;
-        }
-        getLitRunSizes(cur_vec_id);
+        for(i = 0; i < (1 << MATCH_BITS_HUF); ++i)
+            hist_match_diff_MSB[i] += ms.hist_match_diff_MSB[i];
+        for(int o = 0; o < (int) s->ones_ranges; o++)
+            for(int f = 0; f <= (int) MAX_LITERAL_RUN + 3; f++)
+                if(ms.minLitRunSize[o * (MAX_LITERAL_RUN+4) + f] < minLitRunSize[o][f])
+                    minLitRunSize[o][f] = ms.minLitRunSize[o * (MAX_LITERAL_RUN+4) + f];
     }
     
     // Huffman for group_type match_diff_MSB
@@ -168,10 +181,22 @@ void EndCompressor::Encode()
     huf_match_diff_MSB.Complete();
     
     // Decrease by minLitRunSize for each group and flag; get litRunSizeMax, get hist_litRunSize_usedBits
-    literalRunCount = 0;
-    bm.Restart();
-  
-    decreaseLitRunSizesbyMin(unique_no);
+    stats.assign(n_workers, model_stats_t(s->ones_ranges, 0, 0));
+    processBlocks([&](uint32_t thread_id, uint32_t block_id) {
+        CBitMemory in;
+        openBlock(in, thread_id, block_id);
+        decreaseLitRunSizesbyMin(in, block_id, stats[thread_id]);
+    });
+    
+    for(auto &ms : stats)
+        for(int o = 0; o < (int) s->ones_ranges; o++)
+        {
+            if(ms.litRunSizeMax[o] > litRunSizeMax[o])
+                litRunSizeMax[o] = ms.litRunSizeMax[o];
+            for(int a = 0; a < 32; a++)
+                hist_litRunSize_usedBits[o][a] += ms.hist_litRunSize_usedBits[o * 32 + a];
+        }
+    stats.clear();
     
     for(int o = 0; o < (int) s->ones_ranges; o++)
     {
@@ -198,24 +223,48 @@ void EndCompressor::Encode()
             }
         }
     }
-    block = 0;
-    unique = 0;
-    literalRunCount = 0;
-    bm.Restart();
-    for(uint64_t cur_vec_id = 0; cur_vec_id < unique_no; ++cur_vec_id)
+    
+    // Each block is encoded into its own buffer (positions of vectors are relative to its beginning) and appended to the spill file
+    block_huff_pos.assign(no_blocks, 0);
+    block_huff_size.assign(no_blocks, 0);
+    processBlocks([&](uint32_t thread_id, uint32_t block_id) {
+        CBitMemory in, out;
+        openBlock(in, thread_id, block_id);
+        out.Create(in.GetSize());
+        for(uint64_t vec_id = block_first_unique[block_id]; vec_id < block_first_unique[block_id] + unique_in_block[block_id]; ++vec_id)
+            encode_vec(in, out, vec_id, block_id);
+        
+        block_huff_size[block_id] = out.GetPos();
+        block_huff_pos[block_id] = spill_size.fetch_add(out.GetPos());
+        spillWrite(out.mem_buffer, out.GetPos(), block_huff_pos[block_id]);
+        out.Close();
+    });
+    thread_buffers.clear();
+    
+    // Position of every FULL_POS_STEP-th vector is stored in full, positions of the rest as differences to it
+    uint64_t full_pos = 0, pos, block_pos = 0;
+    uint32_t pos_diff;
+    for(uint32_t b = 0; b < no_blocks; ++b)
     {
-        if(cur_vec_id == unique + unique_in_block[block])
+        for(uint64_t vec_id = block_first_unique[b]; vec_id < block_first_unique[b] + unique_in_block[b]; ++vec_id)
         {
-            unique += unique_in_block[block];
-            block++;
+            pos = block_pos + comp_pos_non_copy[vec_id];
+            if(vec_id%FULL_POS_STEP == 0)
+            {
+                comp_pos_non_copy[vec_id] = (uint32_t) pos;
+                full_pos = pos;
+            }
+            else
+            {
+                pos_diff = (uint32_t) (pos - full_pos);
+                comp_pos_non_copy[vec_id] = pos_diff;
+                if(pos_diff > max_pos_diff)
+                    max_pos_diff = pos_diff;
+            }
         }
-        encode_vec(cur_vec_id);
+        block_pos += block_huff_size[b];
     }
     
-    bm.Close();
-    
-    bm_huff.PutBits(0, MAX_HUF_LUT_LEN); // Padding, so SpeedupLUT for Huffman can work nice at the end
-    bm_huff.FlushPartialWordBuffer();
     bm_comp_copy_orgl_id.Create(copy_no*4);
     uint64_t end, j;
   
@@ -225,8 +274,8 @@ void EndCompressor::Encode()
     }
     bm_comp_copy_orgl_id.FlushPartialWordBuffer();
     
-    delete [] comp_pos_copy;
-    comp_pos_copy = NULL;
+    comp_pos_copy.clear();
+    comp_pos_copy.shrink_to_fit();
     
     bm_comp_pos.Create(unique_no*4);
     used_bits_noncp = bits_used(max_pos_diff);
@@ -241,8 +290,8 @@ void EndCompressor::Encode()
         bm_comp_pos.FlushPartialWordBuffer();
     }
     
-    delete [] comp_pos_non_copy;
-    comp_pos_non_copy = NULL;
+    comp_pos_non_copy.clear();
+    comp_pos_non_copy.shrink_to_fit();
     
     for(int i = 0; i < (int) zeros_only_bit_vector[0].size(); i++)
         zeros_only_bit_vector[0][i] = !zeros_only_bit_vector[0][i];
@@ -254,12 +303,111 @@ void EndCompressor::Encode()
     sdsl::util::clear(rank_unique);
 }
 
-void EndCompressor::AddBlock(int &id_block, unsigned char *compressed_block, size_t n_recs, size_t compressed_size, std::vector<int> &perm, std::vector<bool> &zeros, std::vector<bool> &copies, uint32_t * origin_of_copy)
+// Permutation of the block stored in full (flag 1) or as a difference from the previous block (flag 0): the first haplotype
+// of the tour and, for each next position, a flag telling whether it holds the successor (in the previous tour) of the haplotype
+// at the previous position, followed by the id of the haplotype if it does not
+void EndCompressor::storePermDiff(uint32_t block_id, const vector<int> &perm)
+{
+    uint32_t no_haplotypes = s->n_samples*s->ploidy;
+    vector<int> tour(no_haplotypes), prev_pos;
+    vector<bool> same(no_haplotypes, false);
+    
+    for(uint32_t i = 0; i < no_haplotypes; ++i)
+        tour[perm[i]] = i;
+    
+    bool diff = block_id % PERM_KEYFRAME_INTERVAL != 0 && prev_tour.size() == no_haplotypes;
+    if(diff)
+    {
+        uint64_t n_breaks = 1;
+        prev_pos.resize(no_haplotypes);
+        for(uint32_t i = 0; i < no_haplotypes; ++i)
+            prev_pos[prev_tour[i]] = i;
+        for(uint32_t i = 1; i < no_haplotypes; ++i)
+        {
+            uint32_t q = prev_pos[tour[i - 1]] + 1;
+            same[i] = q < no_haplotypes && prev_tour[q] == tour[i];
+            n_breaks += !same[i];
+        }
+        diff = n_breaks * bitsize_perm + no_haplotypes - 1 < (uint64_t) no_haplotypes * bitsize_perm;
+    }
+    
+    block_perm_pos.push_back(bm_perms.mem_buffer_pos);
+    bm_perms.PutBit(!diff);
+    if(diff)
+    {
+        bm_perms.PutBits(tour[0], bitsize_perm);
+        for(uint32_t i = 1; i < no_haplotypes; ++i)
+        {
+            bm_perms.PutBit(same[i]);
+            if(!same[i])
+                bm_perms.PutBits(tour[i], bitsize_perm);
+        }
+    }
+    else
+        for(uint32_t i = 0; i < no_haplotypes; ++i)
+            bm_perms.PutBits(perm[i], bitsize_perm);
+    bm_perms.FlushPartialWordBuffer();
+    
+    prev_tour.swap(tour);
+}
+
+void EndCompressor::AddBlock(int &id_block, unsigned char *compressed_block, size_t n_recs, size_t compressed_size, std::vector<int> &perm, std::vector<bool> &zeros, std::vector<bool> &copies, uint32_t * origin_of_copy, std::vector<uint32_t> &ac_an)
 {
     assert((uint32) id_block == no_blocks);
     no_blocks++;
-    perms.push_back(perm);
-    bm.PutBytes(compressed_block, compressed_size);
+    
+    if(spill_fd < 0)
+    {
+        spill_fd = open(spill_name.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+        if(spill_fd < 0)
+        {
+            cout << "Cannot create temporary file: " << spill_name << endl;
+            exit(1);
+        }
+        unlink(spill_name.c_str());     // Removed by the system when closed
+    }
+    
+    if(s->perm_warm_start)
+        storePermDiff(id_block, perm);
+    else
+    {
+        for(uint32_t i = 0; i < s->n_samples*s->ploidy; ++i)
+            bm_perms.PutBits(perm[i], bitsize_perm);
+        bm_perms.FlushPartialWordBuffer();
+    }
+    
+    if(s->ac_index)
+    {
+        uint32_t ac_bytes = s->ac_bytes();
+        uint32_t ac_min = UINT32_MAX, ac_max = 0;
+        size_t pos = variant_ac.size();
+        
+        variant_ac.resize(pos + ac_an.size() * ac_bytes);
+        for(size_t i = 0; i < ac_an.size(); ++i, pos += ac_bytes)
+            memcpy(variant_ac.data() + pos, &ac_an[i], ac_bytes);
+        for(size_t i = 0; i < ac_an.size(); i += 2)
+        {
+            ac_min = min(ac_min, ac_an[i]);
+            ac_max = max(ac_max, ac_an[i]);
+        }
+        block_ac_min.push_back(ac_min);
+        block_ac_max.push_back(ac_max);
+    }
+    
+    block_spill_pos.push_back(spill_size);
+    block_spill_size.push_back(compressed_size);
+    block_first_unique.push_back(unique_no);
+    spillWrite(compressed_block, compressed_size, spill_size);
+    spill_size += compressed_size;
+    
+    // Bit vectors grow with the number of added vectors
+    uint64_t need = (curr_vec_id + n_recs)/2 + 1;
+    if(zeros_only_bit_vector[0].size() < need)
+        for(int v = 0; v < 2; v++)
+        {
+            zeros_only_bit_vector[v].resize(2 * need);
+            copy_bit_vector[v].resize(2 * need);
+        }
     
     uint64_t block_start_vec_id = curr_vec_id;
     uint64_t cur_copy_no = 0, cur_unique_no = 0, zzeros = 0;
@@ -278,62 +426,113 @@ void EndCompressor::AddBlock(int &id_block, unsigned char *compressed_block, siz
         
         curr_vec_id++;
     }
-    memcpy(comp_pos_copy + copy_no, origin_of_copy, cur_copy_no*sizeof(uint32_t));
+    comp_pos_copy.insert(comp_pos_copy.end(), origin_of_copy, origin_of_copy + cur_copy_no);
     
     copy_no += cur_copy_no;
     unique_no += cur_unique_no;
     unique_in_block.push_back(cur_unique_no);
+}
+
+void EndCompressor::spillWrite(const uchar * data, uint64_t size, uint64_t pos)
+{
+    while(size)
+    {
+        ssize_t r = pwrite(spill_fd, data, size, (off_t) pos);
+        if(r <= 0)
+        {
+            cout << "Cannot write to temporary file: " << spill_name << endl;
+            exit(1);
+        }
+        data += r;
+        size -= r;
+        pos += r;
+    }
+}
+
+void EndCompressor::spillRead(uchar * data, uint64_t size, uint64_t pos)
+{
+    while(size)
+    {
+        ssize_t r = pread(spill_fd, data, size, (off_t) pos);
+        if(r <= 0)
+        {
+            cout << "Cannot read from temporary file: " << spill_name << endl;
+            exit(1);
+        }
+        data += r;
+        size -= r;
+        pos += r;
+    }
+}
+
+// Run func(thread_id, block_id) for all blocks; blocks are taken by n_workers threads one by one
+void EndCompressor::processBlocks(const function<void(uint32_t, uint32_t)> &func)
+{
+    atomic<uint32_t> next_block(0);
+    
+    vector<thread *> workers(n_workers, nullptr);
+    for(uint32_t i = 0; i < n_workers; ++i)
+        workers[i] = new thread([&, i]{
+            uint32_t block_id;
+            while((block_id = next_block++) < no_blocks)
+                func(i, block_id);
+        });
     
-    curr_pos += compressed_size;
+    for(auto p : workers)
+    {
+        p->join();
+        delete p;
+    }
+}
+
+// Read the initial stream of a single block to the buffer of the thread and open it for reading
+void EndCompressor::openBlock(CBitMemory &in, uint32_t thread_id, uint32_t block_id)
+{
+    vector<uchar> &buf = thread_buffers[thread_id];
+    if(buf.size() < block_spill_size[block_id])
+        buf.resize(block_spill_size[block_id]);
+    spillRead(buf.data(), block_spill_size[block_id], block_spill_pos[block_id]);
+    in.Open(buf.data(), block_spill_size[block_id]);
 }
 
-void EndCompressor::encode_vec(uint64_t vec_id)
+void EndCompressor::encode_vec(CBitMemory &in, CBitMemory &out, uint64_t vec_id, uint32_t block_id)
 {
     
     uint32_t decoded_bytes;
     uint32_t zero_run_len, ones_run_len;
     uint32_t best_pos = 0;
-    uint32_t best_match_len = 0, pos_diff;
+    uint32_t best_match_len = 0;
     uint64_t tmp;
     
     uint32_t  byte, flag;
+    uchar literals[MAX_LITERAL_RUN];
     
-    bm.FlushInputWordBuffer();
+    in.FlushInputWordBuffer();
     
-    if(vec_id%FULL_POS_STEP == 0)
-    {
-        comp_pos_non_copy[vec_id] = bm_huff.GetPos();
-    }
-    else
-    {
-        pos_diff = bm_huff.GetPos() - comp_pos_non_copy[vec_id/FULL_POS_STEP * FULL_POS_STEP];
-        comp_pos_non_copy[vec_id] = pos_diff;
-        if(pos_diff > max_pos_diff)
-            max_pos_diff = pos_diff;
-    }
+    comp_pos_non_copy[vec_id] = (uint32_t) out.GetPos();
     
     uint32_t ones_group;
-    bm.GetBits(ones_group, s->bit_size_ones_goup);
-    bm_huff.PutBits(huf_group_type.codes[ones_group].code, huf_group_type.codes[ones_group].len);
+    in.GetBits(ones_group, s->bit_size_ones_goup);
+    out.PutBits(huf_group_type.codes[ones_group].code, huf_group_type.codes[ones_group].len);
     
     decoded_bytes = 0;
     
     while(decoded_bytes < s->vec_len)
     {
-        bm.GetBits(flag, 8);
-        bm_huff.PutBits(huf_flags.codes[flag].code, huf_flags.codes[flag].len);
+        in.GetBits(flag, 8);
+        out.PutBits(huf_flags.codes[flag].code, huf_flags.codes[flag].len);
         
         switch(flag)
         {
             case 0: //literal x1
-                bm.GetBits(byte, 8); //get byte
-                bm_huff.PutBits(huf_literals[ones_group].codes[byte].code, huf_literals[ones_group].codes[byte].len);
+                in.GetBits(byte, 8); //get byte
+                out.PutBits(huf_literals[ones_group].codes[byte].code, huf_literals[ones_group].codes[byte].len);
                 decoded_bytes++;
                 break;
             case 1: //match
             {
-                bm.GetBits(best_pos, s->bit_size_id);
-                best_pos += block*s->max_no_vec_in_block;
+                in.GetBits(best_pos, s->bit_size_id);
+                best_pos += block_id*s->max_no_vec_in_block;
                 // Difference between unique id is of current vector and unique id of match vector
                 best_pos = vec_id - (best_pos \
                                      - rank_copy_bit_vector[0](best_pos/2+(best_pos%2)) - rank_copy_bit_vector[1](best_pos/2)  \
@@ -341,31 +540,31 @@ void EndCompressor::encode_vec(uint64_t vec_id)
                 
                 best_pos -= 1; //shift to not waste 1 value
   
-                tmp = (best_pos >> (s->bit_size_id_match_pos_diff - MATCH_BITS_HUF)) & bm.n_bit_mask[MATCH_BITS_HUF];
-                bm_huff.PutBits(huf_match_diff_MSB.codes[tmp].code, huf_match_diff_MSB.codes[tmp].len);
-                bm_huff.PutBits(best_pos & bm.n_bit_mask[s->bit_size_id_match_pos_diff - MATCH_BITS_HUF], (s->bit_size_id_match_pos_diff - MATCH_BITS_HUF));
+                tmp = (best_pos >> (s->bit_size_id_match_pos_diff - MATCH_BITS_HUF)) & in.n_bit_mask[MATCH_BITS_HUF];
+                out.PutBits(huf_match_diff_MSB.codes[tmp].code, huf_match_diff_MSB.codes[tmp].len);
+                out.PutBits(best_pos & in.n_bit_mask[s->bit_size_id_match_pos_diff - MATCH_BITS_HUF], (s->bit_size_id_match_pos_diff - MATCH_BITS_HUF));
                 
-                bm.GetBits(best_match_len, s->bit_size_match_len);
+                in.GetBits(best_match_len, s->bit_size_match_len);
                 
                 // Huffman
-                bm_huff.PutBits(huf_match_lens[ones_group].codes[best_match_len].code, huf_match_lens[ones_group].codes[best_match_len].len);
+                out.PutBits(huf_match_lens[ones_group].codes[best_match_len].code, huf_match_lens[ones_group].codes[best_match_len].len);
                 
                 decoded_bytes += best_match_len;
                 break;
             }
             case 2: //match same
             {
-                bm.GetBits(best_match_len, s->bit_size_match_len);
+                in.GetBits(best_match_len, s->bit_size_match_len);
                 // Huffman
-                bm_huff.PutBits(huf_match_lens[ones_group].codes[best_match_len].code, huf_match_lens[ones_group].codes[best_match_len].len);
+                out.PutBits(huf_match_lens[ones_group].codes[best_match_len].code, huf_match_lens[ones_group].codes[best_match_len].len);
                 decoded_bytes += best_match_len;
                 break;
             }
             case 3: //zero run
             {
-                bm.GetBits(zero_run_len, s->bit_size_run_len);
+                in.GetBits(zero_run_len, s->bit_size_run_len);
                 // Huffman
-                bm_huff.PutBits(huf_zeros_runs[ones_group].codes[zero_run_len].code, huf_zeros_runs[ones_group].codes[zero_run_len].len);
+                out.PutBits(huf_zeros_runs[ones_group].codes[zero_run_len].code, huf_zeros_runs[ones_group].codes[zero_run_len].len);
                 
                 for(int p = 0; p < (int) zero_run_len; p++)
                 {
@@ -380,9 +579,9 @@ void EndCompressor::encode_vec(uint64_t vec_id)
             }
             case 4: //one run
             {
-                bm.GetBits(ones_run_len, s->bit_size_run_len);
+                in.GetBits(ones_run_len, s->bit_size_run_len);
                 // Huffman
-                bm_huff.PutBits(huf_ones_runs[ones_group].codes[ones_run_len].code, huf_ones_runs[ones_group].codes[ones_run_len].len);
+                out.PutBits(huf_ones_runs[ones_group].codes[ones_run_len].code, huf_ones_runs[ones_group].codes[ones_run_len].len);
                 for(int p = 0; p < (int) ones_run_len; p++)
                 {
                     if(decoded_bytes < s->vec_len)
@@ -397,29 +596,38 @@ void EndCompressor::encode_vec(uint64_t vec_id)
             default: //run of 2(MIN_LITERAL_RUN) - MAX_LITERAL_RUN literals
             {
                 flag = flag - 3; //shift by 3, to be able to difference between 2, 3 and 4 flags nad literal run of 2, 3 or 4
+                // Size of literals description (in bits) is recalculated here, as literals are read before they are stored
+                uint32_t lit_run_size = 0;
+                for(int i = 0; i < (int) flag; i++)
+                {
+                    in.GetBits(byte, 8); //get byte
+                    literals[i] = (uchar) byte;
+                    lit_run_size += huf_literals[ones_group].codes[byte].len;
+                }
+                lit_run_size = lit_run_size - minLitRunSize[ones_group][flag] + 1;
+                
                 // Instead of always using "max_used_bits_litRunSize", use used_bits_litRunSize bits; if not enough (8 bits of 0x00 as a flag), use max_used_bits_litRunSize bits additionally (with full size)
-                if(litRunSize[literalRunCount] <= bm.n_bit_mask[used_bits_litRunSize[ones_group]])
-                    bm_huff.PutBits(litRunSize[literalRunCount++], used_bits_litRunSize[ones_group]);
+                if(lit_run_size <= in.n_bit_mask[used_bits_litRunSize[ones_group]])
+                    out.PutBits(lit_run_size, used_bits_litRunSize[ones_group]);
                 else
                 {
-                    bm_huff.PutBits(0, used_bits_litRunSize[ones_group]);
-                    bm_huff.PutBits(litRunSize[literalRunCount++], max_used_bits_litRunSize[ones_group]);
+                    out.PutBits(0, used_bits_litRunSize[ones_group]);
+                    out.PutBits(lit_run_size, max_used_bits_litRunSize[ones_group]);
                 }
                 for(int i = 0; i < (int) flag; i++)
                 {
-                    bm.GetBits(byte, 8); //get byte
-                    bm_huff.PutBits(huf_literals[ones_group].codes[byte].code, huf_literals[ones_group].codes[byte].len);
+                    out.PutBits(huf_literals[ones_group].codes[literals[i]].code, huf_literals[ones_group].codes[literals[i]].len);
                     decoded_bytes++;
                 }
                 break;
             }
         }
     }
-    bm_huff.FlushPartialWordBuffer();
+    out.FlushPartialWordBuffer();
 }
 
 // Only to get sizes of literals run (in bits); rest is ommitted, bm is not altered, set difference for match pos
-void EndCompressor::getLitRunSizes(uint64_t vec_id)
+void EndCompressor::getLitRunSizes(CBitMemory &in, uint64_t vec_id, uint32_t block_id, model_stats_t &ms)
 {
     uint32_t decoded_bytes;
     uint32_t zero_run_len, ones_run_len;
@@ -428,45 +636,45 @@ void EndCompressor::getLitRunSizes(uint64_t vec_id)
     uint32_t  byte, flag;
     uint32_t ones_group;
     
-    bm.FlushInputWordBuffer();
-    bm.GetBits(ones_group, s->bit_size_ones_goup);
+    in.FlushInputWordBuffer();
+    in.GetBits(ones_group, s->bit_size_ones_goup);
     decoded_bytes = 0;
     while(decoded_bytes < s->vec_len)
     {
-        bm.GetBits(flag, 8);
+        in.GetBits(flag, 8);
         switch(flag)
         {
             case 0: //literal x1
                 
-                bm.GetBits(byte, 8); //get byte
+                in.GetBits(byte, 8); //get byte
                 decoded_bytes++;
                 break;
             case 1: //match
             {
                 
-                bm.GetBits(best_pos, s->bit_size_id);
-                best_pos += block*s->max_no_vec_in_block; //threads!
+                in.GetBits(best_pos, s->bit_size_id);
+                best_pos += block_id*s->max_no_vec_in_block;
     
                 best_pos = vec_id - (best_pos \
                                      - rank_copy_bit_vector[0](best_pos/2+(best_pos%2)) - rank_copy_bit_vector[1](best_pos/2)  \
                                      - rank_zeros_only_vector[0](best_pos/2+(best_pos%2)) - rank_zeros_only_vector[1](best_pos/2));
                 best_pos -= 1;
                 
-                hist_match_diff_MSB[(best_pos >> (s->bit_size_id_match_pos_diff - MATCH_BITS_HUF)) & bm.n_bit_mask[MATCH_BITS_HUF]]++;
+                ms.hist_match_diff_MSB[(best_pos >> (s->bit_size_id_match_pos_diff - MATCH_BITS_HUF)) & in.n_bit_mask[MATCH_BITS_HUF]]++;
                 
-                bm.GetBits(best_match_len, s->bit_size_match_len);
+                in.GetBits(best_match_len, s->bit_size_match_len);
                 decoded_bytes += best_match_len;
                 break;
             }
             case 2: //match same
             {
-                bm.GetBits(best_match_len, s->bit_size_match_len);
+                in.GetBits(best_match_len, s->bit_size_match_len);
                 decoded_bytes += best_match_len;
                 break;
             }
             case 3: //zero run
             {
-                bm.GetBits(zero_run_len, s->bit_size_run_len);
+                in.GetBits(zero_run_len, s->bit_size_run_len);
                 for(int p = 0; p < (int) zero_run_len; p++)
                 {
                     if(decoded_bytes < s->vec_len)
@@ -480,7 +688,7 @@ void EndCompressor::getLitRunSizes(uint64_t vec_id)
             }
             case 4: //one run
             {
-                bm.GetBits(ones_run_len, s->bit_size_run_len);
+                in.GetBits(ones_run_len, s->bit_size_run_len);
                 for(int p = 0; p < (int) ones_run_len; p++)
                 {
                     if(decoded_bytes < s->vec_len)
@@ -499,15 +707,13 @@ void EndCompressor::getLitRunSizes(uint64_t vec_id)
                 uint32_t lit_run_size = 0;
                 for(int i = 0; i < (int) flag; i++)
                 {
-                    bm.GetBits(byte, 8); //get byte
+                    in.GetBits(byte, 8); //get byte
                     decoded_bytes++;
                     lit_run_size += huf_literals[ones_group].codes[byte].len;
                     
                 }
-                // Remember literals description size (in bits)
-                litRunSize[literalRunCount++] = lit_run_size;
-                if(lit_run_size < minLitRunSize[ones_group][flag])
-                    minLitRunSize[ones_group][flag] = lit_run_size;
+                if(lit_run_size < ms.minLitRunSize[ones_group * (MAX_LITERAL_RUN+4) + flag])
+                    ms.minLitRunSize[ones_group * (MAX_LITERAL_RUN+4) + flag] = lit_run_size;
                 
                 break;
             }
@@ -515,9 +721,9 @@ void EndCompressor::getLitRunSizes(uint64_t vec_id)
     }
 }
 
-void EndCompressor::decreaseLitRunSizesbyMin(uint64_t unique_no)
+void EndCompressor::decreaseLitRunSizesbyMin(CBitMemory &in, uint32_t block_id, model_stats_t &ms)
 {
-    for(uint64_t cur_vec_id = 0; cur_vec_id < unique_no; ++cur_vec_id)
+    for(uint64_t cur_vec_id = 0; cur_vec_id < unique_in_block[block_id]; ++cur_vec_id)
     {
         uint32_t decoded_bytes;
         uint32_t zero_run_len, ones_run_len;
@@ -526,36 +732,36 @@ void EndCompressor::decreaseLitRunSizesbyMin(uint64_t unique_no)
         uint32_t  byte, flag;
         uint32_t ones_group;
         
-        bm.FlushInputWordBuffer();
-        bm.GetBits(ones_group, s->bit_size_ones_goup);
+        in.FlushInputWordBuffer();
+        in.GetBits(ones_group, s->bit_size_ones_goup);
         decoded_bytes = 0;
         while(decoded_bytes < s->vec_len)
         {
-            bm.GetBits(flag, 8);
+            in.GetBits(flag, 8);
             switch(flag)
             {
                 case 0: //literal x1
                 {
-                    bm.GetBits(byte, 8); //get byte
+                    in.GetBits(byte, 8); //get byte
                     decoded_bytes++;
                     break;
                 }
                 case 1: //match
                 {
-                    bm.GetBits(best_pos, s->bit_size_id);
-                    bm.GetBits(best_match_len, s->bit_size_match_len);
+                    in.GetBits(best_pos, s->bit_size_id);
+                    in.GetBits(best_match_len, s->bit_size_match_len);
                     decoded_bytes += best_match_len;
                     break;
                 }
                 case 2: //match same
                 {
-                    bm.GetBits(best_match_len, s->bit_size_match_len);
+                    in.GetBits(best_match_len, s->bit_size_match_len);
                     decoded_bytes += best_match_len;
                     break;
                 }
                 case 3: //zero run
                 {
-                    bm.GetBits(zero_run_len, s->bit_size_run_len);
+                    in.GetBits(zero_run_len, s->bit_size_run_len);
                     for(int p = 0; p < (int) zero_run_len; p++)
                     {
                         if(decoded_bytes < s->vec_len)
@@ -569,7 +775,7 @@ void EndCompressor::decreaseLitRunSizesbyMin(uint64_t unique_no)
                 }
                 case 4: //one run
                 {
-                    bm.GetBits(ones_run_len, s->bit_size_run_len);
+                    in.GetBits(ones_run_len, s->bit_size_run_len);
                     for(int p = 0; p < (int) ones_run_len; p++) 
                     {
                         if(decoded_bytes < s->vec_len)
@@ -585,20 +791,20 @@ void EndCompressor::decreaseLitRunSizesbyMin(uint64_t unique_no)
                 {
                     flag = flag - 3; // Shift by 3, to be able to difference between 2, 3 and 4 flags nad literal run of 2, 3 or 4
                     // Count literal run size (in bits)
+                    uint32_t lit_run_size = 0;
                     for(int i = 0; i < (int) flag; i++)
                     {
-                        bm.GetBits(byte, 8); //get byte
+                        in.GetBits(byte, 8); //get byte
                         decoded_bytes++;
+                        lit_run_size += huf_literals[ones_group].codes[byte].len;
                     }
-                    // Remember literals description size (in bits)
-                    litRunSize[literalRunCount] = litRunSize[literalRunCount] -  minLitRunSize[ones_group][flag] + 1; //so it is never == 0
+                    lit_run_size = lit_run_size -  minLitRunSize[ones_group][flag] + 1; //so it is never == 0
                 
                     // Stats
-                    if(litRunSize[literalRunCount] > litRunSizeMax[ones_group])
-                        litRunSizeMax[ones_group]  = litRunSize[literalRunCount];
+                    if(lit_run_size > ms.litRunSizeMax[ones_group])
+                        ms.litRunSizeMax[ones_group]  = lit_run_size;
                     
-                    hist_litRunSize_usedBits[ones_group][(int) bits_used(litRunSize[literalRunCount])]++;
-                    literalRunCount++;
+                    ms.hist_litRunSize_usedBits[ones_group * 32 + (int) bits_used(lit_run_size)]++;
                     break;
                 }
             }
@@ -616,49 +822,71 @@ char EndCompressor::bits_used(unsigned int n)
     return bits;
 }
 
-int EndCompressor::storeArchive(const char * arch_name)
+// Checksum of all bytes of the archive (key of decoded blocks in the cache of the decompressor)
+// The archive is read back once, the checksum and ARCH_MAGIC_CHECKSUM are appended at its end
+void EndCompressor::storeChecksum(const char * fname)
 {
-    char *fname = (char*) malloc(strlen(arch_name)+5);
-    snprintf(fname, strlen(arch_name)+5,"%s.gtc", arch_name);
- 
-    sdsl::osfstream out(fname, std::ios::binary | std::ios::trunc | std::ios::out);
-    if (!out) {
-        if (sdsl::util::verbose) {
-            std::cerr<<"ERROR: store_to_file not successful for: `" << fname << "`" << std::endl;
-        }
+    FILE * f = fopen(fname, "r+b");
+    if(!f)
+    {
+        std::cerr<<"ERROR: storing archive not successful for: `"<<fname<<"`"<<std::endl;
         exit(1);
     }
-    sdsl::rrr_vector<> rrr_bit_vector[5];
-
-    for(int v = 0; v < 2; v++)
+    
+    const size_t chunk_size = 1 << 24;
+    vector<uchar> chunk(chunk_size + 8);
+    uint64_t h = 0xcbf29ce484222325ull, size = 0, w;
+    size_t n;
+    
+    while((n = fread(chunk.data(), 1, chunk_size, f)) > 0)
     {
-        rrr_bit_vector[v] = sdsl::rrr_vector<>(zeros_only_bit_vector[v]);
-        rrr_bit_vector[v].serialize(out);
-        sdsl::util::clear(rrr_bit_vector[v]);
-        
+        fill_n(chunk.data() + n, 8, 0);
+        for(size_t i = 0; i < n; i += 8)
+        {
+            memcpy(&w, chunk.data() + i, 8);
+            h = ((h << 27 | h >> 37) ^ w) * 0x9e3779b97f4a7c15ull;
+        }
+        size += n;
     }
-    for(int v = 0; v < 2; v++)
+    h = ((h << 27 | h >> 37) ^ size) * 0x9e3779b97f4a7c15ull;
+    if(!h)
+        h = 1;  // 0 means no checksum
+    
+    fseek(f, 0, SEEK_END);
+    if(fwrite(&h, sizeof(uint64_t), 1, f) != 1 || fwrite(&ARCH_MAGIC_CHECKSUM, sizeof(uint64_t), 1, f) != 1 || fclose(f) != 0)
     {
-        rrr_bit_vector[v+2] = sdsl::rrr_vector<>(copy_bit_vector[v]);
-        rrr_bit_vector[v+2].serialize(out);
-        sdsl::util::clear(rrr_bit_vector[v+2]);
-        
-    }
-    out.close();
-    if (sdsl::util::verbose) {
-        std::cerr<<"INFO: store_to_file: `"<<fname<<"`"<<std::endl;
+        std::cerr<<"ERROR: storing archive not successful for: `"<<fname<<"`"<<std::endl;
+        exit(1);
     }
+}
 
-    FILE * comp  = fopen(fname, "ab");
+int EndCompressor::storeArchive(const char * arch_name)
+{
+    char *fname = (char*) malloc(strlen(arch_name)+5);
+    snprintf(fname, strlen(arch_name)+5,"%s.gtc", arch_name);
+ 
+    FILE * comp  = fopen(fname, "wb");
     if (!comp) {
         
         std::cerr<<"ERROR: storing archive not successful for: `"<<fname<<"`"<<std::endl;
         exit(1);
     }
-    free(fname);
     
-    fwrite(&s->ones_ranges, sizeof(uchar), 1, comp);
-    fwrite(&s->ploidy, sizeof(uchar), 1, comp);
+    // Bit vectors with rank samples, used in place by the decompressor
+    fwrite(&ARCH_MAGIC_RANK_BV, sizeof(uint64_t), 1, comp);
+    for(int v = 0; v < 2; v++)
+        CRankBitVector::Store(zeros_only_bit_vector[v], comp);
+    for(int v = 0; v < 2; v++)
+        CRankBitVector::Store(copy_bit_vector[v], comp);
+    
+    uchar ones_ranges_flags = (uchar) s->ones_ranges;
+    if(s->perm_warm_start)
+        ones_ranges_flags |= ARCH_FLAG_PERM_DIFF;
+    if(s->ac_index)
+        ones_ranges_flags |= ARCH_FLAG_AC_INDEX;
+    uchar ploidy = (uchar) s->ploidy;
+    fwrite(&ones_ranges_flags, sizeof(uchar), 1, comp);
+    fwrite(&ploidy, sizeof(uchar), 1, comp);
     fwrite(&s->vec_len, sizeof(s->vec_len), 1, comp);
     
     uchar * mem = nullptr;
@@ -753,33 +981,46 @@ int EndCompressor::storeArchive(const char * arch_name)
     fwrite(&bm_comp_pos.mem_buffer_pos, sizeof(bm_comp_pos.mem_buffer_pos), 1, comp);
     fwrite(bm_comp_pos.mem_buffer, 1, bm_comp_pos.mem_buffer_pos, comp);
     
-    // Permutations
-    CBitMemory bv_perm;
-    uint32_t bitsize_perm = bits_used(s->n_samples*s->ploidy);
-    bv_perm.Create(((bitsize_perm*s->n_samples*s->ploidy)/8 + 1)* no_blocks);
-    
+    // Permutations (packed when blocks were added)
     fwrite(&no_blocks, sizeof(no_blocks), 1, comp);
     fwrite(&s->max_no_vec_in_block, sizeof(s->max_no_vec_in_block), 1, comp);
     fwrite(&s->n_samples, sizeof(s->n_samples), 1, comp);
+    if(s->perm_warm_start)
+        fwrite(block_perm_pos.data(), sizeof(uint64_t), no_blocks, comp);
+    
+    fwrite(&bm_perms.mem_buffer_pos, 1, sizeof(bm_perms.mem_buffer_pos), comp);
+    fwrite(bm_perms.mem_buffer, 1, bm_perms.mem_buffer_pos, comp);
+    
+    // AC/AN of variants with the range of AC in blocks
+    if(s->ac_index)
+    {
+        fwrite(block_ac_min.data(), sizeof(uint32_t), no_blocks, comp);
+        fwrite(block_ac_max.data(), sizeof(uint32_t), no_blocks, comp);
+        fwrite(variant_ac.data(), 1, variant_ac.size(), comp);
+    }
     
+    // Core (vector witch gt data), copied block by block from the spill file
+    vector<uchar> buf;
     for(uint32_t b = 0; b < no_blocks; ++b)
-    {    for(uint32_t i = 0; i < s->n_samples*s->ploidy; ++i)
-        {
-            bv_perm.PutBits(perms[b][i], bitsize_perm);
-            
-        }
-        bv_perm.FlushPartialWordBuffer();
+    {
+        buf.resize(block_huff_size[b]);
+        spillRead(buf.data(), block_huff_size[b], block_huff_pos[b]);
+        fwrite(buf.data(), 1, block_huff_size[b], comp);
     }
-    fwrite(&bv_perm.mem_buffer_pos, 1, sizeof(bv_perm.mem_buffer_pos), comp);
-    fwrite(bv_perm.mem_buffer, 1, bv_perm.mem_buffer_pos, comp);
     
-    // Core (vector witch gt data)
-    fwrite(bm_huff.mem_buffer, 1, bm_huff.mem_buffer_pos, comp);
+    CBitMemory bm_padding;
+    bm_padding.Create(4);
+    bm_padding.PutBits(0, MAX_HUF_LUT_LEN); // Padding, so SpeedupLUT for Huffman can work nice at the end
+    bm_padding.FlushPartialWordBuffer();
+    fwrite(bm_padding.mem_buffer, 1, bm_padding.mem_buffer_pos, comp);
     
     fclose(comp);
+    storeChecksum(fname);
+    free(fname);
     no_vec= 0;
-    bm_huff.Close();
-    bm.Close();
+    close(spill_fd);
+    spill_fd = -1;
+    bm_perms.Close();
     bm_comp_pos.Close();
     bm_comp_copy_orgl_id.Close();
     for (int o_g = 0; o_g < (int) s->ones_ranges; o_g++)
@@ -794,15 +1035,10 @@ int EndCompressor::storeArchive(const char * arch_name)
 
 void EndCompressor::calcModel()
 {
-    uint32_t comp_no_matches = 0;
-    uint32_t comp_no_literals = 0;
-    uint32_t comp_zero_run = 0;
-    uint32_t comp_ones_run = 0;
     uint32_t n_copies = 0;
-    uint32_t same_vec_match = 0;
-    uint32_t comp_no_literals_in_run = 0;
     
     uint64_t i = 0, zeros_no  = 0;
+    unique = sdsl::bit_vector(no_vec, 0);
     for ( i = 0; i < no_vec; i++)
     {
         if(zeros_only_bit_vector[i % 2][i / 2])
@@ -857,71 +1093,115 @@ void EndCompressor::calcModel()
     }
     
     hist_group_type = new uint64_t[s->ones_ranges]();
+    
+    // Gather histograms for each block separately and merge them
+    uint32_t run_size = 1 << s->bit_size_run_len, match_size = 1 << s->bit_size_match_len;
+    vector<model_stats_t> stats(n_workers, model_stats_t(s->ones_ranges, run_size, match_size));
+    processBlocks([&](uint32_t thread_id, uint32_t block_id) {
+        CBitMemory in;
+        openBlock(in, thread_id, block_id);
+        calcBlockModel(in, block_id, stats[thread_id]);
+    });
+    
+    model_stats_t total(0, 0, 0);
+    for(auto &ms : stats)
+    {
+        for(int o = 0; o < (int) s->ones_ranges; o++)
+        {
+            hist_group_type[o] += ms.hist_group_type[o];
+            for(uint32_t j = 0; j < 256; j++)
+                hist_literals[o][j] += ms.hist_literals[o * 256 + j];
+            for(uint32_t j = 0; j < run_size; j++)
+            {
+                hist_zero_runs[o][j] += ms.hist_zero_runs[o * run_size + j];
+                hist_ones_runs[o][j] += ms.hist_ones_runs[o * run_size + j];
+            }
+            for(uint32_t j = 0; j < match_size; j++)
+                hist_match_lens[o][j] += ms.hist_match_lens[o * match_size + j];
+        }
+        for(uint32_t j = 0; j < MAX_LITERAL_RUN+4; j++)
+            hist_flags[j] += ms.hist_flags[j];
+        
+        total.no_matches += ms.no_matches;
+        total.no_literals += ms.no_literals;
+        total.no_zero_runs += ms.no_zero_runs;
+        total.no_ones_runs += ms.no_ones_runs;
+        total.no_same_vec_matches += ms.no_same_vec_matches;
+        total.no_literals_in_runs += ms.no_literals_in_runs;
+        literalRunCount += ms.no_lit_runs;
+    }
+    
+    cout << "\nStats:\nno_vec:\t" <<  no_vec  << "\nno_unique:\t " <<  unique_no  << "\nno_zero_vectors:\t" <<  zeros_no << "\nno_copies:\t " <<  n_copies << "\nno_zero_runs:\t" <<   total.no_zero_runs << "\nno_ones_runs:\t" <<   total.no_ones_runs<< "\nno_matches:\t"<<  total.no_matches << "\nno_same_vec_match\t" <<    total.no_same_vec_matches << "\nno_literals(all):\t" <<     total.no_literals<<  "\nno_lit_runs:\t" << literalRunCount << "\nno_literals_in_runs:\t" << total.no_literals_in_runs <<   endl <<   endl;
+}
+
+// Histograms of a single block
+void EndCompressor::calcBlockModel(CBitMemory &in, uint32_t block_id, model_stats_t &ms)
+{
     uint32_t decoded_bytes;
     uint32_t ones_group, flag, best_match_len, best_pos, literal, zero_run_len, ones_run_len;
-    bm.Restart();
-    for(uint64_t i = 0; i < unique_no; i++)
+    uint32_t run_size = 1 << s->bit_size_run_len, match_size = 1 << s->bit_size_match_len;
+    for(uint64_t i = 0; i < unique_in_block[block_id]; i++)
     {
-        bm.FlushInputWordBuffer();
-        bm.GetBits(ones_group, s->bit_size_ones_goup);
-        hist_group_type[ones_group]++;
+        in.FlushInputWordBuffer();
+        in.GetBits(ones_group, s->bit_size_ones_goup);
+        ms.hist_group_type[ones_group]++;
         decoded_bytes = 0;
         while(decoded_bytes < s->vec_len)
         {
-            bm.GetBits(flag, 8);
-            hist_flags[flag]++;
+            in.GetBits(flag, 8);
+            ms.hist_flags[flag]++;
             switch(flag)
             {
                 case 0: //literal
                 {
-                    comp_no_literals++;
-                    bm.GetBits(literal, 8);
-                    hist_literals[ones_group][literal]++;
+                    ms.no_literals++;
+                    in.GetBits(literal, 8);
+                    ms.hist_literals[ones_group * 256 + literal]++;
                     decoded_bytes++;
                     break;
                 }
                 case 1: //match
                 {
-                    comp_no_matches++;
-                    bm.GetBits(best_pos, s->bit_size_id);
-                    bm.GetBits(best_match_len, s->bit_size_match_len);
-                    hist_match_lens[ones_group][best_match_len]++;
+                    ms.no_matches++;
+                    in.GetBits(best_pos, s->bit_size_id);
+                    in.GetBits(best_match_len, s->bit_size_match_len);
+                    ms.hist_match_lens[ones_group * match_size + best_match_len]++;
                     decoded_bytes += best_match_len;
                     break;
                 }
                 case 2: //match same
                 {
-                    same_vec_match++;
-                    bm.GetBits(best_match_len, s->bit_size_match_len);
-                    hist_match_lens[ones_group][best_match_len]++;
+                    ms.no_same_vec_matches++;
+                    in.GetBits(best_match_len, s->bit_size_match_len);
+                    ms.hist_match_lens[ones_group * match_size + best_match_len]++;
                     decoded_bytes += best_match_len;
                     break;
                 }
                 case 3:  //zero run
                 {
-                    comp_zero_run++;
-                    bm.GetBits(zero_run_len, s->bit_size_run_len);
-                    hist_zero_runs[ones_group][zero_run_len]++;
+                    ms.no_zero_runs++;
+                    in.GetBits(zero_run_len, s->bit_size_run_len);
+                    ms.hist_zero_runs[ones_group * run_size + zero_run_len]++;
                     decoded_bytes += zero_run_len;
                     break;
                 }
                 case 4:  //ones run
                 {
-                    comp_ones_run++;
-                    bm.GetBits(ones_run_len, s->bit_size_run_len);
-                    hist_ones_runs[ones_group][ones_run_len]++;
+                    ms.no_ones_runs++;
+                    in.GetBits(ones_run_len, s->bit_size_run_len);
+                    ms.hist_ones_runs[ones_group * run_size + ones_run_len]++;
                     decoded_bytes += ones_run_len;
                     break;
                 }
                 default: //5 +, literal run
                 {
-                    comp_no_literals += flag-3;
-                    comp_no_literals_in_run += flag-3;
-                    literalRunCount++;
+                    ms.no_literals += flag-3;
+                    ms.no_literals_in_runs += flag-3;
+                    ms.no_lit_runs++;
                     for(int l = 0; l < (int) flag-3; l++)
                     {
-                        bm.GetBits(literal, 8);
-                        hist_literals[ones_group][literal]++;
+                        in.GetBits(literal, 8);
+                        ms.hist_literals[ones_group * 256 + literal]++;
                     }
                     decoded_bytes += (flag-3);
                     break;
@@ -929,6 +1209,4 @@ void EndCompressor::calcModel()
             }
         }
     }
-    
-    cout << "\nStats:\nno_vec:\t" <<  no_vec  << "\nno_unique:\t " <<  unique_no  << "\nno_zero_vectors:\t" <<  zeros_no << "\nno_copies:\t " <<  n_copies << "\nno_zero_runs:\t" <<   comp_zero_run << "\nno_ones_runs:\t" <<   comp_ones_run<< "\nno_matches:\t"<<  comp_no_matches << "\nno_same_vec_match\t" <<    same_vec_match << "\nno_literals(all):\t" <<     comp_no_literals<<  "\nno_lit_runs:\t" << literalRunCount << "\nno_literals_in_runs:\t" << comp_no_literals_in_run <<   endl <<   endl;
 }
@@ -12,6 +12,10 @@
 
 #include <iostream>
 #include <vector>
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <unistd.h>
 #include "params.h"
 #include "defs.h"
 #include "compression_settings.h"
@@ -27,10 +31,33 @@
 //#include <cpp-mmf/memory_mapped_file.hpp>
 //#endif
 
+// Statistics gathered by a single thread over the blocks it processed; merged after all threads finish
+typedef struct model_stats_tag {
+    vector<uint64_t> hist_group_type;
+    vector<uint64_t> hist_flags;
+    vector<uint64_t> hist_literals;         // [ones_group * 256 + literal]
+    vector<uint64_t> hist_zero_runs;        // [ones_group * run_size + run_len]
+    vector<uint64_t> hist_ones_runs;
+    vector<uint64_t> hist_match_lens;       // [ones_group * match_size + match_len]
+    vector<uint64_t> hist_match_diff_MSB;
+    vector<uint32_t> minLitRunSize;         // [ones_group * (MAX_LITERAL_RUN+4) + flag]
+    vector<uint32_t> litRunSizeMax;
+    vector<uint32_t> hist_litRunSize_usedBits;  // [ones_group * 32 + bits]
+    
+    uint64_t no_matches = 0, no_literals = 0, no_zero_runs = 0, no_ones_runs = 0, no_same_vec_matches = 0, no_literals_in_runs = 0, no_lit_runs = 0;
+    
+    model_stats_tag(uint32_t ones_ranges, uint32_t run_size, uint32_t match_size) :
+        hist_group_type(ones_ranges, 0), hist_flags(MAX_LITERAL_RUN+4, 0), hist_literals(ones_ranges * 256, 0),
+        hist_zero_runs(ones_ranges * run_size, 0), hist_ones_runs(ones_ranges * run_size, 0), hist_match_lens(ones_ranges * match_size, 0),
+        hist_match_diff_MSB(1 << MATCH_BITS_HUF, 0), minLitRunSize(ones_ranges * (MAX_LITERAL_RUN+4), INT32_MAX),
+        litRunSizeMax(ones_ranges, 0), hist_litRunSize_usedBits(ones_ranges * 32, 0)
+    {}
+} model_stats_t;
+
 class EndCompressor{
     
     CompSettings * s = nullptr;
-    uint64_t no_vec, curr_vec_id = 0;
+    uint64_t no_vec = 0, curr_vec_id = 0;
     sdsl::bit_vector zeros_only_bit_vector[2];
     sdsl::bit_vector copy_bit_vector[2];
     sdsl::bit_vector unique;
@@ -38,15 +65,13 @@ class EndCompressor{
     sdsl::rank_support_v5<> rank_zeros_only_vector[2];
     sdsl::rank_support_v5<> rank_copy_bit_vector[2];
     
-    uint32_t curr_pos = 0;
     uint64_t copy_no = 0, unique_no = 0;
     vector<uint64_t> unique_in_block;
     
-    uint32_t * comp_pos_non_copy;
-    uint32_t * comp_pos_copy;
+    vector<uint32_t> comp_pos_non_copy;
+    vector<uint32_t> comp_pos_copy;
     
-    CBitMemory bm;  //initial
-    CBitMemory bm_huff;
+    CBitMemory bm_perms;
     CBitMemory bm_comp_pos;
     CBitMemory bm_comp_copy_orgl_id;
     
@@ -71,8 +96,7 @@ class EndCompressor{
     uint32_t hist_litRunSize_usedBits[MAX_NUMBER_OF_GROUP][32]= { {0} };
    // uint32_t hist_litRunSize[MAX_NUMBER_OF_GROUP][2048]= { {0} };
    
-    uint32_t literalRunCount = 0;
-    uint16_t * litRunSize = NULL;
+    uint64_t literalRunCount = 0;
     uint32_t minLitRunSize[MAX_NUMBER_OF_GROUP][MAX_LITERAL_RUN+4]; //shift by 3, to be able to differentiate between 2, 3 and 4 flags nad literal run of 2, 3 or 4
     uint32_t  max_used_bits_litRunSize[MAX_NUMBER_OF_GROUP], used_bits_litRunSize[MAX_NUMBER_OF_GROUP] ;    uint32_t litRunSizeMax[MAX_NUMBER_OF_GROUP] = { 0 };
 
@@ -80,18 +104,48 @@ class EndCompressor{
     uint32_t  used_bits_noncp;
      uint32_t max_pos_diff = 0;
     uint32_t  no_blocks = 0;
-    uint32_t block = 0;
+    uint32_t n_threads = 1;
+    uint32_t n_workers = 1;
+    
+    uint32_t bitsize_perm = 0;
+    vector<uint64_t> block_perm_pos;        // byte position of the permutation of the block (warm start)
+    vector<int> prev_tour;                  // haplotypes at positions of the previous block (warm start)
+    
+    // AC and AN of variants (s->ac_bytes() bytes each) and the range of AC in each block
+    vector<uchar> variant_ac;
+    vector<uint32_t> block_ac_min;
+    vector<uint32_t> block_ac_max;
+    
+    // Initial streams of blocks and (later) their Huffman encoded streams are spilled to a temporary file,
+    // so only the blocks being processed by threads are kept in memory
+    string spill_name;
+    int spill_fd = -1;
+    atomic<uint64_t> spill_size;
+    vector<uint64_t> block_spill_pos;       // initial stream of the block
+    vector<uint64_t> block_spill_size;
+    vector<uint64_t> block_huff_pos;        // Huffman encoded stream of the block
+    vector<uint64_t> block_huff_size;
+    vector<uint64_t> block_first_unique;    // id of the first unique vector of the block
+    vector<vector<uchar>> thread_buffers;
+    
+    void storePermDiff(uint32_t block_id, const vector<int> &perm);
     
-    std::vector< std::vector<int> > perms;
+    void spillWrite(const uchar * data, uint64_t size, uint64_t pos);
+    void spillRead(uchar * data, uint64_t size, uint64_t pos);
     
-    void encode_vec(uint64_t vec_id);
+    void processBlocks(const function<void(uint32_t, uint32_t)> &func);
+    void openBlock(CBitMemory &in, uint32_t thread_id, uint32_t block_id);
+    
+    void encode_vec(CBitMemory &in, CBitMemory &out, uint64_t vec_id, uint32_t block_id);
     
     char bits_used(unsigned int n) ;
     
     void calcModel();
+    void calcBlockModel(CBitMemory &in, uint32_t block_id, model_stats_t &ms);
     
-    void getLitRunSizes(uint64_t vec_id);
-    void decreaseLitRunSizesbyMin(uint64_t unique_no);
+    void getLitRunSizes(CBitMemory &in, uint64_t vec_id, uint32_t block_id, model_stats_t &ms);
+    void decreaseLitRunSizesbyMin(CBitMemory &in, uint32_t block_id, model_stats_t &ms);
+    void storeChecksum(const char * fname);
     
 public:
     int storeArchive(const char * arch_name);
@@ -151,8 +205,8 @@ public:
 //            delete [] buf;
 //#endif
         
-        if(litRunSize)
-            delete [] litRunSize;
+        if(spill_fd >= 0)
+            close(spill_fd);
         
         if(huf_literals)
             delete [] huf_literals;
@@ -169,32 +223,23 @@ public:
         huf_match_diff_MSB.Restart();
     }
     
-    EndCompressor(CompSettings * _settings, uint64_t _no_vec)
+    EndCompressor(CompSettings * _settings, uint32_t _n_threads, const string &_spill_name)
     {
         s = _settings;
-        no_vec = _no_vec;
-        zeros_only_bit_vector[0] = sdsl::bit_vector(no_vec/2+no_vec%2, 0);
-        zeros_only_bit_vector[1] = sdsl::bit_vector(no_vec/2+no_vec%2, 0);
-        copy_bit_vector[0] = sdsl::bit_vector(no_vec/2+no_vec%2, 0);
-        copy_bit_vector[1] = sdsl::bit_vector(no_vec/2+no_vec%2, 0);
+        n_threads = _n_threads ? _n_threads : 1;
+        spill_name = _spill_name;
+        spill_size = 0;
         
         curr_vec_id = 0;
-        curr_pos = 0;
         copy_no = 0;
         unique_no = 0;
         no_blocks = 0;
-
-        
-        comp_pos_non_copy = new uint32_t[no_vec]();
-        comp_pos_copy = new uint32_t[no_vec]();
-        
-        bm.Create((no_vec*s->n_samples*s->ploidy/8)/10);
-        
-        unique = sdsl::bit_vector(no_vec, 0);
         
-        perms.clear();
+        bitsize_perm = bits_used(s->n_samples*s->ploidy);
+        bm_perms.Create((bitsize_perm*s->n_samples*s->ploidy)/8 + 1);
     }
-    void AddBlock(int &id_block, unsigned char *compressed_block, size_t n_recs, size_t compressed_size, std::vector<int> &perm, std::vector<bool> &zeros, std::vector<bool> &copies, uint32_t * origin_of_copy);
+    // Blocks must be added in order of their ids; may be called while remaining blocks are still being compressed
+    void AddBlock(int &id_block, unsigned char *compressed_block, size_t n_recs, size_t compressed_size, std::vector<int> &perm, std::vector<bool> &zeros, std::vector<bool> &copies, uint32_t * origin_of_copy, std::vector<uint32_t> &ac_an);
     void Encode();
     
 };
@@ -0,0 +1,169 @@
+/*
+ This file is a part of GTC software distributed under GNU GPL 3 licence.
+ 
+ Authors: Agnieszka Danek and Sebastian Deorowicz
+ 
+ Version: 1
+ Date   : 2017-April
+ */
+#include "gt_expand.h"
+#include <cstring>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define GT_EXPAND_DISPATCH
+#endif
+
+// GT values of 4 haplotypes for pairs of nibbles of both vectors
+static char gt_lut[16][16][4];
+
+// ************************************************************************************
+// Scalar version, lookup of pairs of nibbles
+static void gt_expand_lut(const uchar_t *v1, const uchar_t *v2, size_t n_bytes, char *out)
+{
+    for(size_t i = 0; i < n_bytes; ++i, out += 8)
+    {
+        memcpy(out, gt_lut[v1[i] >> 4][v2[i] >> 4], 4);
+        memcpy(out + 4, gt_lut[v1[i] & 0xF][v2[i] & 0xF], 4);
+    }
+}
+
+#ifdef GT_EXPAND_DISPATCH
+// ************************************************************************************
+// SSSE3 version: bits of 2 bytes spread to 16 bytes (pshufb), tested with masks, and GT values taken from a 4-entry table (pshufb)
+__attribute__((target("ssse3")))
+static void gt_expand_ssse3(const uchar_t *v1, const uchar_t *v2, size_t n_bytes, char *out)
+{
+    const __m128i spread = _mm_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1);
+    const __m128i bits = _mm_set1_epi64x((long long) 0x0102040810204080ull);
+    const __m128i values = _mm_setr_epi8(bcf_gt_phased(0), bcf_gt_phased(1), bcf_gt_missing, bcf_gt_phased(2), 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m128i two = _mm_set1_epi8(2);
+    const __m128i one = _mm_set1_epi8(1);
+    size_t i = 0;
+
+    for(; i + 2 <= n_bytes; i += 2, out += 16)
+    {
+        uint16_t w1, w2;
+        memcpy(&w1, v1 + i, 2);
+        memcpy(&w2, v2 + i, 2);
+
+        __m128i a = _mm_shuffle_epi8(_mm_cvtsi32_si128(w1), spread);
+        __m128i b = _mm_shuffle_epi8(_mm_cvtsi32_si128(w2), spread);
+        a = _mm_cmpeq_epi8(_mm_and_si128(a, bits), bits);
+        b = _mm_cmpeq_epi8(_mm_and_si128(b, bits), bits);
+
+        __m128i idx = _mm_or_si128(_mm_and_si128(a, two), _mm_and_si128(b, one));
+        _mm_storeu_si128((__m128i *) out, _mm_shuffle_epi8(values, idx));
+    }
+    if(i < n_bytes)
+        gt_expand_bits(v1[i], v2[i], 8, out);
+}
+
+// ************************************************************************************
+// AVX2 version: as SSSE3, but 4 bytes of each vector per iteration
+__attribute__((target("avx2")))
+static void gt_expand_avx2(const uchar_t *v1, const uchar_t *v2, size_t n_bytes, char *out)
+{
+    const __m256i spread = _mm256_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1,
+                                            2, 2, 2, 2, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 3);
+    const __m256i bits = _mm256_set1_epi64x((long long) 0x0102040810204080ull);
+    const __m256i values = _mm256_setr_epi8(bcf_gt_phased(0), bcf_gt_phased(1), bcf_gt_missing, bcf_gt_phased(2), 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+                                            bcf_gt_phased(0), bcf_gt_phased(1), bcf_gt_missing, bcf_gt_phased(2), 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m256i two = _mm256_set1_epi8(2);
+    const __m256i one = _mm256_set1_epi8(1);
+    size_t i = 0;
+
+    for(; i + 4 <= n_bytes; i += 4, out += 32)
+    {
+        int32_t w1, w2;
+        memcpy(&w1, v1 + i, 4);
+        memcpy(&w2, v2 + i, 4);
+
+        // Each 128-bit lane holds all 4 bytes, so the in-lane shuffle can take bytes 2 and 3 in the upper lane
+        __m256i a = _mm256_shuffle_epi8(_mm256_set1_epi32(w1), spread);
+        __m256i b = _mm256_shuffle_epi8(_mm256_set1_epi32(w2), spread);
+        a = _mm256_cmpeq_epi8(_mm256_and_si256(a, bits), bits);
+        b = _mm256_cmpeq_epi8(_mm256_and_si256(b, bits), bits);
+
+        __m256i idx = _mm256_or_si256(_mm256_and_si256(a, two), _mm256_and_si256(b, one));
+        _mm256_storeu_si256((__m256i *) out, _mm256_shuffle_epi8(values, idx));
+    }
+    for(; i < n_bytes; ++i, out += 8)
+        gt_expand_bits(v1[i], v2[i], 8, out);
+}
+#endif
+
+// ************************************************************************************
+// Counting of haplotypes; the same code is compiled with the POPCNT instruction and with the portable popcount
+__attribute__((always_inline))
+static inline void gt_count_words(const uchar_t *v1, const uchar_t *v2, const uchar_t *mask, size_t n_bytes, uint32_t &n_allele_1, uint32_t &n_missing)
+{
+    uint64_t w1, w2, m = ~0ull;
+    size_t i = 0;
+    
+    n_allele_1 = 0;
+    n_missing = 0;
+    for(; i + 8 <= n_bytes; i += 8)
+    {
+        memcpy(&w1, v1 + i, 8);
+        memcpy(&w2, v2 + i, 8);
+        if(mask)
+            memcpy(&m, mask + i, 8);
+        n_allele_1 += (uint32_t) __builtin_popcountll(w2 & ~w1 & m);
+        n_missing += (uint32_t) __builtin_popcountll(w1 & ~w2 & m);
+    }
+    for(; i < n_bytes; ++i)
+    {
+        uint32_t mb = mask ? mask[i] : 0xFF;
+        n_allele_1 += (uint32_t) __builtin_popcount(v2[i] & ~v1[i] & mb);
+        n_missing += (uint32_t) __builtin_popcount(v1[i] & ~v2[i] & mb);
+    }
+}
+
+static void gt_count_generic(const uchar_t *v1, const uchar_t *v2, const uchar_t *mask, size_t n_bytes, uint32_t &n_allele_1, uint32_t &n_missing)
+{
+    gt_count_words(v1, v2, mask, n_bytes, n_allele_1, n_missing);
+}
+
+#ifdef GT_EXPAND_DISPATCH
+__attribute__((target("popcnt")))
+static void gt_count_popcnt(const uchar_t *v1, const uchar_t *v2, const uchar_t *mask, size_t n_bytes, uint32_t &n_allele_1, uint32_t &n_missing)
+{
+    gt_count_words(v1, v2, mask, n_bytes, n_allele_1, n_missing);
+}
+#endif
+
+static gt_count_fun_t select_count_kernel()
+{
+#ifdef GT_EXPAND_DISPATCH
+    __builtin_cpu_init();
+
+    if(__builtin_cpu_supports("popcnt"))
+        return gt_count_popcnt;
+#endif
+
+    return gt_count_generic;
+}
+
+gt_count_fun_t gt_count_kernel = select_count_kernel();
+
+// ************************************************************************************
+static gt_expand_fun_t select_kernel()
+{
+    for(uint32_t i = 0; i < 16; ++i)
+        for(uint32_t j = 0; j < 16; ++j)
+            gt_expand_bits((uchar_t) (i << 4), (uchar_t) (j << 4), 4, gt_lut[i][j]);
+
+#ifdef GT_EXPAND_DISPATCH
+    __builtin_cpu_init();
+
+    if(__builtin_cpu_supports("avx2"))
+        return gt_expand_avx2;
+    if(__builtin_cpu_supports("ssse3"))
+        return gt_expand_ssse3;
+#endif
+
+    return gt_expand_lut;
+}
+
+gt_expand_fun_t gt_expand_kernel = select_kernel();
@@ -0,0 +1,52 @@
+/*
+ This file is a part of GTC software distributed under GNU GPL 3 licence.
+ 
+ Authors: Agnieszka Danek and Sebastian Deorowicz
+ 
+ Version: 1
+ Date   : 2017-April
+ */
+#ifndef gt_expand_h
+#define gt_expand_h
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include "defs.h"
+#include "htslib/vcf.h"
+
+// Expansion of the pair of vectors of a variant to BCF-encoded GT values (one byte per haplotype, first haplotype at MSB)
+// Bits of a haplotype in vectors 1 and 2: 00 - 0, 01 - 1, 10 - missing, 11 - 2 (phased)
+typedef void (*gt_expand_fun_t)(const uchar_t *v1, const uchar_t *v2, size_t n_bytes, char *out);
+
+// Kernel chosen at start-up according to the CPU (AVX2, SSSE3 or lookup table)
+extern gt_expand_fun_t gt_expand_kernel;
+
+// GT value of the haplotype at the bit (0 - MSB) of bytes of both vectors
+inline char gt_value(uchar_t v1, uchar_t v2, uint32_t bit)
+{
+    static const char gt_values[4] = {bcf_gt_phased(0), bcf_gt_phased(1), bcf_gt_missing, bcf_gt_phased(2)};
+
+    return gt_values[((v1 << bit) & 0x80) >> 6 | ((v2 << bit) & 0x80) >> 7];
+}
+
+// GT values of the first n_bits haplotypes of bytes of both vectors (last byte of a vector)
+inline void gt_expand_bits(uchar_t v1, uchar_t v2, uint32_t n_bits, char *out)
+{
+    for(uint32_t i = 0; i < n_bits; ++i)
+        out[i] = gt_value(v1, v2, i);
+}
+
+// Counts of haplotypes with allele 1 (bits 01) and with missing value (bits 10) in n_bytes of both vectors
+// If mask is given, only haplotypes with bits set in the mask are counted
+typedef void (*gt_count_fun_t)(const uchar_t *v1, const uchar_t *v2, const uchar_t *mask, size_t n_bytes, uint32_t &n_allele_1, uint32_t &n_missing);
+
+// Kernel chosen at start-up according to the CPU (POPCNT or portable popcount)
+extern gt_count_fun_t gt_count_kernel;
+
+inline void gt_count(const uchar_t *v1, const uchar_t *v2, const uchar_t *mask, size_t n_bytes, uint32_t &n_allele_1, uint32_t &n_missing)
+{
+    gt_count_kernel(v1, v2, mask, n_bytes, n_allele_1, n_missing);
+}
+
+#endif /* gt_expand_h */
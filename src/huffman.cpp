@@ -48,7 +48,6 @@ CHuffman::CHuffman(uint32 _size)
     n_symbols = 0;
     min_len   = 1;
     
-    speedup_tree = NULL;
     bit_memory = NULL;
 }
 
@@ -62,14 +61,8 @@ CHuffman::~CHuffman()
     if(heap)
         delete[] heap;
     
-    if(speedup_tree)
-        delete[] speedup_tree;
-    
     if(bit_memory)
         delete bit_memory;
-    
-    if(speedup_lut)
-        delete[] speedup_lut;
 }
 
 // ********************************************************************************************
@@ -81,10 +74,6 @@ bool CHuffman::Restart(uint32 _size)
         delete[] codes;
     if(heap)
         delete[] heap;
-    if(speedup_tree)
-        delete[] speedup_tree;
-    if(speedup_lut)
-        delete[] speedup_lut;
     
     size = _size;
     if(size)
@@ -100,8 +89,7 @@ bool CHuffman::Restart(uint32 _size)
         heap  = NULL;
     }
     n_symbols = 0;
-    
-    speedup_tree = NULL;
+    decode_lut.clear();
     
     return true;
 }
@@ -115,8 +103,6 @@ bool CHuffman::RestartDecompress(uint32 _size, uint32 _root_id)
         delete[] codes;
     if(heap)
         delete[] heap;
-    if(speedup_tree)
-        delete[] speedup_tree;
     
     size = _size;
     if(size)
@@ -132,8 +118,7 @@ bool CHuffman::RestartDecompress(uint32 _size, uint32 _root_id)
         heap  = NULL;
     }
     n_symbols = size;
-    
-    speedup_tree = NULL;
+    decode_lut.clear();
     
     return true;
 }
@@ -202,10 +187,125 @@ CHuffman::t_code* CHuffman::Complete(bool compact)
     root_id = n_symbols + present_symbols - 2;
     cur_id = root_id;
     
+    LimitCodeLengths();
+    AssignCanonicalCodes();
+    
     return codes;
 }
 
 // ********************************************************************************************
+// Shorten codes longer than MAX_HUF_CODE_LEN, so the code is still complete and the order of lengths is preserved
+void CHuffman::LimitCodeLengths()
+{
+    const uint32 L = MAX_HUF_CODE_LEN;
+    vector<uint32> symbols;
+    bool too_long = false;
+    
+    for(int32 i = 0; i < n_symbols; ++i)
+        if(codes[i].len)
+        {
+            symbols.push_back(i);
+            if(codes[i].len > L)
+                too_long = true;
+        }
+    
+    if(!too_long)
+        return;
+    
+    // Number of codes of each length; Kraft sum is kept in units of 2^-L
+    vector<uint64> count(L + 1, 0);
+    uint64 kraft = 0;
+    for(auto i : symbols)
+    {
+        uint32 len = codes[i].len < L ? codes[i].len : L;
+        count[len]++;
+        kraft += 1ull << (L - len);
+    }
+    
+    // Lengthen the longest codes shorter than L until the Kraft inequality holds
+    uint32 len = L - 1;
+    while(kraft > (1ull << L))
+    {
+        while(!count[len])
+            --len;
+        count[len]--;
+        count[len+1]++;
+        kraft -= 1ull << (L - len - 1);
+        if(len + 1 < L)
+            ++len;
+    }
+    
+    // Shorten the longest codes while the code is not complete
+    len = L;
+    while(kraft < (1ull << L) && len > 1)
+    {
+        if(count[len] && kraft + (1ull << (L - len)) <= (1ull << L))
+        {
+            count[len]--;
+            count[len-1]++;
+            kraft += 1ull << (L - len);
+        }
+        else
+            --len;
+    }
+    
+    // More frequent symbols (shorter original codes) get shorter codes
+    stable_sort(symbols.begin(), symbols.end(), [&](uint32 x, uint32 y) {return codes[x].len < codes[y].len;});
+    
+    len = 1;
+    for(auto i : symbols)
+    {
+        while(!count[len])
+            ++len;
+        codes[i].len = len;
+        count[len]--;
+    }
+}
+
+// ********************************************************************************************
+// Canonical codes: codes of the same length are consecutive numbers assigned in the order of symbols
+void CHuffman::AssignCanonicalCodes()
+{
+    uint32 max_code_len = 0;
+    for(int32 i = 0; i < n_symbols; ++i)
+        if(codes[i].len > max_code_len)
+            max_code_len = codes[i].len;
+    
+    vector<uint32> count(max_code_len + 1, 0);
+    canon_symbols.clear();
+    for(int32 i = 0; i < n_symbols; ++i)
+        if(codes[i].len)
+        {
+            count[codes[i].len]++;
+            canon_symbols.push_back(i);
+        }
+    stable_sort(canon_symbols.begin(), canon_symbols.end(), [&](uint32 x, uint32 y) {return codes[x].len < codes[y].len;});
+    
+    canon_first.assign(max_code_len + 1, 0);
+    canon_limit.assign(max_code_len + 1, 0);
+    canon_offset.assign(max_code_len + 1, 0);
+    
+    uint32 code = 0, offset = 0;
+    for(uint32 len = 1; len <= max_code_len; ++len)
+    {
+        canon_first[len] = code;
+        canon_limit[len] = code + count[len];
+        canon_offset[len] = offset;
+        code = (code + count[len]) << 1;
+        offset += count[len];
+    }
+    
+    for(uint32 j = 0; j < canon_symbols.size(); ++j)
+    {
+        uint32 len = codes[canon_symbols[j]].len;
+        codes[canon_symbols[j]].code = canon_first[len] + j - canon_offset[len];
+    }
+    
+    canonical = true;
+}
+
+// ********************************************************************************************
+// Only lengths of canonical codes are stored (5 bits each); runs of absent symbols are stored as 0 and the length of the run
 bool CHuffman::StoreTree(uchar *&mem, uint32 &len)
 {
     if(bit_memory)
@@ -213,8 +313,8 @@ bool CHuffman::StoreTree(uchar *&mem, uint32 &len)
     
     bit_memory = new CBitMemory();
     
-    bits_per_id = int_log(size, 2);
-    if(size & (size-1))			// size is not power of 2
+    bits_per_id = int_log(n_symbols, 2);
+    if(n_symbols & (n_symbols-1))			// n_symbols is not power of 2
         bits_per_id++;
     
     min_len = 32;
@@ -230,12 +330,24 @@ bool CHuffman::StoreTree(uchar *&mem, uint32 &len)
     if(n_symbols == 1 || min_len > max_len)
         min_len = 0;
     
-    int32 node_id = root_id;
-    bit_memory->PutWord(root_id);
+    bit_memory->PutWord(HUF_CANONICAL_MARK);
     bit_memory->PutWord(n_symbols);
-    bit_memory->PutByte((uchar) min_len);
     bit_memory->PutByte((uchar) max_len);
-    EncodeProcess(node_id);
+    
+    for(int i = 0; i < n_symbols; )
+    {
+        bit_memory->PutBits(codes[i].len, 5);
+        if(codes[i].len)
+            ++i;
+        else
+        {
+            int run = 1;
+            while(i + run < n_symbols && !codes[i + run].len)
+                ++run;
+            bit_memory->PutBits(run - 1, bits_per_id);
+            i += run;
+        }
+    }
     bit_memory->FlushPartialWordBuffer();
     
     mem = bit_memory->mem_buffer;
@@ -244,22 +356,6 @@ bool CHuffman::StoreTree(uchar *&mem, uint32 &len)
     return true;
 }
 
-// ********************************************************************************************
-void CHuffman::EncodeProcess(int32 node_id)
-{
-    if(tree[node_id].left_child == -1)		// leaf
-    {
-        bit_memory->PutBit(1);
-        bit_memory->PutBits(node_id, bits_per_id);
-    }
-    else
-    {
-        bit_memory->PutBit(0);
-        EncodeProcess(tree[node_id].left_child);
-        EncodeProcess(tree[node_id].right_child);
-    }
-}
-
 // ********************************************************************************************
 bool CHuffman::LoadTree(uchar *mem, uint32 len)
 {
@@ -272,9 +368,15 @@ bool CHuffman::LoadTree(uchar *mem, uint32 len)
     uint32 tmp;
     
     bit_memory->GetWord(tmp);
+    if(tmp == HUF_CANONICAL_MARK)
+        return LoadCodeLengths();
+    
+    // Explicit tree (archives of previous versions)
     root_id = tmp;
     bit_memory->GetWord(tmp);
     n_symbols = tmp;
+    if(n_symbols <= 0 || root_id < n_symbols - 1)
+        return false;
     tmp_id = root_id;
     cur_id = root_id;
     
@@ -296,8 +398,8 @@ bool CHuffman::LoadTree(uchar *mem, uint32 len)
     if(!min_len)
         min_len = 1;
     
-    ComputeSpeedupTree();
-    ComputeSpeedupTreeLongest();
+    canonical = false;
+    ComputeDecodeLut();
     
     if(min_len > max_len)
         min_len = 0;
@@ -308,6 +410,54 @@ bool CHuffman::LoadTree(uchar *mem, uint32 len)
     return true;
 }
 
+// ********************************************************************************************
+bool CHuffman::LoadCodeLengths()
+{
+    uint32 tmp;
+    
+    bit_memory->GetWord(tmp);
+    RestartDecompress(0);
+    size = n_symbols = tmp;
+    codes = new t_code[n_symbols];
+    
+    bit_memory->GetByte(max_len);
+    if(max_len > MAX_HUF_CODE_LEN)
+        return false;
+    
+    bits_per_id = int_log(n_symbols, 2);
+    if(n_symbols & (n_symbols-1))			// n_symbols is not power of 2
+        bits_per_id++;
+    
+    min_len = 0;
+    for(int i = 0; i < n_symbols; )
+    {
+        bit_memory->GetBits(tmp, 5);
+        if(tmp)
+        {
+            if(tmp > max_len)
+                return false;
+            if(!min_len || tmp < min_len)
+                min_len = tmp;
+            codes[i].len = tmp;
+            ++i;
+        }
+        else
+        {
+            bit_memory->GetBits(tmp, bits_per_id);
+            for(uint32 j = 0; j <= tmp && i < n_symbols; ++j)
+                codes[i++].len = 0;
+        }
+    }
+    
+    AssignCanonicalCodes();
+    ComputeDecodeLut();
+    
+    delete bit_memory;
+    bit_memory = NULL;
+    
+    return true;
+}
+
 // ********************************************************************************************
 int32 CHuffman::DecodeProcess(int32 node_id)
 {
@@ -332,92 +482,133 @@ int32 CHuffman::DecodeProcess(int32 node_id)
 }
 
 // ********************************************************************************************
-void CHuffman::ComputeSpeedupTree()
+uint32 CHuffman::SubtreeDepth(int32 node_id)
 {
-    int i, j;
-    
-    if(!min_len)
-        return;
+    if(node_id <= 0)    // leaf
+        return 0;
     
-    if(speedup_tree)
-        delete[] speedup_tree;
-    speedup_tree = new int32[(uint32) (1 << min_len)];
+    return 1 + max(SubtreeDepth(tree[node_id].left_child), SubtreeDepth(tree[node_id].right_child));
+}
+
+// ********************************************************************************************
+void CHuffman::ComputeDecodeLut()
+{
+    decode_lut.clear();
     
-    for(i = 0; i < (1 << min_len); ++i)
+    if(!max_len)            // single symbol, no bits are stored
     {
-        cur_id = root_id;
-        for(j = min_len-1; j >= 0; --j)
-            Decode(i & (1 << j));
-        
-        speedup_tree[i] = cur_id;
+        lut_bits = 1;
+        decode_lut.resize(2);
+        for(auto & e : decode_lut)
+        {
+            e.symbol = 0;
+            e.symbol2 = 0;
+            e.len = 0;
+            e.pair_len = 0;
+        }
+        return;
     }
     
-    cur_id = root_id;
-    tmp_id = root_id;
+    lut_bits = max_len < MAX_HUF_LUT_LEN ? max_len : MAX_HUF_LUT_LEN;
+    decode_lut.resize((size_t) 1 << lut_bits);
+    if(canonical)
+        FillCanonicalLut();
+    else
+        FillDecodeLut(0, root_id, lut_bits, true);
 }
 
 // ********************************************************************************************
-void CHuffman::ComputeSpeedupTreeLongest()
+// Codes longer than the index are decoded with canonical limits (HUF_LUT_LONG entries)
+void CHuffman::FillCanonicalLut()
 {
-    int i, j;
-    
-    if(!max_len)
-        return;
-    
-    if(speedup_lut)
-        delete[] speedup_lut;
-    
-    uint32_t size;
-    max_lut_len = MAX_HUF_LUT_LEN;
-    
-    if(max_len <= max_lut_len)
-    {   size = (uint32_t) (1 << max_len);
-        max_lut_len = max_len;
+    t_lut_entry e;
+    e.symbol = 0;
+    e.symbol2 = 0;
+    e.len = 0;
+    e.pair_len = (uint8_t) HUF_LUT_LONG;
+    fill(decode_lut.begin(), decode_lut.end(), e);
+    
+    for(auto symbol : canon_symbols)
+    {
+        uint32 len = codes[symbol].len;
+        if(len > lut_bits)
+            break;
+        
+        e.symbol = symbol;
+        e.len = (uint8_t) len;
+        e.pair_len = 0;
+        uint32 first = codes[symbol].code << (lut_bits - len);
+        fill(decode_lut.begin() + first, decode_lut.begin() + first + (1u << (lut_bits - len)), e);
     }
-    else
-        size = (uint32_t) (1 << max_lut_len);
     
-    speedup_lut = new uint16_t[size];
-    
-    for(i = 0; i < (int) size; ++i)
+    // Second symbol is decoded by the same entry if its code fits in the rest of the index
+    uint32 mask = (1u << lut_bits) - 1;
+    for(uint32 i = 0; i < (1u << lut_bits); ++i)
     {
-        cur_id = root_id;
-        
-        for(j = max_lut_len-1; j >= ((int)max_lut_len-(int)min_len); --j)
-            Decode(i & (1 << j));
+        t_lut_entry & first = decode_lut[i];
+        if(first.pair_len || first.len >= lut_bits)
+            continue;
         
-        
-        while (cur_id > 0 && j >=0)
+        const t_lut_entry & second = decode_lut[(i << first.len) & mask];
+        if(second.pair_len < HUF_LUT_LONG && second.len + first.len <= lut_bits && second.symbol < 0x10000)
         {
-            Decode(i & (1 << j));
-            --j;
+            first.symbol2 = (uint16_t) second.symbol;
+            first.pair_len = (uint8_t) (first.len + second.len);
         }
-        char code_len = max_lut_len-j-1;
+    }
+}
+
+// ********************************************************************************************
+// Fill the table at offset, indexed by the next bits bits of codes continuing from node_id
+// In the main table (pairs == true) entries also hold the second symbol if both codes fit in the index
+void CHuffman::FillDecodeLut(uint32 offset, int32 node_id, uint32 bits, bool pairs)
+{
+    t_lut_entry e;
+    
+    for(uint32 i = 0; i < (1u << bits); ++i)
+    {
+        int32 id = node_id;
+        int32 j = bits - 1;
         
-        uint32_t end_pos = i;
-        for(int idx = j; idx >= 0; idx--)
-            end_pos |= (1<<idx);
+        while(id > 0 && j >= 0)
+            id = ((i >> j--) & 1) ? tree[id].right_child : tree[id].left_child;
         
-        uint16_t tuple;
-        // [ 10 bits      | 1 bit                                  | 5bits          ]
-        // [ abs(cur_id) | flag=1, if positive curr_id (not found) | number_of_bits ]
-        if(cur_id<=0)
+        if(id > 0)          // code longer than index, continue in subtable
         {
-            tuple = ((-cur_id << 6)|(uint8_t)code_len);
+            uint32 sub_bits = SubtreeDepth(id);
+            if(sub_bits > MAX_HUF_LUT_LEN)
+                sub_bits = MAX_HUF_LUT_LEN;
+            
+            uint32 sub_offset = (uint32) decode_lut.size();
+            decode_lut.resize(decode_lut.size() + ((size_t) 1 << sub_bits));
+            FillDecodeLut(sub_offset, id, sub_bits, false);
+            
+            e.symbol = sub_offset;
+            e.symbol2 = 0;
+            e.len = (uint8_t) sub_bits;
+            e.pair_len = (uint8_t) HUF_LUT_SUBTABLE;
         }
         else
         {
-            tuple = ((cur_id << 6)|(uint8_t)code_len);
-            tuple = tuple | (1 << 5);
+            e.symbol = -id;
+            e.symbol2 = 0;
+            e.len = (uint8_t) (bits - 1 - j);
+            e.pair_len = 0;
+            
+            if(pairs && j >= 0)
+            {
+                id = root_id;
+                while(id > 0 && j >= 0)
+                    id = ((i >> j--) & 1) ? tree[id].right_child : tree[id].left_child;
+                
+                if(id <= 0 && -id < 0x10000)
+                {
+                    e.symbol2 = (uint16_t) -id;
+                    e.pair_len = (uint8_t) (bits - 1 - j);
+                }
+            }
         }
         
-        for(int idx = i; idx <= (int) end_pos; idx++)
-        {
-            speedup_lut[idx] = tuple;
-        }
-        i = end_pos;
+        decode_lut[offset + i] = e;
     }
-    
-    cur_id = root_id;
-    tmp_id = root_id;
 }
@@ -44,18 +44,37 @@ public:
     int32 n_symbols;
     int32 cur_id;
     int32 tmp_id;
-    uint32 min_len, max_len, max_lut_len = 0;
+    uint32 min_len, max_len;
     
     CBitMemory *bit_memory  = NULL;
     uint32 bits_per_id;
     
-    int32 *speedup_tree = NULL;
-    uint16_t *speedup_lut = NULL;
+    // Decoding table: entries indexed by the first lut_bits bits of the code; longer codes continue in subtables
+    typedef struct {
+        uint32 symbol;      // symbol or offset of the subtable
+        uint16_t symbol2;   // second symbol decoded by the same entry (if pair_len > 0)
+        uint8_t len;        // length of the code or number of bits indexing the subtable
+        uint8_t pair_len;   // length of codes of both symbols (0 - single symbol, HUF_LUT_SUBTABLE - subtable, HUF_LUT_LONG - longer canonical code)
+    } t_lut_entry;
+    
+    vector<t_lut_entry> decode_lut;
+    uint32 lut_bits = 1;
+    
+    // Canonical codes (first code, limit and offset in canon_symbols for each length)
+    bool canonical = false;
+    vector<uint32> canon_first;
+    vector<uint32> canon_limit;
+    vector<uint32> canon_offset;
+    vector<uint32> canon_symbols;   // symbols sorted by lengths of codes
     
-    void EncodeProcess(int32 node_id);
     int32 DecodeProcess(int32 node_id);
-    void ComputeSpeedupTree();
-    void ComputeSpeedupTreeLongest();
+    uint32 SubtreeDepth(int32 node_id);
+    void LimitCodeLengths();
+    void AssignCanonicalCodes();
+    bool LoadCodeLengths();
+    void ComputeDecodeLut();
+    void FillDecodeLut(uint32 offset, int32 node_id, uint32 bits, bool pairs);
+    void FillCanonicalLut();
     
 public:
     t_code *codes;
@@ -68,8 +87,9 @@ public:
     inline bool Insert(const uint32 frequency);
     t_code* Complete(bool compact = true);
     inline int32 Decode(const uint32 bit);
-    inline int32 DecodeFast(const uint32 bits);
-    inline int32 DecodeFastLut(const uint32 bits, uint8_t & no_bits);
+    
+    // Variant with decoding state (current node) kept by the caller, so a single tree can be used by many threads
+    inline int32 Decode(const uint32 bit, int32 & _cur_id) const;
     
     bool StoreTree(uchar *&mem, uint32 &len);
     bool LoadTree(uchar *mem, uint32 len);
@@ -91,48 +111,23 @@ bool CHuffman::Insert(const uint32 frequency)
 // ********************************************************************************************
 int32 CHuffman::Decode(const uint32 bit)
 {
-    if(cur_id <= 0)
-        cur_id = root_id;
-    if(bit)
-        cur_id = tree[cur_id].right_child;
-    else
-        cur_id = tree[cur_id].left_child;
-
-    if(cur_id <= 0)
-        return -cur_id;				// Symbol found
-    else
-        return -1;					// Not found yet
+    return Decode(bit, cur_id);
 }
 
 // ********************************************************************************************
-inline int32 CHuffman::DecodeFast(const uint32 bits)
+int32 CHuffman::Decode(const uint32 bit, int32 & _cur_id) const
 {
-    cur_id = speedup_tree[bits];
-
-    if(cur_id <= 0)
-        return -cur_id;				// Symbol found
+    if(_cur_id <= 0)
+        _cur_id = root_id;
+    if(bit)
+        _cur_id = tree[_cur_id].right_child;
     else
-        return -1;					// Not found yet
-}
+        _cur_id = tree[_cur_id].left_child;
 
-// ********************************************************************************************
-inline int32 CHuffman::DecodeFastLut(const uint32 bits, uint8_t & no_bits)
-{
-    uint16_t tuple = speedup_lut[bits];
-    // [ 10 bits      | 1 bit                             | 5bits          ]
-    // [ abs(cur_id) | flag = 1, if positive (not found) | number_of_bits ]
-    
-    no_bits = tuple & 31;
-    
-    cur_id = (tuple >> 6);
-    if((tuple & 32) > 0) // positive, not found
-    {
-        return -1;
-    }
+    if(_cur_id <= 0)
+        return -_cur_id;				// Symbol found
     else
-    {
-        return cur_id;
-    }
+        return -1;					// Not found yet
 }
 
 #endif
@@ -30,6 +30,9 @@ int compress_input();
 int compress_parse_param(int argc, const char *argv[]);
 int query(int argc, const char *argv[]);
 int query_parse_param(int argc, const char *argv[]);
+int usage_stats();
+int stats(int argc, const char *argv[]);
+int stats_parse_param(int argc, const char *argv[]);
 
 #ifdef DEVELOPMENT_MODE
 int usage_compress_dev();
@@ -57,6 +60,11 @@ int main(int argc, const char * argv[]) {
         params.task = tquery;
         return query(argc, argv);
     }
+    else  if(strcmp(argv[1], "stats") == 0)
+    {
+        params.task = tstats;
+        return stats(argc, argv);
+    }
 #ifdef DEVELOPMENT_MODE
     else  if(strcmp(argv[1], "compress_dev") == 0)
     {
@@ -84,6 +92,7 @@ int usage()
     cout << "Available options: "<< endl;
     cout << "\tcompress - compress and index VCF/BCF file"<< endl;
     cout << "\tview     - query archive"<< endl;
+    cout << "\tstats    - statistics of archive"<< endl;
 #ifdef DEVELOPMENT_MODE
     cout << "\tcompress_dev \t- preprocess VCF/BCF file (create BV and IND files) or compress BV+IND files" << endl;
     cout << "\tview_dev \t- query archive and output bit vector with genotypes" << endl;
@@ -101,8 +110,11 @@ int usage_compress()
     cout << "\t-p [x]\t- set ploidy of samples in input VCF to [x] (number >= 1; 2 by default)"<< endl;
     cout << "Output: "<< endl;
     cout << "\t-o [name]\t- set archive name to [name](\"archive\" by default)\t"<< endl;
+    cout << "\t-a    \t- store allele counts of variants in the archive (fast filtering by AC/AF in view)"<< endl;
     cout << "Parameters: "<< endl;
     cout << "\t-t [x]\t- set number of threads to [x] (number >= 1; 2 by default)"<< endl;
+    cout << "\t-q [x]\t- set quality of the permutation of samples to [x] (0: fastest, parallel; 1: default; 2, 3: tour refined with a fixed budget of moves per block, larger for 3; higher values give smaller archives)"<< endl;
+    cout << "\t-w    \t- build the permutation of samples of each block starting from the previous block and store it as a difference (smaller archives for many samples; tours of 16 consecutive blocks are built one after another, so fewer blocks are processed in parallel)"<< endl;
     cout << "\t-d [x]\t- set maximum depth to [x] (number >= 0; 0 means no matches; 100 by default)"<< endl;
     cout << "\t-g [x]   \t- [DEV] set number of vector groups [percentage of 1s] to [x] (max: "<< MAX_NUMBER_OF_GROUP <<"; 8 by default)\t"<< endl;
     cout << "\t-hm [x]   \t- [DEV] set n_vec_history for matches to pow(2, [x]) (8 by default, min: " << MATCH_BITS_HUF << ")\t"<< endl;
@@ -119,7 +131,8 @@ int usage_query()
     cout << "Output: "<< endl;
     cout << "\t-o [name]\t- output to a file and set output name to [name] (stdout by default)\t"<< endl;
     cout << "\t-b\t- output a BCF file (output is a VCF file by default)\t"<< endl;
-    cout << "\t-C \t- write AC/AN to the INFO field (always set when using -minAC, -maxAC, -minAF or -maxAF)"<< endl;
+    cout << "\t-z\t- output a bgzipped VCF file (VCF.GZ)\t"<< endl;
+    cout << "\t-C \t- write AC/AN to the INFO field (AN without missing values; always set when using -minAC, -maxAC, -minAF or -maxAF)"<< endl;
     cout << "\t-G \t- don't output sample genotypes (only #CHROM, POS, ID, REF, ALT, QUAL, FILTER and INFO columns)" <<endl;
     cout << "\t-c [0-9]   set level of compression of the output bcf (number from 0 to 9; 1 by default; 0 means no compression)\t"<< endl;
     cout << "Query: "<< endl;
@@ -129,9 +142,22 @@ int usage_query()
     cout << "Settings: "<< endl;
     cout << "\t-minAC X \t- report only sites with count of alternate alleles among selected samples smaller than or equal to X (default: no limit)" << endl;
     cout << "\t-maxAC X \t- report only sites with count of alternate alleles among selected samples greater than or equal to X" << endl;
-    cout << "\t-minAF X \t- report only sites with allele frequency among selected samples greather than or equal to X (X - number between 0 and 1; default: 0)" << endl;
-    cout << "\t-maxAF X \t- report only sites with allele frequency among selected samples smaller than or equal to X (X - number between 0 and 1; default: 1)" << endl;
-    cout << "\t-m X\t- limit maximum memory usage to remember previous vectors to X MB (no limit by default)\t"<< endl;
+    cout << "\t-minAF X \t- report only sites with allele frequency (AC/AN) among selected samples greather than or equal to X (X - number between 0 and 1; default: 0)" << endl;
+    cout << "\t-maxAF X \t- report only sites with allele frequency (AC/AN) among selected samples smaller than or equal to X (X - number between 0 and 1; default: 1)" << endl;
+    cout << "\t-t X\t- set number of threads to X (number >= 1; 1 by default; used when all samples are decompressed and for compression of BCF/VCF.GZ output; each thread keeps the decoded vectors of one block of the archive, up to 7168 x [number of haplotypes]/8 bytes)\t"<< endl;
+    cout << "\t-cache [dir]\t- keep decoded blocks of the archive in directory [dir] and reuse them in next range queries (-r) of the same archive (no cache by default); the first query of a block decodes the whole block and writes it to [dir] (7168 x [number of haplotypes]/8 bytes), even if a single variant is requested\t"<< endl;
+    cout << "\t-cacheSize X\t- limit the size of the cache directory to X MB; least recently used blocks are removed first (1024 by default; 0 means no limit)\t"<< endl;
+    cout << endl;
+    exit (1);
+}
+
+int usage_stats()
+{
+    cout << "Output statistics of the archive: summary numbers, allele frequency spectrum and per-sample counts (missing, heterozygous and homozygous genotypes, singletons)"<< endl;
+    cout << "Usage: gtc stats <options> [archive_name]"<< endl;
+    cout << "Available options: "<< endl;
+    cout << "\t-o [name]\t- output to a file and set output name to [name] (stdout by default)\t"<< endl;
+    cout << "\t-t X\t- set number of threads to X (number >= 1; 1 by default; each thread keeps the decoded vectors of one block of the archive, up to 7168 x [number of haplotypes]/8 bytes)\t"<< endl;
     cout << endl;
     exit (1);
 }
@@ -145,9 +171,37 @@ int compress_input()
   
     CompSettings settings(params, no_samples);
     
+    // Buffers of blocks are returned to pools and reused instead of being freed
+    uint32_t pool_size = max((int) params.n_threads * 2, 8) + params.n_threads + 2;
+    CBufferPool<uchar> block_pool(pool_size), comp_pool(pool_size);
+    CBufferPool<uint32_t> copy_pool(pool_size);
+    
     CBlockQueue inBlockQueue(max((int) params.n_threads * 2, 8));
-    CCompressedBlockQueue compBlockQueue;
-    managerVCF.setQueue(&inBlockQueue);
+    CCompressedBlockQueue compBlockQueue(max((int) params.n_threads * 2, 8));
+    managerVCF.setQueue(&inBlockQueue, &block_pool);
+    CPermutationChain perm_chain(PERM_KEYFRAME_INTERVAL);
+    
+    // Blocks are passed to the end compressor (in order) as soon as they are initially compressed
+    EndCompressor endCompressor(&settings, params.n_threads, params.arch_name + ".gtc_spill");
+    thread * gatherer = new thread([&]{
+        int id_block = 0;
+        unsigned long n_rec;
+        unsigned char  *compressedBlock = nullptr;
+        size_t compressed_size;
+        vector<int> perm;
+        vector<bool> zeros;
+        vector<bool> copies;
+        uint32_t * origin_of_copy = nullptr;
+        vector<uint32_t> ac_an;
+        
+        while(compBlockQueue.Pop(id_block, compressedBlock, n_rec, compressed_size, perm, zeros, copies, origin_of_copy, ac_an))
+        {
+            endCompressor.AddBlock(id_block, compressedBlock, n_rec, compressed_size, perm, zeros, copies, origin_of_copy, ac_an);
+            
+            comp_pool.Release(compressedBlock);
+            copy_pool.Release(origin_of_copy);
+        }
+    });
     
     // Distribute blocks to threads, thread initially compresses block and pushes it into compBlockQueue queue
     vector<thread *> workers(params.n_threads, nullptr);
@@ -160,10 +214,9 @@ int compress_input()
             size_t compressed_size;
             
             vector<int> perm;
-            perm.clear();
-            perm.resize(no_samples * params.ploidy, 0);
+            vector<uint32_t> ac_an;
           
-            BlockInitCompressor init_compr(&settings);
+            BlockInitCompressor init_compr(&settings, &comp_pool, &copy_pool, params.perm_warm_start ? &perm_chain : nullptr);
             while(true)
             {
                 
@@ -175,20 +228,24 @@ int compress_input()
                 
                 init_compr.SetBlock(n_rec, ptr);
                 
-                // Permutations
-                init_compr.PermuteBlock(perm, true);
+                // Allele counts (taken before the vectors are permuted)
+                if(settings.ac_index)
+                    init_compr.CountAlleles(ac_an);
+                
+                // Permutations (perm of the previous block was moved to compBlockQueue)
+                perm.resize(no_samples * params.ploidy, 0);
+                init_compr.PermuteBlock(perm, true, id_block);
                 
                 // Initial compression
                 init_compr.Compress(zeros_only, copies, compressedBlock, compressed_size, origin_of_copy);
                 
-                compBlockQueue.Push(id_block, compressedBlock, n_rec, compressed_size, perm, zeros_only, copies, origin_of_copy);
+                compBlockQueue.Push(id_block, compressedBlock, n_rec, compressed_size, perm, zeros_only, copies, origin_of_copy, ac_an);
         
-                delete [] ptr;
+                block_pool.Release(ptr);
             }
         });
     
     if(!managerVCF.ProcessInVCF()) return 1;
-    uint64_t no_vec = managerVCF.getNoVec();
     
     managerVCF.CloseFiles();
     
@@ -199,26 +256,11 @@ int compress_input()
     }
     workers.clear();
     std::cout << "All blocks initially compressed." << std::endl;
-
-    // Gathering blocks
-    int id_block = 0;
-    unsigned long n_rec;
-    unsigned char  *compressedBlock = nullptr;
-    size_t compressed_size;
-    vector<int> perm;
-    vector<bool> zeros;
-    vector<bool> copies;
-    uint32_t * origin_of_copy = nullptr;
-    
-    EndCompressor endCompressor(&settings, no_vec);
-    
-    while(compBlockQueue.Pop(id_block, compressedBlock, n_rec, compressed_size, perm, zeros, copies, origin_of_copy))
-    {
-        endCompressor.AddBlock(id_block, compressedBlock, n_rec, compressed_size, perm, zeros, copies, origin_of_copy);
     
-        delete [] compressedBlock;
-        delete [] origin_of_copy;
-    }
+    compBlockQueue.Complete();
+    gatherer->join();
+    delete gatherer;
+    
     std::cout << "Final encoding." << std::endl;
     endCompressor.Encode();
     
@@ -282,6 +324,21 @@ int compress_parse_param(int argc, const char *argv[])
             
             params.n_threads = tmp;
         }
+        else if(strncmp(argv[i], "-q", 2) == 0)
+        {
+            i++;
+            if(i >= argc)
+                return usage_compress();
+            tmp = atoi(argv[i]);
+            if(tmp < 0 || tmp > (int) PERM_QUALITY_MAX)
+                usage_compress();
+            
+            params.perm_quality = tmp;
+        }
+        else if(strncmp(argv[i], "-w", 2) == 0)
+            params.perm_warm_start = true;
+        else if(strncmp(argv[i], "-a", 2) == 0)
+            params.ac_index = true;
         else if(strncmp(argv[i], "-g", 2) == 0)
         {
             i++;
@@ -336,9 +393,9 @@ int query(int argc, const char *argv[])
     
     Decompressor decompressor(params); // Load settings and data
     
-    decompressor.loadPack();
+    if(!decompressor.loadPack())
+        return 1;
     decompressor.loadBCF();
-    decompressor.setMemoryUsage();
     
     decompressor.initOut();
     decompressor.decompress();
@@ -356,6 +413,7 @@ int query_parse_param(int argc, const char *argv[])
     if(argc < 3)
         return usage_query();
     
+    params.n_threads = 1;
     for(i = 2 ; i < argc - 1; ++i)
     {
         if(argv[i][0] != '-')
@@ -438,7 +496,36 @@ int query_parse_param(int argc, const char *argv[])
         {
             params.out_type = BCF;
         }
+        else if(strncmp(argv[i], "-z", 2) == 0)
+        {
+            params.out_type = VCF_GZ;
+        }
         else if(strncmp(argv[i], "-m", 2) == 0)
+        {
+            // Memory limit of older versions (each thread keeps the decoded vectors of a single block)
+            i++;
+            if(i >= argc)
+                return usage_query();
+            cerr << "Option -m is no longer used and is ignored" << endl;
+        }
+        else if(strncmp(argv[i], "-o", 2) == 0)
+        {
+            i++;
+            if(i >= argc)
+                return usage_query();
+            params.out_name = string(argv[i]);
+        }
+        else if(strncmp(argv[i], "-t", 2) == 0)
+        {
+            i++;
+            if(i >= argc)
+                return usage_query();
+            tmp = atoi(argv[i]);
+            if(tmp < 1)
+                usage_query();
+            params.n_threads = tmp;
+        }
+        else if(strncmp(argv[i], "-cacheSize", 10) == 0)
         {
             i++;
             if(i >= argc)
@@ -446,17 +533,14 @@ int query_parse_param(int argc, const char *argv[])
             tmp = atoi(argv[i]);
             if(tmp < 0)
                 usage_query();
-            if(!tmp)
-                params.MB_memory = false;
-            else
-                params.max_MB_memory = tmp;
+            params.cache_max_MB = tmp;
         }
-        else if(strncmp(argv[i], "-o", 2) == 0)
+        else if(strncmp(argv[i], "-cache", 6) == 0)
         {
             i++;
             if(i >= argc)
                 return usage_query();
-            params.out_name = string(argv[i]);
+            params.cache_dir = string(argv[i]);
         }
         else if(strncmp(argv[i], "-c", 2) == 0)
         {
@@ -483,6 +567,62 @@ int query_parse_param(int argc, const char *argv[])
     return 0;
 }
 
+int stats(int argc, const char *argv[])
+{
+    if(stats_parse_param(argc, argv) == 1)
+        return 1;
+    
+    Decompressor decompressor(params);
+    
+    if(!decompressor.loadPack())
+        return 1;
+    
+    return decompressor.computeStats();
+}
+
+// Parse the parameters
+int stats_parse_param(int argc, const char *argv[])
+{
+    int i;
+    int tmp;
+    
+    if(argc < 3)
+        return usage_stats();
+    
+    params.n_threads = 1;
+    for(i = 2 ; i < argc - 1; ++i)
+    {
+        if(argv[i][0] != '-')
+        {
+            usage_stats();
+            break;
+        }
+        if(strncmp(argv[i], "-o", 2) == 0)
+        {
+            i++;
+            if(i >= argc)
+                return usage_stats();
+            params.out_name = string(argv[i]);
+        }
+        else if(strncmp(argv[i], "-t", 2) == 0)
+        {
+            i++;
+            if(i >= argc)
+                return usage_stats();
+            tmp = atoi(argv[i]);
+            if(tmp < 1)
+                usage_stats();
+            params.n_threads = tmp;
+        }
+    }
+    if(i >= argc)
+        return usage_stats();
+    
+    params.arch_name = string(argv[i++]);
+    
+    return 0;
+}
+
 #ifdef DEVELOPMENT_MODE
 
 int compress_input_dev(int argc, const char *argv[])
@@ -569,9 +709,35 @@ int compress_input_dev(int argc, const char *argv[])
         uint32_t no_vec_in_block = params.var_in_block * 2;
         CompSettings settings(params, no_samples);
         
+        // Buffers of blocks are returned to pools and reused instead of being freed
+        uint32_t pool_size = max((int) params.n_threads * 2, 8) + params.n_threads + 2;
+        CBufferPool<uchar> block_pool(pool_size), comp_pool(pool_size);
+        CBufferPool<uint32_t> copy_pool(pool_size);
+        
         CBlockQueue inBlockQueue(max((int) params.n_threads * 2, 8));
         
-        CCompressedBlockQueue compBlockQueue;
+        CCompressedBlockQueue compBlockQueue(max((int) params.n_threads * 2, 8));
+        
+        EndCompressor endCompressor(&settings, params.n_threads, params.arch_name + ".gtc_spill");
+        thread * gatherer = new thread([&]{
+            int id_block = 0;
+            unsigned long n_rec;
+            unsigned char  *compressedBlock = nullptr;
+            size_t compressed_size;
+            vector<int> perm;
+            vector<bool> zeros;
+            vector<bool> copies;
+            uint32_t * origin_of_copy = nullptr;
+            vector<uint32_t> ac_an;
+            
+            while(compBlockQueue.Pop(id_block, compressedBlock, n_rec, compressed_size, perm, zeros, copies, origin_of_copy, ac_an))
+            {
+                endCompressor.AddBlock(id_block, compressedBlock, n_rec, compressed_size, perm, zeros, copies, origin_of_copy, ac_an);
+                
+                comp_pool.Release(compressedBlock);
+                copy_pool.Release(origin_of_copy);
+            }
+        });
         
         vector<thread *> workers(params.n_threads, nullptr);
         for(uint32_t i = 0; i < params.n_threads; ++i)
@@ -583,10 +749,9 @@ int compress_input_dev(int argc, const char *argv[])
                 size_t compressed_size;
                 
                 vector<int> perm;
-                perm.clear();
-                perm.resize(no_samples * params.ploidy, 0);
+                vector<uint32_t> ac_an;
                 
-                BlockInitCompressor init_compr(&settings);
+                BlockInitCompressor init_compr(&settings, &comp_pool, &copy_pool);
                 while(true)
                 {
                     
@@ -599,15 +764,19 @@ int compress_input_dev(int argc, const char *argv[])
                     
                     init_compr.SetBlock(n_rec, ptr);
                     
-                    // Permutations
+                    if(settings.ac_index)
+                        init_compr.CountAlleles(ac_an);
+                    
+                    // Permutations (perm of the previous block was moved to compBlockQueue)
+                    perm.resize(no_samples * params.ploidy, 0);
                     init_compr.PermuteBlock(perm, true);
                     
                     // Initial comprassion
                     init_compr.Compress(zeros_only, copies, compressedBlock, compressed_size, origin_of_copy);
                     
-                    compBlockQueue.Push(id_block, compressedBlock, n_rec, compressed_size, perm, zeros_only, copies, origin_of_copy);
+                    compBlockQueue.Push(id_block, compressedBlock, n_rec, compressed_size, perm, zeros_only, copies, origin_of_copy, ac_an);
     
-                    delete [] ptr;
+                    block_pool.Release(ptr);
                 }
             });
         
@@ -619,7 +788,7 @@ int compress_input_dev(int argc, const char *argv[])
         
         while(read_vec + no_vec_in_block < no_vec)
         {
-            unsigned char * bv_buf = new unsigned char[no_vec_in_block * vec_len]; //deleted by workers
+            unsigned char * bv_buf = block_pool.Get(no_vec_in_block * vec_len); //released by workers
             
             bv_out.read((char *)bv_buf, no_vec_in_block * vec_len);
             
@@ -629,7 +798,7 @@ int compress_input_dev(int argc, const char *argv[])
             read_vec += no_vec_in_block;
         }
         // Last
-        unsigned char * bv_buf = new unsigned char[(no_vec - read_vec) * vec_len]; //deleted by workers
+        unsigned char * bv_buf = block_pool.Get((no_vec - read_vec) * vec_len); //released by workers
         bv_out.read((char *)bv_buf, (no_vec - read_vec) * vec_len);
         
         inBlockQueue.Push(block_id, bv_buf, (no_vec - read_vec));
@@ -645,26 +814,9 @@ int compress_input_dev(int argc, const char *argv[])
         }
         workers.clear();
         
-        
-        // Gathering blocks
-        int id_block = 0;
-        unsigned long n_rec;
-        unsigned char  *compressedBlock = nullptr;
-        size_t compressed_size;
-        vector<int> perm;
-        vector<bool> zeros;
-        vector<bool> copies;
-        uint32_t * origin_of_copy = nullptr;
-        
-        EndCompressor endCompressor(&settings, no_vec);
-        
-        while(compBlockQueue.Pop(id_block, compressedBlock, n_rec, compressed_size, perm, zeros, copies, origin_of_copy))
-        {
-            endCompressor.AddBlock(id_block, compressedBlock, n_rec, compressed_size, perm, zeros, copies, origin_of_copy);
-            
-            delete [] compressedBlock;
-            delete [] origin_of_copy;
-        }
+        compBlockQueue.Complete();
+        gatherer->join();
+        delete gatherer;
         
         endCompressor.Encode();
         endCompressor.storeArchive(params.arch_name.c_str());
@@ -690,16 +842,11 @@ int query_parse_param_dev(int argc, const char *argv[])
             break;
         else if(strncmp(argv[i], "-m", 2) == 0)
         {
+            // Memory limit of older versions (each thread keeps the decoded vectors of a single block)
             i++;
             if(i >= argc)
                 return usage_query_dev();
-            tmp = atoi(argv[i]);
-            if(tmp < 0)
-                usage_query_dev();
-            if(!tmp)
-                params.MB_memory = false;
-            else
-                params.max_MB_memory = tmp;
+            cerr << "Option -m is no longer used and is ignored" << endl;
         }
         else if(strncmp(argv[i], "-o", 2) == 0)
         {
@@ -749,8 +896,8 @@ int query_dev(int argc, const char *argv[])
     
     Decompressor decompressor(params); // Load settings and data
     
-    decompressor.loadPack();
-    decompressor.setMemoryUsage();
+    if(!decompressor.loadPack())
+        return 1;
     
     if(params.dec_single_var == false && params.dec_single_sample == false)
     {
@@ -921,7 +1068,6 @@ int usage_query_dev()
     cout << "\t-j J output bit vector with genotypes at J-th variant site (all by default; 0-based); if used with -i one byte for each haplotype is outputted (instead of bit)"<< endl;
     
     cout << "Settings: "<< endl;
-    cout << "\t-m X\t- limit maximum memory usage to remember previous vectors to X MB (no limit by default)\t"<< endl;
     exit (1);
 }
 
@@ -17,7 +17,7 @@
 struct Params{
     task_type task;
     file_type in_type, out_type;
-    uint32_t max_depth, ones_ranges, max_MB_memory, max_bit_size_id_match_pos_diff, max_bit_size_id_copy_pos_diff;
+    uint32_t max_depth, ones_ranges, max_bit_size_id_match_pos_diff, max_bit_size_id_copy_pos_diff;
     std::string in_file_name, in_ind_file;
     std::string arch_name;
     uint32_t ploidy;
@@ -26,15 +26,19 @@ struct Params{
     std::string range;
     
     std::string out_name;
+    std::string cache_dir;
+    uint32_t cache_max_MB;
     
     uint32_t sample_to_dec;
     uint32_t var_to_dec;
     uint32_t n_threads;
     uint32_t var_in_block;
+    uint32_t perm_quality;
+    bool perm_warm_start;
+    bool ac_index;
     uint32_t records_to_process;
     
     char compression_level, mode;
-    bool MB_memory;
     bool preprocessVCFonly;
     bool input_is_bit_vector;
     
@@ -53,13 +57,16 @@ struct Params{
         ploidy = 2;
         n_threads = 2;
         var_in_block = PART_SIZE;
+        perm_quality = 1;
+        perm_warm_start = false;
+        ac_index = false;
         arch_name = "archive";
         out_name = "";
+        cache_dir = "";
+        cache_max_MB = 1024;
         range = "";
         samples = "";
         ones_ranges = 8;
-        MB_memory = true;  // Remember some of the decoded vectors
-        max_MB_memory = 0;  // 0 means no limit (if MB_memory == true)
         compression_level = '1';
         max_bit_size_id_match_pos_diff = 8; //(1 << 17) - 1;
         max_bit_size_id_copy_pos_diff  = 17; //(1 << 17) - 1;
@@ -0,0 +1,423 @@
+/*
+ This file is a part of GTC software distributed under GNU GPL 3 licence.
+ 
+ Authors: Agnieszka Danek and Sebastian Deorowicz
+ 
+ Version: 1
+ Date   : 2017-April
+ */
+#include "permutation_engine.h"
+#include <list>
+#include <utility>
+#include <algorithm>
+#include <numeric>
+#include <thread>
+
+const int PERM_NO_CAND = 8;             // candidate neighbours of a haplotype in the refinement
+const int PERM_CAND_WINDOW = 32;        // candidates are looked for among that many haplotypes of similar density (on each side)
+const int PERM_MIN_PART_SIZE = 256;     // min. no. of haplotypes in a part of the fast mode
+const int PERM_MAX_PARTS = 16;          // max. no. of parts of the fast mode (the split does not depend on the no. of threads)
+const int PERM_MAX_SEGMENT = 3;         // max. length of segments moved by Or-opt
+
+// ************************************************************************************
+CPermutationEngine::CPermutationEngine(uint32_t _quality, uint32_t _n_threads)
+{
+    quality = _quality;
+    n_threads = _n_threads ? _n_threads : 1;
+}
+
+// ************************************************************************************
+// Cost of the edge between haplotypes; -1 stands for the outside of the path
+uint64_t CPermutationEngine::dist(int a, int b) const
+{
+    if(a < 0 || b < 0)
+        return 0;
+    
+    return bit_cost((*mc_vectors)[a], (*mc_vectors)[b]);
+}
+
+// ************************************************************************************
+int CPermutationEngine::node(int i) const
+{
+    return (i < 0 || i >= (int) tour.size()) ? -1 : tour[i];
+}
+
+// ************************************************************************************
+// Cost of the edge between positions i and i+1 of the tour
+uint64_t CPermutationEngine::edge(int i) const
+{
+    return dist(node(i), node(i + 1));
+}
+
+// ************************************************************************************
+void CPermutationEngine::Run(const vector<mc_vec_t> &_mc_vectors, const vector<int> &n_ones, vector<int> &perm)
+{
+    BuildTour(_mc_vectors, n_ones, perm);
+    RefineTour(_mc_vectors, n_ones, perm);
+}
+
+// ************************************************************************************
+// Haplotypes ordered according to the number of ones
+void CPermutationEngine::densityOrder(const vector<int> &n_ones, vector<int> &order)
+{
+    order.resize(n_ones.size());
+    iota(order.begin(), order.end(), 0);
+    stable_sort(order.begin(), order.end(), [&](int x, int y) {return n_ones[x] < n_ones[y]; });
+}
+
+// ************************************************************************************
+void CPermutationEngine::BuildTour(const vector<mc_vec_t> &_mc_vectors, const vector<int> &n_ones, vector<int> &perm, const vector<int> * prev_perm)
+{
+    int n_h_samples = (int) n_ones.size();
+    
+    mc_vectors = &_mc_vectors;
+    tour.resize(n_h_samples);
+    
+    // Successors of haplotypes in the tour of the previous block
+    vector<int> succ;
+    if(prev_perm && (int) prev_perm->size() == n_h_samples)
+    {
+        succ.assign(n_h_samples, -1);
+        for(int i = 1; i < n_h_samples; ++i)
+            succ[(*prev_perm)[i - 1]] = (*prev_perm)[i];
+    }
+    const int * p_succ = succ.empty() ? nullptr : succ.data();
+    
+    int n_parts = 1;
+    if(quality == PERM_QUALITY_FAST)
+        n_parts = max(1, min(PERM_MAX_PARTS, n_h_samples / PERM_MIN_PART_SIZE));
+    
+    if(n_parts > 1)
+    {
+        // Parts of haplotypes of similar density are processed independently and concatenated
+        vector<int> order;
+        densityOrder(n_ones, order);
+        
+        // Threads take parts in turn, so the tour is the same for any number of threads
+        int n_part_threads = min((int) n_threads, n_parts);
+        vector<thread *> part_threads(n_part_threads, nullptr);
+        for(int t = 0; t < n_part_threads; ++t)
+        {
+            part_threads[t] = new thread([&, t]{
+                for(int i = t; i < n_parts; i += n_part_threads)
+                {
+                    int beg = (int) ((int64_t) n_h_samples * i / n_parts);
+                    int end = (int) ((int64_t) n_h_samples * (i + 1) / n_parts);
+                    
+                    nearestNeighbour(order.data() + beg, end - beg, n_ones, tour.data() + beg, p_succ);
+                }
+            });
+        }
+        for(auto p : part_threads)
+        {
+            p->join();
+            delete p;
+        }
+    }
+    else if(n_h_samples)
+    {
+        // The tour starts as the previous one (haplotypes of the same density are also kept in its order)
+        vector<int> ids(n_h_samples);
+        if(p_succ)
+            ids = *prev_perm;
+        else
+            iota(ids.begin(), ids.end(), 0);
+        nearestNeighbour(ids.data(), n_h_samples, n_ones, tour.data(), p_succ);
+    }
+    
+    perm.swap(tour);
+    mc_vectors = nullptr;
+}
+
+// ************************************************************************************
+void CPermutationEngine::RefineTour(const vector<mc_vec_t> &_mc_vectors, const vector<int> &n_ones, vector<int> &perm)
+{
+    int n_h_samples = (int) n_ones.size();
+    
+    if(quality <= PERM_QUALITY_DEFAULT || n_h_samples <= 2)
+        return;
+    
+    mc_vectors = &_mc_vectors;
+    tour.swap(perm);
+    
+    work_left = PERM_REFINE_WORK[min(quality, PERM_QUALITY_MAX)] * n_h_samples;
+    
+    vector<int> order;
+    densityOrder(n_ones, order);
+    
+    pos.resize(n_h_samples);
+    for(int i = 0; i < n_h_samples; ++i)
+        pos[tour[i]] = i;
+    buildCandidates(order);
+    
+    bool improved = true;
+    while(improved && !outOfWork())
+    {
+        improved = twoOpt();
+        if(orOpt())
+            improved = true;
+    }
+    
+    perm.swap(tour);
+    mc_vectors = nullptr;
+}
+
+// ************************************************************************************
+// Greedy tour over the given haplotypes starting from ids[0]
+// The most similar vector is looked for on the list ordered according to the number of ones,
+// which limits the number of vector pairs that must be evaluated
+// If succ is given, the successor of the haplotype in the previous tour is chosen unless a closer vector is found
+void CPermutationEngine::nearestNeighbour(const int * ids, int n_ids, const vector<int> &n_ones, int * out, const int * succ)
+{
+    const vector<mc_vec_t> &mc = *mc_vectors;
+    list<pair<int, int>> density_list;
+    vector<list<pair<int, int>>::iterator> where;
+    
+    if(succ)
+        where.resize(n_ones.size(), density_list.end());
+    
+    for(int i = 0; i < n_ids; ++i)
+    {
+        density_list.push_back(make_pair(ids[i], n_ones[ids[i]]));
+        if(succ)
+            where[ids[i]] = prev(density_list.end());
+    }
+    auto p = density_list.begin();
+    
+    // Insert two guards into list
+    int huge_val = 1 << 28;
+    density_list.push_back(make_pair(-1, -2*huge_val));
+    density_list.push_back(make_pair(-1, 2*huge_val));
+    
+    density_list.sort([](pair<int, int> &x, pair<int, int> &y) {return x.second < y.second; });
+    
+    out[0] = p->first;
+    for(int k = 1; k < n_ids; ++k)
+    {
+        uint64_t best_cost = huge_val;
+        auto best_p = p;
+        
+        if(succ && succ[p->first] >= 0 && where[succ[p->first]] != density_list.end())
+        {
+            best_p = where[succ[p->first]];
+            best_cost = bit_cost(mc[p->first], mc[best_p->first]);
+        }
+        
+        // Starts from p and moves up and down on the list
+        auto p_down = p;
+        auto p_up = p;
+        --p_down;
+        ++p_up;
+        
+        uint64_t dif_up = abs(p->second - p_up->second);
+        uint64_t dif_down = abs(p->second - p_down->second);
+        
+        while (true)
+        {
+            uint64_t min_dif = min(dif_up, dif_down);
+            
+            if (min_dif >= best_cost)
+                break;
+            
+            if (dif_up < dif_down)
+            {
+                uint64_t cost = bit_cost(mc[p->first], mc[p_up->first], best_cost);
+                if (cost < best_cost)
+                {
+                    best_cost = cost;
+                    best_p = p_up;
+                    
+                    if (best_cost == 0)
+                        break;
+                }
+                
+                ++p_up;
+                dif_up = abs(p->second - p_up->second);
+            }
+            else
+            {
+                uint64_t cost = bit_cost(mc[p->first], mc[p_down->first], best_cost);
+                if (cost < best_cost)
+                {
+                    best_cost = cost;
+                    best_p = p_down;
+                    
+                    if (best_cost == 0)
+                        break;
+                }
+                
+                --p_down;
+                dif_down = abs(p->second - p_down->second);
+            }
+        }
+        
+        out[k] = best_p->first;
+        if(succ)
+            where[p->first] = density_list.end();
+        density_list.erase(p);
+        p = best_p;
+    }
+}
+
+// ************************************************************************************
+// Closest haplotypes among the ones of similar density
+void CPermutationEngine::buildCandidates(const vector<int> &order)
+{
+    int n_h_samples = (int) order.size();
+    vector<pair<uint64_t, int>> costs;
+    
+    cand.assign((size_t) n_h_samples * PERM_NO_CAND, -1);
+    
+    for(int r = 0; r < n_h_samples; ++r)
+    {
+        int h = order[r];
+        int beg = max(0, r - PERM_CAND_WINDOW);
+        int end = min(n_h_samples, r + PERM_CAND_WINDOW + 1);
+        
+        costs.clear();
+        for(int i = beg; i < end; ++i)
+            if(i != r)
+                costs.push_back(make_pair(dist(h, order[i]), order[i]));
+        
+        int n_cand = min((int) costs.size(), PERM_NO_CAND);
+        partial_sort(costs.begin(), costs.begin() + n_cand, costs.end());
+        for(int i = 0; i < n_cand; ++i)
+            cand[(size_t) h * PERM_NO_CAND + i] = costs[i].second;
+    }
+}
+
+// ************************************************************************************
+void CPermutationEngine::reverseTour(int l, int r)
+{
+    reverse(tour.begin() + l, tour.begin() + r + 1);
+    for(int i = l; i <= r; ++i)
+        pos[tour[i]] = i;
+    charge(r - l + 1);
+}
+
+// ************************************************************************************
+// Reverse parts of the tour to make haplotypes adjacent to their candidate neighbours
+bool CPermutationEngine::twoOpt()
+{
+    int n_h_samples = (int) tour.size();
+    bool improved = false;
+    
+    for(int i = 0; i < n_h_samples; ++i)
+    {
+        if((i & 15) == 0 && outOfWork())
+            break;
+        
+        for(int k = 0; k < PERM_NO_CAND; ++k)
+        {
+            int c = cand[(size_t) tour[i] * PERM_NO_CAND + k];
+            if(c < 0)
+                break;
+            
+            charge(1);
+            int j = pos[c];
+            int l, r;
+            if(j > i + 1)
+            {
+                l = i + 1;
+                r = j;
+            }
+            else if(j < i - 1)
+            {
+                l = j + 1;
+                r = i;
+            }
+            else
+                continue;
+            
+            // Edges (l-1, l) and (r, r+1) are replaced by (l-1, r) and (l, r+1)
+            int64_t delta = (int64_t) (dist(node(l - 1), tour[r]) + dist(tour[l], node(r + 1))) - (int64_t) (edge(l - 1) + edge(r));
+            if(delta < 0)
+            {
+                reverseTour(l, r);
+                improved = true;
+            }
+        }
+    }
+    
+    return improved;
+}
+
+// ************************************************************************************
+// Move short segments of the tour next to the candidate neighbours of their ends
+bool CPermutationEngine::orOpt()
+{
+    int n_h_samples = (int) tour.size();
+    bool improved = false;
+    
+    for(int len = 1; len <= PERM_MAX_SEGMENT; ++len)
+        for(int i = 0; i + len <= n_h_samples; ++i)
+        {
+            if((i & 15) == 0 && outOfWork())
+                return improved;
+            
+            int s_first = tour[i];
+            int s_last = tour[i + len - 1];
+            int64_t gain = (int64_t) (edge(i - 1) + edge(i + len - 1)) - (int64_t) dist(node(i - 1), node(i + len));
+            if(gain <= 0)
+                continue;
+            
+            int best_j = 0;
+            bool best_rev = false;
+            int64_t best_delta = 0;
+            
+            for(int e = 0; e < 2; ++e)
+                for(int k = 0; k < PERM_NO_CAND; ++k)
+                {
+                    int c = cand[(size_t) (e ? s_last : s_first) * PERM_NO_CAND + k];
+                    if(c < 0)
+                        break;
+                    
+                    // Insertion between positions j and j+1
+                    for(int j = pos[c] - 1; j <= pos[c]; ++j)
+                    {
+                        if(j >= i - 1 && j <= i + len - 1)
+                            continue;
+                        
+                        charge(1);
+                        uint64_t fwd = dist(node(j), s_first) + dist(s_last, node(j + 1));
+                        uint64_t rev = dist(node(j), s_last) + dist(s_first, node(j + 1));
+                        int64_t delta = (int64_t) min(fwd, rev) - (int64_t) edge(j) - gain;
+                        
+                        if(delta < best_delta)
+                        {
+                            best_delta = delta;
+                            best_j = j;
+                            best_rev = rev < fwd;
+                        }
+                    }
+                }
+            
+            if(best_delta >= 0)
+                continue;
+            
+            int lo, hi, new_i;
+            if(best_j > i)
+            {
+                rotate(tour.begin() + i, tour.begin() + i + len, tour.begin() + best_j + 1);
+                lo = i;
+                hi = best_j;
+                new_i = best_j + 1 - len;
+            }
+            else
+            {
+                rotate(tour.begin() + best_j + 1, tour.begin() + i, tour.begin() + i + len);
+                lo = best_j + 1;
+                hi = i + len - 1;
+                new_i = best_j + 1;
+            }
+            if(best_rev)
+                reverse(tour.begin() + new_i, tour.begin() + new_i + len);
+            
+            for(int x = lo; x <= hi; ++x)
+                pos[tour[x]] = x;
+            charge(hi - lo + 1);
+            improved = true;
+        }
+    
+    return improved;
+}
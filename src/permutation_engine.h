@@ -0,0 +1,88 @@
+/*
+ This file is a part of GTC software distributed under GNU GPL 3 licence.
+ 
+ Authors: Agnieszka Danek and Sebastian Deorowicz
+ 
+ Version: 1
+ Date   : 2017-April
+ */
+#ifndef permutation_engine_h
+#define permutation_engine_h
+
+#include "defs.h"
+#include "bit_cost.h"
+#include <array>
+#include <vector>
+
+using namespace std;
+
+typedef array<uint64_t, MC_ARRAY_SIZE> mc_vec_t;
+
+// Vectors of the permutation heuristic use the kernels selected for the CPU at start-up
+inline uint64_t bit_cost(const mc_vec_t &x, const mc_vec_t &y)
+{
+    return bit_cost_full_kernel(x.data(), y.data(), x.size(), UINT64_MAX);
+}
+
+inline uint64_t bit_cost(const mc_vec_t &x, const mc_vec_t &y, uint64_t best_cost)
+{
+    return bit_cost_bounded_kernel(x.data(), y.data(), x.size(), best_cost);
+}
+
+// Quality levels of the permutation of haplotypes
+const uint32_t PERM_QUALITY_FAST = 0;       // nearest neighbour tours of parts of samples built in parallel
+const uint32_t PERM_QUALITY_DEFAULT = 1;    // single nearest neighbour tour
+const uint32_t PERM_QUALITY_MAX = 3;        // levels 2 and 3 refine the tour (2-opt, Or-opt) within the work budget
+
+// Work budget of the refinement per haplotype (evaluated moves and moved tour positions) for quality levels;
+// the budget does not depend on time, so archives are the same in each run
+const uint64_t PERM_REFINE_WORK[PERM_QUALITY_MAX + 1] = {0, 0, 256, 2560};
+
+// Permutations of blocks with ids divisible by the interval are stored in full when they follow the previous
+// block (warm start), so decoding of a permutation starts at most that many blocks before
+const uint32_t PERM_KEYFRAME_INTERVAL = 16;
+
+// Looks for a short path over the Monte-Carlo sample vectors of haplotypes (Hamming distance)
+class CPermutationEngine
+{
+    uint32_t quality;
+    uint32_t n_threads;
+    
+    const vector<mc_vec_t> * mc_vectors = nullptr;
+    vector<int> tour;
+    vector<int> pos;                // position of haplotypes in the tour
+    vector<int> cand;               // candidate neighbours of haplotypes (PERM_NO_CAND per haplotype)
+    uint64_t work_left = 0;
+    
+    inline uint64_t dist(int a, int b) const;
+    inline uint64_t edge(int i) const;
+    inline int node(int i) const;
+    
+    void densityOrder(const vector<int> &n_ones, vector<int> &order);
+    void nearestNeighbour(const int * ids, int n_ids, const vector<int> &n_ones, int * out, const int * succ);
+    void buildCandidates(const vector<int> &order);
+    bool twoOpt();
+    bool orOpt();
+    void reverseTour(int l, int r);
+    bool outOfWork() const
+    {
+        return work_left == 0;
+    }
+    void charge(uint64_t units)
+    {
+        work_left -= min(work_left, units);
+    }
+    
+public:
+    CPermutationEngine(uint32_t _quality = PERM_QUALITY_DEFAULT, uint32_t _n_threads = 1);
+    
+    // perm[i] = haplotype placed at position i
+    void Run(const vector<mc_vec_t> &_mc_vectors, const vector<int> &n_ones, vector<int> &perm);
+    
+    // Steps of Run: the greedy tour and its refinement (quality levels above default)
+    // The tour may follow the tour of the previous block (prev_perm) wherever this does not make it longer
+    void BuildTour(const vector<mc_vec_t> &_mc_vectors, const vector<int> &n_ones, vector<int> &perm, const vector<int> * prev_perm = nullptr);
+    void RefineTour(const vector<mc_vec_t> &_mc_vectors, const vector<int> &n_ones, vector<int> &perm);
+};
+
+#endif /* permutation_engine_h */
@@ -18,7 +18,9 @@
 #include <list>
 #include <stack>
 #include <tuple>
-#include <set>
+#include <vector>
+
+#include "htslib/vcf.h"
 
 using namespace std;
 
@@ -95,70 +97,391 @@ public:
 };
 
 // ********************************************************************************
+// Reorder buffer of initially compressed blocks; block block_id is kept in slot block_id % capacity,
+// so producers that get capacity or more blocks ahead of the consumer wait
 class CCompressedBlockQueue
 {
     typedef struct compressed_block_tag
     {
-        int block_id;
-        unsigned char *ptr;
-        size_t n_recs;
-        size_t compressed_size;
+        bool filled = false;
+        unsigned char *ptr = nullptr;
+        size_t n_recs = 0;
+        size_t compressed_size = 0;
         vector<int> perm;
         vector<bool> zeros;
         vector<bool> copies;
-        uint32_t * origin_of_copy;
+        uint32_t * origin_of_copy = nullptr;
+        vector<uint32_t> ac_an;
         
-        compressed_block_tag(
-                             int _block_id, unsigned char *_ptr, size_t _n_recs, size_t _compressed_size, vector<int> &_perm, vector<bool> &_zeros, vector<bool> &_copies, uint32_t * _origin_of_copy) :
-        block_id(_block_id), ptr(_ptr), n_recs(_n_recs), compressed_size(_compressed_size), perm(_perm), zeros(_zeros), copies(_copies), origin_of_copy(_origin_of_copy)
+        compressed_block_tag()
         {}
         
-        friend bool operator<(const compressed_block_tag &x, const compressed_block_tag &y)
-        {
-            return x.block_id < y.block_id;
-        }
+        // Payloads are only moved (pointers are owned by the consumer after Pop)
+        compressed_block_tag(const compressed_block_tag &) = delete;
+        compressed_block_tag &operator=(const compressed_block_tag &) = delete;
     } compressed_block_t;
     
-    set<compressed_block_t> s_blocks;
+    vector<compressed_block_t> ring;
+    
+    bool eoq_flag;
+    int capacity;
+    int next_block_id;
     
     mutex mtx;
+    condition_variable cv_pop, cv_push;
     
 public:
-    CCompressedBlockQueue()
+    CCompressedBlockQueue(int _capacity) : ring(_capacity), eoq_flag(false), capacity(_capacity), next_block_id(0)
     {}
     
     ~CCompressedBlockQueue()
     {}
     
-    void Push(int id_block, unsigned char *ptr, size_t n_recs, size_t compressed_size, vector<int> &perm, vector<bool> &zeros, vector<bool> &copies, uint32_t * _origin_of_copy)
+    // Vectors are moved to the queue (they are empty after the call)
+    void Push(int id_block, unsigned char *ptr, size_t n_recs, size_t compressed_size, vector<int> &perm, vector<bool> &zeros, vector<bool> &copies, uint32_t * _origin_of_copy, vector<uint32_t> &ac_an)
+    {
+        unique_lock<std::mutex> lck(mtx);
+        cv_push.wait(lck, [&] {return id_block < next_block_id + capacity;});
+        
+        compressed_block_t &x = ring[id_block % capacity];
+        x.filled = true;
+        x.ptr = ptr;
+        x.n_recs = n_recs;
+        x.compressed_size = compressed_size;
+        x.perm = move(perm);
+        x.zeros = move(zeros);
+        x.copies = move(copies);
+        x.origin_of_copy = _origin_of_copy;
+        x.ac_an = move(ac_an);
+        
+        if(id_block == next_block_id)
+            cv_pop.notify_all();
+    }
+    
+    // Blocks are returned in order of their ids; waits until the next block is available (or the queue is completed)
+    bool Pop(int &id_block, unsigned char *&ptr, size_t &n_recs, size_t &compressed_size, vector<int> &perm, vector<bool> &zeros, vector<bool> &copies, uint32_t *& origin_of_copy, vector<uint32_t> &ac_an)
+    {
+        unique_lock<std::mutex> lck(mtx);
+        compressed_block_t &x = ring[next_block_id % capacity];
+        cv_pop.wait(lck, [&] {return x.filled || eoq_flag; });
+        
+        if (!x.filled)
+            return false;
+        
+        id_block = next_block_id;
+        ptr = x.ptr;
+        n_recs = x.n_recs;
+        compressed_size = x.compressed_size;
+        perm = move(x.perm);
+        zeros = move(x.zeros);
+        copies = move(x.copies);
+        origin_of_copy = x.origin_of_copy;
+        ac_an = move(x.ac_an);
+        x.filled = false;
+        
+        ++next_block_id;
+        cv_push.notify_all();
+        
+        return true;
+    }
+    
+    void Complete()
+    {
+        unique_lock<std::mutex> lck(mtx);
+        
+        eoq_flag = true;
+        
+        cv_pop.notify_all();
+    }
+};
+
+// ********************************************************************************
+// Tours of haplotypes handed from block to block, so the permutation of a block can start from the tour of the previous one
+// The chain restarts at blocks with ids divisible by the interval, so groups of blocks are processed in parallel
+class CPermutationChain
+{
+    int interval;
+    map<int, vector<int>> tours;    // tours waiting for the next block
+    
+    mutex mtx;
+    condition_variable cv;
+    
+public:
+    CPermutationChain(int _interval) : interval(_interval)
+    {}
+    
+    ~CPermutationChain()
+    {}
+    
+    // Waits for the tour of the previous block (empty for the first block of a group)
+    void Get(int id_block, vector<int> &_tour)
+    {
+        _tour.clear();
+        if(id_block % interval == 0)
+            return;
+        
+        unique_lock<std::mutex> lck(mtx);
+        cv.wait(lck, [&] {return tours.count(id_block - 1) != 0;});
+        
+        _tour.swap(tours[id_block - 1]);
+        tours.erase(id_block - 1);
+    }
+    
+    void Put(int id_block, const vector<int> &_tour)
+    {
+        if((id_block + 1) % interval == 0)
+            return;
+        
+        unique_lock<std::mutex> lck(mtx);
+        
+        tours[id_block] = _tour;
+        
+        cv.notify_all();
+    }
+};
+
+// ********************************************************************************
+// Groups of consecutive VCF/BCF records (e.g., sites only records belonging to a single block of the archive)
+class CRecordBlockQueue
+{
+    typedef struct record_block_tag
+    {
+        int part_id;
+        uint64_t first_vec_id;
+        vector<bcf1_t *> records;
+        
+        record_block_tag(int _part_id, uint64_t _first_vec_id, vector<bcf1_t *> &_records) :
+        part_id(_part_id), first_vec_id(_first_vec_id)
+        {
+            records.swap(_records);
+        }
+    } record_block_t;
+    
+    queue<record_block_t> q_blocks;
+    
+    bool eoq_flag;
+    int capacity;
+    
+    mutex mtx;
+    condition_variable cv_pop, cv_push;
+    
+public:
+    CRecordBlockQueue(int _capacity) : eoq_flag(false), capacity(_capacity)
+    {}
+    
+    ~CRecordBlockQueue()
+    {}
+    
+    void Push(int part_id, uint64_t first_vec_id, vector<bcf1_t *> &records)
+    {
+        unique_lock<std::mutex> lck(mtx);
+        cv_push.wait(lck, [this] {return (int) q_blocks.size() < capacity;});
+        
+        q_blocks.push(record_block_t(part_id, first_vec_id, records));
+        
+        cv_pop.notify_all();
+    }
+    
+    bool Pop(int &part_id, uint64_t &first_vec_id, vector<bcf1_t *> &records)
+    {
+        unique_lock<std::mutex> lck(mtx);
+        cv_pop.wait(lck, [this] {return !q_blocks.empty() || eoq_flag; });
+        
+        if (eoq_flag && q_blocks.empty())
+            return false;
+        
+        part_id      = q_blocks.front().part_id;
+        first_vec_id = q_blocks.front().first_vec_id;
+        records.swap(q_blocks.front().records);
+        
+        q_blocks.pop();
+        
+        cv_push.notify_all();
+        
+        return true;
+    }
+    
+    void Complete()
+    {
+        unique_lock<std::mutex> lck(mtx);
+        
+        eoq_flag = true;
+        
+        cv_pop.notify_all();
+    }
+};
+
+// ********************************************************************************
+// Parsed input records (sites and their bit vectors) waiting for the consumer; Pop returns them in the original order
+class CParsedBatchQueue
+{
+    typedef struct parsed_batch_tag
+    {
+        vector<bcf1_t *> sites;
+        vector<unsigned char> gt_data;
+    } parsed_batch_t;
+    
+    map<int, parsed_batch_t> m_batches;
+    
+    int next_batch_id;
+    bool eoq_flag;
+    size_t capacity;
+    
+    mutex mtx;
+    condition_variable cv_pop, cv_push;
+    
+public:
+    CParsedBatchQueue(size_t _capacity) : next_batch_id(0), eoq_flag(false), capacity(_capacity)
+    {}
+    
+    ~CParsedBatchQueue()
+    {}
+    
+    // The batch expected by the consumer is always accepted, so the queue cannot deadlock when full
+    void Push(int batch_id, vector<bcf1_t *> &sites, vector<unsigned char> &gt_data)
     {
-        lock_guard<std::mutex> lck(mtx);
+        unique_lock<std::mutex> lck(mtx);
+        cv_push.wait(lck, [&] {return m_batches.size() < capacity || batch_id == next_batch_id;});
         
-        s_blocks.insert(compressed_block_t(id_block, ptr, n_recs, compressed_size, perm, zeros, copies, _origin_of_copy));
+        auto &batch = m_batches[batch_id];
+        batch.sites.swap(sites);
+        batch.gt_data.swap(gt_data);
+        
+        cv_pop.notify_all();
     }
     
-    bool Pop(int &id_block, unsigned char *&ptr, size_t &n_recs, size_t &compressed_size, vector<int> &perm, vector<bool> &zeros, vector<bool> &copies, uint32_t *& origin_of_copy)
+    bool Pop(vector<bcf1_t *> &sites, vector<unsigned char> &gt_data)
     {
         unique_lock<std::mutex> lck(mtx);
+        cv_pop.wait(lck, [this] {return m_batches.count(next_batch_id) || eoq_flag; });
         
-        if (s_blocks.empty())
+        auto p = m_batches.find(next_batch_id);
+        if (p == m_batches.end())
             return false;
         
-        auto x = s_blocks.begin();
+        sites.swap(p->second.sites);
+        gt_data.swap(p->second.gt_data);
         
-        id_block = x->block_id;
-        ptr = x->ptr;
-        n_recs = x->n_recs;
-        compressed_size = x->compressed_size;
-        perm = x->perm;
-        zeros = x->zeros;
-        copies = x->copies;
-        origin_of_copy = x->origin_of_copy;
+        m_batches.erase(p);
+        next_batch_id++;
         
-        s_blocks.erase(s_blocks.begin());
+        cv_push.notify_all();
         
         return true;
     }
+    
+    void Complete()
+    {
+        unique_lock<std::mutex> lck(mtx);
+        
+        eoq_flag = true;
+        
+        cv_pop.notify_all();
+    }
+};
+
+// ********************************************************************************
+// Decompressed records waiting for the writer; Pop returns them in the original order (part_id, chunk_id)
+class CDecompressedPartQueue
+{
+    typedef struct decompressed_part_tag
+    {
+        bool last_chunk;
+        vector<bcf1_t *> records;
+        vector<kstring_t> gt_data;
+    } decompressed_part_t;
+    
+    map<pair<int, int>, decompressed_part_t> m_parts;
+    
+    int next_part_id;
+    int next_chunk_id;
+    bool eoq_flag;
+    bool abort_flag;
+    size_t capacity;
+    
+    mutex mtx;
+    condition_variable cv_pop, cv_push;
+    
+public:
+    CDecompressedPartQueue(size_t _capacity) : next_part_id(0), next_chunk_id(0), eoq_flag(false), abort_flag(false), capacity(_capacity)
+    {}
+    
+    ~CDecompressedPartQueue()
+    {}
+    
+    // The chunk expected by the writer is always accepted, so the queue cannot deadlock when full
+    bool Push(int part_id, int chunk_id, bool last_chunk, vector<bcf1_t *> &records, vector<kstring_t> &gt_data)
+    {
+        unique_lock<std::mutex> lck(mtx);
+        cv_push.wait(lck, [&] {return abort_flag || m_parts.size() < capacity || (part_id == next_part_id && chunk_id == next_chunk_id);});
+        
+        if(abort_flag)
+            return false;
+        
+        auto &part = m_parts[make_pair(part_id, chunk_id)];
+        part.last_chunk = last_chunk;
+        part.records.swap(records);
+        part.gt_data.swap(gt_data);
+        
+        cv_pop.notify_all();
+        
+        return true;
+    }
+    
+    bool Pop(vector<bcf1_t *> &records, vector<kstring_t> &gt_data)
+    {
+        unique_lock<std::mutex> lck(mtx);
+        cv_pop.wait(lck, [this] {return m_parts.count(make_pair(next_part_id, next_chunk_id)) || eoq_flag; });
+        
+        auto p = m_parts.find(make_pair(next_part_id, next_chunk_id));
+        if (p == m_parts.end())
+            return false;
+        
+        records.swap(p->second.records);
+        gt_data.swap(p->second.gt_data);
+        
+        if(p->second.last_chunk)
+        {
+            next_part_id++;
+            next_chunk_id = 0;
+        }
+        else
+            next_chunk_id++;
+        
+        m_parts.erase(p);
+        
+        cv_push.notify_all();
+        
+        return true;
+    }
+    
+    void Complete()
+    {
+        unique_lock<std::mutex> lck(mtx);
+        
+        eoq_flag = true;
+        
+        cv_pop.notify_all();
+    }
+    
+    // Stop accepting new data and release chunks not consumed by the writer
+    void Abort()
+    {
+        unique_lock<std::mutex> lck(mtx);
+        
+        abort_flag = true;
+        
+        for(auto & part : m_parts)
+        {
+            for(auto record : part.second.records)
+                bcf_destroy(record);
+            for(auto & str : part.second.gt_data)
+                free(str.s);
+        }
+        m_parts.clear();
+        
+        cv_push.notify_all();
+    }
 };
 
 #endif
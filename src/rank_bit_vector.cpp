@@ -0,0 +1,76 @@
+/*
+ This file is a part of GTC software distributed under GNU GPL 3 licence.
+ 
+ Authors: Agnieszka Danek and Sebastian Deorowicz
+ 
+ Version: 1
+ Date   : 2017-April
+ */
+
+#include "rank_bit_vector.h"
+#include <iostream>
+#include <cstring>
+
+using namespace std;
+
+// Interleave words of the bit vector (n_bits bits) with numbers of ones before blocks
+static void make_blocks(const uint64_t * words, uint64_t n_bits, vector<uint64_t> & out)
+{
+    uint64_t n_words = (n_bits + 63) / 64;
+    uint64_t n_blocks = (n_words + RBV_BLOCK_WORDS - 1) / RBV_BLOCK_WORDS;
+    uint64_t ones = 0;
+
+    out.assign(n_blocks * RBV_BLOCK_STRIDE + 1, 0);
+    for(uint64_t w = 0; w < n_words; ++w)
+    {
+        uint64_t x = words[w];
+        if(w + 1 == n_words && n_bits % 64)
+            x &= (1ull << (n_bits % 64)) - 1;
+
+        uint64_t * p = out.data() + (w / RBV_BLOCK_WORDS) * RBV_BLOCK_STRIDE;
+        if(w % RBV_BLOCK_WORDS == 0)
+            p[0] = ones;
+        p[1 + w % RBV_BLOCK_WORDS] = x;
+        ones += __builtin_popcountll(x);
+    }
+    out.back() = ones;
+}
+
+uint64_t CRankBitVector::Store(const sdsl::bit_vector & bv, FILE * f)
+{
+    vector<uint64_t> out;
+    uint64_t size = bv.size();
+
+    make_blocks(bv.data(), size, out);
+
+    if(fwrite(&size, sizeof(uint64_t), 1, f) != 1 || fwrite(out.data(), sizeof(uint64_t), out.size(), f) != out.size())
+    {
+        cout << "Error while writing the archive" << endl;
+        exit(1);
+    }
+
+    return (out.size() + 1) * sizeof(uint64_t);
+}
+
+uint64_t CRankBitVector::Map(const uchar_t * p)
+{
+    memcpy(&n_bits, p, sizeof(uint64_t));
+    blocks = (const uint64_t *) (p + sizeof(uint64_t));
+    own_words.clear();
+
+    uint64_t n_blocks = ((n_bits + 63) / 64 + RBV_BLOCK_WORDS - 1) / RBV_BLOCK_WORDS;
+
+    return (n_blocks * RBV_BLOCK_STRIDE + 2) * sizeof(uint64_t);
+}
+
+void CRankBitVector::Build(const sdsl::rrr_vector<> & rrr)
+{
+    n_bits = rrr.size();
+
+    vector<uint64_t> words((n_bits + 63) / 64);
+    for(uint64_t w = 0; w < words.size(); ++w)
+        words[w] = rrr.get_int(w * 64, (uint8_t) min<uint64_t>(64, n_bits - w * 64));
+
+    make_blocks(words.data(), n_bits, own_words);
+    blocks = own_words.data();
+}
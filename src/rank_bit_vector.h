@@ -0,0 +1,80 @@
+/*
+ This file is a part of GTC software distributed under GNU GPL 3 licence.
+ 
+ Authors: Agnieszka Danek and Sebastian Deorowicz
+ 
+ Version: 1
+ Date   : 2017-April
+ */
+
+#ifndef rank_bit_vector_h
+#define rank_bit_vector_h
+
+#include <stdio.h>
+#include <vector>
+#include <sdsl/bit_vectors.hpp>
+#include "defs.h"
+
+// Bit vector with rank samples stored together with the bits, so it can be used in place from the mapped archive
+// Layout (64-bit words): number of bits, then blocks of RBV_BLOCK_WORDS words of bits, each preceded by the number of
+// ones before the block, and the number of all ones at the end (for rank of the end of the vector)
+const uint32_t RBV_BLOCK_WORDS = 8;
+const uint32_t RBV_BLOCK_STRIDE = RBV_BLOCK_WORDS + 1;
+
+class CRankBitVector
+{
+    const uint64_t * blocks = nullptr;
+    uint64_t n_bits = 0;
+    std::vector<uint64_t> own_words;   // words of vectors built in memory (older archives)
+
+    // Word with bits [64 * w, 64 * w + 64)
+    inline uint64_t word(uint64_t w) const
+    {
+        return blocks[(w / RBV_BLOCK_WORDS) * RBV_BLOCK_STRIDE + 1 + w % RBV_BLOCK_WORDS];
+    }
+
+public:
+    CRankBitVector() {}
+
+    // Write the bit vector in the layout used in place; returns the number of written bytes
+    static uint64_t Store(const sdsl::bit_vector & bv, FILE * f);
+
+    // Use the vector stored at p (8-byte aligned); returns its size in bytes
+    uint64_t Map(const uchar_t * p);
+
+    // Build the vector in memory from the sdsl rrr vector (older archives)
+    void Build(const sdsl::rrr_vector<> & rrr);
+
+    uint64_t size() const
+    {
+        return n_bits;
+    }
+
+    inline bool operator[](uint64_t i) const
+    {
+        return (word(i / 64) >> (i % 64)) & 1;
+    }
+
+    // Number of ones in [0, i)
+    inline uint64_t rank1(uint64_t i) const
+    {
+        const uint64_t * p = blocks + (i / (64 * RBV_BLOCK_WORDS)) * RBV_BLOCK_STRIDE;
+        uint64_t r = p[0];
+        uint32_t w = (i / 64) % RBV_BLOCK_WORDS;
+
+        for(uint32_t k = 0; k < w; ++k)
+            r += __builtin_popcountll(p[1 + k]);
+        if(i % 64)
+            r += __builtin_popcountll(p[1 + w] & ((1ull << (i % 64)) - 1));
+
+        return r;
+    }
+
+    // Number of zeros in [0, i)
+    inline uint64_t rank0(uint64_t i) const
+    {
+        return i - rank1(i);
+    }
+};
+
+#endif /* rank_bit_vector_h */
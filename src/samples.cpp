@@ -33,7 +33,7 @@ int Samples::loadSamples(std::string filename)
             std::cout << "Error! Two individuals with the same name!\n";
             return 2;
         }
-        
+        names.push_back(ind_name);
     }
     fi.close();
     
@@ -12,16 +12,22 @@
 
 #include <iostream>
 #include <map>
+#include <vector>
 #include <cstring>
 #include "htslib/vcf.h"
 
 class Samples{
      std::map<std::string, uint32_t> whichIndMap;
+     std::vector<std::string> names;   // in the order of the archive
 public:
     uint32_t no_samples;
     
     int loadSamples(std::string filename);
     uint32_t getWhich(std::string nm);
+    const std::vector<std::string> & getNames() const
+    {
+        return names;
+    }
     int setAllSamples(bcf_hdr_t * hdr, std::string filename, bool out_genotypes);
     uint32_t * setSamples(bcf_hdr_t * hdr, const std::string  & samples, bool out_genotypes);
 };
@@ -0,0 +1,139 @@
+/*
+ This file is a part of GTC software distributed under GNU GPL 3 licence.
+ 
+ Authors: Agnieszka Danek and Sebastian Deorowicz
+ 
+ Version: 1
+ Date   : 2017-April
+ */
+
+#include "stats.h"
+#include "gt_expand.h"
+#include <cstring>
+
+using namespace std;
+
+CArchiveStats::CArchiveStats(uint32_t _no_samples, uint32_t _ploidy)
+{
+    no_samples = _no_samples;
+    ploidy = _ploidy;
+    no_haplotypes = no_samples * ploidy;
+
+    af_bins.resize(STATS_AF_BINS, 0);
+    smpl_missing.resize(no_samples, 0);
+    smpl_het.resize(no_samples, 0);
+    smpl_hom_alt.resize(no_samples, 0);
+    smpl_singletons.resize(no_samples, 0);
+    smpl_stamp.resize(no_samples, 0);
+}
+
+// Word of both vectors ORed (bit of the first haplotype as MSB); bytes past the end of the vectors are zeros
+static inline uint64_t load_or_word(const uchar_t *v1, const uchar_t *v2, uint32_t n_bytes_left)
+{
+    uint64_t w1 = 0, w2 = 0;
+    memcpy(&w1, v1, n_bytes_left < 8 ? n_bytes_left : 8);
+    memcpy(&w2, v2, n_bytes_left < 8 ? n_bytes_left : 8);
+
+    return __builtin_bswap64(w1 | w2);
+}
+
+void CArchiveStats::AddVariant(const uchar_t *v1, const uchar_t *v2, size_t n_bytes, const uint32_t *perm, const uint32_t *rev_perm)
+{
+    uint32_t n_allele_1, n_missing;
+
+    // AC/AN do not depend on the order of haplotypes
+    gt_count(v1, v2, nullptr, n_bytes, n_allele_1, n_missing);
+
+    ++no_variants;
+    uint32_t an = no_haplotypes - n_missing;
+    uint32_t bin = an ? (uint32_t) ((double) n_allele_1 / an * STATS_AF_BINS) : 0;
+    if(bin >= STATS_AF_BINS)
+        bin = STATS_AF_BINS - 1;
+    af_bins[bin]++;
+
+    bool singleton = n_allele_1 == 1;
+    if(singleton)
+        ++no_singletons;
+
+    // Samples with any haplotype other than allele 0 (the stamp is the id of the variant in this object)
+    for(uint32_t x0 = 0; x0 < no_haplotypes; x0 += 64)
+    {
+        uint64_t w = load_or_word(v1 + x0 / 8, v2 + x0 / 8, (uint32_t) n_bytes - x0 / 8);
+        if(!w)
+            continue;
+        if(no_haplotypes - x0 < 64)
+            w &= ~0ull << (64 - (no_haplotypes - x0));
+
+        while(w)
+        {
+            uint32_t s = rev_perm[x0 + 63 - __builtin_ctzll(w)] / ploidy;
+            w &= w - 1;
+
+            if(smpl_stamp[s] == no_variants)
+                continue;
+            smpl_stamp[s] = no_variants;
+
+            uint32_t first = hapCode(v1, v2, perm[s * ploidy]);
+            bool missing = first == 2, het = false, allele_1 = first == 1;
+            for(uint32_t k = 1; k < ploidy; ++k)
+            {
+                uint32_t code = hapCode(v1, v2, perm[s * ploidy + k]);
+                missing |= code == 2;
+                het |= code != first;
+                allele_1 |= code == 1;
+            }
+
+            if(missing)
+                smpl_missing[s]++;
+            else if(het)
+                smpl_het[s]++;
+            else
+                smpl_hom_alt[s]++;
+
+            if(singleton && allele_1)
+                smpl_singletons[s]++;
+        }
+    }
+}
+
+void CArchiveStats::Merge(const CArchiveStats &x)
+{
+    no_variants += x.no_variants;
+    no_singletons += x.no_singletons;
+    for(uint32_t i = 0; i < STATS_AF_BINS; ++i)
+        af_bins[i] += x.af_bins[i];
+
+    for(uint32_t s = 0; s < no_samples; ++s)
+    {
+        smpl_missing[s] += x.smpl_missing[s];
+        smpl_het[s] += x.smpl_het[s];
+        smpl_hom_alt[s] += x.smpl_hom_alt[s];
+        smpl_singletons[s] += x.smpl_singletons[s];
+    }
+}
+
+// Output in the tab-separated layout of sections (as in bcftools stats)
+void CArchiveStats::Write(FILE *f, const vector<string> &names) const
+{
+    fprintf(f, "# SN, Summary numbers:\n");
+    fprintf(f, "# SN\t[2]key\t[3]value\n");
+    fprintf(f, "SN\tnumber of samples:\t%u\n", no_samples);
+    fprintf(f, "SN\tnumber of records:\t%llu\n", (unsigned long long) no_variants);
+    fprintf(f, "SN\tnumber of singletons:\t%llu\n", (unsigned long long) no_singletons);
+
+    fprintf(f, "# AF, Allele frequency spectrum (AF of allele 1, missing values excluded):\n");
+    fprintf(f, "# AF\t[2]allele frequency (lower bound of the bin)\t[3]number of records\n");
+    for(uint32_t i = 0; i < STATS_AF_BINS; ++i)
+        fprintf(f, "AF\t%.2f\t%llu\n", (double) i / STATS_AF_BINS, (unsigned long long) af_bins[i]);
+
+    fprintf(f, "# PSC, Per-sample counts (genotypes with any missing allele are counted as missing):\n");
+    fprintf(f, "# PSC\t[2]sample\t[3]nRefHom\t[4]nNonRefHom\t[5]nHets\t[6]nMissing\t[7]nSingletons\t[8]missing rate\t[9]heterozygosity\n");
+    for(uint32_t s = 0; s < no_samples; ++s)
+    {
+        uint64_t called = no_variants - smpl_missing[s];
+        fprintf(f, "PSC\t%s\t%llu\t%llu\t%llu\t%llu\t%llu\t%.6f\t%.6f\n", s < names.size() ? names[s].c_str() : "",
+            (unsigned long long) (called - smpl_het[s] - smpl_hom_alt[s]), (unsigned long long) smpl_hom_alt[s],
+            (unsigned long long) smpl_het[s], (unsigned long long) smpl_missing[s], (unsigned long long) smpl_singletons[s],
+            no_variants ? (double) smpl_missing[s] / no_variants : 0.0, called ? (double) smpl_het[s] / called : 0.0);
+    }
+}
@@ -0,0 +1,60 @@
+/*
+ This file is a part of GTC software distributed under GNU GPL 3 licence.
+ 
+ Authors: Agnieszka Danek and Sebastian Deorowicz
+ 
+ Version: 1
+ Date   : 2017-April
+ */
+
+#ifndef stats_h
+#define stats_h
+
+#include <stdio.h>
+#include <vector>
+#include <string>
+#include "defs.h"
+
+// Number of bins of the allele frequency spectrum
+const uint32_t STATS_AF_BINS = 100;
+
+// Statistics of the archive collected from vectors in the permuted order (one object per thread, merged at the end)
+// Counts of variants are permutation-invariant (popcount of whole vectors); per-sample counts visit only haplotypes
+// with bits set in any of the vectors, mapped to samples through the permutation of the block
+class CArchiveStats
+{
+    uint32_t no_samples;
+    uint32_t ploidy;
+    uint32_t no_haplotypes;
+
+    uint64_t no_variants = 0;
+    uint64_t no_singletons = 0;
+    std::vector<uint64_t> af_bins;
+
+    // Per-sample counts of genotypes (reference homozygotes are the rest)
+    std::vector<uint64_t> smpl_missing;
+    std::vector<uint64_t> smpl_het;
+    std::vector<uint64_t> smpl_hom_alt;
+    std::vector<uint64_t> smpl_singletons;
+
+    // Id of the last variant in which the sample was seen (each sample is counted once per variant)
+    std::vector<uint64_t> smpl_stamp;
+
+    // Code of the haplotype at position pos: 0 - allele 0, 1 - allele 1, 2 - missing, 3 - allele 2
+    static inline uint32_t hapCode(const uchar_t *v1, const uchar_t *v2, uint32_t pos)
+    {
+        uint32_t shift = 7 - (pos & 7);
+
+        return ((v1[pos >> 3] >> shift) & 1) << 1 | ((v2[pos >> 3] >> shift) & 1);
+    }
+
+public:
+    CArchiveStats(uint32_t _no_samples, uint32_t _ploidy);
+
+    // Add the variant given by its (permuted) vectors
+    void AddVariant(const uchar_t *v1, const uchar_t *v2, size_t n_bytes, const uint32_t *perm, const uint32_t *rev_perm);
+    void Merge(const CArchiveStats &x);
+    void Write(FILE *f, const std::vector<std::string> &names) const;
+};
+
+#endif /* stats_h */
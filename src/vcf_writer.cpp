@@ -0,0 +1,127 @@
+/*
+ This file is a part of GTC software distributed under GNU GPL 3 licence.
+ 
+ Authors: Agnieszka Danek and Sebastian Deorowicz
+ 
+ Version: 1
+ Date   : 2017-April
+ */
+
+#include "vcf_writer.h"
+#include "htslib/hfile.h"
+#include "htslib/bgzf.h"
+#include <string.h>
+#include <iostream>
+
+using namespace std;
+
+CVCFWriter::~CVCFWriter()
+{
+    if(buf.s)
+        free(buf.s);
+}
+
+// Genotypes are formatted here only for haploid and diploid samples (otherwise false is returned and htslib should be used)
+// Ploidy 0 means records without genotypes
+bool CVCFWriter::Open(htsFile * _out, uint32_t _ploidy)
+{
+    if(_ploidy > 2)
+        return false;
+
+    out = _out;
+    ploidy = _ploidy;
+    buf.l = 0;
+
+    // Text of a GT value as in htslib: '.' for missing, allele number otherwise; the separator before the allele is '|' if phased
+    const char allele[4] = {'.', '0', '1', '2'};
+    const char sep[4] = {'/', '|', '|', '|'};
+
+    for(uint32_t a = 0; a < 4; ++a)
+    {
+        gt_text_haploid[a][0] = '\t';
+        gt_text_haploid[a][1] = allele[a];
+
+        for(uint32_t b = 0; b < 4; ++b)
+        {
+            gt_text_diploid[a * 4 + b][0] = '\t';
+            gt_text_diploid[a * 4 + b][1] = allele[a];
+            gt_text_diploid[a * 4 + b][2] = sep[b];
+            gt_text_diploid[a * 4 + b][3] = allele[b];
+        }
+    }
+
+    return true;
+}
+
+void CVCFWriter::FormatRecord(const bcf_hdr_t * hdr, bcf1_t * record, const kstring_t * gt, kstring_t & line) const
+{
+    // Columns of the site (up to INFO)
+    uint32_t n_sample = record->n_sample;
+    record->n_sample = 0;
+    vcf_format(hdr, record, &line);
+    record->n_sample = n_sample;
+
+    if(!gt)
+        return;
+
+    // GT values follow the 3 bytes of the BCF header of the field
+    const char * p_gt = gt->s + 3;
+    size_t no_haplotypes = gt->l - 3;
+
+    line.l--;   // '\n'
+    ks_resize(&line, line.l + 2 * no_haplotypes + 8);
+    char * p = line.s + line.l;
+
+    memcpy(p, "\tGT", 3);
+    p += 3;
+    if(ploidy == 2)
+        for(size_t i = 0; i + 1 < no_haplotypes; i += 2, p += 4)
+            memcpy(p, gt_text_diploid[gtCode(p_gt[i]) * 4 + gtCode(p_gt[i + 1])], 4);
+    else
+        for(size_t i = 0; i < no_haplotypes; ++i, p += 2)
+            memcpy(p, gt_text_haploid[gtCode(p_gt[i])], 2);
+    *p++ = '\n';
+
+    line.l = p - line.s;
+    line.s[line.l] = 0;
+}
+
+void CVCFWriter::WriteRecord(const bcf_hdr_t * hdr, bcf1_t * record, const kstring_t * gt)
+{
+    FormatRecord(hdr, record, gt, buf);
+    if(buf.l >= VCF_WRITER_BUF_SIZE)
+        Flush();
+}
+
+void CVCFWriter::Write(const char * data, size_t len)
+{
+    kputsn(data, len, &buf);
+    if(buf.l >= VCF_WRITER_BUF_SIZE)
+        Flush();
+}
+
+// Text is passed to the stream of htslib in the same way as by vcf_write
+void CVCFWriter::Flush()
+{
+    if(!out || !buf.l)
+        return;
+
+    ssize_t r;
+    if(out->format.compression != no_compression)
+        r = bgzf_write(out->fp.bgzf, buf.s, buf.l);
+    else
+        r = hwrite(out->fp.hfile, buf.s, buf.l);
+
+    if(r != (ssize_t) buf.l)
+    {
+        cout << "Error while writing the output file" << endl;
+        exit(1);
+    }
+    buf.l = 0;
+}
+
+void CVCFWriter::Close()
+{
+    Flush();
+    out = nullptr;
+}
@@ -0,0 +1,56 @@
+/*
+ This file is a part of GTC software distributed under GNU GPL 3 licence.
+ 
+ Authors: Agnieszka Danek and Sebastian Deorowicz
+ 
+ Version: 1
+ Date   : 2017-April
+ */
+
+#ifndef vcf_writer_h
+#define vcf_writer_h
+
+#include <stdio.h>
+#include "defs.h"
+#include "htslib/vcf.h"
+#include "htslib/kstring.h"
+
+// Size of the buffer of text lines passed to the output at once
+const size_t VCF_WRITER_BUF_SIZE = 1 << 20;
+
+// Writer of VCF text records: columns of sites are formatted by htslib, genotypes (GT only) are formatted here
+// from BCF-encoded GT values with small text tables; the text goes to the output stream of htslib (plain or BGZF)
+class CVCFWriter
+{
+    htsFile * out = nullptr;
+    uint32_t ploidy = 0;
+    kstring_t buf = {0, 0, 0};
+
+    char gt_text_diploid[16][4];    // "\ta|b" for pair of codes of GT values
+    char gt_text_haploid[4][2];     // "\ta" for code of GT value
+
+    // Code of BCF-encoded GT value (missing, 0, 1 or 2, always phased except missing)
+    static inline uint32_t gtCode(char gt)
+    {
+        return ((uchar_t) gt >> 1) & 3;
+    }
+
+public:
+    CVCFWriter() {}
+    ~CVCFWriter();
+
+    bool Open(htsFile * _out, uint32_t _ploidy);
+    bool IsOpen() const
+    {
+        return out != nullptr;
+    }
+
+    // Append the text line of the record to line (may be called concurrently; the record is modified, the header is not)
+    void FormatRecord(const bcf_hdr_t * hdr, bcf1_t * record, const kstring_t * gt, kstring_t & line) const;
+    void WriteRecord(const bcf_hdr_t * hdr, bcf1_t * record, const kstring_t * gt);
+    void Write(const char * data, size_t len);
+    void Flush();
+    void Close();
+};
+
+#endif /* vcf_writer_h */